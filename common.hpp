@@ -3,10 +3,26 @@
 #define PERFORMANCE_MEASUREMENT_ACTIVE 1
 #define PERFORMANCE_REPETITIONS 100
 #define USE_FUSION 0
+#define USE_MMAP_LOADING 1 // map column files instead of reading them into host buffers
+#define VERIFY_COLUMN_CHECKSUMS 0 // check column file checksums at load time (reads all data)
+#define PACK_DEVICE_SEGMENTS 1 // frame-of-reference + bit-packing of the loaded segments moved to a device
+#define PACKED_SEGMENT_MAX_BITS 16 // segments needing more bits per value are moved as plain ints
+#define PLACEMENT_WORKLOAD_DIR "" // .sql files whose plans drive the column placement, empty: the query run
+#define PLACEMENT_DEVICE_HEADROOM 16 // 1/16 of the device memory is kept free beside the columns and the allocators
+#define USE_SEGMENT_SCHEDULER 1 // segments may run away from their placement, see models/scheduler.hpp
+#define SCHEDULER_HOST_ROWS_PER_MS 100000.0 // initial throughput estimates, refined by measurements
+#define SCHEDULER_DEVICE_ROWS_PER_MS 1000000.0
+#define SCHEDULER_TRANSFER_BYTES_PER_MS 12000000.0 // host to device copies, about PCIe 3.0 x16
+#define USE_SEGMENT_STREAMING 1 // scheduled segments without room on their device are streamed, see models/stream.hpp
+#define STREAM_RING_SLOTS 8 // device buffers of SEGMENT_SIZE ints per device for the streamed segments
+#define STAGING_BUFFERS 4 // pinned host buffers the pageable data copied to the devices goes through
+#define STAGING_BUFFER_SIZE (((uint64_t)8) << 20) // 8MB
+#define USE_COMMAND_GRAPHS 1 // kernel batches of repeated queries are replayed as SYCL command graphs, see models/graph.hpp
 
 #define SIZE_TEMP_MEMORY_GPU (((uint64_t)20) << 30) // 20GB
 #define SIZE_TEMP_MEMORY_CPU (((uint64_t)20) << 30) // 20GB
 
 #define DATA_DIR "/home/matteo/ssb/s100_columnar/"
 
-#define SEGMENT_SIZE (((uint64_t)1) << 30)
\ No newline at end of file
+#define SEGMENT_SIZE (((uint64_t)1) << 24) // small enough for zone maps to skip segments
+#define SEGMENT_FLAG_WORDS (SEGMENT_SIZE / FLAG_WORD_BITS) // SEGMENT_SIZE must be a multiple of FLAG_WORD_BITS
\ No newline at end of file
@@ -0,0 +1,115 @@
+// Converts the raw column files of the SSB tables into the self-describing
+// column format (operations/column_file.hpp). Every <TABLE><n> file found in
+// the data directory gets a <TABLE><n>.col companion, the raw files are kept.
+//
+// String columns given as <TABLE><n>.txt, one value per line, are dictionary
+// encoded (operations/dictionary.hpp): their codes are written as the raw
+// <TABLE><n> file and its .col companion, the dictionary as <TABLE><n>.dict.
+//
+// usage: ./convert_columns [data_dir] [segment_size] [--no-checksums]
+// the defaults are DATA_DIR and SEGMENT_SIZE from common.hpp, the segment size
+// must match SEGMENT_SIZE for the executor to reuse the per-segment statistics.
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "kernels/types.hpp"
+#include "operations/column_file.hpp"
+#include "operations/dictionary.hpp"
+
+// codes of the string column in text_filename, written next to it; false if there is none
+bool encode_string_column(const std::string &filename, const std::string &text_filename)
+{
+    std::ifstream text(text_filename.c_str());
+    if (!text.is_open())
+        return false;
+
+    std::vector<std::string> strings;
+    for (std::string line; std::getline(text, line);)
+        strings.push_back(line);
+    text.close();
+
+    std::vector<int> codes;
+    column_dictionary dictionary = dictionary_encode(strings, codes);
+    write_dictionary_file(filename + DICTIONARY_FILE_EXTENSION, dictionary);
+
+    std::ofstream out(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(codes.data()), codes.size() * sizeof(int));
+    if (!out.good())
+    {
+        std::cerr << "Could not write the codes of " << text_filename << std::endl;
+        throw std::runtime_error("Could not write the codes of " + text_filename);
+    }
+
+    std::cout << "Encoded " << text_filename << " (" << strings.size() << " rows, "
+        << dictionary.size() << " distinct values)" << std::endl;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    std::string data_dir = DATA_DIR;
+    uint64_t segment_size = SEGMENT_SIZE;
+    bool with_checksums = true;
+
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--no-checksums")
+            with_checksums = false;
+        else
+            positional.push_back(arg);
+    }
+
+    if (positional.size() > 0)
+        data_dir = positional[0];
+    if (positional.size() > 1)
+        segment_size = std::stoull(positional[1]);
+    if (!data_dir.empty() && data_dir.back() != '/')
+        data_dir += '/';
+
+    for (const auto &table : table_column_numbers)
+    {
+        std::string table_name = table.first;
+        std::transform(table_name.begin(), table_name.end(), table_name.begin(), ::toupper);
+
+        for (int i = 0; i < table.second; i++)
+        {
+            std::string filename = data_dir + table_name + std::to_string(i);
+            encode_string_column(filename, filename + ".txt");
+
+            std::ifstream colData(filename.c_str(), std::ios::in | std::ios::binary);
+            if (!colData.is_open())
+            {
+                std::cout << "Skipping missing column " << filename << std::endl;
+                continue;
+            }
+
+            colData.seekg(0, std::ios::end);
+            uint64_t num_entries = static_cast<uint64_t>(colData.tellg()) / sizeof(int);
+            colData.seekg(0, std::ios::beg);
+
+            std::vector<int> content(num_entries);
+            colData.read(reinterpret_cast<char *>(content.data()), num_entries * sizeof(int));
+            colData.close();
+
+            if (num_entries == 0)
+            {
+                std::cout << "Skipping empty column " << filename << std::endl;
+                continue;
+            }
+
+            write_column_file(filename + COLUMN_FILE_EXTENSION, content.data(), num_entries, segment_size, with_checksums);
+            std::cout << "Converted " << filename << " (" << num_entries << " rows, "
+                << (num_entries + segment_size - 1) / segment_size << " segments)" << std::endl;
+        }
+    }
+
+    return 0;
+}
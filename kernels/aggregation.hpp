@@ -2,486 +2,1080 @@
 
 #include <sycl/sycl.hpp>
 
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
 #include "types.hpp"
 #include "../operations/memory_manager.hpp"
 #include "common.hpp"
 
 #define PRINT_AGGREGATE_DEBUG_INFO 0
 
-enum class BinaryOp : uint8_t
+#define MAX_AGGREGATES 8
+
+enum class AggregateFunction : uint8_t
 {
-    Multiply,
-    Divide,
-    Add,
-    Subtract
+    Sum,
+    Count,
+    Min,
+    Max,
+    Avg
 };
 
-template <typename T>
-inline T element_operation(T a, T b, BinaryOp op)
+AggregateFunction get_aggregate_function(const std::string &agg)
 {
-    switch (op)
+    if (agg == "SUM" || agg == "$SUM0")
+        return AggregateFunction::Sum;
+    if (agg == "COUNT")
+        return AggregateFunction::Count;
+    if (agg == "MIN")
+        return AggregateFunction::Min;
+    if (agg == "MAX")
+        return AggregateFunction::Max;
+    if (agg == "AVG")
+        return AggregateFunction::Avg;
+    throw std::invalid_argument("Unknown aggregate function: " + agg);
+}
+
+// Aggregate functions computed by the kernels, selected at compile time.
+// Every aggregate owns 64-bit result slots (signed for MIN and MAX): identity is
+// their initial value, combine merges two partial results in registers and merge
+// adds a partial result to a slot with the cheapest atomic for the function, on
+// global memory or on the work-group local copy of the slots.
+// AVG is not a kernel function, it is a SUM and a COUNT (see plan_aggregate_slots).
+template <typename T, sycl::access::address_space Space>
+using aggregate_atomic = sycl::atomic_ref<
+    T,
+    sycl::memory_order::relaxed,
+    Space == sycl::access::address_space::local_space ? sycl::memory_scope::work_group : sycl::memory_scope::device,
+    Space
+>;
+
+#define AGGREGATE_GLOBAL sycl::access::address_space::global_space
+#define AGGREGATE_LOCAL sycl::access::address_space::local_space
+
+template <AggregateFunction F>
+struct aggregate_function;
+
+template <>
+struct aggregate_function<AggregateFunction::Sum>
+{
+    static constexpr int64_t identity = 0;
+
+    static inline int64_t combine(int64_t a, int64_t b) { return a + b; }
+
+    template <sycl::access::address_space Space = AGGREGATE_GLOBAL>
+    static inline void merge(uint64_t &slot, int64_t partial)
     {
-    case BinaryOp::Multiply:
-        return a * b;
-    case BinaryOp::Divide:
-        return a / b;
-    case BinaryOp::Add:
-        return a + b;
-    case BinaryOp::Subtract:
-        return a - b;
+        aggregate_atomic<uint64_t, Space>(slot).fetch_add(static_cast<uint64_t>(partial));
+    }
+};
+
+// COUNT never reads its column, a selected row adds 1 (the columns have no nulls)
+template <>
+struct aggregate_function<AggregateFunction::Count> : aggregate_function<AggregateFunction::Sum>
+{};
+
+template <>
+struct aggregate_function<AggregateFunction::Min>
+{
+    static constexpr int64_t identity = INT64_MAX;
+
+    static inline int64_t combine(int64_t a, int64_t b) { return a < b ? a : b; }
+
+    // the relaxed load skips the read-modify-write once the slot holds a smaller value
+    template <sycl::access::address_space Space = AGGREGATE_GLOBAL>
+    static inline void merge(uint64_t &slot, int64_t partial)
+    {
+        aggregate_atomic<int64_t, Space> slot_obj(reinterpret_cast<int64_t &>(slot));
+        if (partial < slot_obj.load())
+            slot_obj.fetch_min(partial);
+    }
+};
+
+template <>
+struct aggregate_function<AggregateFunction::Max>
+{
+    static constexpr int64_t identity = INT64_MIN;
+
+    static inline int64_t combine(int64_t a, int64_t b) { return a > b ? a : b; }
+
+    template <sycl::access::address_space Space = AGGREGATE_GLOBAL>
+    static inline void merge(uint64_t &slot, int64_t partial)
+    {
+        aggregate_atomic<int64_t, Space> slot_obj(reinterpret_cast<int64_t &>(slot));
+        if (partial > slot_obj.load())
+            slot_obj.fetch_max(partial);
+    }
+};
+
+// Aggregates the selected rows of a flag word in registers, then merges them into the slot.
+template <AggregateFunction F, sycl::access::address_space Space = AGGREGATE_GLOBAL, typename T>
+inline void aggregate_word(const T *column, flag_word word, uint64_t first_row, int n, uint64_t &slot)
+{
+    using function = aggregate_function<F>;
+
+    int64_t partial;
+    if constexpr (F == AggregateFunction::Count)
+        partial = sycl::popcount(word);
+    else
+    {
+        partial = function::identity;
+        for (int b = 0; b < n; b++)
+            if ((word >> b) & 1)
+                partial = function::combine(partial, column[first_row + b]);
+    }
+    function::template merge<Space>(slot, partial);
+}
+
+template <AggregateFunction F, sycl::access::address_space Space = AGGREGATE_GLOBAL, typename T>
+inline void aggregate_row(const T *column, uint64_t row, uint64_t &slot)
+{
+    if constexpr (F == AggregateFunction::Count)
+        aggregate_function<F>::template merge<Space>(slot, 1);
+    else
+        aggregate_function<F>::template merge<Space>(slot, column[row]);
+}
+
+// The switches only pick the instantiation, every work-item takes the same branch.
+template <sycl::access::address_space Space = AGGREGATE_GLOBAL, typename T>
+inline void aggregate_word(AggregateFunction function, const T *column, flag_word word, uint64_t first_row, int n, uint64_t &slot)
+{
+    switch (function)
+    {
+    case AggregateFunction::Sum:
+        aggregate_word<AggregateFunction::Sum, Space>(column, word, first_row, n, slot);
+        break;
+    case AggregateFunction::Count:
+        aggregate_word<AggregateFunction::Count, Space>(column, word, first_row, n, slot);
+        break;
+    case AggregateFunction::Min:
+        aggregate_word<AggregateFunction::Min, Space>(column, word, first_row, n, slot);
+        break;
+    case AggregateFunction::Max:
+        aggregate_word<AggregateFunction::Max, Space>(column, word, first_row, n, slot);
+        break;
     default:
-        return 0;
+        break;
     }
 }
 
-BinaryOp get_op_from_string(const std::string &op)
-{
-    if (op == "*")
-        return BinaryOp::Multiply;
-    if (op == "/")
-        return BinaryOp::Divide;
-    if (op == "+")
-        return BinaryOp::Add;
-    if (op == "-")
-        return BinaryOp::Subtract;
-    throw std::invalid_argument("Unknown operation: " + op);
+template <sycl::access::address_space Space = AGGREGATE_GLOBAL, typename T>
+inline void aggregate_row(AggregateFunction function, const T *column, uint64_t row, uint64_t &slot)
+{
+    switch (function)
+    {
+    case AggregateFunction::Sum:
+        aggregate_row<AggregateFunction::Sum, Space>(column, row, slot);
+        break;
+    case AggregateFunction::Count:
+        aggregate_row<AggregateFunction::Count, Space>(column, row, slot);
+        break;
+    case AggregateFunction::Min:
+        aggregate_row<AggregateFunction::Min, Space>(column, row, slot);
+        break;
+    case AggregateFunction::Max:
+        aggregate_row<AggregateFunction::Max, Space>(column, row, slot);
+        break;
+    default:
+        break;
+    }
 }
 
-class PerformOperationKernelColumns : public KernelDefinition
+// one instantiation per input width, an Int32 input is never widened in memory
+template <sycl::access::address_space Space = AGGREGATE_GLOBAL>
+inline void aggregate_word(AggregateFunction function, const typed_column &column, flag_word word, uint64_t first_row, int n, uint64_t &slot)
 {
-private:
-    int *result;
-    const int *col1, *col2;
-    const bool *flags;
-    BinaryOp op_enum;
-public:
-    PerformOperationKernelColumns(int *result, const int *col1, const int *col2, const bool *flags, BinaryOp op, int col_len)
-        : KernelDefinition(col_len), result(result), col1(col1), col2(col2), flags(flags), op_enum(op)
-    {}
+    if (column.type == ColumnType::Int64)
+        aggregate_word<Space>(function, (const int64_t *)column.data, word, first_row, n, slot);
+    else
+        aggregate_word<Space>(function, (const int *)column.data, word, first_row, n, slot);
+}
 
-    PerformOperationKernelColumns(int *res, const int *a, const int *b, const bool *flgs, const std::string &op, int col_len)
-        : KernelDefinition(col_len), result(res), col1(a), col2(b), flags(flgs), op_enum(get_op_from_string(op))
-    {}
+template <sycl::access::address_space Space = AGGREGATE_GLOBAL>
+inline void aggregate_row(AggregateFunction function, const typed_column &column, uint64_t row, uint64_t &slot)
+{
+    if (column.type == ColumnType::Int64)
+        aggregate_row<Space>(function, (const int64_t *)column.data, row, slot);
+    else
+        aggregate_row<Space>(function, (const int *)column.data, row, slot);
+}
 
-    void operator()(sycl::id<1> idx) const
+// merges a partial result, e.g. a work-group local slot, into a global slot
+inline void merge_aggregate(AggregateFunction function, uint64_t &slot, int64_t partial)
+{
+    switch (function)
     {
-        if (flags[idx])
+    case AggregateFunction::Sum:
+    case AggregateFunction::Count:
+        aggregate_function<AggregateFunction::Sum>::merge(slot, partial);
+        break;
+    case AggregateFunction::Min:
+        aggregate_function<AggregateFunction::Min>::merge(slot, partial);
+        break;
+    case AggregateFunction::Max:
+        aggregate_function<AggregateFunction::Max>::merge(slot, partial);
+        break;
+    default:
+        break;
+    }
+}
+
+inline int64_t aggregate_identity(AggregateFunction function)
+{
+    switch (function)
+    {
+    case AggregateFunction::Min:
+        return aggregate_function<AggregateFunction::Min>::identity;
+    case AggregateFunction::Max:
+        return aggregate_function<AggregateFunction::Max>::identity;
+    default:
+        return 0;
+    }
+}
+
+// MIN, MAX and AVG of no rows are NULL, the identity of MIN and MAX or 0 is not a result
+inline bool aggregate_is_nullable(AggregateFunction function)
+{
+    return function == AggregateFunction::Min || function == AggregateFunction::Max || function == AggregateFunction::Avg;
+}
+
+// Kernel slots of the aggregates of a node. Aggregate a keeps slot a, an AVG is
+// computed as a SUM there and divided by finalize_averages with a COUNT slot
+// appended after the aggregates of the node. Appended slots read no column.
+// Without group by, the single result row may have no input rows: rows_slot then
+// counts them for the nullable aggregates, reusing a COUNT slot when there is one.
+struct aggregate_slots
+{
+    std::vector<AggregateFunction> functions;
+    std::vector<std::pair<int, int>> averages; // (sum slot, count slot)
+    int rows_slot = -1; // COUNT of the input rows, -1 with a group by or no nullable aggregate
+};
+
+aggregate_slots plan_aggregate_slots(const std::vector<AggregateFunction> &functions, bool group_by)
+{
+    aggregate_slots slots;
+    slots.functions = functions;
+    for (int a = 0; a < functions.size(); a++)
+    {
+        if (functions[a] == AggregateFunction::Avg)
         {
-            result[idx] = element_operation(col1[idx], col2[idx], op_enum);
+            slots.functions[a] = AggregateFunction::Sum;
+            slots.averages.emplace_back(a, slots.functions.size());
+            slots.functions.push_back(AggregateFunction::Count);
         }
     }
-};
 
-sycl::event perform_operation(
-    int result[],
-    const int a[],
-    const int b[],
-    const bool flags[],
-    int size,
-    const std::string &op,
+    if (group_by || std::none_of(functions.begin(), functions.end(), aggregate_is_nullable))
+        return slots;
+
+    auto count = std::find(slots.functions.begin(), slots.functions.end(), AggregateFunction::Count);
+    slots.rows_slot = count - slots.functions.begin();
+    if (count == slots.functions.end())
+        slots.functions.push_back(AggregateFunction::Count);
+    return slots;
+}
+
+// Fills the slots of MIN and MAX with their identity, the other slots come zeroed
+// from alloc_zero. slot_size is the number of results of every aggregate.
+std::vector<sycl::event> init_aggregate_slots(
+    uint64_t *results,
+    const std::vector<AggregateFunction> &functions,
+    uint64_t slot_size,
+    sycl::queue &queue,
+    const std::vector<sycl::event> &dependencies)
+{
+    std::vector<sycl::event> events;
+    for (int a = 0; a < functions.size(); a++)
+    {
+        int64_t identity = aggregate_identity(functions[a]);
+        if (identity != 0)
+            events.push_back(queue.fill(results + a * slot_size, static_cast<uint64_t>(identity), slot_size, dependencies));
+    }
+    return events;
+}
+
+// AVG is the SUM divided by the COUNT truncated toward zero, in the scale of its input: the
+// result type of AVG over an integer or decimal column is the type of the column, as in Calcite.
+// The AVG of no rows is left at 0 here, it is NULL through aggregate_slots::rows_slot.
+sycl::event finalize_averages(
+    uint64_t *results,
+    const std::vector<std::pair<int, int>> &averages,
+    uint64_t slot_size,
     sycl::queue &queue,
     const std::vector<sycl::event> &dependencies)
 {
-    BinaryOp op_enum = get_op_from_string(op);
+    int sum_slots[MAX_AGGREGATES], count_slots[MAX_AGGREGATES];
+    for (int i = 0; i < averages.size(); i++)
+    {
+        sum_slots[i] = averages[i].first;
+        count_slots[i] = averages[i].second;
+    }
+    int num_averages = averages.size();
 
     return queue.submit(
         [&](sycl::handler &cgh)
         {
             cgh.depends_on(dependencies);
             cgh.parallel_for(
-                size,
-                [=](sycl::id<1> i)
+                slot_size,
+                [=](sycl::id<1> idx)
                 {
-                    if (flags[i])
-                        result[i] = element_operation(a[i], b[i], op_enum);
+                    for (int i = 0; i < num_averages; i++)
+                    {
+                        uint64_t &sum = results[sum_slots[i] * slot_size + idx[0]];
+                        uint64_t count = results[count_slots[i] * slot_size + idx[0]];
+                        sum = count == 0 ? 0 : static_cast<uint64_t>(static_cast<int64_t>(sum) / static_cast<int64_t>(count));
+                    }
                 }
             );
         }
     );
 }
 
-class PerformOperationKernelLiteralFirst : public KernelDefinition
-{
-private:
-    int *result;
-    int literal;
-    const int *col;
-    const bool *flags;
-    BinaryOp op_enum;
-public:
-    PerformOperationKernelLiteralFirst(int *res, int lit, const int *column, const bool *flgs, BinaryOp op, int col_len)
-        : KernelDefinition(col_len), result(res), literal(lit), col(column), flags(flgs), op_enum(op)
-    {}
+// Group by result slots (GroupByTable in types.hpp). The group columns form a
+// composite key, the mixed-radix number of their offsets from min, and:
+//  - Dense: the key is the slot, one slot per combination of the group ranges.
+//  - OpenAddressing: a power of two number of slots probed linearly from a mixed
+//    hash of the key, sized from the selected rows when the key space is much larger.
+// Either way the occupied slots are compacted after the pass (compact_group_by).
 
-    PerformOperationKernelLiteralFirst(int *res, int lit, const int *column, const bool *flgs, const std::string &op, int col_len)
-        : KernelDefinition(col_len), result(res), literal(lit), col(column), flags(flgs), op_enum(get_op_from_string(op))
-    {}
+#define DENSE_GROUP_BY_MAX_SLOTS (((uint64_t)1) << 20) // dense layout below this many slots, without counting rows
+#define DENSE_GROUP_BY_MAX_RANGE_RATIO 4 // dense layout while the key space is at most this many times the groups
+#define GROUP_BY_MIN_CAPACITY 64
 
-    void operator()(sycl::id<1> idx) const
+// number of composite keys of the group columns, throws when it does not fit in 64 bits
+uint64_t group_key_space(const int *min, const int *max, int col_num)
+{
+    uint64_t key_space = 1;
+    for (int j = 0; j < col_num; j++)
     {
-        if (flags[idx])
+        uint64_t range = (int64_t)max[j] - (int64_t)min[j] + 1;
+        if (range > (UINT64_MAX - 1) / key_space)
         {
-            result[idx] = element_operation(literal, col[idx], op_enum);
+            std::cerr << "Group by: the composite key of " << col_num << " columns does not fit in 64 bits" << std::endl;
+            throw std::overflow_error("Group by: composite key does not fit in 64 bits");
         }
+        key_space *= range;
     }
-};
+    return key_space;
+}
 
-sycl::event perform_operation(
-    int result[],
-    int a,
-    const int b[],
-    const bool flags[],
-    int size,
-    const std::string &op,
-    sycl::queue &queue,
-    const std::vector<sycl::event> &dependencies)
+// max_groups bounds the number of groups, the key space or the number of selected rows
+GroupByTable make_group_by_table(uint64_t key_space, uint64_t max_groups, memory_manager &allocator)
 {
-    BinaryOp op_enum = get_op_from_string(op);
+    GroupByTable table;
+    if (key_space <= DENSE_GROUP_BY_MAX_SLOTS || key_space <= DENSE_GROUP_BY_MAX_RANGE_RATIO * max_groups)
+    {
+        table.layout = HashTableLayout::Dense;
+        table.capacity = key_space;
+    }
+    else
+    {
+        // load factor of at most 1/2
+        table.layout = HashTableLayout::OpenAddressing;
+        table.capacity = GROUP_BY_MIN_CAPACITY;
+        while (table.capacity < 2 * max_groups)
+            table.capacity <<= 1;
+        table.keys = allocator.alloc_zero<uint64_t>(table.capacity);
+    }
 
-    return queue.submit(
-        [&](sycl::handler &cgh)
-        {
-            cgh.depends_on(dependencies);
-            cgh.parallel_for(
-                size,
-                [=](sycl::id<1> i)
-                {
-                    if (flags[i])
-                        result[i] = element_operation(a, b[i], op_enum);
-                }
-            );
-        }
-    );
+    #if PRINT_AGGREGATE_DEBUG_INFO
+    std::cout << "GROUP BY " << (table.layout == HashTableLayout::Dense ? "dense" : "open addressing")
+        << " with " << table.capacity << " slots for a key space of " << key_space
+        << " and at most " << max_groups << " groups" << std::endl;
+    #endif
+
+    return table;
+}
+
+inline uint64_t group_key(const int *const *contents, const int *min, const int *max, int col_num, uint64_t row)
+{
+    uint64_t key = 0, mult = 1;
+    for (int j = 0; j < col_num; j++)
+    {
+        key += (uint64_t)((int64_t)contents[j][row] - min[j]) * mult;
+        mult *= (uint64_t)((int64_t)max[j] - min[j] + 1);
+    }
+    return key;
 }
 
-class PerformOperationKernelLiteralSecond : public KernelDefinition
+// slot of the group of key, inserted when new, -1 if the table is full
+inline int64_t group_by_slot(const GroupByTable &table, uint64_t key)
+{
+    if (table.layout == HashTableLayout::Dense)
+        return key;
+
+    // murmur3 64-bit finalizer
+    uint64_t h = key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    uint64_t stored_key = key + 1;
+    for (uint64_t slot = h & (table.capacity - 1), probes = 0; probes < table.capacity; slot = (slot + 1) & (table.capacity - 1), probes++)
+    {
+        sycl::atomic_ref<
+            uint64_t,
+            sycl::memory_order::relaxed,
+            sycl::memory_scope::device,
+            sycl::access::address_space::global_space
+        > slot_key(table.keys[slot]);
+
+        uint64_t expected = 0;
+        if (slot_key.compare_exchange_strong(expected, stored_key) || expected == stored_key)
+            return slot;
+    }
+    return -1;
+}
+
+class GroupByAggregateKernel : public KernelDefinition
 {
 private:
-    int *result;
-    const int *col;
-    int literal;
-    const bool *flags;
-    BinaryOp op_enum;
+    const int **contents;
+    typed_column agg_columns[MAX_AGGREGATES];
+    AggregateFunction functions[MAX_AGGREGATES];
+    int num_aggs;
+    const int *max;
+    const int *min;
+    const flag_word *flags;
+    int col_num;
+    int **results;
+    GroupByTable table;
+    uint64_t *agg_result; // num_aggs arrays of table.capacity results
+    unsigned *result_flags;
 public:
-    PerformOperationKernelLiteralSecond(int *res, const int *column, int lit, const bool *flgs, BinaryOp op, int col_len)
-        : KernelDefinition(col_len), result(res), col(column), literal(lit), flags(flgs), op_enum(op)
-    {}
+    GroupByAggregateKernel(
+        const int **contents,
+        const typed_column *agg_columns,
+        const AggregateFunction *functions,
+        int num_aggs,
+        const int *max,
+        const int *min,
+        const flag_word *flags,
+        int col_num,
+        int col_len,
+        int **results,
+        uint64_t *agg_result,
+        unsigned *result_flags,
+        const GroupByTable &table)
+        : KernelDefinition(col_len), contents(contents), num_aggs(num_aggs),
+        max(max), min(min), flags(flags), col_num(col_num),
+        results(results), table(table), agg_result(agg_result),
+        result_flags(result_flags)
+    {
+        std::copy_n(agg_columns, num_aggs, this->agg_columns);
+        std::copy_n(functions, num_aggs, this->functions);
+    }
 
-    PerformOperationKernelLiteralSecond(int *res, const int *column, int lit, const bool *flgs, const std::string &op, int col_len)
-        : KernelDefinition(col_len), result(res), col(column), literal(lit), flags(flgs), op_enum(get_op_from_string(op))
-    {}
+    void describe(kernel_arguments &arguments) const
+    {
+        arguments << contents;
+        arguments.append(agg_columns, num_aggs).append(functions, num_aggs)
+            << num_aggs << max << min << flags << col_num << results << table << agg_result << result_flags;
+    }
 
     void operator()(sycl::id<1> idx) const
     {
-        if (flags[idx])
+        auto i = idx[0];
+        if (get_flag(flags, i))
         {
-            result[idx] = element_operation(col[idx], literal, op_enum);
+            int64_t slot = group_by_slot(table, group_key(contents, min, max, col_num, i));
+            if (slot < 0)
+                return;
+
+            sycl::atomic_ref<
+                unsigned,
+                sycl::memory_order::relaxed,
+                sycl::memory_scope::device,
+                sycl::access::address_space::global_space
+            > flag_obj(result_flags[slot]);
+            if (flag_obj.exchange(1) == 0)
+            {
+                for (int j = 0; j < col_num; j++)
+                    results[j][slot] = contents[j][i];
+            }
+
+            for (int a = 0; a < num_aggs; a++)
+                aggregate_row(functions[a], agg_columns[a], i, agg_result[a * table.capacity + slot]);
         }
     }
 };
 
-sycl::event perform_operation(
-    int result[],
-    const int a[],
-    int b,
-    const bool flags[],
-    int size,
-    const std::string &op,
-    sycl::queue &queue,
+sycl::event group_by_aggregate(
+    const int **contents,
+    const typed_column agg_columns[],
+    const AggregateFunction functions[],
+    int num_aggs,
+    const int *max,
+    const int *min,
+    const flag_word *flags,
+    int col_len,
+    int col_num,
+    int **results,
+    uint64_t *agg_result,
+    unsigned *result_flags,
+    const GroupByTable &table,
+    sycl::queue &gpu_queue,
     const std::vector<sycl::event> &dependencies)
 {
-    BinaryOp op_enum = get_op_from_string(op);
+    GroupByAggregateKernel kernel(
+        contents, agg_columns, functions, num_aggs, max, min, flags, col_num, col_len,
+        results, agg_result, result_flags, table);
 
-    return queue.submit(
+    return gpu_queue.submit(
         [&](sycl::handler &cgh)
         {
             cgh.depends_on(dependencies);
             cgh.parallel_for(
-                size,
-                [=](sycl::id<1> i)
-                {
-                    if (flags[i])
-                        result[i] = element_operation(a[i], b, op_enum);
-                }
+                kernel.get_col_len(),
+                kernel
             );
         }
     );
 }
 
-class AggregateOperationKernel : public KernelDefinition
+// Privatized aggregation, one work-item per flag word: every work-group aggregates
+// its rows into a local memory copy of the result slots, then merges each occupied
+// slot into the global result once, instead of one global atomic per row.
+// Without group columns there is a single slot, fed with the per-word partials,
+// so q1.x sums take one global atomic per work-group. The group by variant needs
+// the dense layout, where the group values are decoded from the slot at the merge.
+// On CPU devices the local slots are the memory of the thread running the work-group.
+
+#define LOCAL_AGGREGATE_WORK_GROUP_SIZE 256
+#define LOCAL_AGGREGATE_MAX_BYTES (32 << 10) // local slots per work-group, below the usual 64 KiB
+
+class LocalAggregateKernel : public KernelDefinition
 {
 private:
-    const int *data;
-    const bool *flags;
-    uint64_t *agg_res;
+    const int **contents;
+    typed_column agg_columns[MAX_AGGREGATES];
+    AggregateFunction functions[MAX_AGGREGATES];
+    int num_aggs;
+    const int *max;
+    const int *min;
+    const flag_word *flags;
+    int col_num;
+    uint64_t nrows;
+    int **results;
+    uint64_t capacity; // dense slots, 1 without group by
+    uint64_t *agg_result; // num_aggs arrays of capacity results
+    unsigned *result_flags;
 public:
-    AggregateOperationKernel(const int *data, const bool *flags, int col_len, uint64_t *agg_res)
-        : KernelDefinition(col_len), data(data), flags(flags), agg_res(agg_res)
-    {}
+    // aggregates without group by
+    LocalAggregateKernel(const typed_column *data, const AggregateFunction *functions, int num_aggs, const flag_word *flags, int col_len, uint64_t *agg_res)
+        : KernelDefinition(flag_words(col_len)), contents(nullptr), num_aggs(num_aggs),
+        max(nullptr), min(nullptr), flags(flags), col_num(0), nrows(col_len),
+        results(nullptr), capacity(1), agg_result(agg_res), result_flags(nullptr)
+    {
+        std::copy_n(data, num_aggs, this->agg_columns);
+        std::copy_n(functions, num_aggs, this->functions);
+    }
+
+    // group by over a dense table
+    LocalAggregateKernel(
+        const int **contents,
+        const typed_column *agg_columns,
+        const AggregateFunction *functions,
+        int num_aggs,
+        const int *max,
+        const int *min,
+        const flag_word *flags,
+        int col_num,
+        int col_len,
+        int **results,
+        uint64_t *agg_result,
+        unsigned *result_flags,
+        const GroupByTable &table)
+        : KernelDefinition(flag_words(col_len)), contents(contents), num_aggs(num_aggs),
+        max(max), min(min), flags(flags), col_num(col_num), nrows(col_len),
+        results(results), capacity(table.capacity), agg_result(agg_result), result_flags(result_flags)
+    {
+        std::copy_n(agg_columns, num_aggs, this->agg_columns);
+        std::copy_n(functions, num_aggs, this->functions);
+    }
 
-    uint64_t *get_agg_res() const
+    void describe(kernel_arguments &arguments) const
     {
-        return agg_res;
+        arguments << contents;
+        arguments.append(agg_columns, num_aggs).append(functions, num_aggs)
+            << num_aggs << max << min << flags << col_num << nrows << results << capacity << agg_result << result_flags;
     }
 
-    // This optimization works only on CPU, where the reduction is quite beneficial and fusion is not
-    void operator()(sycl::id<1> idx
-        #if not USE_FUSION
-        ,
-        auto &sum
-        #endif
-        ) const
+    uint64_t local_agg_slots() const { return num_aggs * capacity; }
+    uint64_t local_flag_slots() const { return capacity; }
+
+    void operator()(sycl::nd_item<1> item, uint64_t *local_aggs, unsigned *local_flags) const
     {
-        #if USE_FUSION
-        if (flags[idx])
+        uint64_t local_id = item.get_local_id(0), local_range = item.get_local_range(0);
+
+        for (uint64_t s = local_id; s < num_aggs * capacity; s += local_range)
+            local_aggs[s] = aggregate_identity(functions[s / capacity]);
+        for (uint64_t s = local_id; s < capacity; s += local_range)
+            local_flags[s] = 0;
+        sycl::group_barrier(item.get_group());
+
+        uint64_t w = item.get_global_id(0);
+        flag_word word = w < get_col_len() ? flags[w] : 0;
+        if (word != 0)
         {
-            sycl::atomic_ref<
-                uint64_t,
-                sycl::memory_order::relaxed,
-                sycl::memory_scope::device,
-                sycl::access::address_space::global_space
-            > sum_obj(*agg_res);
-            sum_obj.fetch_add(data[idx]);
+            uint64_t first_row = w * FLAG_WORD_BITS;
+            if (col_num == 0)
+            {
+                int n = rows_in_flag_word(w, nrows);
+                aggregate_atomic<unsigned, AGGREGATE_LOCAL>(local_flags[0]).store(1);
+                for (int a = 0; a < num_aggs; a++)
+                    aggregate_word<AGGREGATE_LOCAL>(functions[a], agg_columns[a], word, first_row, n, local_aggs[a]);
+            }
+            else
+            {
+                for (flag_word rest = word; rest != 0; rest &= rest - 1)
+                {
+                    uint64_t row = first_row + sycl::ctz(rest);
+                    uint64_t slot = group_key(contents, min, max, col_num, row);
+                    aggregate_atomic<unsigned, AGGREGATE_LOCAL>(local_flags[slot]).store(1);
+                    for (int a = 0; a < num_aggs; a++)
+                        aggregate_row<AGGREGATE_LOCAL>(functions[a], agg_columns[a], row, local_aggs[a * capacity + slot]);
+                }
+            }
+        }
+        sycl::group_barrier(item.get_group());
+
+        for (uint64_t s = local_id; s < capacity; s += local_range)
+        {
+            if (local_flags[s] == 0)
+                continue;
+
+            if (result_flags != nullptr && aggregate_atomic<unsigned, AGGREGATE_GLOBAL>(result_flags[s]).exchange(1) == 0)
+            {
+                uint64_t key = s;
+                for (int j = 0; j < col_num; j++)
+                {
+                    uint64_t range = (uint64_t)((int64_t)max[j] - min[j] + 1);
+                    results[j][s] = min[j] + (int)(key % range);
+                    key /= range;
+                }
+            }
+
+            for (int a = 0; a < num_aggs; a++)
+                merge_aggregate(functions[a], agg_result[a * capacity + s], local_aggs[a * capacity + s]);
         }
-        #else
-        sum.combine(data[idx] * flags[idx]);
-        #endif
     }
 };
 
-sycl::event aggregate_operation(
-    const int a[],
-    const bool flags[],
-    int size,
-    uint64_t *agg_res,
+// the group by slots fit the local memory and their merge is amortized over the rows of a work-group
+bool use_local_aggregation(const GroupByTable &table, int num_aggs, const sycl::queue &queue)
+{
+    uint64_t local_bytes = table.capacity * (num_aggs * sizeof(uint64_t) + sizeof(unsigned));
+    uint64_t local_mem_size = queue.get_device().get_info<sycl::info::device::local_mem_size>();
+    return table.layout == HashTableLayout::Dense
+        && local_bytes <= std::min<uint64_t>(LOCAL_AGGREGATE_MAX_BYTES, local_mem_size)
+        && table.capacity <= LOCAL_AGGREGATE_WORK_GROUP_SIZE * FLAG_WORD_BITS;
+}
+
+sycl::event submit_local_aggregate(
+    const LocalAggregateKernel &kernel,
     sycl::queue &queue,
     const std::vector<sycl::event> &dependencies)
 {
-    #if PRINT_AGGREGATE_DEBUG_INFO
-    auto start = std::chrono::high_resolution_clock::now();
-    #endif
-
-
-    #if PRINT_AGGREGATE_DEBUG_INFO
-    auto end = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double, std::milli> memset_time = end - start;
-    std::cout << "Memset time: " << memset_time.count() << " ms" << std::endl;
+    uint64_t work_group_size = std::min<uint64_t>(
+        LOCAL_AGGREGATE_WORK_GROUP_SIZE,
+        queue.get_device().get_info<sycl::info::device::max_work_group_size>());
+    uint64_t work_groups = std::max<uint64_t>(1, (kernel.get_col_len() + work_group_size - 1) / work_group_size);
 
-    start = std::chrono::high_resolution_clock::now();
-    #endif
-
-    auto e2 = queue.submit(
+    return queue.submit(
         [&](sycl::handler &cgh)
         {
-            cgh.depends_on(dependencies);
+            if (!dependencies.empty())
+                cgh.depends_on(dependencies);
+
+            sycl::local_accessor<uint64_t, 1> local_aggs(sycl::range<1>(kernel.local_agg_slots()), cgh);
+            sycl::local_accessor<unsigned, 1> local_flags(sycl::range<1>(kernel.local_flag_slots()), cgh);
+
             cgh.parallel_for(
-                sycl::range<1>(size),
-                // agg,
-                [=](sycl::id<1> idx)
+                sycl::nd_range<1>(work_groups * work_group_size, work_group_size),
+                [=](sycl::nd_item<1> item)
                 {
-                    if (flags[idx])
-                    {
-                        // sum.combine(a[idx]);
-                        sycl::atomic_ref<
-                            uint64_t,
-                            sycl::memory_order::relaxed,
-                            sycl::memory_scope::device,
-                            sycl::access::address_space::global_space
-                        > sum_obj(*agg_res);
-                        sum_obj.fetch_add(a[idx]);
-                    }
+                    kernel(item, &local_aggs[0], &local_flags[0]);
                 }
             );
         }
     );
+}
 
-    #if PRINT_AGGREGATE_DEBUG_INFO
-    end = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double, std::milli> kernel_time = end - start;
-    std::cout << "Aggregate kernel time: " << kernel_time.count() << " ms" << std::endl;
-    #endif
+// Host aggregation for CPU queues, where the global atomics of the device kernels
+// serialize across cores and sockets. The flag words are split in partitions, one
+// work-item (one thread) each, that aggregate into their own partial dense table
+// with plain loads and stores. A second kernel merges the partial tables, one
+// work-item per slot, with one atomic per occupied slot into the result (only
+// needed because the segments of a table merge concurrently).
+// Scalar aggregates are the single slot case.
 
-    return e2;
+#define CPU_AGGREGATE_MAX_PARTIAL_BYTES (((uint64_t)1) << 30) // partial tables of an aggregate node
+#define CPU_AGGREGATE_MIN_PARTITION_WORDS 256 // a partition aggregates at least this many flag words
+
+inline int64_t combine_aggregate(AggregateFunction function, int64_t a, int64_t b)
+{
+    switch (function)
+    {
+    case AggregateFunction::Min:
+        return aggregate_function<AggregateFunction::Min>::combine(a, b);
+    case AggregateFunction::Max:
+        return aggregate_function<AggregateFunction::Max>::combine(a, b);
+    default:
+        return a + b;
+    }
 }
 
-class GroupByAggregateKernel : public KernelDefinition
+// Partitions of one of num_tables aggregations sharing the partial table budget,
+// 0 when a single partial table does not fit.
+int cpu_aggregate_partitions(uint64_t capacity, int num_aggs, uint64_t words, uint64_t num_tables, const sycl::queue &queue)
+{
+    uint64_t table_bytes = capacity * (num_aggs * sizeof(uint64_t) + sizeof(unsigned));
+    uint64_t partitions = queue.get_device().get_info<sycl::info::device::max_compute_units>();
+    partitions = std::min(partitions, (words + CPU_AGGREGATE_MIN_PARTITION_WORDS - 1) / CPU_AGGREGATE_MIN_PARTITION_WORDS);
+    partitions = std::min(partitions, CPU_AGGREGATE_MAX_PARTIAL_BYTES / (num_tables * table_bytes));
+    return partitions;
+}
+
+class CpuAggregateKernel : public KernelDefinition
 {
 private:
     const int **contents;
-    const int *agg_column;
+    typed_column agg_columns[MAX_AGGREGATES];
+    AggregateFunction functions[MAX_AGGREGATES];
+    int num_aggs;
     const int *max;
     const int *min;
-    const bool *flags;
+    const flag_word *flags;
     int col_num;
+    uint64_t nrows;
     int **results;
-    uint64_t prod_ranges;
-    uint64_t *agg_result;
+    uint64_t capacity; // dense slots, 1 without group by
+    uint64_t *agg_result; // num_aggs arrays of capacity results
     unsigned *result_flags;
+    uint64_t *partial_aggs; // num_partitions * num_aggs arrays of capacity partial results
+    unsigned *partial_flags; // num_partitions arrays of capacity flags
+    int num_partitions;
 public:
-    GroupByAggregateKernel(
+    // aggregates without group by
+    CpuAggregateKernel(
+        const typed_column *data,
+        const AggregateFunction *functions,
+        int num_aggs,
+        const flag_word *flags,
+        int col_len,
+        uint64_t *agg_res,
+        uint64_t *partial_aggs,
+        unsigned *partial_flags,
+        int num_partitions)
+        : KernelDefinition(flag_words(col_len)), contents(nullptr), num_aggs(num_aggs),
+        max(nullptr), min(nullptr), flags(flags), col_num(0), nrows(col_len),
+        results(nullptr), capacity(1), agg_result(agg_res), result_flags(nullptr),
+        partial_aggs(partial_aggs), partial_flags(partial_flags), num_partitions(num_partitions)
+    {
+        std::copy_n(data, num_aggs, this->agg_columns);
+        std::copy_n(functions, num_aggs, this->functions);
+    }
+
+    // group by over a dense table
+    CpuAggregateKernel(
         const int **contents,
-        const int *agg_column,
+        const typed_column *agg_columns,
+        const AggregateFunction *functions,
+        int num_aggs,
         const int *max,
         const int *min,
-        const bool *flags,
+        const flag_word *flags,
         int col_num,
         int col_len,
         int **results,
         uint64_t *agg_result,
         unsigned *result_flags,
-        uint64_t prod_ranges)
-        : KernelDefinition(col_len), contents(contents), agg_column(agg_column),
-        max(max), min(min), flags(flags), col_num(col_num),
-        results(results), prod_ranges(prod_ranges), agg_result(agg_result),
-        result_flags(result_flags)
-    {}
+        const GroupByTable &table,
+        uint64_t *partial_aggs,
+        unsigned *partial_flags,
+        int num_partitions)
+        : KernelDefinition(flag_words(col_len)), contents(contents), num_aggs(num_aggs),
+        max(max), min(min), flags(flags), col_num(col_num), nrows(col_len),
+        results(results), capacity(table.capacity), agg_result(agg_result), result_flags(result_flags),
+        partial_aggs(partial_aggs), partial_flags(partial_flags), num_partitions(num_partitions)
+    {
+        std::copy_n(agg_columns, num_aggs, this->agg_columns);
+        std::copy_n(functions, num_aggs, this->functions);
+    }
 
-    void operator()(sycl::id<1> idx) const
+    void describe(kernel_arguments &arguments) const
     {
-        auto i = idx[0];
-        if (flags[i])
+        arguments << contents;
+        arguments.append(agg_columns, num_aggs).append(functions, num_aggs)
+            << num_aggs << max << min << flags << col_num << nrows << results << capacity << agg_result << result_flags
+            << partial_aggs << partial_flags << num_partitions;
+    }
+
+    int get_num_partitions() const { return num_partitions; }
+    uint64_t get_capacity() const { return capacity; }
+
+    void aggregate_partition(uint64_t p) const
+    {
+        uint64_t *aggs = partial_aggs + p * num_aggs * capacity;
+        unsigned *occupied = partial_flags + p * capacity;
+        for (int a = 0; a < num_aggs; a++)
+            std::fill_n(aggs + a * capacity, capacity, (uint64_t)aggregate_identity(functions[a]));
+        std::fill_n(occupied, capacity, 0);
+
+        uint64_t words = get_col_len(), words_per_partition = (words + num_partitions - 1) / num_partitions;
+        uint64_t first_word = p * words_per_partition, last_word = std::min(words, first_word + words_per_partition);
+        for (uint64_t w = first_word; w < last_word; w++)
         {
-            int hash = 0, mult = 1;
-            for (int j = 0; j < col_num; j++)
+            for (flag_word rest = flags[w]; rest != 0; rest &= rest - 1)
             {
-                hash += (contents[j][i] - min[j]) * mult;
-                mult *= max[j] - min[j] + 1;
+                uint64_t row = w * FLAG_WORD_BITS + sycl::ctz(rest);
+                uint64_t slot = col_num == 0 ? 0 : group_key(contents, min, max, col_num, row);
+                occupied[slot] = 1;
+                for (int a = 0; a < num_aggs; a++)
+                {
+                    uint64_t &partial = aggs[a * capacity + slot];
+                    int64_t value = agg_columns[a].data == nullptr ? 1 : typed_value(agg_columns[a], row);
+                    partial = combine_aggregate(functions[a], partial, value);
+                }
             }
-            hash %= prod_ranges;
+        }
+    }
 
-            sycl::atomic_ref<
-                unsigned,
-                sycl::memory_order::relaxed,
-                sycl::memory_scope::device,
-                sycl::access::address_space::global_space
-            > flag_obj(result_flags[hash]);
-            if (flag_obj.exchange(1) == 0)
+    void merge_slot(uint64_t s) const
+    {
+        bool found = false;
+        for (int p = 0; p < num_partitions && !found; p++)
+            found = partial_flags[p * capacity + s] != 0;
+        if (!found)
+            return;
+
+        if (result_flags != nullptr && aggregate_atomic<unsigned, AGGREGATE_GLOBAL>(result_flags[s]).exchange(1) == 0)
+        {
+            uint64_t key = s;
+            for (int j = 0; j < col_num; j++)
             {
-                for (int j = 0; j < col_num; j++)
-                    results[j][hash] = contents[j][i];
+                uint64_t range = (uint64_t)((int64_t)max[j] - min[j] + 1);
+                results[j][s] = min[j] + (int)(key % range);
+                key /= range;
             }
+        }
 
-            sycl::atomic_ref<
-                uint64_t,
-                sycl::memory_order::relaxed,
-                sycl::memory_scope::device,
-                sycl::access::address_space::global_space
-            > sum_obj(agg_result[hash]);
-            sum_obj.fetch_add(agg_column[i]);
+        for (int a = 0; a < num_aggs; a++)
+        {
+            int64_t value = aggregate_identity(functions[a]);
+            for (int p = 0; p < num_partitions; p++)
+                value = combine_aggregate(functions[a], value, partial_aggs[(p * num_aggs + a) * capacity + s]);
+            merge_aggregate(functions[a], agg_result[a * capacity + s], value);
         }
     }
 };
 
-sycl::event group_by_aggregate(
-    const int **contents,
-    const int *agg_column,
-    const int *max,
-    const int *min,
-    const bool *flags,
-    int col_len,
+sycl::event submit_cpu_aggregate(
+    const CpuAggregateKernel &kernel,
+    sycl::queue &queue,
+    const std::vector<sycl::event> &dependencies)
+{
+    auto e1 = queue.submit(
+        [&](sycl::handler &cgh)
+        {
+            if (!dependencies.empty())
+                cgh.depends_on(dependencies);
+            cgh.parallel_for(
+                kernel.get_num_partitions(),
+                [=](sycl::id<1> p)
+                {
+                    kernel.aggregate_partition(p[0]);
+                }
+            );
+        }
+    );
+
+    return queue.submit(
+        [&](sycl::handler &cgh)
+        {
+            cgh.depends_on(e1);
+            cgh.parallel_for(
+                kernel.get_capacity(),
+                [=](sycl::id<1> s)
+                {
+                    kernel.merge_slot(s[0]);
+                }
+            );
+        }
+    );
+}
+
+// privatized per work-group on devices, per thread on CPU queues
+sycl::event aggregate_operation(
+    const typed_column agg_columns[],
+    const AggregateFunction functions[],
+    int num_aggs,
+    const flag_word flags[],
+    int size,
+    uint64_t *agg_res,
+    memory_manager &allocator,
+    sycl::queue &queue,
+    const std::vector<sycl::event> &dependencies)
+{
+    if (queue.get_device().is_cpu())
+    {
+        int partitions = cpu_aggregate_partitions(1, num_aggs, flag_words(size), 1, queue);
+        return submit_cpu_aggregate(
+            CpuAggregateKernel(
+                agg_columns, functions, num_aggs, flags, size, agg_res,
+                allocator.alloc<uint64_t>(partitions * num_aggs, true), allocator.alloc<unsigned>(partitions, true), partitions),
+            queue, dependencies);
+    }
+
+    return submit_local_aggregate(LocalAggregateKernel(agg_columns, functions, num_aggs, flags, size, agg_res), queue, dependencies);
+}
+
+// Moves the occupied slots of a group by to the front, so that the downstream
+// operators only see real groups: the group columns and the num_slots aggregate
+// arrays are gathered into new arrays of one entry per group, in slot order.
+// Sync point, the number of groups sizes the new arrays.
+// Returns the group columns, the aggregate arrays, the number of groups and the gather event.
+std::tuple<int **, uint64_t *, uint64_t, sycl::event> compact_group_by(
+    int *const *results,
     int col_num,
-    int **results,
-    uint64_t *agg_result,
-    unsigned *result_flags,
-    uint64_t prod_ranges,
-    const std::string &agg_op,
-    sycl::queue &gpu_queue,
+    const uint64_t *agg_result,
+    int num_slots,
+    const unsigned *result_flags,
+    uint64_t capacity,
+    memory_manager &allocator,
+    sycl::queue &queue,
     const std::vector<sycl::event> &dependencies)
 {
-    return gpu_queue.submit(
+    uint64_t words = flag_words(capacity);
+    flag_word *occupied = allocator.alloc<flag_word>(words, true);
+    uint64_t *offsets = allocator.alloc<uint64_t>(words + 1, false);
+
+    auto e1 = pack_flags(occupied, result_flags, capacity, queue, dependencies);
+    queue.submit(
         [&](sycl::handler &cgh)
         {
-            cgh.depends_on(dependencies);
+            cgh.depends_on(e1);
             cgh.parallel_for(
-                col_len,
-                [=](sycl::id<1> idx)
+                words,
+                [=](sycl::id<1> w)
                 {
-                    auto i = idx[0];
-                    if (flags[i])
+                    offsets[w] = sycl::popcount(occupied[w]);
+                }
+            );
+        }
+    ).wait();
+
+    uint64_t num_groups = 0;
+    for (uint64_t w = 0; w < words; w++)
+    {
+        uint64_t count = offsets[w];
+        offsets[w] = num_groups;
+        num_groups += count;
+    }
+    offsets[words] = num_groups;
+
+    int **compacted = allocator.alloc<int *>(col_num, false);
+    for (int j = 0; j < col_num; j++)
+        compacted[j] = allocator.alloc<int>(num_groups, true);
+    uint64_t *compacted_aggs = allocator.alloc<uint64_t>(num_slots * num_groups, true);
+
+    auto e2 = queue.submit(
+        [&](sycl::handler &cgh)
+        {
+            cgh.parallel_for(
+                words,
+                [=](sycl::id<1> w)
+                {
+                    flag_word word = occupied[w];
+                    uint64_t group = offsets[w];
+                    while (word != 0)
                     {
-                        int hash = 0, mult = 1;
+                        uint64_t slot = w[0] * FLAG_WORD_BITS + sycl::ctz(word);
                         for (int j = 0; j < col_num; j++)
-                        {
-                            hash += (contents[j][i] - min[j]) * mult;
-                            mult *= max[j] - min[j] + 1;
-                        }
-                        hash %= prod_ranges;
-
-                        sycl::atomic_ref<
-                            unsigned,
-                            sycl::memory_order::relaxed,
-                            sycl::memory_scope::device,
-                            sycl::access::address_space::global_space
-                        > flag_obj(result_flags[hash]);
-                        unsigned expected = 0;
-                        bool first = flag_obj.compare_exchange_strong(expected, 1);
-                        if (first)
-                        {
-                            for (int j = 0; j < col_num; j++)
-                            {
-                                results[j][hash] = contents[j][i];
-                            }
-                        }
-
-                        sycl::atomic_ref<
-                            uint64_t,
-                            sycl::memory_order::relaxed,
-                            sycl::memory_scope::device,
-                            sycl::access::address_space::global_space
-                        > sum_obj(agg_result[hash]);
-                        sum_obj.fetch_add(agg_column[i]);
+                            compacted[j][group] = results[j][slot];
+                        for (int a = 0; a < num_slots; a++)
+                            compacted_aggs[a * num_groups + group] = agg_result[a * capacity + slot];
+                        word &= word - 1;
+                        group++;
                     }
                 }
             );
         }
     );
+
+    #if PRINT_AGGREGATE_DEBUG_INFO
+    std::cout << "GROUP BY compacted " << capacity << " slots to " << num_groups << " groups" << std::endl;
+    #endif
+
+    return std::make_tuple(compacted, compacted_aggs, num_groups, e2);
 }
 
+// Group by of the normal engine, returns the compacted group columns, the number
+// of groups, their flags, the aggregate arrays and the event of the last kernel.
 std::tuple<
     int **,
     unsigned long long,
-    bool *,
+    flag_word *,
     uint64_t *,
     sycl::event
 > group_by_aggregate(
     ColumnData<int> *group_columns,
-    int *agg_column,
-    bool *flags,
+    const typed_column agg_columns[],
+    const AggregateFunction functions[],
+    int num_aggs,
+    flag_word *flags,
     int col_num,
     int col_len,
-    const std::string &agg_op,
     memory_manager &gpu_allocator,
     sycl::queue &queue,
     const std::vector<sycl::event> &dependencies)
 {
-    unsigned long long prod_ranges = 1;
-    std::vector<sycl::event> events(dependencies);
-    events.reserve(dependencies.size() + col_num + 2);
-
     #if PRINT_AGGREGATE_DEBUG_INFO
     auto start = std::chrono::high_resolution_clock::now();
     #endif
 
-    for (int i = 0; i < col_num; i++)
+    const int **contents = gpu_allocator.alloc<const int *>(col_num, false);
+    int *min = gpu_allocator.alloc<int>(col_num, false),
+        *max = gpu_allocator.alloc<int>(col_num, false);
+    for (int j = 0; j < col_num; j++)
     {
-        prod_ranges *= group_columns[i].max_value - group_columns[i].min_value + 1;
+        contents[j] = group_columns[j].content;
+        min[j] = group_columns[j].min_value;
+        max[j] = group_columns[j].max_value;
     }
 
+    uint64_t key_space = group_key_space(min, max, col_num);
+    uint64_t max_groups = key_space <= DENSE_GROUP_BY_MAX_SLOTS ? key_space :
+        std::min(key_space, count_true_flags(flags, col_len, queue, dependencies));
+    GroupByTable table = make_group_by_table(key_space, max_groups, gpu_allocator);
+
     #if PRINT_AGGREGATE_DEBUG_INFO
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double, std::milli> range_time = end - start;
-    std::cout << "Range calculation time: " << range_time.count() << " ms" << std::endl;
+    std::cout << "Group table sizing time: " << range_time.count() << " ms" << std::endl;
     start = std::chrono::high_resolution_clock::now();
     #endif
 
-    int **results = sycl::malloc_shared<int *>(col_num, queue);
+    int **results = gpu_allocator.alloc<int *>(col_num, false);
     for (int i = 0; i < col_num; i++)
     {
-        results[i] = gpu_allocator.alloc<int>(prod_ranges, true);
+        results[i] = gpu_allocator.alloc<int>(table.capacity, true);
     }
 
-    uint64_t *agg_result = gpu_allocator.alloc_zero<uint64_t>(prod_ranges);
-    unsigned *res_flags = gpu_allocator.alloc_zero<unsigned>(prod_ranges);
+    uint64_t *agg_result = gpu_allocator.alloc_zero<uint64_t>(num_aggs * table.capacity);
+    unsigned *res_flags = gpu_allocator.alloc_zero<unsigned>(table.capacity);
+
+    std::vector<sycl::event> events(dependencies);
+    auto init_events = init_aggregate_slots(
+        agg_result, std::vector<AggregateFunction>(functions, functions + num_aggs), table.capacity, queue, dependencies);
+    events.insert(events.end(), init_events.begin(), init_events.end());
 
     #if PRINT_AGGREGATE_DEBUG_INFO
     end = std::chrono::high_resolution_clock::now();
@@ -490,51 +1084,27 @@ std::tuple<
     start = std::chrono::high_resolution_clock::now();
     #endif
 
-    auto e4 = queue.submit(
-        [&](sycl::handler &cgh)
-        {
-            cgh.depends_on(events);
-            cgh.parallel_for(
-                col_len,
-                [=](sycl::id<1> idx)
-                {
-                    auto i = idx[0];
-                    if (flags[i])
-                    {
-                        int hash = 0, mult = 1;
-                        for (int j = 0; j < col_num; j++)
-                        {
-                            hash += (group_columns[j].content[i] - group_columns[j].min_value) * mult;
-                            mult *= group_columns[j].max_value - group_columns[j].min_value + 1;
-                        }
-                        hash %= prod_ranges;
-
-                        sycl::atomic_ref<
-                            unsigned,
-                            sycl::memory_order::relaxed,
-                            sycl::memory_scope::device,
-                            sycl::access::address_space::global_space
-                        > flag_obj(res_flags[hash]);
-                        if (flag_obj.exchange(1) == 0)
-                        {
-                            for (int j = 0; j < col_num; j++)
-                                results[j][hash] = group_columns[j].content[i];
-                        }
-
-                        // if (agg_op == "SUM")
-
-                        sycl::atomic_ref<
-                            uint64_t,
-                            sycl::memory_order::relaxed,
-                            sycl::memory_scope::device,
-                            sycl::access::address_space::global_space
-                        > sum_obj(agg_result[hash]);
-                        sum_obj.fetch_add(agg_column[i]);
-                    }
-                }
-            );
-        }
-    );
+    int cpu_partitions = queue.get_device().is_cpu() && table.layout == HashTableLayout::Dense ?
+        cpu_aggregate_partitions(table.capacity, num_aggs, flag_words(col_len), 1, queue) : 0;
+
+    auto e4 = cpu_partitions > 0 ?
+        submit_cpu_aggregate(
+            CpuAggregateKernel(
+                contents, agg_columns, functions, num_aggs, max, min, flags, col_num, col_len,
+                results, agg_result, res_flags, table,
+                gpu_allocator.alloc<uint64_t>(cpu_partitions * num_aggs * table.capacity, true),
+                gpu_allocator.alloc<unsigned>(cpu_partitions * table.capacity, true),
+                cpu_partitions),
+            queue, events) :
+        use_local_aggregation(table, num_aggs, queue) ?
+        submit_local_aggregate(
+            LocalAggregateKernel(
+                contents, agg_columns, functions, num_aggs, max, min, flags, col_num, col_len,
+                results, agg_result, res_flags, table),
+            queue, events) :
+        group_by_aggregate(
+            contents, agg_columns, functions, num_aggs, max, min, flags, col_len, col_num,
+            results, agg_result, res_flags, table, queue, events);
 
     #if PRINT_AGGREGATE_DEBUG_INFO
     end = std::chrono::high_resolution_clock::now();
@@ -543,26 +1113,17 @@ std::tuple<
     start = std::chrono::high_resolution_clock::now();
     #endif
 
-    bool *final_flags = gpu_allocator.alloc<bool>(prod_ranges, true);
-    auto e5 = queue.submit(
-        [&](sycl::handler &cgh)
-        {
-            cgh.depends_on(e4);
-            cgh.parallel_for(
-                prod_ranges,
-                [=](sycl::id<1> idx)
-                {
-                    final_flags[idx] = res_flags[idx] != 0;
-                }
-            );
-        }
-    );
+    auto [compacted, compacted_aggs, num_groups, e5] = compact_group_by(
+        results, col_num, agg_result, num_aggs, res_flags, table.capacity, gpu_allocator, queue, { e4 });
+
+    flag_word *final_flags = gpu_allocator.alloc<flag_word>(flag_words(num_groups), true);
+    auto e6 = fill_flags(final_flags, true, num_groups, queue, { e5 });
 
     #if PRINT_AGGREGATE_DEBUG_INFO
     end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double, std::milli> flag_time = end - start;
-    std::cout << "Final flags kernel time: " << flag_time.count() << " ms" << std::endl;
+    std::cout << "Compaction and final flags time: " << flag_time.count() << " ms" << std::endl;
     #endif
 
-    return std::make_tuple(results, prod_ranges, final_flags, agg_result, e5);
-}
\ No newline at end of file
+    return std::make_tuple(compacted, num_groups, final_flags, compacted_aggs, e6);
+}
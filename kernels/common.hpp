@@ -1,5 +1,10 @@
 #pragma once
 
+#include <string>
+#include <type_traits>
+
+#include "types.hpp"
+
 class KernelDefinition
 {
 private:
@@ -9,9 +14,192 @@ public:
     int get_col_len() const { return col_len; }
 };
 
+// Arguments of a kernel written field by field (see kernel_graphs): kernels built with the same
+// arguments write the same bytes, whatever their padding and their unused array entries.
+class kernel_arguments
+{
+private:
+    std::string &bytes;
+public:
+    kernel_arguments(std::string &bytes) : bytes(bytes) {}
+
+    template <typename T>
+        requires std::is_scalar_v<T>
+    kernel_arguments &operator<<(T value)
+    {
+        bytes.append(reinterpret_cast<const char *>(&value), sizeof(T));
+        return *this;
+    }
+
+    // the first count entries of an array
+    template <typename T>
+    kernel_arguments &append(const T *values, int count)
+    {
+        for (int i = 0; i < count; i++)
+            *this << values[i];
+        return *this;
+    }
+};
+
+inline kernel_arguments &operator<<(kernel_arguments &arguments, const packed_column &column)
+{
+    return arguments << column.values << column.words << column.base << column.bits;
+}
+
+inline kernel_arguments &operator<<(kernel_arguments &arguments, const typed_column &column)
+{
+    return arguments << column.data << column.type;
+}
+
+inline kernel_arguments &operator<<(kernel_arguments &arguments, const JoinHashTable &ht)
+{
+    return arguments << ht.layout << ht.slots << ht.capacity << ht.num_payloads << ht.min_value << ht.max_value;
+}
+
+inline kernel_arguments &operator<<(kernel_arguments &arguments, const GroupByTable &table)
+{
+    return arguments << table.layout << table.keys << table.capacity;
+}
+
+// Kernels writing flags run one work-item per flag word, so that no two
+// work-items write the same word; their col_len is the number of words.
+class FillFlagsKernel : public KernelDefinition
+{
+private:
+    flag_word *flags;
+    bool value;
+    uint64_t nrows;
+public:
+    FillFlagsKernel(flag_word *f, bool val, uint64_t len)
+        : KernelDefinition(flag_words(len)), flags(f), value(val), nrows(len)
+    {}
+
+    void describe(kernel_arguments &arguments) const
+    {
+        arguments << flags << value << nrows;
+    }
+
+    void operator()(sycl::id<1> idx) const
+    {
+        flags[idx] = value ? flag_word_mask(rows_in_flag_word(idx[0], nrows)) : 0;
+    }
+};
+
+// Packs a per-row array of 0/non-0 values (e.g. the group by slot markers) into flags
+class PackFlagsKernel : public KernelDefinition
+{
+private:
+    flag_word *flags;
+    const unsigned *values;
+    uint64_t nrows;
+public:
+    PackFlagsKernel(flag_word *f, const unsigned *vals, uint64_t len)
+        : KernelDefinition(flag_words(len)), flags(f), values(vals), nrows(len)
+    {}
+
+    void operator()(sycl::id<1> idx) const
+    {
+        uint64_t first_row = idx[0] * FLAG_WORD_BITS;
+        int n = rows_in_flag_word(idx[0], nrows);
+        flag_word word = 0;
+        for (int b = 0; b < n; b++)
+            word |= ((flag_word)(values[first_row + b] != 0)) << b;
+        flags[idx] = word;
+    }
+};
+
+// Frame-of-reference + bit-packing of an int column (see packed_column), one work-item
+// per output word: it gathers the fields overlapping the word, so no word is written twice.
+class PackIntsKernel : public KernelDefinition
+{
+private:
+    uint32_t *words;
+    const int *values;
+    int base, bits;
+    uint64_t nrows;
+public:
+    PackIntsKernel(uint32_t *w, const int *vals, int frame, int bit_width, uint64_t len)
+        : KernelDefinition(packed_word_count(len, bit_width)), words(w), values(vals), base(frame), bits(bit_width), nrows(len)
+    {}
+
+    void operator()(sycl::id<1> idx) const
+    {
+        uint64_t first_bit = idx[0] * 32,
+            first_row = first_bit / bits,
+            last_row = std::min((first_bit + 31) / bits, nrows - 1);
+        uint64_t word = 0;
+        for (uint64_t row = first_row; row <= last_row; row++)
+        {
+            uint64_t field = (uint32_t)values[row] - (uint32_t)base;
+            int64_t shift = (int64_t)(row * bits) - (int64_t)first_bit;
+            word |= shift >= 0 ? field << shift : field >> -shift;
+        }
+        words[idx] = (uint32_t)word;
+    }
+};
+
+// Decodes a packed column back into plain ints, for the kernels that do not read packed columns
+class UnpackIntsKernel : public KernelDefinition
+{
+private:
+    int *values;
+    packed_column column;
+public:
+    UnpackIntsKernel(int *vals, const packed_column &col, uint64_t len)
+        : KernelDefinition(len), values(vals), column(col)
+    {}
+
+    void operator()(sycl::id<1> idx) const
+    {
+        values[idx] = column[idx[0]];
+    }
+};
+
+sycl::event fill_flags(
+    flag_word *flags,
+    bool value,
+    uint64_t len,
+    sycl::queue &queue,
+    const std::vector<sycl::event> &dependencies = {})
+{
+    FillFlagsKernel kernel(flags, value, len);
+
+    return queue.submit(
+        [&](sycl::handler &cgh)
+        {
+            cgh.depends_on(dependencies);
+            cgh.parallel_for(
+                kernel.get_col_len(),
+                kernel
+            );
+        }
+    );
+}
+
+sycl::event pack_flags(
+    flag_word *flags,
+    const unsigned *values,
+    uint64_t len,
+    sycl::queue &queue,
+    const std::vector<sycl::event> &dependencies = {})
+{
+    PackFlagsKernel kernel(flags, values, len);
+
+    return queue.submit(
+        [&](sycl::handler &cgh)
+        {
+            cgh.depends_on(dependencies);
+            cgh.parallel_for(
+                kernel.get_col_len(),
+                kernel
+            );
+        }
+    );
+}
+
 
 uint64_t count_true_flags(
-    const bool *flags,
+    const flag_word *flags,
     int len,
     sycl::queue &queue,
     const std::vector<sycl::event> &dependencies = {})
@@ -23,7 +211,7 @@ uint64_t count_true_flags(
         {
             cgh.depends_on(dependencies);
             cgh.parallel_for(
-                sycl::range<1>(len),
+                sycl::range<1>(flag_words(len)),
                 sycl::reduction(
                     count,
                     sycl::plus<>(),
@@ -31,7 +219,7 @@ uint64_t count_true_flags(
                 ),
                 [=](sycl::id<1> idx, auto &sum)
                 {
-                    sum.combine(flags[idx[0]]);
+                    sum.combine(sycl::popcount(flags[idx[0]]));
                 }
             );
         }
@@ -42,7 +230,7 @@ uint64_t count_true_flags(
 }
 
 sycl::event count_true_flags(
-    const bool *flags,
+    const flag_word *flags,
     int len,
     sycl::queue &queue,
     memory_manager &allocator,
@@ -54,7 +242,7 @@ sycl::event count_true_flags(
         {
             cgh.depends_on(dependencies);
             cgh.parallel_for(
-                sycl::range<1>(len),
+                sycl::range<1>(flag_words(len)),
                 sycl::reduction(result, sycl::plus<>()),
                 [=](sycl::id<1> idx, auto &sum)
                 {
@@ -65,9 +253,54 @@ sycl::event count_true_flags(
                     //     sycl::access::address_space::global_space
                     // > count_atomic(*count);
                     // count_atomic.fetch_add(flags[idx[0]]);
-                    sum.combine(flags[idx[0]]);
+                    sum.combine(sycl::popcount(flags[idx[0]]));
                 }
             );
         }
     );
-}
\ No newline at end of file
+}
+
+// words: packed_word_count(len, bits) words, bits > 0
+sycl::event pack_ints(
+    uint32_t *words,
+    const int *values,
+    int base,
+    int bits,
+    uint64_t len,
+    sycl::queue &queue,
+    const std::vector<sycl::event> &dependencies = {})
+{
+    PackIntsKernel kernel(words, values, base, bits, len);
+
+    return queue.submit(
+        [&](sycl::handler &cgh)
+        {
+            cgh.depends_on(dependencies);
+            cgh.parallel_for(
+                kernel.get_col_len(),
+                kernel
+            );
+        }
+    );
+}
+
+sycl::event unpack_ints(
+    int *values,
+    const packed_column &column,
+    uint64_t len,
+    sycl::queue &queue,
+    const std::vector<sycl::event> &dependencies = {})
+{
+    UnpackIntsKernel kernel(values, column, len);
+
+    return queue.submit(
+        [&](sycl::handler &cgh)
+        {
+            cgh.depends_on(dependencies);
+            cgh.parallel_for(
+                kernel.get_col_len(),
+                kernel
+            );
+        }
+    );
+}
@@ -2,6 +2,9 @@
 
 #include <sycl/sycl.hpp>
 
+#include <algorithm>
+#include <climits>
+
 #include "../operations/memory_manager.hpp"
 #include "types.hpp"
 #include "common.hpp"
@@ -14,44 +17,185 @@ inline T HASH(T X, T Y, T Z)
     return ((X - Z) % Y);
 }
 
+// Join hash tables (JoinHashTable in types.hpp) come in two layouts:
+//  - Dense: one slot per key of [min_value, max_value], indexed by HASH(key, capacity, min_value).
+//    Keys only: bool presence per slot. With payloads: [present, payload 0, ..., payload n-1] ints.
+//    Perfect hashing for the dense SSB surrogate keys, but the size follows the key range.
+//  - OpenAddressing: a power of two number of slots probed linearly from a mixed hash of the key.
+//    Slots are [key, payload 0, ..., payload n-1] ints.
+//    Keys are stored as key ^ INT_MIN so that the zeroed memory marks empty slots,
+//    INT_MIN itself can not be a build key of such a table.
+// The layout is chosen when the table is created, from the key range and the build cardinality.
+// Payloads are the build columns a full join materializes on the probe side.
+
+#define DENSE_HT_MAX_RANGE_RATIO 4 // dense layout while the key range is at most this many times the build rows
+#define OPEN_ADDRESSING_MIN_CAPACITY 64
+#define MAX_JOIN_PAYLOADS 8
+
+HashTableLayout choose_ht_layout(int min_value, int max_value, uint64_t build_rows)
+{
+    uint64_t range = (int64_t)max_value - (int64_t)min_value + 1;
+    return range <= DENSE_HT_MAX_RANGE_RATIO * build_rows ? HashTableLayout::Dense : HashTableLayout::OpenAddressing;
+}
+
+JoinHashTable make_join_hash_table(int min_value, int max_value, uint64_t build_rows, int num_payloads, memory_manager &allocator)
+{
+    if (num_payloads < 0 || num_payloads > MAX_JOIN_PAYLOADS)
+    {
+        std::cerr << "Join hash table: " << num_payloads << " payload columns, at most "
+            << MAX_JOIN_PAYLOADS << " are supported" << std::endl;
+        throw std::invalid_argument("Join hash table: unsupported number of payload columns");
+    }
+
+    JoinHashTable ht;
+    ht.layout = choose_ht_layout(min_value, max_value, build_rows);
+    ht.num_payloads = num_payloads;
+    ht.min_value = min_value;
+    ht.max_value = max_value;
+
+    if (ht.layout == HashTableLayout::Dense)
+    {
+        ht.capacity = (int64_t)max_value - (int64_t)min_value + 1;
+        if (num_payloads > 0)
+            ht.slots = allocator.alloc_zero<int>(ht.capacity * (1 + num_payloads));
+        else
+            ht.slots = allocator.alloc_zero<bool>(ht.capacity);
+    }
+    else
+    {
+        // load factor of at most 1/2
+        ht.capacity = OPEN_ADDRESSING_MIN_CAPACITY;
+        while (ht.capacity < 2 * build_rows)
+            ht.capacity <<= 1;
+        ht.slots = allocator.alloc_zero<int>(ht.capacity * (1 + num_payloads));
+    }
+
+    #if PRINT_JOIN_DEBUG_INFO
+    std::cout << "JOIN ht " << (ht.layout == HashTableLayout::Dense ? "dense" : "open addressing")
+        << " with " << ht.capacity << " slots of " << num_payloads << " payloads for "
+        << build_rows << " build rows" << std::endl;
+    #endif
+
+    return ht;
+}
+
+inline uint64_t ht_probe_start(int key, uint64_t capacity)
+{
+    // murmur3 finalizer, spreads consecutive keys over the table
+    uint32_t h = key;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h & (capacity - 1);
+}
+
+// payloads of a slot of a table with num_payloads > 0
+inline int *ht_payloads(const JoinHashTable &ht, int64_t slot)
+{
+    return (int *)ht.slots + slot * (1 + ht.num_payloads) + 1;
+}
+
+// inserts key and returns its slot, -1 if the table is full
+inline int64_t ht_insert(const JoinHashTable &ht, int key)
+{
+    if (ht.layout == HashTableLayout::Dense)
+    {
+        int slot = HASH(key, (int)ht.capacity, ht.min_value);
+        if (ht.num_payloads > 0)
+            ((int *)ht.slots)[(int64_t)slot * (1 + ht.num_payloads)] = 1;
+        else
+            ((bool *)ht.slots)[slot] = true;
+        return slot;
+    }
+
+    int *slots = (int *)ht.slots;
+    int width = 1 + ht.num_payloads, stored_key = key ^ INT_MIN;
+    for (uint64_t slot = ht_probe_start(key, ht.capacity), probes = 0; probes < ht.capacity; slot = (slot + 1) & (ht.capacity - 1), probes++)
+    {
+        sycl::atomic_ref<
+            int,
+            sycl::memory_order::relaxed,
+            sycl::memory_scope::device,
+            sycl::access::address_space::global_space
+        > slot_key(slots[slot * width]);
+
+        int expected = 0;
+        if (slot_key.compare_exchange_strong(expected, stored_key) || expected == stored_key)
+            return slot;
+    }
+    return -1;
+}
+
+// slot of key, -1 if the key is not in the table
+inline int64_t ht_find(const JoinHashTable &ht, int key)
+{
+    if (key < ht.min_value || key > ht.max_value)
+        return -1;
+
+    if (ht.layout == HashTableLayout::Dense)
+    {
+        int slot = HASH(key, (int)ht.capacity, ht.min_value);
+        bool present = ht.num_payloads > 0
+            ? ((const int *)ht.slots)[(int64_t)slot * (1 + ht.num_payloads)] == 1
+            : ((const bool *)ht.slots)[slot];
+        return present ? slot : -1;
+    }
+
+    const int *slots = (const int *)ht.slots;
+    int width = 1 + ht.num_payloads, stored_key = key ^ INT_MIN;
+    for (uint64_t slot = ht_probe_start(key, ht.capacity), probes = 0; probes < ht.capacity; slot = (slot + 1) & (ht.capacity - 1), probes++)
+    {
+        int slot_key = slots[slot * width];
+        if (slot_key == 0)
+            return -1;
+        if (slot_key == stored_key)
+            return slot;
+    }
+    return -1;
+}
+
 class BuildKeysHTKernel : public KernelDefinition
 {
 private:
-    bool *ht;
+    JoinHashTable ht;
     const int *col;
-    const bool *flags;
-    int ht_len, ht_min_value;
+    const flag_word *flags;
 public:
-    BuildKeysHTKernel(bool *hash_table, const int *column, const bool *flags, int ht_length, int ht_min, int col_len)
-        : KernelDefinition(col_len), ht(hash_table), col(column), flags(flags), ht_len(ht_length), ht_min_value(ht_min)
+    BuildKeysHTKernel(const JoinHashTable &hash_table, const int *column, const flag_word *flags, int col_len)
+        : KernelDefinition(col_len), ht(hash_table), col(column), flags(flags)
     {}
 
+    void describe(kernel_arguments &arguments) const
+    {
+        arguments << ht << col << flags;
+    }
+
     void operator()(sycl::id<1> idx) const
     {
-        ht[HASH(col[idx], ht_len, ht_min_value)] = flags[idx];
+        if (get_flag(flags, idx[0]))
+            ht_insert(ht, col[idx]);
     }
 };
 
 sycl::event build_keys_ht(
     const int col[],
-    const bool flags[],
+    const flag_word flags[],
     int col_len,
-    bool ht[],
-    int ht_len,
-    int ht_min_value,
+    const JoinHashTable &ht,
     sycl::queue &queue,
     const std::vector<sycl::event> &dependencies)
 {
+    BuildKeysHTKernel kernel(ht, col, flags, col_len);
+
     return queue.submit(
         [&](sycl::handler &cgh)
         {
             cgh.depends_on(dependencies);
             cgh.parallel_for(
-                col_len,
-                [=](sycl::id<1> i)
-                {
-                    ht[HASH(col[i], ht_len, ht_min_value)] = flags[i];
-                }
+                kernel.get_col_len(),
+                kernel
             );
         }
     );
@@ -60,67 +204,62 @@ sycl::event build_keys_ht(
 class BuildKeyValsHTKernel : public KernelDefinition
 {
 private:
-    int *ht;
+    JoinHashTable ht;
     const int *col;
-    const int *agg_col;
-    const bool *flags;
-    int ht_len, ht_min_value;
+    const int *payload_cols[MAX_JOIN_PAYLOADS];
+    const flag_word *flags;
 public:
     BuildKeyValsHTKernel(
-        int *hash_table,
+        const JoinHashTable &hash_table,
         const int *column,
-        const int *agg_column,
-        const bool *flgs,
-        int ht_length,
-        int ht_min,
+        const int *const *payload_columns, // ht.num_payloads columns
+        const flag_word *flgs,
         int col_len)
-        : KernelDefinition(col_len), ht(hash_table), col(column), agg_col(agg_column), flags(flgs),
-        ht_len(ht_length), ht_min_value(ht_min)
-    {}
+        : KernelDefinition(col_len), ht(hash_table), col(column), flags(flgs)
+    {
+        std::copy_n(payload_columns, ht.num_payloads, payload_cols);
+    }
+
+    void describe(kernel_arguments &arguments) const
+    {
+        arguments << ht << col;
+        arguments.append(payload_cols, ht.num_payloads) << flags;
+    }
 
     void operator()(sycl::id<1> idx) const
     {
         auto i = idx[0];
-        if (flags[i])
-        {
-            int hash = HASH(col[i], ht_len, ht_min_value);
-            ht[hash << 1] = 1;
-            ht[(hash << 1) + 1] = agg_col[i];
-        }
-        else
-            ht[HASH(col[i], ht_len, ht_min_value) << 1] = 0;
+        if (!get_flag(flags, i))
+            return;
+
+        int64_t slot = ht_insert(ht, col[i]);
+        if (slot < 0)
+            return;
+
+        int *payloads = ht_payloads(ht, slot);
+        for (int p = 0; p < ht.num_payloads; p++)
+            payloads[p] = payload_cols[p][i];
     }
 };
 
 sycl::event build_key_vals_ht(
-    int col[],
-    int agg_col[],
-    const bool flags[],
+    const int col[],
+    const int *const payload_cols[],
+    const flag_word flags[],
     int col_len,
-    int ht[],
-    int ht_len,
-    int ht_min_value,
+    const JoinHashTable &ht,
     sycl::queue &queue,
     const std::vector<sycl::event> &dependencies)
 {
+    BuildKeyValsHTKernel kernel(ht, col, payload_cols, flags, col_len);
+
     return queue.submit(
         [&](sycl::handler &cgh)
         {
             cgh.depends_on(dependencies);
             cgh.parallel_for(
-                col_len,
-                [=](sycl::id<1> idx)
-                {
-                    auto i = idx[0];
-                    if (flags[i])
-                    {
-                        int hash = HASH(col[i], ht_len, ht_min_value);
-                        ht[hash << 1] = 1;
-                        ht[(hash << 1) + 1] = agg_col[i];
-                    }
-                    else
-                        ht[HASH(col[i], ht_len, ht_min_value) << 1] = 0;
-                }
+                kernel.get_col_len(),
+                kernel
             );
         }
     );
@@ -130,67 +269,58 @@ class FilterJoinKernel : public KernelDefinition
 {
 private:
     const int *probe_col;
-    bool *probe_col_flags;
-    const bool *build_ht;
-    int build_min_value, build_max_value, ht_len;
+    flag_word *probe_col_flags;
+    JoinHashTable build_ht;
+    uint64_t nrows;
 public:
     FilterJoinKernel(
         const int *probe_column,
-        bool *probe_column_flags,
-        const bool *build_hash_table,
-        int build_min,
-        int build_max,
+        flag_word *probe_column_flags,
+        const JoinHashTable &build_hash_table,
         int col_len)
-        : KernelDefinition(col_len), probe_col(probe_column), probe_col_flags(probe_column_flags), build_ht(build_hash_table),
-        build_min_value(build_min), build_max_value(build_max)
+        : KernelDefinition(flag_words(col_len)), probe_col(probe_column), probe_col_flags(probe_column_flags),
+        build_ht(build_hash_table), nrows(col_len)
+    {}
+
+    void describe(kernel_arguments &arguments) const
     {
-        ht_len = build_max_value - build_min_value + 1;
+        arguments << probe_col << probe_col_flags << build_ht << nrows;
     }
 
     void operator()(sycl::id<1> idx) const
     {
-        auto i = idx[0];
-        if (
-            probe_col_flags[i] &&
-            probe_col[i] >= build_min_value &&
-            probe_col[i] <= build_max_value
-            )
-            probe_col_flags[i] = build_ht[HASH(probe_col[i], ht_len, build_min_value)];
-        else
-            probe_col_flags[i] = false;
+        flag_word word = probe_col_flags[idx];
+        if (word == 0)
+            return;
+
+        uint64_t first_row = idx[0] * FLAG_WORD_BITS;
+        int n = rows_in_flag_word(idx[0], nrows);
+        for (int b = 0; b < n; b++)
+        {
+            if (((word >> b) & 1) && ht_find(build_ht, probe_col[first_row + b]) < 0)
+                word &= ~(((flag_word)1) << b);
+        }
+        probe_col_flags[idx] = word;
     }
 };
 
 sycl::event filter_join(
     const int *probe_col,
-    bool *probe_col_flags,
+    flag_word *probe_col_flags,
     int probe_col_len,
-    const bool *build_ht,
-    int build_min_value,
-    int build_max_value,
+    const JoinHashTable &build_ht,
     sycl::queue &queue,
     const std::vector<sycl::event> &dependencies)
 {
-    int ht_len = build_max_value - build_min_value + 1;
+    FilterJoinKernel kernel(probe_col, probe_col_flags, build_ht, probe_col_len);
 
     return queue.submit(
         [&](sycl::handler &cgh)
         {
             cgh.depends_on(dependencies);
             cgh.parallel_for(
-                probe_col_len,
-                [=](sycl::id<1> idx)
-                {
-                    auto i = idx[0];
-                    if (
-                        probe_col_flags[i] &&
-                        probe_col[i] >= build_min_value &&
-                        probe_col[i] <= build_max_value
-                        )
-                        probe_col_flags[i] = build_ht[HASH(probe_col[i], ht_len, build_min_value)];
-                    else
-                        probe_col_flags[i] = false;
-                }
+                kernel.get_col_len(),
+                kernel
             );
         }
     );
@@ -198,31 +328,30 @@ sycl::event filter_join(
 
 sycl::event filter_join(
     int build_col[],
-    bool build_flags[],
+    flag_word build_flags[],
     int build_col_len,
     int build_max_value,
     int build_min_value,
     int probe_col[],
-    bool probe_col_flags[],
+    flag_word probe_col_flags[],
     int probe_col_len,
-    bool *build_ht,
+    const JoinHashTable &build_ht,
     memory_manager &gpu_allocator,
     sycl::queue &queue,
     const std::vector<sycl::event> &dependencies)
 {
     std::vector<sycl::event> events(dependencies);
-    int ht_len = build_max_value - build_min_value + 1;
-    bool *ht;
+    JoinHashTable ht;
 
-    if (build_ht != nullptr)
+    if (build_ht.slots != nullptr)
     {
         ht = build_ht;
     }
     else
     {
-        ht = gpu_allocator.alloc_zero<bool>(ht_len);
+        ht = make_join_hash_table(build_min_value, build_max_value, build_col_len, 0, gpu_allocator);
 
-        auto e2 = build_keys_ht(build_col, build_flags, build_col_len, ht, ht_len, build_min_value, queue, events);
+        auto e2 = build_keys_ht(build_col, build_flags, build_col_len, ht, queue, events);
         events = { e2 };
 
         #if PRINT_JOIN_DEBUG_INFO
@@ -235,104 +364,185 @@ sycl::event filter_join(
         probe_col_flags,
         probe_col_len,
         ht,
-        build_min_value,
-        build_max_value,
         queue,
         events
     );
 }
 
+// Probe side of a full join: rows without a match are deselected,
+// the payloads of the matching build row are written to the payload output columns.
 class FullJoinKernel : public KernelDefinition
 {
 private:
     const int *probe_col;
-    int *probe_val_out;
-    bool *probe_flags;
-    const int *ht;
-    int ht_len, ht_min_value, ht_max_value;
+    int *payload_out[MAX_JOIN_PAYLOADS];
+    flag_word *probe_flags;
+    JoinHashTable ht;
+    uint64_t nrows;
 public:
     FullJoinKernel(
         const int *probe_column,
-        int *probe_value_output,
-        bool *probe_column_flags,
-        const int *hash_table,
-        int ht_min,
-        int ht_max,
+        int *const *payload_output, // ht.num_payloads columns of the probe length
+        flag_word *probe_column_flags,
+        const JoinHashTable &hash_table,
         int col_len)
-        : KernelDefinition(col_len), probe_col(probe_column), probe_val_out(probe_value_output),
-        probe_flags(probe_column_flags), ht(hash_table), ht_min_value(ht_min), ht_max_value(ht_max)
+        : KernelDefinition(flag_words(col_len)), probe_col(probe_column),
+        probe_flags(probe_column_flags), ht(hash_table), nrows(col_len)
+    {
+        std::copy_n(payload_output, ht.num_payloads, payload_out);
+    }
+
+    void describe(kernel_arguments &arguments) const
     {
-        ht_len = ht_max - ht_min + 1;
+        arguments << probe_col;
+        arguments.append(payload_out, ht.num_payloads) << probe_flags << ht << nrows;
     }
 
     void operator()(sycl::id<1> idx) const
     {
-        auto i = idx[0];
-        if (probe_flags[i])
+        flag_word word = probe_flags[idx];
+        if (word == 0)
+            return;
+
+        uint64_t first_row = idx[0] * FLAG_WORD_BITS;
+        int n = rows_in_flag_word(idx[0], nrows);
+        for (int b = 0; b < n; b++)
         {
-            int hash = HASH(probe_col[i], ht_len, ht_min_value) << 1;
-            if (probe_col[i] >= ht_min_value &&
-                probe_col[i] <= ht_max_value &&
-                ht[hash] == 1)
-            {
-                probe_val_out[i] = ht[hash + 1]; // save the value to group by on
-            }
-            else
+            if (((word >> b) & 1) == 0)
+                continue;
+
+            uint64_t i = first_row + b;
+            int64_t slot = ht_find(ht, probe_col[i]);
+            if (slot < 0)
             {
-                probe_flags[i] = false; // mark as not selected
+                word &= ~(((flag_word)1) << b); // mark as not selected
+                continue;
             }
+
+            const int *payloads = ht_payloads(ht, slot);
+            for (int p = 0; p < ht.num_payloads; p++)
+                payload_out[p][i] = payloads[p];
         }
+        probe_flags[idx] = word;
     }
 };
 
 sycl::event full_join(
     const int *probe_col,
-    int *probe_val_out,
-    bool *probe_flags,
+    int *const *payload_out,
+    flag_word *probe_flags,
     int probe_col_len,
-    const int *ht,
-    int ht_min,
-    int ht_max,
+    const JoinHashTable &ht,
     sycl::queue &queue,
     const std::vector<sycl::event> &dependencies
 )
 {
-    int ht_len = ht_max - ht_min + 1;
+    FullJoinKernel kernel(probe_col, payload_out, probe_flags, ht, probe_col_len);
 
     return queue.submit(
         [&](sycl::handler &cgh)
         {
             cgh.depends_on(dependencies);
             cgh.parallel_for(
-                sycl::range<1>{(unsigned long)probe_col_len},
-                [=](sycl::id<1> idx)
-                {
-                    auto i = idx[0];
-                    if (probe_flags[i])
-                    {
-                        int hash = HASH(probe_col[i], ht_len, ht_min);
-                        if (probe_col[i] >= ht_min &&
-                            probe_col[i] <= ht_max &&
-                            ht[hash << 1] == 1)
-                        {
-                            probe_val_out[i] = ht[(hash << 1) + 1]; // save the value to group by on
-                        }
-                        else
-                        {
-                            probe_flags[i] = false; // mark as not selected
-                        }
-                    }
-                }
+                kernel.get_col_len(),
+                kernel
             );
         }
     );
 }
 
+#define MAX_STAR_JOIN_TABLES 8
+
+// Probe side of several joins on the same rows in one pass (star join): every selected row is
+// looked up in the hash tables in order and deselected at its first miss, the payloads are
+// written only for the rows that match every table.
+class StarJoinKernel : public KernelDefinition
+{
+private:
+    packed_column probe_cols[MAX_STAR_JOIN_TABLES]; // decoded on the fly when packed
+    JoinHashTable hts[MAX_STAR_JOIN_TABLES];
+    int *payload_out[MAX_STAR_JOIN_TABLES][MAX_JOIN_PAYLOADS];
+    int num_tables;
+    flag_word *probe_flags;
+    uint64_t nrows;
+public:
+    StarJoinKernel(flag_word *probe_column_flags, int col_len)
+        : KernelDefinition(flag_words(col_len)), num_tables(0), probe_flags(probe_column_flags), nrows(col_len)
+    {}
+
+    // payload_output: ht.num_payloads columns of the probe length
+    void add_table(const packed_column &probe_column, const JoinHashTable &ht, int *const *payload_output)
+    {
+        if (num_tables == MAX_STAR_JOIN_TABLES)
+        {
+            std::cerr << "Star join: more than " << MAX_STAR_JOIN_TABLES << " hash tables" << std::endl;
+            throw std::runtime_error("Star join: too many hash tables");
+        }
+        probe_cols[num_tables] = probe_column;
+        hts[num_tables] = ht;
+        std::copy_n(payload_output, ht.num_payloads, payload_out[num_tables]);
+        num_tables++;
+    }
+
+    void describe(kernel_arguments &arguments) const
+    {
+        for (int t = 0; t < num_tables; t++)
+        {
+            arguments << probe_cols[t] << hts[t];
+            arguments.append(payload_out[t], hts[t].num_payloads);
+        }
+        arguments << num_tables << probe_flags << nrows;
+    }
+
+    void operator()(sycl::id<1> idx) const
+    {
+        flag_word word = probe_flags[idx];
+        if (word == 0)
+            return;
+
+        uint64_t first_row = idx[0] * FLAG_WORD_BITS;
+        int n = rows_in_flag_word(idx[0], nrows);
+        int64_t slots[MAX_STAR_JOIN_TABLES];
+        for (int b = 0; b < n; b++)
+        {
+            if (((word >> b) & 1) == 0)
+                continue;
+
+            uint64_t i = first_row + b;
+            bool matched = true;
+            for (int t = 0; t < num_tables && matched; t++)
+            {
+                slots[t] = ht_find(hts[t], probe_cols[t][i]);
+                matched = slots[t] >= 0;
+            }
+
+            if (!matched)
+            {
+                word &= ~(((flag_word)1) << b); // mark as not selected
+                continue;
+            }
+
+            for (int t = 0; t < num_tables; t++)
+            {
+                const int *payloads = ht_payloads(hts[t], slots[t]);
+                for (int p = 0; p < hts[t].num_payloads; p++)
+                    payload_out[t][p][i] = payloads[p];
+            }
+        }
+        probe_flags[idx] = word;
+    }
+};
+
+// payload_columns are the column numbers of the build table carried by the hash table.
+// Each one becomes a new column of the probe table, referenced as probe col_number + column number,
+// the probe key column is left untouched.
 sycl::event full_join(
     TableData<int> &probe_table,
     TableData<int> &build_table,
     int probe_col_index,
     int build_col_index,
+    const std::vector<int> &payload_columns,
+    std::vector<void *> &resources,
     memory_manager &gpu_allocator,
     sycl::queue &queue,
     const std::vector<sycl::event> &dependencies)
@@ -340,28 +550,29 @@ sycl::event full_join(
     std::vector<sycl::event> events(dependencies);
     int build_column = build_table.column_indices.at(build_col_index),
         probe_column = probe_table.column_indices.at(probe_col_index),
-        group_by_column = build_table.column_indices.at(build_table.group_by_column),
-        build_col_min, build_col_max, ht_len, *ht;
+        num_payloads = payload_columns.size();
+    const int *payload_contents[MAX_JOIN_PAYLOADS];
+    int *payload_outputs[MAX_JOIN_PAYLOADS];
+    JoinHashTable ht;
 
     #if PRINT_JOIN_DEBUG_INFO
     auto start = std::chrono::high_resolution_clock::now();
     auto end = std::chrono::high_resolution_clock::now();
     #endif
 
-    if (build_table.ht != nullptr)
+    if (build_table.ht.slots != nullptr)
     {
-        ht = (int *)build_table.ht;
-        build_col_min = build_table.ht_min;
-        build_col_max = build_table.ht_max;
-        ht_len = build_col_max - build_col_min + 1;
+        ht = build_table.ht;
     }
     else
     {
-        build_col_min = build_table.columns[build_column].min_value;
-        build_col_max = build_table.columns[build_column].max_value;
-        ht_len = build_col_max - build_col_min + 1;
-
-        ht = gpu_allocator.alloc_zero<int>(ht_len * 2);
+        ht = make_join_hash_table(
+            build_table.columns[build_column].min_value,
+            build_table.columns[build_column].max_value,
+            build_table.col_len,
+            num_payloads,
+            gpu_allocator
+        );
 
         #if PRINT_JOIN_DEBUG_INFO
         auto end = std::chrono::high_resolution_clock::now();
@@ -370,39 +581,70 @@ sycl::event full_join(
         start = std::chrono::high_resolution_clock::now();
         #endif
 
+        for (int p = 0; p < num_payloads; p++)
+            payload_contents[p] = build_table.columns[build_table.column_indices.at(payload_columns[p])].content;
+
         auto e2 = build_key_vals_ht(
             build_table.columns[build_column].content,
-            build_table.columns[group_by_column].content,
-            build_table.flags, build_table.col_len, ht, ht_len,
-            build_col_min, queue, events);
+            payload_contents,
+            build_table.flags, build_table.col_len, ht, queue, events);
 
         #if PRINT_JOIN_DEBUG_INFO
         end = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double, std::milli> diff2 = end - start;
 
         std::cout << "JOIN ht built in FULL JOIN op\n"
-            << "diff1 (" << ht_len << "): " << diff1.count() << " ms\n"
+            << "diff1 (" << ht.capacity << "): " << diff1.count() << " ms\n"
             << "diff2: " << diff2.count() << " ms\n";
         #endif
 
         events = { e2 };
     }
 
-    bool *probe_flags = probe_table.flags;
-    int *probe_content = probe_table.columns[probe_column].content;
+    if (ht.num_payloads != num_payloads)
+    {
+        std::cerr << "Full join: hash table of " << build_table.table_name << " has " << ht.num_payloads
+            << " payload columns, " << num_payloads << " expected" << std::endl;
+        throw std::invalid_argument("Full join: hash table payload columns mismatch");
+    }
 
     #if PRINT_JOIN_DEBUG_INFO
     start = std::chrono::high_resolution_clock::now();
     #endif
 
+    // the payloads are appended to the columns of the probe table
+    ColumnData<int> *new_columns = sycl::malloc_shared<ColumnData<int>>(probe_table.columns_size + num_payloads, queue);
+    std::copy_n(probe_table.columns, probe_table.columns_size, new_columns);
+
+    for (int p = 0; p < num_payloads; p++)
+    {
+        const ColumnData<int> &build_payload = build_table.columns[build_table.column_indices.at(payload_columns[p])];
+        ColumnData<int> &payload = new_columns[probe_table.columns_size + p];
+
+        payload.content = gpu_allocator.alloc<int>(probe_table.col_len, true);
+        payload.has_ownership = true;
+        payload.is_aggregate_result = false;
+        payload.type = ColumnType::Int32;
+        payload.scale = build_payload.scale;
+        payload.dictionary = build_payload.dictionary;
+        payload.input_rows = nullptr;
+        payload.min_value = build_payload.min_value;
+        payload.max_value = build_payload.max_value;
+        payload_outputs[p] = payload.content;
+
+        probe_table.column_indices[probe_table.col_number + payload_columns[p]] = probe_table.columns_size + p;
+    }
+
+    resources.push_back(probe_table.columns);
+    probe_table.columns = new_columns;
+    probe_table.columns_size += num_payloads;
+
     auto e3 = full_join(
-        probe_content,
-        probe_content,
-        probe_flags,
+        probe_table.columns[probe_column].content,
+        payload_outputs,
+        probe_table.flags,
         probe_table.col_len,
         ht,
-        build_col_min,
-        build_col_max,
         queue,
         events
     );
@@ -411,25 +653,8 @@ sycl::event full_join(
     end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double, std::milli> diff3 = end - start;
 
-    start = std::chrono::high_resolution_clock::now();
-    #endif
-
-    // the group by column index must refer to the old foreign key
-    probe_table.column_indices.erase(probe_col_index);
-    probe_table.column_indices[probe_table.col_number + build_table.group_by_column] = probe_column;
-
-    // update min and max values of the probe column
-    probe_table.columns[probe_column].min_value = build_table.columns[group_by_column].min_value;
-    probe_table.columns[probe_column].max_value = build_table.columns[group_by_column].max_value;
-
-    #if PRINT_JOIN_DEBUG_INFO
-    end = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double, std::milli> diff4 = end - start;
-
-    std::cout << "diff3: " << diff3.count() << " ms\n"
-        << "diff4: " << diff4.count() << " ms"
-        << std::endl;
+    std::cout << "diff3: " << diff3.count() << " ms" << std::endl;
     #endif
 
     return e3;
-}
\ No newline at end of file
+}
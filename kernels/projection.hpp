@@ -2,6 +2,15 @@
 
 #include <sycl/sycl.hpp>
 
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "types.hpp"
 #include "common.hpp"
 
 class FillKernel : public KernelDefinition
@@ -14,8 +23,400 @@ public:
         : KernelDefinition(len), target(tgt), value(val)
     {}
 
+    void describe(kernel_arguments &arguments) const
+    {
+        arguments << target << value;
+    }
+
     void operator()(sycl::id<1> idx) const
     {
         target[idx] = value;
     }
 };
+
+enum class BinaryOp : uint8_t
+{
+    Multiply,
+    Divide,
+    Add,
+    Subtract
+};
+
+template <typename T>
+inline T element_operation(T a, T b, BinaryOp op)
+{
+    switch (op)
+    {
+    case BinaryOp::Multiply:
+        return a * b;
+    case BinaryOp::Divide:
+        return a / b;
+    case BinaryOp::Add:
+        return a + b;
+    case BinaryOp::Subtract:
+        return a - b;
+    default:
+        return 0;
+    }
+}
+
+// element_operation with the operation known at compile time
+template <BinaryOp Op, typename T>
+inline T element_operation(T a, T b)
+{
+    if constexpr (Op == BinaryOp::Multiply)
+        return a * b;
+    else if constexpr (Op == BinaryOp::Divide)
+        return a / b;
+    else if constexpr (Op == BinaryOp::Add)
+        return a + b;
+    else
+        return a - b;
+}
+
+BinaryOp get_op_from_string(const std::string &op)
+{
+    if (op == "*")
+        return BinaryOp::Multiply;
+    if (op == "/")
+        return BinaryOp::Divide;
+    if (op == "+")
+        return BinaryOp::Add;
+    if (op == "-")
+        return BinaryOp::Subtract;
+    throw std::invalid_argument("Unknown operation: " + op);
+}
+
+#define MAX_EXPRESSION_NODES 32
+#define MAX_EXPRESSION_COLUMNS 8
+
+enum expression_node_type : uint8_t
+{
+    EXPRESSION_COLUMN,    // column slot
+    EXPRESSION_LITERAL,
+    EXPRESSION_OPERATION  // combines the two previous results
+};
+
+struct expression_node
+{
+    expression_node_type type;
+    BinaryOp op;
+    int column; // column slot of the program
+    int64_t value;
+};
+
+// Shapes evaluated by kernels templated on their operations, a, b and c being columns or literals.
+// Any other tree runs through the stack interpreter.
+enum class ExpressionShape : uint8_t
+{
+    Binary,      // a op b
+    NestedRight, // a op1 (b op2 c)
+    NestedLeft,  // (a op2 b) op1 c
+    Tree
+};
+
+// Arithmetic tree of a PROJECT expression, in postfix order so that it can be evaluated with a small stack.
+// Columns are referenced by slot, each slot is read once per row whatever the number of uses.
+// The widths are planned from the operand ranges (expression_types): the kernel computes in
+// compute_type and stores result_type, so int64 is only paid for when an int could overflow.
+struct expression_program
+{
+    expression_node nodes[MAX_EXPRESSION_NODES];
+    int num_nodes = 0;
+    int num_columns = 0;
+    ExpressionShape shape = ExpressionShape::Tree;
+    ColumnType column_types[MAX_EXPRESSION_COLUMNS] = {};
+    ColumnType compute_type = ColumnType::Int32;
+    ColumnType result_type = ColumnType::Int32;
+    int scale = 0; // decimal scale of the result
+};
+
+inline kernel_arguments &operator<<(kernel_arguments &arguments, const expression_node &node)
+{
+    return arguments << node.type << node.op << node.column << node.value;
+}
+
+inline kernel_arguments &operator<<(kernel_arguments &arguments, const expression_program &program)
+{
+    arguments.append(program.nodes, program.num_nodes) << program.num_nodes << program.num_columns << program.shape;
+    return arguments.append(program.column_types, program.num_columns)
+        << program.compute_type << program.result_type << program.scale;
+}
+
+inline bool is_expression_leaf(const expression_node &node)
+{
+    return node.type != EXPRESSION_OPERATION;
+}
+
+ExpressionShape get_expression_shape(const expression_program &program)
+{
+    const expression_node *n = program.nodes;
+    if (program.num_nodes == 3 && is_expression_leaf(n[0]) && is_expression_leaf(n[1]))
+        return ExpressionShape::Binary;
+    if (program.num_nodes == 5 && is_expression_leaf(n[0]) && is_expression_leaf(n[1]))
+    {
+        if (is_expression_leaf(n[2]) && !is_expression_leaf(n[3]))
+            return ExpressionShape::NestedRight;
+        if (!is_expression_leaf(n[2]) && is_expression_leaf(n[3]))
+            return ExpressionShape::NestedLeft;
+    }
+    return ExpressionShape::Tree;
+}
+
+// full range of the values a column of the given width can hold
+inline std::pair<int64_t, int64_t> column_type_range(ColumnType type)
+{
+    if (type == ColumnType::Int64)
+        return { INT64_MIN, INT64_MAX };
+    return { INT_MIN, INT_MAX };
+}
+
+struct expression_bounds
+{
+    int64_t min_value, max_value; // range of the result, clamped to int64
+    bool fits_int;                // every intermediate result fits an int
+};
+
+// Bounds of the values of an expression given the bounds of its column slots.
+// A division by a range containing 0 is bounded by the dividend, as |a / b| <= |a|.
+expression_bounds expression_range(const expression_program &program, const std::vector<std::pair<int64_t, int64_t>> &column_ranges)
+{
+    std::pair<__int128, __int128> stack[MAX_EXPRESSION_NODES];
+    int top = 0;
+    bool fits_int = true;
+    for (int n = 0; n < program.num_nodes; n++)
+    {
+        const expression_node &node = program.nodes[n];
+        switch (node.type)
+        {
+        case EXPRESSION_COLUMN:
+            stack[top++] = column_ranges[node.column];
+            break;
+        case EXPRESSION_LITERAL:
+            stack[top++] = { node.value, node.value };
+            break;
+        case EXPRESSION_OPERATION:
+        {
+            top--;
+            auto [a_min, a_max] = stack[top - 1];
+            auto [b_min, b_max] = stack[top];
+            if (node.op == BinaryOp::Add)
+                stack[top - 1] = { a_min + b_min, a_max + b_max };
+            else if (node.op == BinaryOp::Subtract)
+                stack[top - 1] = { a_min - b_max, a_max - b_min };
+            else if (node.op == BinaryOp::Divide && b_min <= 0 && b_max >= 0)
+            {
+                __int128 bound = std::max(a_max, -a_min);
+                stack[top - 1] = { -bound, bound };
+            }
+            else
+            {
+                __int128 corners[4] = {
+                    element_operation(a_min, b_min, node.op), element_operation(a_min, b_max, node.op),
+                    element_operation(a_max, b_min, node.op), element_operation(a_max, b_max, node.op)
+                };
+                stack[top - 1] = { *std::min_element(corners, corners + 4), *std::max_element(corners, corners + 4) };
+            }
+            stack[top - 1].first = std::clamp<__int128>(stack[top - 1].first, INT64_MIN, INT64_MAX);
+            stack[top - 1].second = std::clamp<__int128>(stack[top - 1].second, INT64_MIN, INT64_MAX);
+            break;
+        }
+        }
+        fits_int = fits_int && stack[top - 1].first >= INT_MIN && stack[top - 1].second <= INT_MAX;
+    }
+    return { (int64_t)stack[0].first, (int64_t)stack[0].second, fits_int };
+}
+
+// Plans the widths of the program: the kernel computes in int as long as no operand is Int64
+// and no intermediate result can leave the int range, the result is Int64 only when it can.
+void expression_types(expression_program &program, const std::vector<std::pair<int64_t, int64_t>> &column_ranges)
+{
+    expression_bounds bounds = expression_range(program, column_ranges);
+
+    bool wide_operand = false;
+    for (int c = 0; c < program.num_columns; c++)
+        wide_operand = wide_operand || program.column_types[c] == ColumnType::Int64;
+
+    program.compute_type = wide_operand || !bounds.fits_int ? ColumnType::Int64 : ColumnType::Int32;
+    program.result_type = bounds.min_value >= INT_MIN && bounds.max_value <= INT_MAX ? ColumnType::Int32 : ColumnType::Int64;
+}
+
+// Whole expression of a PROJECT in one pass, no intermediate column is materialized:
+// result = expression(columns) on the selected rows
+class ExpressionKernel : public KernelDefinition
+{
+private:
+    expression_program program;
+    const void *columns[MAX_EXPRESSION_COLUMNS];
+    void *result;
+    const flag_word *flags;
+
+    template <typename T>
+    inline T leaf(const expression_node &node, uint64_t i) const
+    {
+        if (node.type == EXPRESSION_LITERAL)
+            return (T)node.value;
+        if (program.column_types[node.column] == ColumnType::Int64)
+            return (T)((const int64_t *)columns[node.column])[i];
+        return (T)((const int *)columns[node.column])[i];
+    }
+
+    template <typename T>
+    inline void store(uint64_t i, T value) const
+    {
+        if (program.result_type == ColumnType::Int64)
+            ((int64_t *)result)[i] = value;
+        else
+            ((int *)result)[i] = (int)value;
+    }
+
+public:
+    ExpressionKernel(const expression_program &prog, const void *const *cols, void *res, const flag_word *f, uint64_t len)
+        : KernelDefinition(len), program(prog), result(res), flags(f)
+    {
+        for (int c = 0; c < program.num_columns; c++)
+            columns[c] = cols[c];
+    }
+
+    const expression_program &get_program() const { return program; }
+
+    void describe(kernel_arguments &arguments) const
+    {
+        arguments << program;
+        arguments.append(columns, program.num_columns) << result << flags;
+    }
+
+    // T is the compute type of the program, the operations of the common shapes are template parameters
+    template <typename T, ExpressionShape Shape, BinaryOp Op1, BinaryOp Op2>
+    void evaluate(uint64_t i) const
+    {
+        if (!get_flag(flags, i))
+            return;
+
+        const expression_node *n = program.nodes;
+        if constexpr (Shape == ExpressionShape::Binary)
+            store(i, element_operation<Op1>(leaf<T>(n[0], i), leaf<T>(n[1], i)));
+        else if constexpr (Shape == ExpressionShape::NestedRight)
+            store(i, element_operation<Op1>(leaf<T>(n[0], i), element_operation<Op2>(leaf<T>(n[1], i), leaf<T>(n[2], i))));
+        else if constexpr (Shape == ExpressionShape::NestedLeft)
+            store(i, element_operation<Op1>(element_operation<Op2>(leaf<T>(n[0], i), leaf<T>(n[1], i)), leaf<T>(n[3], i)));
+        else
+        {
+            // stack interpreter for the other trees
+            T stack[MAX_EXPRESSION_NODES];
+            int top = 0;
+            for (int k = 0; k < program.num_nodes; k++)
+            {
+                const expression_node &node = n[k];
+                if (node.type == EXPRESSION_OPERATION)
+                {
+                    top--;
+                    stack[top - 1] = element_operation(stack[top - 1], stack[top], node.op);
+                }
+                else
+                    stack[top++] = leaf<T>(node, i);
+            }
+            store(i, stack[0]);
+        }
+    }
+};
+
+template <typename T, ExpressionShape Shape, BinaryOp Op1, BinaryOp Op2>
+sycl::event submit_expression_shape(const ExpressionKernel &kernel, sycl::queue &queue, const std::vector<sycl::event> &dependencies)
+{
+    return queue.submit(
+        [&](sycl::handler &cgh)
+        {
+            if (!dependencies.empty())
+                cgh.depends_on(dependencies);
+
+            cgh.parallel_for(
+                kernel.get_col_len(),
+                [=](sycl::id<1> i)
+                {
+                    kernel.evaluate<T, Shape, Op1, Op2>(i[0]);
+                }
+            );
+        }
+    );
+}
+
+template <typename T, ExpressionShape Shape, BinaryOp Op1>
+sycl::event submit_expression_shape(const ExpressionKernel &kernel, BinaryOp op2, sycl::queue &queue, const std::vector<sycl::event> &dependencies)
+{
+    switch (op2)
+    {
+    case BinaryOp::Multiply:
+        return submit_expression_shape<T, Shape, Op1, BinaryOp::Multiply>(kernel, queue, dependencies);
+    case BinaryOp::Divide:
+        return submit_expression_shape<T, Shape, Op1, BinaryOp::Divide>(kernel, queue, dependencies);
+    case BinaryOp::Add:
+        return submit_expression_shape<T, Shape, Op1, BinaryOp::Add>(kernel, queue, dependencies);
+    default:
+        return submit_expression_shape<T, Shape, Op1, BinaryOp::Subtract>(kernel, queue, dependencies);
+    }
+}
+
+template <typename T, ExpressionShape Shape>
+sycl::event submit_expression_shape(const ExpressionKernel &kernel, BinaryOp op1, BinaryOp op2, sycl::queue &queue, const std::vector<sycl::event> &dependencies)
+{
+    switch (op1)
+    {
+    case BinaryOp::Multiply:
+        return submit_expression_shape<T, Shape, BinaryOp::Multiply>(kernel, op2, queue, dependencies);
+    case BinaryOp::Divide:
+        return submit_expression_shape<T, Shape, BinaryOp::Divide>(kernel, op2, queue, dependencies);
+    case BinaryOp::Add:
+        return submit_expression_shape<T, Shape, BinaryOp::Add>(kernel, op2, queue, dependencies);
+    default:
+        return submit_expression_shape<T, Shape, BinaryOp::Subtract>(kernel, op2, queue, dependencies);
+    }
+}
+
+// The operations of the common shapes are resolved here, once per kernel instead of once per row
+template <typename T>
+sycl::event submit_expression(const ExpressionKernel &kernel, sycl::queue &queue, const std::vector<sycl::event> &dependencies)
+{
+    const expression_program &program = kernel.get_program();
+    const expression_node *n = program.nodes;
+    switch (program.shape)
+    {
+    case ExpressionShape::Binary:
+        switch (n[2].op)
+        {
+        case BinaryOp::Multiply:
+            return submit_expression_shape<T, ExpressionShape::Binary, BinaryOp::Multiply, BinaryOp::Multiply>(kernel, queue, dependencies);
+        case BinaryOp::Divide:
+            return submit_expression_shape<T, ExpressionShape::Binary, BinaryOp::Divide, BinaryOp::Divide>(kernel, queue, dependencies);
+        case BinaryOp::Add:
+            return submit_expression_shape<T, ExpressionShape::Binary, BinaryOp::Add, BinaryOp::Add>(kernel, queue, dependencies);
+        default:
+            return submit_expression_shape<T, ExpressionShape::Binary, BinaryOp::Subtract, BinaryOp::Subtract>(kernel, queue, dependencies);
+        }
+    case ExpressionShape::NestedRight:
+        return submit_expression_shape<T, ExpressionShape::NestedRight>(kernel, n[4].op, n[3].op, queue, dependencies);
+    case ExpressionShape::NestedLeft:
+        return submit_expression_shape<T, ExpressionShape::NestedLeft>(kernel, n[4].op, n[2].op, queue, dependencies);
+    default:
+        return submit_expression_shape<T, ExpressionShape::Tree, BinaryOp::Add, BinaryOp::Add>(kernel, queue, dependencies);
+    }
+}
+
+sycl::event submit_expression(const ExpressionKernel &kernel, sycl::queue &queue, const std::vector<sycl::event> &dependencies)
+{
+    if (kernel.get_program().compute_type == ColumnType::Int64)
+        return submit_expression<int64_t>(kernel, queue, dependencies);
+    return submit_expression<int>(kernel, queue, dependencies);
+}
+
+sycl::event projection(
+    void *result,
+    const expression_program &program,
+    const void *const columns[],
+    const flag_word flags[],
+    int col_len,
+    sycl::queue &queue,
+    const std::vector<sycl::event> &dependencies)
+{
+    return submit_expression(ExpressionKernel(program, columns, result, flags, col_len), queue, dependencies);
+}
@@ -80,6 +80,60 @@ inline bool compare(comp_op CO, T a, T b)
     }
 }
 
+// Outcome of checking a predicate against the min/max of a segment
+enum zone_map_match
+{
+    NO_MATCH,
+    PARTIAL_MATCH,
+    FULL_MATCH
+};
+
+zone_map_match evaluate_zone_map(comp_op comparison, int min, int max, int value)
+{
+    switch (comparison)
+    {
+    case EQ:
+        if (value < min || value > max)
+            return NO_MATCH;
+        return (min == value && max == value) ? FULL_MATCH : PARTIAL_MATCH;
+    case NE:
+        if (min == value && max == value)
+            return NO_MATCH;
+        return (value < min || value > max) ? FULL_MATCH : PARTIAL_MATCH;
+    case LT:
+        return min >= value ? NO_MATCH : (max < value ? FULL_MATCH : PARTIAL_MATCH);
+    case LE:
+        return min > value ? NO_MATCH : (max <= value ? FULL_MATCH : PARTIAL_MATCH);
+    case GT:
+        return max <= value ? NO_MATCH : (min > value ? FULL_MATCH : PARTIAL_MATCH);
+    case GE:
+        return max < value ? NO_MATCH : (min >= value ? FULL_MATCH : PARTIAL_MATCH);
+    default:
+        return PARTIAL_MATCH;
+    }
+}
+
+zone_map_match zone_map_and(zone_map_match a, zone_map_match b)
+{
+    if (a == NO_MATCH || b == NO_MATCH)
+        return NO_MATCH;
+    return (a == FULL_MATCH && b == FULL_MATCH) ? FULL_MATCH : PARTIAL_MATCH;
+}
+
+zone_map_match zone_map_or(zone_map_match a, zone_map_match b)
+{
+    if (a == FULL_MATCH || b == FULL_MATCH)
+        return FULL_MATCH;
+    return (a == NO_MATCH && b == NO_MATCH) ? NO_MATCH : PARTIAL_MATCH;
+}
+
+// With a predicate constant over a segment, flags = logical(logic, flags, predicate)
+// either leaves the flags untouched or sets all of them to the predicate.
+inline bool constant_filter_is_noop(logical_op logic, bool predicate)
+{
+    return (logic == AND && predicate) || (logic == OR && !predicate);
+}
+
 inline bool logical(logical_op logic, bool a, bool b)
 {
     switch (logic)
@@ -95,11 +149,29 @@ inline bool logical(logical_op logic, bool a, bool b)
     }
 }
 
+// Same as logical, on 64 rows at once
+inline flag_word logical_words(logical_op logic, flag_word a, flag_word b)
+{
+    switch (logic)
+    {
+    case AND:
+        return a & b;
+    case OR:
+        return a | b;
+    case NONE:
+        return b;
+    default:
+        return 0;
+    }
+}
+
 class EmptyKernel : public KernelDefinition
 {
 public:
     EmptyKernel(int len) : KernelDefinition(len) {}
 
+    void describe(kernel_arguments &) const {}
+
     void operator()() const {}
 };
 
@@ -107,104 +179,177 @@ class LogicalKernel : public KernelDefinition
 {
 private:
     logical_op logic;
-    bool *flags1, *flags2;
+    flag_word *flags1;
+    const flag_word *flags2;
 public:
-    LogicalKernel(logical_op log, bool *f1, bool *f2, int len)
-        : KernelDefinition(len), logic(log), flags1(f1), flags2(f2)
+    LogicalKernel(logical_op log, flag_word *f1, const flag_word *f2, uint64_t len)
+        : KernelDefinition(flag_words(len)), logic(log), flags1(f1), flags2(f2)
     {}
 
+    void describe(kernel_arguments &arguments) const
+    {
+        arguments << logic << flags1 << flags2;
+    }
+
     void operator()(sycl::id<1> idx) const
     {
-        flags1[idx] = logical(logic, flags1[idx], flags2[idx]);
+        flags1[idx] = logical_words(logic, flags1[idx], flags2[idx]);
     }
 };
 
-class SelectionKernelColumns : public KernelDefinition
+#define MAX_PREDICATE_NODES 32
+#define MAX_PREDICATE_COLUMNS 8
+
+enum predicate_node_type : uint8_t
 {
-private:
+    PREDICATE_COMPARE_LITERAL, // column <op> value
+    PREDICATE_COMPARE_COLUMNS, // column <op> column
+    PREDICATE_AND,             // combines the two previous results
+    PREDICATE_OR
+};
+
+struct predicate_node
+{
+    predicate_node_type type;
     comp_op comparison;
-    logical_op logic;
-    bool *flags;
-    const int *operand1, *operand2;
-public:
-    SelectionKernelColumns(comp_op comp, logical_op log, bool *f, const int *op1, const int *op2, int len)
-        : KernelDefinition(len), comparison(comp), logic(log), flags(f), operand1(op1), operand2(op2)
-    {}
+    int column1, column2; // column slots of the program
+    int value;
+};
 
-    SelectionKernelColumns(bool *f, const int *op1, const std::string &op, const int *op2, const std::string &parent_op, int len)
-        : SelectionKernelColumns(get_comp_op(op), get_logical_op(parent_op), f, op1, op2, len)
-    {}
+// Predicate tree of a FILTER node, in postfix order so that it can be evaluated with a small stack.
+// Columns are referenced by slot, each slot is read once per row whatever the number of comparisons on it.
+struct predicate_program
+{
+    predicate_node nodes[MAX_PREDICATE_NODES];
+    int num_nodes = 0;
+    int num_columns = 0;
+};
 
-    void operator()(sycl::id<1> idx) const
+inline kernel_arguments &operator<<(kernel_arguments &arguments, const predicate_node &node)
+{
+    return arguments << node.type << node.comparison << node.column1 << node.column2 << node.value;
+}
+
+inline kernel_arguments &operator<<(kernel_arguments &arguments, const predicate_program &program)
+{
+    return arguments.append(program.nodes, program.num_nodes) << program.num_nodes << program.num_columns;
+}
+
+inline bool evaluate_predicate(const predicate_program &program, const int *values)
+{
+    bool stack[MAX_PREDICATE_NODES];
+    int top = 0;
+    for (int n = 0; n < program.num_nodes; n++)
     {
-        flags[idx] = logical(logic, flags[idx], compare(comparison, operand1[idx], operand2[idx]));
+        const predicate_node &node = program.nodes[n];
+        switch (node.type)
+        {
+        case PREDICATE_COMPARE_LITERAL:
+            stack[top++] = compare(node.comparison, values[node.column1], node.value);
+            break;
+        case PREDICATE_COMPARE_COLUMNS:
+            stack[top++] = compare(node.comparison, values[node.column1], values[node.column2]);
+            break;
+        case PREDICATE_AND:
+            top--;
+            stack[top - 1] = stack[top - 1] && stack[top];
+            break;
+        case PREDICATE_OR:
+            top--;
+            stack[top - 1] = stack[top - 1] || stack[top];
+            break;
+        }
     }
-};
+    return stack[0];
+}
 
-class SelectionKernelLiteral : public KernelDefinition
+// Zone map outcome of a whole predicate program, leaf_match gives the outcome of a comparison node
+template <typename LeafMatch>
+zone_map_match evaluate_zone_map(const predicate_program &program, LeafMatch leaf_match)
+{
+    zone_map_match stack[MAX_PREDICATE_NODES];
+    int top = 0;
+    for (int n = 0; n < program.num_nodes; n++)
+    {
+        const predicate_node &node = program.nodes[n];
+        switch (node.type)
+        {
+        case PREDICATE_AND:
+            top--;
+            stack[top - 1] = zone_map_and(stack[top - 1], stack[top]);
+            break;
+        case PREDICATE_OR:
+            top--;
+            stack[top - 1] = zone_map_or(stack[top - 1], stack[top]);
+            break;
+        default:
+            stack[top++] = leaf_match(node);
+            break;
+        }
+    }
+    return stack[0];
+}
+
+// Whole predicate tree of a FILTER node in one pass: flags = logical(logic, flags, predicate)
+class PredicateTreeKernel : public KernelDefinition
 {
 private:
-    comp_op comparison;
+    predicate_program program;
+    packed_column columns[MAX_PREDICATE_COLUMNS]; // decoded on the fly when packed
     logical_op logic;
-    bool *flags;
-    const int *operand1;
-    int value;
+    flag_word *flags;
+    uint64_t nrows;
 public:
-    SelectionKernelLiteral(comp_op comp, logical_op log, bool *f, const int *op1, int val, int len)
-        : KernelDefinition(len), comparison(comp), logic(log), flags(f), operand1(op1), value(val)
-    {}
+    PredicateTreeKernel(const predicate_program &prog, const int *const *cols, logical_op log, flag_word *f, uint64_t len)
+        : KernelDefinition(flag_words(len)), program(prog), logic(log), flags(f), nrows(len)
+    {
+        for (int c = 0; c < program.num_columns; c++)
+            columns[c] = cols[c];
+    }
 
-    SelectionKernelLiteral(bool *f, const int *op1, const std::string &op, int val, const std::string &parent_op, int len)
-        : SelectionKernelLiteral(get_comp_op(op), get_logical_op(parent_op), f, op1, val, len)
-    {}
+    PredicateTreeKernel(const predicate_program &prog, const packed_column *cols, logical_op log, flag_word *f, uint64_t len)
+        : KernelDefinition(flag_words(len)), program(prog), logic(log), flags(f), nrows(len)
+    {
+        for (int c = 0; c < program.num_columns; c++)
+            columns[c] = cols[c];
+    }
 
-    void operator()(sycl::id<1> idx) const
+    void describe(kernel_arguments &arguments) const
     {
-        flags[idx] = logical(logic, flags[idx], compare(comparison, operand1[idx], value));
+        arguments << program;
+        arguments.append(columns, program.num_columns) << logic << flags << nrows;
     }
-};
 
-sycl::event selection(
-    bool flags[],
-    const int arr[],
-    std::string op,
-    int value,
-    std::string parent_op,
-    int col_len,
-    sycl::queue &queue,
-    const std::vector<sycl::event> deps)
-{
-    comp_op comparison = get_comp_op(op);
-    logical_op logic = get_logical_op(parent_op);
-    SelectionKernelLiteral kernel(comparison, logic, flags, arr, value, col_len);
+    void operator()(sycl::id<1> idx) const
+    {
+        flag_word word = flags[idx];
+        if (logic == AND && word == 0)
+            return; // nothing left to filter, the columns are not read
 
-    return queue.submit(
-        [&](sycl::handler &cgh)
+        uint64_t first_row = idx[0] * FLAG_WORD_BITS;
+        int n = rows_in_flag_word(idx[0], nrows);
+        int values[MAX_PREDICATE_COLUMNS];
+        flag_word predicate = 0;
+        for (int b = 0; b < n; b++)
         {
-            cgh.depends_on(deps);
-            cgh.parallel_for(
-                kernel.get_col_len(),
-                kernel
-            );
+            for (int c = 0; c < program.num_columns; c++)
+                values[c] = columns[c][first_row + b];
+            predicate |= ((flag_word)evaluate_predicate(program, values)) << b;
         }
-    );
-
-    // std::cout << "Running selection with comparison: " << op << " and parent op " << parent_op << std::endl;
-}
+        flags[idx] = logical_words(logic, word, predicate);
+    }
+};
 
 sycl::event selection(
-    bool flags[],
-    const int operand1[],
-    std::string op,
-    const int operand2[],
-    std::string parent_op,
+    flag_word flags[],
+    const predicate_program &program,
+    const int *const columns[],
+    logical_op logic,
     int col_len,
     sycl::queue &queue,
-    const std::vector<sycl::event> deps)
+    const std::vector<sycl::event> &deps)
 {
-    comp_op comparison = get_comp_op(op);
-    logical_op logic = get_logical_op(parent_op);
-    SelectionKernelColumns kernel(comparison, logic, flags, operand1, operand2, col_len);
+    PredicateTreeKernel kernel(program, columns, logic, flags, col_len);
 
     return queue.submit(
         [&](sycl::handler &cgh)
@@ -216,6 +361,4 @@ sycl::event selection(
             );
         }
     );
-
-    // std::cout << "Running selection with comparison: " << op << " and parent op " << parent_op << std::endl;
-}
\ No newline at end of file
+}
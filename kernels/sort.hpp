@@ -1,103 +1,422 @@
 #pragma once
 
 #include <sycl/sycl.hpp>
+#include <oneapi/dpl/algorithm>
+#include <oneapi/dpl/execution>
+
+#include <algorithm>
+#include <bit>
+#include <vector>
 
 #include "types.hpp"
+#include "../operations/memory_manager.hpp"
+
+#define PRINT_SORT_DEBUG_INFO 0
+
+// SORT packs the sort columns of every row into 64-bit keys and orders the row ids
+// with the oneDPL stable sort of the queue owning the data (device or CPU), then
+// gathers every column through the sorted row ids. Rows with equal keys keep their
+// order, so the full sort and the top-K agree on ties (and OFFSET pages do too).
+//
+// A key is, from the most significant bit: 1 bit for unselected rows, so that they
+// sort last, then one field per sort column of bit_width(max - min) bits holding
+// value - min (ascending) or max - value (descending), min and max taken over the
+// selected rows. When the fields do not fit in 64 bits the sort runs in several
+// passes, least significant bits first; the keys of the later passes end with the
+// position of the row in the previous pass, which keeps the sort stable.
 
-void sort_table(TableData<int> &table_data, const int *sort_columns, const bool *ascending, int num_sort_columns, sycl::queue &queue)
+#define MAX_SORT_COLUMNS 8
+
+struct sort_column
 {
-    // Create an array of indices to represent the original row order
-    int *indices = sycl::malloc_host<int>(table_data.col_len, queue);
-    for (int i = 0; i < table_data.col_len; i++)
-        indices[i] = i;
+    const void *content;
+    bool is_aggregate_result; // 64-bit values
+    bool ascending;
+};
 
-    int **columns_content = new int *[table_data.col_number];
-    for (int i = 0; i < table_data.col_number; i++)
-    {
-        if (table_data.columns[i].is_aggregate_result)
+struct sort_field
+{
+    const void *content;
+    bool is_aggregate_result;
+    bool ascending;
+    int64_t min_value, max_value;
+    int value_shift; // bits of the value below this piece of the field
+    uint64_t value_mask;
+    int shift;       // position of the piece in the key
+};
+
+inline int64_t sort_value(const void *content, bool is_aggregate_result, uint64_t row)
+{
+    return is_aggregate_result ? (int64_t)((const uint64_t *)content)[row] : ((const int *)content)[row];
+}
+
+// range of the selected rows of a column, max < min when no row is selected
+std::pair<int64_t, int64_t> sort_column_range(
+    const sort_column &column,
+    const flag_word *flags,
+    uint64_t nrows,
+    memory_manager &allocator,
+    sycl::queue &queue)
+{
+    int64_t *range = allocator.alloc<int64_t>(2, false);
+    const void *content = column.content;
+    bool is_aggregate_result = column.is_aggregate_result;
+
+    queue.submit(
+        [&](sycl::handler &cgh)
         {
-            columns_content[i] = (int *)sycl::malloc_host<uint64_t>(table_data.col_len, queue);
-            queue.copy((uint64_t *)table_data.columns[i].content, (uint64_t *)columns_content[i], table_data.col_len);
+            cgh.parallel_for(
+                sycl::range<1>(nrows),
+                sycl::reduction(range, sycl::minimum<int64_t>(), sycl::property::reduction::initialize_to_identity()),
+                sycl::reduction(range + 1, sycl::maximum<int64_t>(), sycl::property::reduction::initialize_to_identity()),
+                [=](sycl::id<1> idx, auto &min, auto &max)
+                {
+                    if (get_flag(flags, idx[0]))
+                    {
+                        int64_t value = sort_value(content, is_aggregate_result, idx[0]);
+                        min.combine(value);
+                        max.combine(value);
+                    }
+                }
+            );
         }
-        else
+    ).wait();
+
+    return { range[0], range[1] };
+}
+
+// Packs the piece of the key of every row described by fields, in the order of row_ids.
+sycl::event pack_sort_keys(
+    uint64_t *keys,
+    const int *row_ids,
+    const std::vector<sort_field> &fields,
+    bool with_position,
+    const flag_word *flags,
+    uint64_t nrows,
+    sycl::queue &queue)
+{
+    sort_field pass_fields[MAX_SORT_COLUMNS + 1]; // at most one piece of every field per pass
+    int num_fields = fields.size();
+    std::copy(fields.begin(), fields.end(), pass_fields);
+
+    return queue.submit(
+        [&](sycl::handler &cgh)
         {
-            columns_content[i] = sycl::malloc_host<int>(table_data.col_len, queue);
-            queue.copy(table_data.columns[i].content, columns_content[i], table_data.col_len);
+            cgh.parallel_for(
+                nrows,
+                [=](sycl::id<1> i)
+                {
+                    int row = row_ids[i];
+                    bool selected = get_flag(flags, row);
+                    uint64_t key = with_position ? i[0] : 0;
+                    for (int f = 0; f < num_fields; f++)
+                    {
+                        const sort_field &field = pass_fields[f];
+                        uint64_t value;
+                        if (field.content == nullptr)
+                            value = !selected;
+                        else if (!selected)
+                            value = 0;
+                        else
+                        {
+                            int64_t v = sort_value(field.content, field.is_aggregate_result, row);
+                            value = field.ascending ? (uint64_t)v - (uint64_t)field.min_value : (uint64_t)field.max_value - (uint64_t)v;
+                        }
+                        key |= ((value >> field.value_shift) & field.value_mask) << field.shift;
+                    }
+                    keys[i] = key;
+                }
+            );
         }
-    }
-    queue.wait();
+    );
+}
+
+// Top-K: every partition of the rows keeps its k smallest (key, row) pairs in a bounded
+// max-heap, then the candidates of all partitions are sorted. Ties are broken by row,
+// like the stable sort. Used when the keys fit in one pass and k is small.
+#define TOP_K_MAX_ROWS 1024
+#define TOP_K_MIN_PARTITION_ROWS 16 // rows scanned per heap slot
+#define TOP_K_MAX_PARTITIONS (1 << 16)
+
+inline bool top_k_before(uint64_t key1, int row1, uint64_t key2, int row2)
+{
+    return key1 < key2 || (key1 == key2 && row1 < row2);
+}
 
-    auto compare = [&](int a, int b)
+uint64_t top_k_partitions(uint64_t nrows, uint64_t k)
+{
+    if (k == 0 || k > TOP_K_MAX_ROWS)
+        return 0;
+    return std::min<uint64_t>(nrows / (k * TOP_K_MIN_PARTITION_ROWS), TOP_K_MAX_PARTITIONS);
+}
+
+// Writes the row ids of the k first rows to row_ids. This is a sync point.
+void top_k_row_ids(
+    int *row_ids,
+    const uint64_t *keys,
+    uint64_t nrows,
+    uint64_t k,
+    uint64_t partitions,
+    memory_manager &allocator,
+    sycl::queue &queue)
+{
+    uint64_t candidates = partitions * k;
+    uint64_t *heap_keys = allocator.alloc<uint64_t>(candidates, true);
+    int *heap_rows = allocator.alloc<int>(candidates, true);
+
+    queue.parallel_for(
+        partitions,
+        [=](sycl::id<1> p)
         {
-            for (size_t i = 0; i < num_sort_columns; i++)
-            {
-                bool asc = ascending[i];
-                ColumnData<int> col = table_data.columns[table_data.column_indices.at(sort_columns[i])];
-                int *col_content = columns_content[table_data.column_indices.at(sort_columns[i])];
+            uint64_t *h_keys = heap_keys + p[0] * k;
+            int *h_rows = heap_rows + p[0] * k;
 
-                if (col.is_aggregate_result)
+            // every partition has at least k rows, so the heaps end up full
+            uint64_t begin = p[0] * nrows / partitions, end = (p[0] + 1) * nrows / partitions, size = 0;
+            for (uint64_t row = begin; row < end; row++)
+            {
+                uint64_t key = keys[row];
+                if (size < k)
                 {
-                    uint64_t *content = (uint64_t *)col_content;
-
-                    if (content[a] != content[b])
+                    // sift up the new entry
+                    uint64_t i = size++;
+                    while (i > 0 && top_k_before(h_keys[(i - 1) / 2], h_rows[(i - 1) / 2], key, row))
                     {
-                        return asc != (content[a] > content[b]);
+                        h_keys[i] = h_keys[(i - 1) / 2];
+                        h_rows[i] = h_rows[(i - 1) / 2];
+                        i = (i - 1) / 2;
                     }
+                    h_keys[i] = key;
+                    h_rows[i] = row;
                 }
-                else
+                else if (top_k_before(key, row, h_keys[0], h_rows[0]))
                 {
-                    int *content = col_content;
-
-                    if (content[a] != content[b])
+                    // replace the largest entry and sift it down
+                    uint64_t i = 0;
+                    while (2 * i + 1 < k)
                     {
-                        return asc != (content[a] > content[b]);
+                        uint64_t child = 2 * i + 1;
+                        if (child + 1 < k && top_k_before(h_keys[child], h_rows[child], h_keys[child + 1], h_rows[child + 1]))
+                            child++;
+                        if (!top_k_before(key, row, h_keys[child], h_rows[child]))
+                            break;
+                        h_keys[i] = h_keys[child];
+                        h_rows[i] = h_rows[child];
+                        i = child;
                     }
+                    h_keys[i] = key;
+                    h_rows[i] = row;
                 }
             }
-            return false;
-        };
+        }
+    ).wait();
 
-    std::sort(indices, indices + table_data.col_len, compare);
+    // sort the candidates by row (rows are distinct), then stably by key
+    auto policy = oneapi::dpl::execution::make_device_policy(queue);
+    oneapi::dpl::sort_by_key(policy, heap_rows, heap_rows + candidates, heap_keys);
+    oneapi::dpl::stable_sort_by_key(policy, heap_keys, heap_keys + candidates, heap_rows);
 
-    // Copy sorted data into new columns
-    ColumnData<int> *sorted_columns = sycl::malloc_shared<ColumnData<int>>(table_data.col_number, queue);
-    bool *sorted_flags = sycl::malloc_shared<bool>(table_data.col_len, queue);
-    for (int i = 0; i < table_data.col_number; i++)
+    queue.memcpy(row_ids, heap_rows, k * sizeof(int)).wait();
+}
+
+// Row ids of the nrows rows in sorted order, only the first limit ones are guaranteed
+// to be in place. Sync point, oneDPL sorts block.
+int *sort_row_ids(
+    const std::vector<sort_column> &columns,
+    const flag_word *flags,
+    uint64_t nrows,
+    memory_manager &allocator,
+    sycl::queue &queue,
+    uint64_t limit = UINT64_MAX)
+{
+    if (columns.size() > MAX_SORT_COLUMNS)
     {
-        int *col_content = columns_content[i];
+        std::cerr << "Sort: more than " << MAX_SORT_COLUMNS << " sort columns" << std::endl;
+        throw std::invalid_argument("Sort: too many sort columns");
+    }
 
-        sorted_columns[i].is_aggregate_result = table_data.columns[i].is_aggregate_result;
-        if (table_data.columns[i].is_aggregate_result)
-            sorted_columns[i].content = sycl::malloc_shared<int>(sizeof(uint64_t) / sizeof(int) * table_data.col_len, queue);
-        else
-            sorted_columns[i].content = sycl::malloc_shared<int>(table_data.col_len, queue);
+    int *row_ids = allocator.alloc<int>(nrows, true);
+    uint64_t *keys = allocator.alloc<uint64_t>(nrows, true);
 
-        sorted_columns[i].has_ownership = true;
-        sorted_columns[i].min_value = table_data.columns[i].min_value;
-        sorted_columns[i].max_value = table_data.columns[i].max_value;
+    queue.parallel_for(
+        nrows,
+        [=](sycl::id<1> i)
+        {
+            row_ids[i] = i;
+        }
+    ).wait();
+
+    if (nrows < 2 || limit == 0)
+        return row_ids;
+
+    // fields from the most significant, the selection bit has no content
+    std::vector<sort_field> fields;
+    fields.push_back({ nullptr, false, true, 0, 1, 0, 0, 0 });
+    for (const sort_column &column : columns)
+    {
+        auto [min_value, max_value] = sort_column_range(column, flags, nrows, allocator, queue);
+        if (max_value < min_value)
+            min_value = max_value = 0;
+        fields.push_back({ column.content, column.is_aggregate_result, column.ascending, min_value, max_value, 0, 0, 0 });
+    }
 
-        for (int j = 0; j < table_data.col_len; j++)
+    // passes from the least significant fields, the first one has no position bits;
+    // a field wider than the space left in a pass continues in the next one
+    int position_bits = std::bit_width(nrows - 1);
+    std::vector<std::vector<sort_field>> passes;
+    int used_bits = 64;
+    for (int f = fields.size() - 1; f >= 0; f--)
+    {
+        int bits = std::bit_width((uint64_t)fields[f].max_value - (uint64_t)fields[f].min_value);
+        for (int offset = 0; offset < bits;)
         {
-            if (sorted_columns[i].is_aggregate_result)
-                ((uint64_t *)sorted_columns[i].content)[j] = ((uint64_t *)col_content)[indices[j]];
-            else
-                sorted_columns[i].content[j] = col_content[indices[j]];
+            if (used_bits == 64)
+            {
+                passes.emplace_back();
+                used_bits = passes.size() == 1 ? 0 : position_bits;
+            }
+            int piece_bits = std::min(bits - offset, 64 - used_bits);
+            sort_field piece = fields[f];
+            piece.value_shift = offset;
+            piece.value_mask = piece_bits == 64 ? ~0ULL : (1ULL << piece_bits) - 1;
+            piece.shift = used_bits;
+            passes.back().push_back(piece);
+            used_bits += piece_bits;
+            offset += piece_bits;
         }
+    }
 
-        sycl::free(col_content, queue);
+    uint64_t partitions = passes.size() == 1 ? top_k_partitions(nrows, limit) : 0;
+
+    #if PRINT_SORT_DEBUG_INFO
+    std::cout << "SORT of " << nrows << " rows on " << columns.size() << " columns in " << passes.size() << " passes";
+    if (partitions > 0)
+        std::cout << ", top " << limit << " over " << partitions << " partitions";
+    std::cout << std::endl;
+    #endif
+
+    if (partitions > 0)
+    {
+        pack_sort_keys(keys, row_ids, passes[0], false, flags, nrows, queue).wait();
+        top_k_row_ids(row_ids, keys, nrows, limit, partitions, allocator, queue);
+        return row_ids;
     }
 
-    bool *table_flags = sycl::malloc_host<bool>(table_data.col_len, queue);
-    queue.copy(table_data.flags, table_flags, table_data.col_len).wait();
+    auto policy = oneapi::dpl::execution::make_device_policy(queue);
+    for (int p = 0; p < passes.size(); p++)
+    {
+        pack_sort_keys(keys, row_ids, passes[p], p > 0, flags, nrows, queue).wait();
+        oneapi::dpl::stable_sort_by_key(policy, keys, keys + nrows, row_ids);
+    }
+
+    return row_ids;
+}
+
+// first row and number of rows of the result of a SORT with OFFSET offset and FETCH fetch
+std::pair<uint64_t, uint64_t> sort_result_range(uint64_t nrows, uint64_t offset, uint64_t fetch)
+{
+    uint64_t first_row = std::min(offset, nrows);
+    return { first_row, std::min(fetch, nrows - first_row) };
+}
+
+template <typename T>
+sycl::event gather_rows(
+    T *result,
+    const T *content,
+    const int *row_ids,
+    uint64_t nrows,
+    sycl::queue &queue,
+    const std::vector<sycl::event> &dependencies = {})
+{
+    return queue.submit(
+        [&](sycl::handler &cgh)
+        {
+            cgh.depends_on(dependencies);
+            cgh.parallel_for(
+                nrows,
+                [=](sycl::id<1> i)
+                {
+                    result[i] = content[row_ids[i]];
+                }
+            );
+        }
+    );
+}
+
+// one work-item per flag word of the result
+sycl::event gather_flags(
+    flag_word *result,
+    const flag_word *flags,
+    const int *row_ids,
+    uint64_t nrows,
+    sycl::queue &queue,
+    const std::vector<sycl::event> &dependencies = {})
+{
+    return queue.submit(
+        [&](sycl::handler &cgh)
+        {
+            cgh.depends_on(dependencies);
+            cgh.parallel_for(
+                flag_words(nrows),
+                [=](sycl::id<1> w)
+                {
+                    flag_word word = 0;
+                    int n = rows_in_flag_word(w[0], nrows);
+                    for (int b = 0; b < n; b++)
+                        word |= ((flag_word)get_flag(flags, row_ids[w[0] * FLAG_WORD_BITS + b])) << b;
+                    result[w] = word;
+                }
+            );
+        }
+    );
+}
+
+void sort_table(
+    TableData<int> &table_data,
+    const int *sort_columns,
+    const bool *ascending,
+    int num_sort_columns,
+    memory_manager &allocator,
+    sycl::queue &queue,
+    uint64_t offset = 0,
+    uint64_t fetch = UINT64_MAX)
+{
+    std::vector<sort_column> columns;
+    for (int i = 0; i < num_sort_columns; i++)
+    {
+        const ColumnData<int> &column = table_data.columns[table_data.column_indices.at(sort_columns[i])];
+        columns.push_back({ column.content, column.type == ColumnType::Int64, ascending[i] });
+    }
+
+    auto [first_row, result_rows] = sort_result_range(table_data.col_len, offset, fetch);
+    int *row_ids = sort_row_ids(columns, table_data.flags, table_data.col_len, allocator, queue, first_row + result_rows) + first_row;
+
+    std::vector<sycl::event> events;
+    ColumnData<int> *sorted_columns = sycl::malloc_shared<ColumnData<int>>(table_data.col_number, queue);
+    for (int i = 0; i < table_data.col_number; i++)
+    {
+        sorted_columns[i] = table_data.columns[i];
+        sorted_columns[i].has_ownership = true;
+        if (table_data.columns[i].type == ColumnType::Int64)
+        {
+            uint64_t *content = allocator.alloc<uint64_t>(result_rows, true);
+            events.push_back(gather_rows(content, (const uint64_t *)table_data.columns[i].content, row_ids, result_rows, queue));
+            sorted_columns[i].content = (int *)content;
+        }
+        else
+        {
+            sorted_columns[i].content = allocator.alloc<int>(result_rows, true);
+            events.push_back(gather_rows(sorted_columns[i].content, table_data.columns[i].content, row_ids, result_rows, queue));
+        }
+    }
 
-    for (int i = 0; i < table_data.col_len; i++)
-        sorted_flags[i] = table_flags[indices[i]];
+    flag_word *sorted_flags = allocator.alloc<flag_word>(flag_words(result_rows), true);
+    events.push_back(gather_flags(sorted_flags, table_data.flags, row_ids, result_rows, queue));
+    sycl::event::wait(events);
 
-    sycl::free(indices, queue);
-    sycl::free(table_flags, queue);
     sycl::free(table_data.columns, queue);
-    delete[] columns_content;
 
     table_data.columns = sorted_columns;
     table_data.flags = sorted_flags;
-}
\ No newline at end of file
+    table_data.col_len = result_rows;
+}
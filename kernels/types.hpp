@@ -1,6 +1,9 @@
 #pragma once
 
+#include <bit>
+#include <cstdint>
 #include <map>
+#include <string>
 
 #define MAX_NTABLES 5
 
@@ -24,16 +27,167 @@ std::map<std::string, int> table_column_numbers(
     }
 );
 
+// Selection flags are a bitmap: row i is selected when bit i % FLAG_WORD_BITS
+// of word i / FLAG_WORD_BITS is set. Bits past the last row are always zero,
+// so a word can be combined or counted without masking.
+typedef uint64_t flag_word;
+
+#define FLAG_WORD_BITS 64
+
+inline uint64_t flag_words(uint64_t nrows)
+{
+    return (nrows + FLAG_WORD_BITS - 1) / FLAG_WORD_BITS;
+}
+
+inline bool get_flag(const flag_word *flags, uint64_t row)
+{
+    return (flags[row / FLAG_WORD_BITS] >> (row % FLAG_WORD_BITS)) & 1;
+}
+
+// number of rows of the given word, the last word of a table may be partial
+inline int rows_in_flag_word(uint64_t word, uint64_t nrows)
+{
+    uint64_t first_row = word * FLAG_WORD_BITS;
+    return nrows - first_row < FLAG_WORD_BITS ? nrows - first_row : FLAG_WORD_BITS;
+}
+
+// word with the first n bits set
+inline flag_word flag_word_mask(int n)
+{
+    return n >= FLAG_WORD_BITS ? ~((flag_word)0) : (((flag_word)1) << n) - 1;
+}
+
+enum class HashTableLayout : uint8_t
+{
+    Dense,         // one slot per key of [min_value, max_value]
+    OpenAddressing // linear probing over a power of two number of slots
+};
+
+// Build side of a join, see kernels/join.hpp for the slot layouts
+struct JoinHashTable
+{
+    HashTableLayout layout = HashTableLayout::Dense;
+    void *slots = nullptr;
+    uint64_t capacity = 0; // number of slots
+    int num_payloads = 0; // payload columns stored with every key, 0 for keys only (semi join)
+    int min_value = 0, max_value = 0; // range of the build keys
+};
+
+// Result slots of a group by, see kernels/aggregation.hpp
+struct GroupByTable
+{
+    HashTableLayout layout = HashTableLayout::Dense;
+    uint64_t *keys = nullptr; // OpenAddressing only: composite key + 1 of every slot, 0 when empty
+    uint64_t capacity = 0;    // number of result slots
+};
+
+// Storage width of a column. Int64 columns hold int64_t values behind the content pointer.
+// The width is chosen at plan time: loaded columns are Int32, aggregate results are Int64 and
+// expressions only widen when the range of their operands can overflow an int.
+enum class ColumnType : uint8_t
+{
+    Int32,
+    Int64
+};
+
+inline uint64_t column_type_size(ColumnType type)
+{
+    return type == ColumnType::Int64 ? sizeof(int64_t) : sizeof(int);
+}
+
+// column pointer of either width, as read by the aggregation kernels
+struct typed_column
+{
+    const void *data = nullptr;
+    ColumnType type = ColumnType::Int32;
+};
+
+inline int64_t typed_value(const typed_column &column, uint64_t row)
+{
+    return column.type == ColumnType::Int64 ?
+        ((const int64_t *)column.data)[row] : ((const int *)column.data)[row];
+}
+
+// Integer column as read by the selection and probe kernels: either plain ints, or
+// frame-of-reference + bit-packed, row i being base + the i-th bits-wide field of words
+// (fields are packed from the low bits up and may straddle two words, bits 0 is a constant).
+struct packed_column
+{
+    const int *values = nullptr; // plain ints, nullptr when packed
+    const uint32_t *words = nullptr;
+    int base = 0;
+    int bits = 0;
+
+    packed_column() = default;
+    packed_column(const int *plain) : values(plain) {}
+    packed_column(const uint32_t *packed_words, int frame, int bit_width)
+        : words(packed_words), base(frame), bits(bit_width)
+    {}
+
+    inline int operator[](uint64_t row) const
+    {
+        if (values != nullptr)
+            return values[row];
+        if (bits == 0)
+            return base;
+
+        uint64_t bit = row * bits;
+        int shift = bit % 32;
+        uint64_t field = words[bit / 32] >> shift;
+        if (shift + bits > 32)
+            field |= ((uint64_t)words[bit / 32 + 1]) << (32 - shift);
+        return (int)((uint32_t)base + (uint32_t)(field & ((((uint64_t)1) << bits) - 1)));
+    }
+};
+
+// bits per value of the frame-of-reference encoding of [min_value, max_value]
+inline int packed_bit_width(int min_value, int max_value)
+{
+    return std::bit_width((uint32_t)max_value - (uint32_t)min_value);
+}
+
+inline uint64_t packed_word_count(uint64_t nrows, int bits)
+{
+    return (nrows * bits + 31) / 32;
+}
+
+// Decimals are stored as integers scaled by 10^scale, e.g. 12345 with scale 2 is 123.45
+inline std::string format_scaled(int64_t value, int scale)
+{
+    if (scale <= 0)
+        return std::to_string(value);
+
+    uint64_t magnitude = value < 0 ? -(uint64_t)value : value, divisor = 1;
+    for (int s = 0; s < scale; s++)
+        divisor *= 10;
+
+    std::string fraction = std::to_string(magnitude % divisor);
+    return (value < 0 ? "-" : "") + std::to_string(magnitude / divisor) + "."
+        + std::string(scale - fraction.size(), '0') + fraction;
+}
+
+class column_dictionary; // operations/dictionary.hpp
+
 template <typename T>
 struct ColumnData
 {
     T *content;
     bool has_ownership;       // Indicates if this column owns the memory for its content
     bool is_aggregate_result; // Indicates if this column is the result of an aggregate operation
+    ColumnType type;          // Width of the values behind content
+    int scale;                // Decimal scale of the values, 0 for integers
+    const column_dictionary *dictionary; // Strings of the codes of a dictionary-encoded column, nullptr otherwise
+    const uint64_t *input_rows; // Input rows of each value, a value of no rows is NULL; nullptr if never NULL
     T min_value;              // Minimum value in the column
     T max_value;              // Maximum value in the column
 };
 
+template <typename T>
+bool column_is_null(const ColumnData<T> &column, int row)
+{
+    return column.input_rows != nullptr && column.input_rows[row] == 0;
+}
+
 template <typename T>
 struct TableData
 {
@@ -41,11 +195,9 @@ struct TableData
     int columns_size;    // length of the columns array (number of columns loaded)
     int col_len;         // number of rows
     int col_number;      // total number of columns in the table
-    bool *flags;         // selection flags
-    int group_by_column; // column number used for grouping, -1 if not used
+    flag_word *flags;    // selection flags, one bit per row
 
-    void *ht;               // hash table for joins
-    int ht_min, ht_max;
+    JoinHashTable ht;       // hash table for joins, ht.slots is nullptr if not built
 
     std::string table_name;
     std::map<int, int> column_indices; // Maps column numbers from calcite to its index in the columns array
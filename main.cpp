@@ -11,6 +11,7 @@
 #include "gen-cpp/calciteserver_types.h"
 
 #include "operations/preprocessing.hpp"
+#include "operations/plan_cache.hpp"
 #include "operations/load.hpp"
 #include "operations/filter.hpp"
 #include "operations/project.hpp"
@@ -21,6 +22,7 @@
 
 #include "models/models.hpp"
 #include "models/transient_table.hpp"
+#include "models/placement.hpp"
 
 #include "kernels/types.hpp"
 
@@ -65,10 +67,14 @@ void print_result(const TableData<int> &table_data)
     std::cout << "Result table:" << std::endl;
     for (int i = 0; i < table_data.col_len; i++)
     {
-        if (table_data.flags[i])
+        if (get_flag(table_data.flags, i))
         {
             for (int j = 0; j < table_data.columns_size; j++) // at this point column_size should match col_number
-                std::cout << ((table_data.columns[j].is_aggregate_result) ? ((unsigned long long *)table_data.columns[j].content)[i] : table_data.columns[j].content[i]) << ((j < table_data.columns_size - 1) ? " " : "");
+            {
+                const ColumnData<int> &column = table_data.columns[j];
+                std::cout << (column_is_null(column, i) ? "NULL" : format_scaled(typed_value({ column.content, column.type }, i), column.scale))
+                    << ((j < table_data.columns_size - 1) ? " " : "");
+            }
             std::cout << "\n";
             res_count++;
         }
@@ -91,10 +97,19 @@ void save_result(const TableData<int> &table_data, const std::string &data_path)
 
     for (int i = 0; i < table_data.col_len; i++)
     {
-        if (table_data.flags[i])
+        if (get_flag(table_data.flags, i))
         {
             for (int j = 0; j < table_data.columns_size; j++) // at this point column_size should match col_number
-                outfile << ((table_data.columns[j].is_aggregate_result) ? ((unsigned long long *)table_data.columns[j].content)[i] : table_data.columns[j].content[i]) << ((j < table_data.columns_size - 1) ? " " : "");
+            {
+                const ColumnData<int> &column = table_data.columns[j];
+                int64_t value = typed_value({ column.content, column.type }, i);
+                // string columns are decoded only here, every operator works on their codes
+                if (column_is_null(column, i))
+                    outfile << "NULL";
+                else
+                    outfile << (column.dictionary != nullptr ? column.dictionary->decode(value) : format_scaled(value, column.scale));
+                outfile << ((j < table_data.columns_size - 1) ? " " : "");
+            }
             outfile << "\n";
         }
     }
@@ -120,7 +135,7 @@ void save_result(const TransientTable &table, const std::string &data_path)
 }
 
 std::chrono::duration<double, std::milli> execute_result(
-    const PlanResult &result,
+    const cached_plan &plan,
     const std::string &data_path,
     const std::map<std::string,
     TableData<int>> &all_tables,
@@ -129,19 +144,16 @@ std::chrono::duration<double, std::milli> execute_result(
     std::ostream &perf_out = std::cout
 )
 {
-    #if PERFORMANCE_MEASUREMENT_ACTIVE
-    bool output_done = false;
-    #endif
-
     #if USE_FUSION
     sycl::ext::codeplay::experimental::fusion_wrapper fw{ queue };
     bool fusion_active = false;
     #endif
 
+    const PlanResult &result = plan.result;
     TableData<int> tables[MAX_NTABLES];
     int current_table = 0,
         *output_table = sycl::malloc_host<int>(result.rels.size(), queue); // used to track the output table of each operation, in order to be referenced in the joins. other operation types just use the previous output table
-    ExecutionInfo exec_info = parse_execution_info(result);
+    ExecutionInfo exec_info = plan.exec_info; // looked up with operator[] below
     std::vector<void *> resources; // used to track allocated resources for freeing at the end
     resources.reserve(500);        // high enough to avoid multiple reallocations
     std::map<int, std::vector<sycl::event>> dependencies; // used to track dependencies between operations
@@ -164,8 +176,6 @@ std::chrono::duration<double, std::milli> execute_result(
         const std::set<int> &column_idxs = exec_info.loaded_columns[rel.tables[1]];
         tables[current_table] = copy_table(all_tables.at(rel.tables[1]), column_idxs, gpu_allocator, queue);
 
-        if (exec_info.group_by_columns.find(rel.tables[1]) != exec_info.group_by_columns.end())
-            tables[current_table].group_by_column = exec_info.group_by_columns[rel.tables[1]];
         output_table[rel.id] = current_table;
 
         if (rel.tables[1] != "lineorder" && exec_info.prepare_join.find(rel.tables[1]) != exec_info.prepare_join.end())
@@ -177,26 +187,15 @@ std::chrono::duration<double, std::milli> execute_result(
 
             queue.wait();
 
-            if (exec_info.table_last_used[rel.tables[1]] == join_id)
-            {
-                // filter join ht
-                int ht_len = column_info.max_value - column_info.min_value + 1;
-                bool *ht = gpu_allocator.alloc_zero<bool>(ht_len);
-
-                table_info.ht = ht;
-                table_info.ht_min = column_info.min_value;
-                table_info.ht_max = column_info.max_value;
-            }
-            else
-            {
-                // full join ht
-                int ht_len = column_info.max_value - column_info.min_value + 1,
-                    *ht = gpu_allocator.alloc_zero<int>(ht_len * 2);
-
-                table_info.ht = ht;
-                table_info.ht_min = column_info.min_value;
-                table_info.ht_max = column_info.max_value;
-            }
+            // filter joins only need the keys, full joins also the columns used after the join.
+            // The dense or open addressing layout is picked from the key range and the table size.
+            table_info.ht = make_join_hash_table(
+                column_info.min_value,
+                column_info.max_value,
+                table_info.col_len,
+                join_payload_columns(exec_info, join_id).size(),
+                gpu_allocator
+            );
         }
 
         current_table++;
@@ -297,7 +296,7 @@ std::chrono::duration<double, std::milli> execute_result(
 
             dependencies[rel.id] = parse_aggregate(
                 tables[output_table[rel.id - 1]],
-                rel.aggs[0],
+                rel.aggs,
                 rel.group,
                 resources,
                 gpu_allocator,
@@ -330,6 +329,8 @@ std::chrono::duration<double, std::milli> execute_result(
                 tables[output_table[rel.inputs[0]]],
                 tables[output_table[rel.inputs[1]]],
                 exec_info.table_last_used,
+                join_payload_columns(exec_info, rel.id),
+                resources,
                 gpu_allocator,
                 queue,
                 join_dependencies
@@ -358,10 +359,11 @@ std::chrono::duration<double, std::milli> execute_result(
             queue.wait();
             queue.single_task<EndTimer1>([=]() {}).wait();
 
-            auto start_sort = std::chrono::high_resolution_clock::now();
             #if not PERFORMANCE_MEASUREMENT_ACTIVE
-            parse_sort(rel, tables[output_table[rel.id - 1]], queue);
+            auto start_sort = std::chrono::high_resolution_clock::now();
             #endif
+            // sorted in both modes, the measured time includes the sort as in DDOR
+            parse_sort(rel, tables[output_table[rel.id - 1]], gpu_allocator, queue);
             output_table[rel.id] = output_table[rel.id - 1];
 
             dependencies[rel.id] = {};
@@ -372,10 +374,6 @@ std::chrono::duration<double, std::milli> execute_result(
             std::chrono::duration<double, std::milli> exec_no_sort = start_sort - start;
             std::cout << "Execution time without sort: " << exec_no_sort.count() << " ms\n"
                 << "Sort operation (" << sort_time.count() << " ms)" << std::endl;
-            #else
-            std::chrono::duration<double, std::milli> exec_no_sort = start_sort - start;
-            perf_out << exec_no_sort.count() << '\n';
-            output_done = true;
             #endif
 
             break;
@@ -394,7 +392,7 @@ std::chrono::duration<double, std::milli> execute_result(
 
             std::vector<sycl::event> &ht_dependencies = dependencies[rel.id];
 
-            if (table_info.ht == nullptr)
+            if (table_info.ht.slots == nullptr)
             {
                 std::cerr << "!!!!! Table " << table_info.table_name
                     << " does not have a hash table !!!!!" << std::endl;
@@ -404,20 +402,18 @@ std::chrono::duration<double, std::milli> execute_result(
             if (join_id == exec_info.table_last_used[table_info.table_name])
             {
                 // filter join ht
-                int ht_len = table_info.ht_max - table_info.ht_min + 1;
-                bool *ht = (bool *)table_info.ht;
-
-                auto e2 = build_keys_ht(column_info.content, table_info.flags, table_info.col_len, ht, ht_len, column_info.min_value, queue, ht_dependencies);
+                auto e2 = build_keys_ht(column_info.content, table_info.flags, table_info.col_len, table_info.ht, queue, ht_dependencies);
                 ht_dependencies = { e2 };
             }
             else
             {
                 // full join ht
-                const ColumnData<int> &group_by_column_info = table_info.columns[table_info.column_indices.at(table_info.group_by_column)];
-                int ht_len = table_info.ht_max - table_info.ht_min + 1,
-                    *ht = (int *)table_info.ht;
+                std::vector<int> payload_columns = join_payload_columns(exec_info, join_id);
+                std::vector<const int *> payload_contents;
+                for (int col : payload_columns)
+                    payload_contents.push_back(table_info.columns[table_info.column_indices.at(col)].content);
 
-                auto e2 = build_key_vals_ht(column_info.content, group_by_column_info.content, table_info.flags, table_info.col_len, ht, ht_len, column_info.min_value, queue, ht_dependencies);
+                auto e2 = build_key_vals_ht(column_info.content, payload_contents.data(), table_info.flags, table_info.col_len, table_info.ht, queue, ht_dependencies);
                 ht_dependencies = { e2 };
             }
         }
@@ -448,8 +444,7 @@ std::chrono::duration<double, std::milli> execute_result(
     #if not PERFORMANCE_MEASUREMENT_ACTIVE
     std::cout << "Execution time: " << exec_time.count() << " ms - " << time_before_wait.count() << " ms (before wait)" << std::endl;
     #else
-    if (!output_done)
-        perf_out << exec_time.count() << '\n';
+    perf_out << exec_time.count() << '\n';
     #endif
 
     #if not PERFORMANCE_MEASUREMENT_ACTIVE
@@ -459,7 +454,7 @@ std::chrono::duration<double, std::milli> execute_result(
     {
         if (final_table.columns[i].has_ownership)
         {
-            if (final_table.columns[i].is_aggregate_result)
+            if (final_table.columns[i].type == ColumnType::Int64)
             {
                 uint64_t *host_col = final_table_allocator.alloc<uint64_t>(final_table.col_len, false);
                 queue.copy((uint64_t *)final_table.columns[i].content, host_col, final_table.col_len).wait();
@@ -476,8 +471,8 @@ std::chrono::duration<double, std::milli> execute_result(
             std::cout << "!!!!!!!!!! Column " << i << " does not have ownership, skipping copy to host !!!!!!!!!!" << std::endl;
     }
 
-    bool *host_flags = final_table_allocator.alloc<bool>(final_table.col_len, false);
-    queue.copy(final_table.flags, host_flags, final_table.col_len).wait();
+    flag_word *host_flags = final_table_allocator.alloc<flag_word>(flag_words(final_table.col_len), false);
+    queue.copy(final_table.flags, host_flags, flag_words(final_table.col_len)).wait();
     final_table.flags = host_flags;
 
     // print_result(final_table);
@@ -510,6 +505,7 @@ int normal_execution(int argc, char **argv)
     std::shared_ptr<TTransport> transport(new TBufferedTransport(socket));
     std::shared_ptr<TProtocol> protocol(new TBinaryProtocol(transport));
     CalciteServerClient client(protocol);
+    plan_cache plans(client);
     std::string sql;
     sycl::queue queue{
         sycl::gpu_selector_v,
@@ -567,12 +563,10 @@ int normal_execution(int argc, char **argv)
 
         for (int i = 0; i < PERFORMANCE_REPETITIONS; i++)
         {
-            PlanResult result;
-
-            client.parse(result, sql);
+            const cached_plan &plan = plans.get(sql);
             // std::cout << "Starting repetition " << i + 1 << "/" << PERFORMANCE_REPETITIONS << std::endl;
             auto start = std::chrono::high_resolution_clock::now();
-            auto exec_time = execute_result(result, argv[1], all_tables, queue, gpu_allocator);
+            auto exec_time = execute_result(plan, argv[1], all_tables, queue, gpu_allocator);
             auto end = std::chrono::high_resolution_clock::now();
             std::chrono::duration<double, std::milli> total_time = end - start;
 
@@ -584,12 +578,11 @@ int normal_execution(int argc, char **argv)
         }
         perf_file.close();
         #else
-        PlanResult result;
-        client.parse(result, sql);
+        const cached_plan &plan = plans.get(sql);
 
-        // std::cout << "Result: " << result << std::endl;
+        // std::cout << "Result: " << plan.result << std::endl;
 
-        execute_result(result, argv[1], all_tables, queue, gpu_allocator);
+        execute_result(plan, argv[1], all_tables, queue, gpu_allocator);
         #endif
 
         // client.shutdown();
@@ -613,7 +606,7 @@ int normal_execution(int argc, char **argv)
 }
 
 std::chrono::duration<double, std::milli> ddor_execute_result(
-    const PlanResult &result,
+    const cached_plan &plan,
     const std::string &data_path,
     Table tables[MAX_NTABLES],
     sycl::queue &cpu_queue,
@@ -624,12 +617,18 @@ std::chrono::duration<double, std::milli> ddor_execute_result(
     #endif
     memory_manager &cpu_allocator,
     std::vector<memory_manager> &device_allocators,
+    segment_scheduler &scheduler,
+    segment_streams &streams,
+    transfer_engine &transfers,
+    kernel_graphs &graphs,
     std::ostream &perf_out = std::cout)
 {
 
-    ExecutionInfo exec_info = parse_execution_info(result);
+    const PlanResult &result = plan.result;
+    const ExecutionInfo &exec_info = plan.exec_info;
     std::vector<int> output_table(result.rels.size(), -1);
     std::vector<TransientTable> transient_tables;
+    graphs.begin_query(plan.shape);
 
     for (const RelNode &rel : result.rels)
     {
@@ -671,12 +670,13 @@ std::chrono::duration<double, std::milli> ddor_execute_result(
             fw_devices,
             #endif
             cpu_allocator,
-            device_allocators
+            device_allocators,
+            scheduler,
+            streams,
+            transfers,
+            graphs
         );
 
-        if (exec_info.group_by_columns.find(rel.tables[1]) != exec_info.group_by_columns.end())
-            t.set_group_by_column(exec_info.group_by_columns[rel.tables[1]]);
-
         output_table[rel.id] = transient_tables.size() - 1;
     }
 
@@ -753,7 +753,7 @@ std::chrono::duration<double, std::milli> ddor_execute_result(
             #endif
             int prev_table_idx = output_table[id - 1];
             transient_tables[prev_table_idx].apply_aggregate(
-                rel.aggs[0],
+                rel.aggs,
                 rel.group,
                 cpu_allocator,
                 device_allocators
@@ -779,6 +779,7 @@ std::chrono::duration<double, std::milli> ddor_execute_result(
             transient_tables[left_table_idx].apply_join(
                 transient_tables[right_table_idx],
                 rel,
+                join_payload_columns(exec_info, rel.id),
                 cpu_allocator,
                 device_allocators
             );
@@ -794,8 +795,24 @@ std::chrono::duration<double, std::milli> ddor_execute_result(
         }
         case RelNodeType::SORT:
         {
-            // Sort is done in bash
-            output_table[id] = output_table[id - 1];
+            #if not PERFORMANCE_MEASUREMENT_ACTIVE
+            std::cout << "Starting Sort operation." << std::endl;
+            auto start_sort = std::chrono::high_resolution_clock::now();
+            #endif
+            int prev_table_idx = output_table[id - 1];
+            transient_tables[prev_table_idx].apply_sort(
+                rel.collation,
+                sort_offset(rel),
+                sort_fetch(rel),
+                cpu_allocator,
+                device_allocators
+            );
+            output_table[id] = prev_table_idx;
+            #if not PERFORMANCE_MEASUREMENT_ACTIVE
+            auto end_sort = std::chrono::high_resolution_clock::now();
+            std::chrono::duration<double, std::milli> sort_time = end_sort - start_sort;
+            std::cout << "Sort operation (" << sort_time.count() << " ms)" << std::endl;
+            #endif
             break;
         }
         default:
@@ -836,6 +853,7 @@ std::chrono::duration<double, std::milli> ddor_execute_result(
     cpu_queue.wait();
     for (sycl::queue &q : device_queues)
         q.wait();
+    transfers.wait();
 
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double, std::milli> duration = end - start;
@@ -874,6 +892,7 @@ int data_driven_operator_replacement(int argc, char **argv)
     std::shared_ptr<TTransport> transport(new TBufferedTransport(socket));
     std::shared_ptr<TProtocol> protocol(new TBinaryProtocol(transport));
     CalciteServerClient client(protocol);
+    plan_cache plans(client);
     std::string sql;
     sycl::queue cpu_queue{
         sycl::cpu_selector_v,
@@ -974,59 +993,6 @@ int data_driven_operator_replacement(int argc, char **argv)
         std::cout << table.get_name() << " num segments: " << table.num_segments() << std::endl;
     }
 
-    tables[0].move_column_to_device(0, 0);
-    tables[0].move_column_to_device(2, 0);
-    tables[0].move_column_to_device(3, 0);
-    tables[0].move_column_to_device(4, 0);
-
-    tables[1].move_column_to_device(0, 1);
-    tables[1].move_column_to_device(3, 1);
-    tables[1].move_column_to_device(4, 1);
-    tables[1].move_column_to_device(5, 1);
-
-    tables[2].move_column_to_device(0, 2);
-    tables[2].move_column_to_device(3, 2);
-    tables[2].move_column_to_device(4, 2);
-    tables[2].move_column_to_device(5, 2);
-
-    tables[3].move_column_to_device(0, 3);
-    tables[3].move_column_to_device(4, 3);
-    tables[3].move_column_to_device(5, 3);
-
-    tables[4].move_column_to_device(2, 2); // lo_custkey
-    tables[4].move_column_to_device(3, 0); // lo_partkey
-    tables[4].move_column_to_device(4, 1); // lo_suppkey
-    tables[4].move_column_to_device(5, 3); // lo_orderdate
-
-    // tables[4].move_column_to_device(8, 0);
-    // tables[4].move_column_to_device(9, 0);
-    // tables[4].move_column_to_device(11, 0);
-    // tables[4].move_column_to_device(12, 0);
-    // tables[4].move_column_to_device(13, 0);
-    // tables[4].move_column_to_device(14, 0);
-
-    // for (int i = 0; i < MAX_NTABLES; i++)
-    //     tables[i].move_all_to_device(0);
-
-    for (auto &gpu_queue : device_queues)
-        gpu_queue.wait_and_throw();
-
-    // std::cout << "All tables moved to device." << std::endl;
-
-    uint64_t total_mem = 0;
-    std::vector<uint64_t> total_gpu_mem_per_device(device_queues.size(), 0);
-    for (int i = 0; i < MAX_NTABLES; i++)
-    {
-        total_mem += tables[i].get_data_size(false, -1);
-        for (int d = 0; d < device_queues.size(); d++)
-            total_gpu_mem_per_device[d] += tables[i].get_data_size(true, d);
-    }
-    std::cout << "Total memory used by tables:\nCPU: " << (total_mem >> 20) << " MB" << std::endl;
-    for (int d = 0; d < device_queues.size(); d++)
-        std::cout << "GPU" << d
-        << " (" << device_queues[d].get_device().get_info<sycl::info::device::name>() << "): "
-        << (total_gpu_mem_per_device[d] >> 20) << " MB" << std::endl;
-
     memory_manager cpu_allocator(cpu_queue, SIZE_TEMP_MEMORY_CPU, SIZE_TEMP_MEMORY_CPU);
     std::vector<memory_manager> device_allocators;
 
@@ -1041,12 +1007,55 @@ int data_driven_operator_replacement(int argc, char **argv)
             device_allocators.emplace_back(gpu_queue, mem_size >> 1, mem_size >> 1);
     }
 
+    // outlive the queues waited at the end, the measurements and the copies run on them
+    segment_scheduler scheduler(device_queues.size());
+    transfer_engine transfers(cpu_queue, device_queues);
+    segment_streams streams(device_queues, transfers);
+    kernel_graphs graphs(cpu_queue, device_queues);
+
     try
     {
         // std::cout << "SQL Query: " << sql << std::endl;
         transport->open();
         std::cout << "Transport opened successfully." << std::endl;
 
+        // columns placed from the plans of the workload, by default the query run
+        placement_workload workload;
+        std::vector<std::string> workload_queries = read_workload_queries(PLACEMENT_WORKLOAD_DIR);
+        if (workload_queries.empty())
+            workload_queries.push_back(sql);
+        for (const std::string &query : workload_queries)
+            add_plan_to_workload(workload, plans.get(query).exec_info, tables, MAX_NTABLES);
+        // the scheduler moves segments of the query run on demand, wherever the workload comes from
+        add_plain_reads(workload, plans.get(sql).exec_info, tables, MAX_NTABLES);
+        apply_plain_reads(tables, workload);
+
+        std::vector<uint64_t> device_budgets;
+        for (const sycl::queue &gpu_queue : device_queues)
+            device_budgets.push_back(placement_device_budget(gpu_queue));
+        apply_placement(tables, plan_placement(tables, MAX_NTABLES, workload, device_budgets), transfers);
+        transfers.wait();
+
+        uint64_t total_mem = 0;
+        std::vector<uint64_t> total_gpu_mem_per_device(device_queues.size(), 0);
+        for (int i = 0; i < MAX_NTABLES; i++)
+        {
+            total_mem += tables[i].get_data_size(false, -1);
+            for (int d = 0; d < device_queues.size(); d++)
+                total_gpu_mem_per_device[d] += tables[i].get_data_size(true, d);
+        }
+        std::cout << "Total memory used by tables:\nCPU: " << (total_mem >> 20) << " MB" << std::endl;
+        for (int d = 0; d < device_queues.size(); d++)
+            std::cout << "GPU" << d
+            << " (" << device_queues[d].get_device().get_info<sycl::info::device::name>() << "): "
+            << (total_gpu_mem_per_device[d] >> 20) << " MB" << std::endl;
+
+        // segments moved on demand by the scheduler use what the placement left of the budgets
+        std::vector<uint64_t> move_budgets;
+        for (int d = 0; d < device_queues.size(); d++)
+            move_budgets.push_back(device_budgets[d] - std::min(device_budgets[d], total_gpu_mem_per_device[d]));
+        scheduler.set_move_budgets(move_budgets);
+
         #if PERFORMANCE_MEASUREMENT_ACTIVE
         std::string sql_filename = argv[1];
         std::string query_name = sql_filename.substr(sql_filename.find_last_of("/") + 1, 3);
@@ -1059,12 +1068,10 @@ int data_driven_operator_replacement(int argc, char **argv)
 
         for (int i = 0; i < PERFORMANCE_REPETITIONS; i++)
         {
-            PlanResult result;
-
             auto start = std::chrono::high_resolution_clock::now();
-            client.parse(result, sql);
+            const cached_plan &plan = plans.get(sql);
             auto exec_time = ddor_execute_result(
-                result,
+                plan,
                 argv[1],
                 tables,
                 cpu_queue,
@@ -1075,6 +1082,10 @@ int data_driven_operator_replacement(int argc, char **argv)
                 #endif
                 cpu_allocator,
                 device_allocators,
+                scheduler,
+                streams,
+                transfers,
+                graphs,
                 perf_file
             );
             auto end = std::chrono::high_resolution_clock::now();
@@ -1102,11 +1113,10 @@ int data_driven_operator_replacement(int argc, char **argv)
         }
         perf_file.close();
         #else
-        PlanResult result;
-        client.parse(result, sql);
+        const cached_plan &plan = plans.get(sql);
 
         auto time = ddor_execute_result(
-            result,
+            plan,
             argv[1],
             tables,
             cpu_queue,
@@ -1116,7 +1126,11 @@ int data_driven_operator_replacement(int argc, char **argv)
             fw_devices,
             #endif
             cpu_allocator,
-            device_allocators
+            device_allocators,
+            scheduler,
+            streams,
+            transfers,
+            graphs
         );
         std::cout << "DDOR execution completed in " << time.count() << " ms." << std::endl;
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+#include <string>
 #include <vector>
 #include <memory>
 #include "../kernels/common.hpp"
@@ -8,21 +10,23 @@
 #include "../kernels/aggregation.hpp"
 #include "../kernels/join.hpp"
 
+#include "transfer.hpp"
+
 enum class KernelType : uint8_t
 {
     EmptyKernel,
+    FillFlagsKernel,
     LogicalKernel,
-    SelectionKernelColumns,
-    SelectionKernelLiteral,
+    PredicateTreeKernel,
     FillKernel,
-    PerformOperationKernelColumns,
-    PerformOperationKernelLiteralFirst,
-    PerformOperationKernelLiteralSecond,
+    ExpressionKernel,
     BuildKeysHTKernel,
     FilterJoinKernel,
     BuildKeyValsHTKernel,
     FullJoinKernel,
-    AggregateOperationKernel,
+    StarJoinKernel,
+    LocalAggregateKernel,
+    CpuAggregateKernel,
     GroupByAggregateKernel,
 };
 
@@ -31,11 +35,27 @@ class KernelData
 private:
     KernelType kernel_type;
     std::shared_ptr<KernelDefinition> kernel_def;
+    void (*describe_arguments)(const KernelDefinition *, kernel_arguments &); // K::describe of the kernel
 public:
-    KernelData(KernelType kt, KernelDefinition *kd)
-        : kernel_type(kt), kernel_def(std::shared_ptr<KernelDefinition>(kd))
+    template <typename K>
+    KernelData(KernelType kt, K *kd)
+        : kernel_type(kt), kernel_def(std::shared_ptr<K>(kd)),
+        describe_arguments([](const KernelDefinition *kernel, kernel_arguments &arguments) { static_cast<const K *>(kernel)->describe(arguments); })
     {}
 
+    bool is_empty() const
+    {
+        return kernel_type == KernelType::EmptyKernel;
+    }
+
+    // what the submissions of the kernel depend on, see kernel_graphs
+    void describe(std::string &signature, std::string &argument_bytes) const
+    {
+        signature += std::to_string(static_cast<int>(kernel_type)) + ':' + std::to_string(kernel_def->get_col_len()) + ';';
+        kernel_arguments arguments(argument_bytes);
+        describe_arguments(kernel_def.get(), arguments);
+    }
+
     std::vector<sycl::event> execute(
         sycl::queue &queue,
         const std::vector<sycl::event> &dependencies
@@ -51,9 +71,9 @@ public:
         {
             return dependencies;
         }
-        case KernelType::LogicalKernel:
+        case KernelType::FillFlagsKernel:
         {
-            LogicalKernel *kernel = static_cast<LogicalKernel *>(kernel_def.get());
+            FillFlagsKernel *kernel = static_cast<FillFlagsKernel *>(kernel_def.get());
             auto e = queue.submit(
                 [&](sycl::handler &cgh)
                 {
@@ -68,9 +88,9 @@ public:
             );
             return { e };
         }
-        case KernelType::SelectionKernelColumns:
+        case KernelType::LogicalKernel:
         {
-            SelectionKernelColumns *kernel = static_cast<SelectionKernelColumns *>(kernel_def.get());
+            LogicalKernel *kernel = static_cast<LogicalKernel *>(kernel_def.get());
             auto e = queue.submit(
                 [&](sycl::handler &cgh)
                 {
@@ -85,9 +105,9 @@ public:
             );
             return { e };
         }
-        case KernelType::SelectionKernelLiteral:
+        case KernelType::PredicateTreeKernel:
         {
-            SelectionKernelLiteral *kernel = static_cast<SelectionKernelLiteral *>(kernel_def.get());
+            PredicateTreeKernel *kernel = static_cast<PredicateTreeKernel *>(kernel_def.get());
             auto e = queue.submit(
                 [&](sycl::handler &cgh)
                 {
@@ -119,56 +139,10 @@ public:
             );
             return { e };
         }
-        case KernelType::PerformOperationKernelColumns:
-        {
-            PerformOperationKernelColumns *kernel = static_cast<PerformOperationKernelColumns *>(kernel_def.get());
-            auto e = queue.submit(
-                [&](sycl::handler &cgh)
-                {
-                    if (!dependencies.empty())
-                        cgh.depends_on(dependencies);
-
-                    cgh.parallel_for(
-                        kernel->get_col_len(),
-                        *kernel
-                    );
-                }
-            );
-            return { e };
-        }
-        case KernelType::PerformOperationKernelLiteralFirst:
+        case KernelType::ExpressionKernel:
         {
-            PerformOperationKernelLiteralFirst *kernel = static_cast<PerformOperationKernelLiteralFirst *>(kernel_def.get());
-            auto e = queue.submit(
-                [&](sycl::handler &cgh)
-                {
-                    if (!dependencies.empty())
-                        cgh.depends_on(dependencies);
-
-                    cgh.parallel_for(
-                        kernel->get_col_len(),
-                        *kernel
-                    );
-                }
-            );
-            return { e };
-        }
-        case KernelType::PerformOperationKernelLiteralSecond:
-        {
-            PerformOperationKernelLiteralSecond *kernel = static_cast<PerformOperationKernelLiteralSecond *>(kernel_def.get());
-            auto e = queue.submit(
-                [&](sycl::handler &cgh)
-                {
-                    if (!dependencies.empty())
-                        cgh.depends_on(dependencies);
-
-                    cgh.parallel_for(
-                        kernel->get_col_len(),
-                        *kernel
-                    );
-                }
-            );
-            return { e };
+            ExpressionKernel *kernel = static_cast<ExpressionKernel *>(kernel_def.get());
+            return { submit_expression(*kernel, queue, dependencies) };
         }
         case KernelType::BuildKeysHTKernel:
         {
@@ -238,12 +212,9 @@ public:
             );
             return { e };
         }
-        case KernelType::AggregateOperationKernel:
+        case KernelType::StarJoinKernel:
         {
-            AggregateOperationKernel *kernel = static_cast<AggregateOperationKernel *>(kernel_def.get());
-            #if not USE_FUSION
-            uint64_t *agg_res_ptr = kernel->get_agg_res();
-            #endif
+            StarJoinKernel *kernel = static_cast<StarJoinKernel *>(kernel_def.get());
             auto e = queue.submit(
                 [&](sycl::handler &cgh)
                 {
@@ -252,15 +223,22 @@ public:
 
                     cgh.parallel_for(
                         kernel->get_col_len(),
-                        #if not USE_FUSION
-                        sycl::reduction(agg_res_ptr, sycl::plus<uint64_t>()),
-                        #endif
-                        * kernel
+                        *kernel
                     );
                 }
             );
             return { e };
         }
+        case KernelType::LocalAggregateKernel:
+        {
+            LocalAggregateKernel *kernel = static_cast<LocalAggregateKernel *>(kernel_def.get());
+            return { submit_local_aggregate(*kernel, queue, dependencies) };
+        }
+        case KernelType::CpuAggregateKernel:
+        {
+            CpuAggregateKernel *kernel = static_cast<CpuAggregateKernel *>(kernel_def.get());
+            return { submit_cpu_aggregate(*kernel, queue, dependencies) };
+        }
         case KernelType::GroupByAggregateKernel:
         {
             GroupByAggregateKernel *kernel = static_cast<GroupByAggregateKernel *>(kernel_def.get());
@@ -285,10 +263,29 @@ public:
     }
 };
 
+// Device buffer of a streamed segment, reused once the kernels reading the previous copy are done
+struct stream_slot
+{
+    void *buffer = nullptr;
+    std::vector<sycl::event> release; // kernels of the last bundle that read the buffer
+};
+
+// copy of host data into a stream slot, issued by the bundle before its kernels
+struct staged_transfer
+{
+    stream_slot *slot;
+    const void *source;
+    uint64_t bytes;
+    bool pinned; // see transfer_engine::to_device
+    transfer_engine *transfers;
+};
+
 class KernelBundle
 {
 private:
     std::vector<KernelData> kernels;
+    std::vector<staged_transfer> transfers;
+    std::vector<sycl::event> dependencies; // copies of the inputs moved to the device for the bundle
     bool on_device;
     int device_index;
 public:
@@ -311,6 +308,49 @@ public:
         kernels.push_back(kernel);
     }
 
+    void add_transfer(const staged_transfer &transfer)
+    {
+        transfers.push_back(transfer);
+    }
+
+    void add_dependency(const sycl::event &event)
+    {
+        dependencies.push_back(event);
+    }
+
+    bool has_kernels() const
+    {
+        return std::any_of(kernels.begin(), kernels.end(), [](const KernelData &kernel) { return !kernel.is_empty(); });
+    }
+
+    bool has_transfers() const
+    {
+        return !transfers.empty();
+    }
+
+    const std::vector<sycl::event> &get_dependencies() const
+    {
+        return dependencies;
+    }
+
+    void describe(std::string &signature, std::string &arguments) const
+    {
+        for (const KernelData &kernel : kernels)
+            kernel.describe(signature, arguments);
+    }
+
+    // the kernels alone, after deps, without the dependencies and the transfers of the bundle
+    std::vector<sycl::event> execute_kernels(sycl::queue &queue, std::vector<sycl::event> deps) const
+    {
+        for (const KernelData &kernel : kernels)
+        {
+            deps = kernel.execute(queue, deps);
+            // sycl::event::wait(deps);
+            // std::cout << "    - Kernel executed" << std::endl;
+        }
+        return deps;
+    }
+
     std::vector<sycl::event> execute(
         sycl::queue &cpu_queue,
         std::vector<sycl::queue> &device_queues,
@@ -319,16 +359,19 @@ public:
     ) const
     {
         std::vector<sycl::event> deps = on_device ? device_dependencies[device_index] : cpu_dependencies;
+        deps.insert(deps.end(), dependencies.begin(), dependencies.end());
 
-        for (const KernelData &kernel : kernels)
-        {
-            deps = kernel.execute(
-                on_device ? device_queues[device_index] : cpu_queue,
-                deps
+        // the copies only wait for their slot, so they overlap the kernels of the previous segments
+        for (const staged_transfer &transfer : transfers)
+            deps.push_back(
+                transfer.transfers->to_device(
+                    transfer.slot->buffer, transfer.source, transfer.bytes, device_index, transfer.pinned, transfer.slot->release)
             );
-            // sycl::event::wait(deps);
-            // std::cout << "    - Kernel executed" << std::endl;
-        }
+
+        deps = execute_kernels(on_device ? device_queues[device_index] : cpu_queue, deps);
+
+        for (const staged_transfer &transfer : transfers)
+            transfer.slot->release = deps;
 
         return deps;
     }
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <sycl/sycl.hpp>
+
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../common.hpp"
+
+// Record and replay of the kernel batches of the DDOR operators as SYCL command graphs.
+//
+// A repeated query submits the same batches of kernels at every execution, only their
+// arguments (literals, buffers of the allocators) may differ. The kernels of a batch on a
+// location are recorded once into a command graph, keyed by the shape of the plan (see
+// plan_shape), the number of the batch in the query and the location, and the later
+// executions of the batch submit the graph instead of the kernels one by one. A batch with
+// the same kernels and other arguments is recorded again and updates the executable graph
+// in place, which patches the arguments without finalizing a new graph; a batch with other
+// kernels (e.g. after the scheduler moved its segments) replaces it.
+// Graphs are submitted at most once per query and every query waits for its queues, so a
+// graph is never updated while it runs.
+
+#if USE_COMMAND_GRAPHS && USE_FUSION
+#error "USE_COMMAND_GRAPHS and USE_FUSION are exclusive"
+#endif
+
+#ifdef SYCL_EXT_ONEAPI_GRAPH
+namespace sycl_graph = sycl::ext::oneapi::experimental;
+#endif
+
+class kernel_graphs
+{
+private:
+    #ifdef SYCL_EXT_ONEAPI_GRAPH
+    struct recorded_graph
+    {
+        std::string signature; // kernels and ranges, see KernelBundle::describe
+        std::string arguments; // arguments of the kernels, see KernelData::describe
+        sycl_graph::command_graph<sycl_graph::graph_state::executable> graph;
+    };
+
+    std::unordered_map<std::string, recorded_graph> graphs;
+    #endif
+    std::vector<bool> supported; // index location + 1
+    std::string query_shape;
+    uint64_t batch_number = 0;
+public:
+    kernel_graphs(sycl::queue &cpu_queue, std::vector<sycl::queue> &device_queues)
+        : supported(device_queues.size() + 1, false)
+    {
+        #ifdef SYCL_EXT_ONEAPI_GRAPH
+        // updates need the full support, not the limited one
+        supported[0] = cpu_queue.get_device().has(sycl::aspect::ext_oneapi_graph);
+        for (int d = 0; d < device_queues.size(); d++)
+            supported[d + 1] = device_queues[d].get_device().has(sycl::aspect::ext_oneapi_graph);
+        #endif
+    }
+
+    kernel_graphs(const kernel_graphs &) = delete;
+    kernel_graphs &operator=(const kernel_graphs &) = delete;
+
+    void begin_query(const std::string &shape)
+    {
+        query_shape = shape;
+        batch_number = 0;
+    }
+
+    // key of the next batch of the query, called once per batch whether it is recorded or not
+    std::string next_batch()
+    {
+        return query_shape + '#' + std::to_string(batch_number++);
+    }
+
+    bool supports(int location) const
+    {
+        return supported[location + 1];
+    }
+
+    // Submits the kernels of batch on location after dependencies, record submits them to
+    // queue, it only runs when the recorded graph does not match signature and arguments
+    sycl::event submit(
+        const std::string &batch,
+        int location,
+        sycl::queue &queue,
+        const std::string &signature,
+        const std::string &arguments,
+        const std::function<void()> &record,
+        const std::vector<sycl::event> &dependencies)
+    {
+        #ifdef SYCL_EXT_ONEAPI_GRAPH
+        std::string key = batch + '@' + std::to_string(location);
+        auto recorded = graphs.find(key);
+
+        if (recorded == graphs.end() || recorded->second.signature != signature || recorded->second.arguments != arguments)
+        {
+            sycl_graph::command_graph graph(queue.get_context(), queue.get_device());
+            graph.begin_recording(queue);
+            record();
+            graph.end_recording(queue);
+
+            bool updated = false;
+            if (recorded != graphs.end() && recorded->second.signature == signature)
+            {
+                try
+                {
+                    recorded->second.graph.update(graph);
+                    recorded->second.arguments = arguments;
+                    updated = true;
+                }
+                catch (const sycl::exception &)
+                {
+                    // other kernels behind the same signature (e.g. expression shapes), finalized below
+                }
+            }
+
+            if (!updated)
+                recorded = graphs.insert_or_assign(
+                    key,
+                    recorded_graph { signature, arguments, graph.finalize(sycl::property_list { sycl_graph::property::graph::updatable {} }) }
+                ).first;
+        }
+
+        return queue.ext_oneapi_graph(recorded->second.graph, dependencies);
+        #else
+        std::cerr << "Kernel graphs: command graphs are not supported by this SYCL implementation" << std::endl;
+        throw std::runtime_error("Kernel graphs: command graphs not supported");
+        #endif
+    }
+};
@@ -2,9 +2,15 @@
 
 #include <sycl/sycl.hpp>
 
+#include <algorithm>
 #include <fstream>
+#include <memory>
+#include <optional>
 
 #include "../operations/memory_manager.hpp"
+#include "../operations/mapped_file.hpp"
+#include "../operations/column_file.hpp"
+#include "../operations/dictionary.hpp"
 #include "../gen-cpp/calciteserver_types.h"
 #include "../kernels/selection.hpp"
 #include "../kernels/projection.hpp"
@@ -13,23 +19,146 @@
 #include "../common.hpp"
 
 #include "execution.hpp"
+#include "transfer.hpp"
 
 
 class Segment
 {
 private:
     int *data_host;
-    std::vector<int *> device_ptrs;
-    int min, max;
+    std::vector<int *> device_ptrs; // plain ints, nullptr where the segment was moved packed
+    std::vector<uint32_t *> packed_device_ptrs; // loaded segments moved packed, see PACK_DEVICE_SEGMENTS
+    std::vector<sycl::event> device_copies; // copy of a loaded segment moved to every device, on its copy queue
+    uint32_t *packed_host = nullptr; // packed words, kept to move the segment to other devices
+    int packed_bits = 0;
+    bool read_plain = false; // read by kernels that cannot decode packed data, moved as plain ints
+    mutable int min, max;
     uint64_t nrows;
     sycl::queue &cpu_queue;
     std::vector<sycl::queue> &device_queues;
     std::vector<bool> on_device_vec;
-    bool on_device, is_aggregate_result, is_materialized, dirty_cache;
+    std::shared_ptr<mapped_file> mapping; // set when data_host points into a mapped column file
+    bool on_device, is_aggregate_result, is_materialized, dirty_cache; // is_aggregate_result: 64-bit values, see get_type
+    mutable bool has_min_max;
+
+    // min/max reduction over the host data, deferred until the first get_min/get_max
+    // so that mapped segments are not paged in at load time
+    void compute_min_max() const
+    {
+        if (has_min_max)
+            return;
+
+        int *min_val = sycl::malloc_host<int>(1, cpu_queue);
+        int *max_val = sycl::malloc_host<int>(1, cpu_queue);
+        const int *data = data_host;
+        min_val[0] = data[0];
+        max_val[0] = data[0];
+
+        if (nrows > 1)
+            cpu_queue.submit(
+                [&](sycl::handler &cgh)
+                {
+                    cgh.parallel_for(
+                        sycl::range<1>(nrows - 1),
+                        sycl::reduction(max_val, sycl::maximum<int>()),
+                        sycl::reduction(min_val, sycl::minimum<int>()),
+                        [=](sycl::id<1> idx, auto &maxr, auto &minr)
+                        {
+                            auto j = idx[0] + 1;
+                            int val = data[j];
+                            maxr.combine(val);
+                            minr.combine(val);
+                        }
+                    );
+                }
+            ).wait();
+
+        min = *min_val;
+        max = *max_val;
+        has_min_max = true;
+
+        sycl::free(min_val, cpu_queue);
+        sycl::free(max_val, cpu_queue);
+    }
+
+    bool is_packed_on(int device_index) const
+    {
+        return packed_device_ptrs[device_index] != nullptr;
+    }
+
+    // plain ints on the device, a segment moved packed is only read through get_packed_data:
+    // the columns read by other kernels are moved plain (set_read_plain)
+    const int *device_data(int device_index) const
+    {
+        if (device_ptrs[device_index] == nullptr && is_packed_on(device_index))
+        {
+            std::cerr << "Segment data: segment packed on device " << device_index
+                << " read as plain ints, its column was not marked read plain" << std::endl;
+            throw std::runtime_error("Segment data: packed segment read as plain ints");
+        }
+        return device_ptrs[device_index];
+    }
+
+    // bits per value of the segment once packed, 0 if it does not pack
+    int device_packed_bits() const
+    {
+        #if PACK_DEVICE_SEGMENTS
+        if (!is_materialized && !is_aggregate_result)
+        {
+            // frame of reference: the segment min, the fields hold value - min
+            int bits = packed_bit_width(get_min(), get_max());
+            if (bits <= PACKED_SEGMENT_MAX_BITS)
+                return bits;
+        }
+        #endif
+        return 0;
+    }
+
+    // bits per value of the segment once moved to a device, 0 if it is moved as plain ints
+    int moved_packed_bits() const
+    {
+        return read_plain ? 0 : device_packed_bits();
+    }
+
+    // packs the segment on the host once, packed_bits is in (0, 32)
+    void pack_on_host()
+    {
+        if (packed_host != nullptr)
+            return;
+        packed_host = sycl::malloc_host<uint32_t>(packed_word_count(nrows, packed_bits), cpu_queue);
+        pack_ints(packed_host, data_host, min, packed_bits, nrows, cpu_queue).wait();
+    }
+
+    sycl::event move_packed_to_device(int device_index, transfer_engine &transfers)
+    {
+        uint64_t words = packed_word_count(nrows, packed_bits);
+
+        pack_on_host();
+        if (packed_device_ptrs[device_index] == nullptr)
+            packed_device_ptrs[device_index] = sycl::malloc_device<uint32_t>(words, device_queues[device_index]);
+
+        on_device = true;
+        on_device_vec[device_index] = true;
+        device_copies[device_index] = transfers.to_device(packed_device_ptrs[device_index], packed_host, words * sizeof(uint32_t), device_index, true);
+        return device_copies[device_index];
+    }
+
+    // device holding the data a dirty materialized segment has to copy back to the host, -1 if none
+    int copy_on_host_source() const
+    {
+        if (!on_device || !dirty_cache || !is_materialized)
+            return -1;
+        for (int i = 0; i < device_queues.size(); i++)
+            if (on_device_vec[i])
+                return i;
+        return -1;
+    }
 public:
     Segment(const int *init_data, sycl::queue &cpu_queue, std::vector<sycl::queue> &device_queues, uint64_t count = SEGMENT_SIZE)
         :
         device_ptrs(device_queues.size(), nullptr),
+        packed_device_ptrs(device_queues.size(), nullptr),
+        device_copies(device_queues.size()),
         nrows(count),
         cpu_queue(cpu_queue),
         device_queues(device_queues),
@@ -37,7 +166,8 @@ public:
         on_device(false),
         is_aggregate_result(false),
         is_materialized(false),
-        dirty_cache(false)
+        dirty_cache(false),
+        has_min_max(false)
     {
         if (count > SEGMENT_SIZE)
         {
@@ -46,45 +176,65 @@ public:
         }
         data_host = sycl::malloc_host<int>(count, cpu_queue);
 
-        sycl::event e;
         if (init_data != nullptr)
-            e = cpu_queue.memcpy(data_host, init_data, count * sizeof(int));
+            cpu_queue.memcpy(data_host, init_data, count * sizeof(int)).wait();
         else
         {
             std::cerr << "Error: Segment not initialized" << std::endl;
             throw std::runtime_error("Segment not initialized");
         }
 
-        int *min_val = sycl::malloc_host<int>(1, cpu_queue);
-        int *max_val = sycl::malloc_host<int>(1, cpu_queue);
-        int *data = data_host;
-        min_val[0] = init_data[0];
-        max_val[0] = init_data[0];
+        compute_min_max();
+    }
 
-        cpu_queue.submit(
-            [&](sycl::handler &cgh)
+    // zero-copy segment over rows [offset, offset + count) of a mapped column file,
+    // stats come from the file directory when available
+    Segment(
+        std::shared_ptr<mapped_file> mapping,
+        uint64_t offset,
+        sycl::queue &cpu_queue,
+        std::vector<sycl::queue> &device_queues,
+        uint64_t count = SEGMENT_SIZE,
+        const column_segment_stats *stats = nullptr
+    )
+        :
+        data_host(const_cast<int *>(mapping->get_data<int>(offset))),
+        device_ptrs(device_queues.size(), nullptr),
+        packed_device_ptrs(device_queues.size(), nullptr),
+        device_copies(device_queues.size()),
+        nrows(count),
+        cpu_queue(cpu_queue),
+        device_queues(device_queues),
+        on_device_vec(device_queues.size(), false),
+        mapping(mapping),
+        on_device(false),
+        is_aggregate_result(false),
+        is_materialized(false),
+        dirty_cache(false),
+        has_min_max(false)
+    {
+        if (count > SEGMENT_SIZE)
+        {
+            std::cerr << "Segment allocation failed: requested size " << count << " exceeds SEGMENT_SIZE " << SEGMENT_SIZE << std::endl;
+            throw std::bad_alloc();
+        }
+        if ((offset + count) * sizeof(int) > mapping->get_size())
+        {
+            std::cerr << "Segment mapping failed: rows " << offset << "-" << offset + count << " exceed the mapped file" << std::endl;
+            throw std::out_of_range("Segment mapping exceeds the mapped file");
+        }
+
+        if (stats != nullptr)
+        {
+            if (stats->nrows != count)
             {
-                cgh.depends_on(e);
-                cgh.parallel_for(
-                    sycl::range<1>(count - 1),
-                    sycl::reduction(max_val, sycl::maximum<int>()),
-                    sycl::reduction(min_val, sycl::minimum<int>()),
-                    [=](sycl::id<1> idx, auto &maxr, auto &minr)
-                    {
-                        auto j = idx[0] + 1;
-                        int val = data[j];
-                        maxr.combine(val);
-                        minr.combine(val);
-                    }
-                );
+                std::cerr << "Segment mapping failed: directory has " << stats->nrows << " rows, expected " << count << std::endl;
+                throw std::runtime_error("Segment mapping does not match the file directory");
             }
-        ).wait();
-
-        min = *min_val;
-        max = *max_val;
-
-        sycl::free(min_val, cpu_queue);
-        sycl::free(max_val, cpu_queue);
+            min = stats->min_value;
+            max = stats->max_value;
+            has_min_max = true;
+        }
     }
 
     Segment(
@@ -93,18 +243,22 @@ public:
         memory_manager &cpu_allocator,
         memory_manager &device_allocator,
         bool use_alloc_host = false,
-        uint64_t count = SEGMENT_SIZE
+        uint64_t count = SEGMENT_SIZE,
+        ColumnType type = ColumnType::Int32
     )
         :
         device_ptrs(device_queues.size(), nullptr),
+        packed_device_ptrs(device_queues.size(), nullptr),
+        device_copies(device_queues.size()),
         nrows(count),
         cpu_queue(cpu_queue),
         device_queues(device_queues),
         on_device_vec(device_queues.size(), false),
         on_device(false),
-        is_aggregate_result(false),
+        is_aggregate_result(type == ColumnType::Int64),
         is_materialized(true),
-        dirty_cache(false)
+        dirty_cache(false),
+        has_min_max(true)
     {
         if (count > SEGMENT_SIZE)
         {
@@ -112,7 +266,10 @@ public:
             throw std::bad_alloc();
         }
 
-        if (use_alloc_host)
+        if (is_aggregate_result)
+            data_host = reinterpret_cast<int *>(use_alloc_host ?
+                device_allocator.alloc<uint64_t>(count, false) : cpu_allocator.alloc<uint64_t>(count, true));
+        else if (use_alloc_host)
             data_host = device_allocator.alloc<int>(count, false);
         else
             data_host = cpu_allocator.alloc<int>(count, true);
@@ -130,6 +287,8 @@ public:
     )
         :
         device_ptrs(device_queues.size(), nullptr),
+        packed_device_ptrs(device_queues.size(), nullptr),
+        device_copies(device_queues.size()),
         min(0),
         max(0),
         nrows(count),
@@ -139,7 +298,8 @@ public:
         on_device(on_device),
         is_aggregate_result(true),
         is_materialized(true),
-        dirty_cache(true)
+        dirty_cache(true),
+        has_min_max(true)
     {
         if (count > SEGMENT_SIZE)
         {
@@ -176,6 +336,8 @@ public:
     )
         :
         device_ptrs(device_queues.size(), nullptr),
+        packed_device_ptrs(device_queues.size(), nullptr),
+        device_copies(device_queues.size()),
         min(0),
         max(0),
         nrows(count),
@@ -185,7 +347,8 @@ public:
         on_device(on_device),
         is_aggregate_result(false),
         is_materialized(true),
-        dirty_cache(true)
+        dirty_cache(true),
+        has_min_max(true)
     {
         if (count > SEGMENT_SIZE)
         {
@@ -214,7 +377,7 @@ public:
     {
         if (!is_materialized)
         {
-            if (data_host != nullptr)
+            if (data_host != nullptr && mapping == nullptr)
             {
                 // std::cout << "Freeing data_host " << data_host << std::endl;
                 sycl::free(data_host, cpu_queue);
@@ -226,7 +389,11 @@ public:
                     // std::cout << "Freeing data_device " << device_ptrs[i] << " on device " << i << std::endl;
                     sycl::free(device_ptrs[i], device_queues[i]);
                 }
+                if (packed_device_ptrs[i] != nullptr)
+                    sycl::free(packed_device_ptrs[i], device_queues[i]);
             }
+            if (packed_host != nullptr)
+                sycl::free(packed_host, cpu_queue);
             // std::cout << "Segment free completed" << std::endl;
         }
     }
@@ -240,9 +407,18 @@ public:
     }
 
     const std::vector<bool> &get_on_device_vec() const { return on_device_vec; }
-    int get_min() const { return min; }
-    int get_max() const { return max; }
+    int get_min() const
+    {
+        compute_min_max();
+        return min;
+    }
+    int get_max() const
+    {
+        compute_min_max();
+        return max;
+    }
     uint64_t get_nrows() const { return nrows; }
+    ColumnType get_type() const { return is_aggregate_result ? ColumnType::Int64 : ColumnType::Int32; }
 
     int get_device_index() const
     {
@@ -302,7 +478,8 @@ public:
         on_device = true;
         on_device_vec[device_index] = true;
         dirty_cache = true;
-        device_ptrs[device_index] = device_allocator.alloc<int>(nrows, true);
+        device_ptrs[device_index] = is_aggregate_result ?
+            reinterpret_cast<int *>(device_allocator.alloc<uint64_t>(nrows, true)) : device_allocator.alloc<int>(nrows, true);
     }
 
     void set_min(int value)
@@ -334,7 +511,7 @@ public:
             std::cerr << "Invalid device index " << device_index << " for get_data" << std::endl;
             throw std::runtime_error("Invalid device index for get_data");
         }
-        return device ? device_ptrs[device_index] : data_host;
+        return device ? device_data(device_index) : data_host;
     }
 
     int *get_data(bool device, int device_index)
@@ -369,6 +546,31 @@ public:
         return const_cast<uint64_t *>(static_cast<const Segment &>(*this).get_aggregate_data(device, device_index));
     }
 
+    // data of either width, for the kernels reading both
+    typed_column get_typed_data(bool device, int device_index) const
+    {
+        if (is_aggregate_result)
+            return { get_aggregate_data(device, device_index), ColumnType::Int64 };
+        return { get_data(device, device_index), ColumnType::Int32 };
+    }
+
+    // data for the kernels decoding packed columns on the fly, packed if the segment was moved packed
+    packed_column get_packed_data(bool device, int device_index) const
+    {
+        if (device && !is_aggregate_result && device_index >= 0 && device_index < device_queues.size()
+            && is_packed_on(device_index))
+            return packed_column(packed_device_ptrs[device_index], min, packed_bits);
+        return packed_column(get_data(device, device_index));
+    }
+
+    // value range used to plan expression widths, the min/max of 64-bit segments are not tracked
+    std::pair<int64_t, int64_t> get_value_range() const
+    {
+        if (is_aggregate_result)
+            return column_type_range(ColumnType::Int64);
+        return { get_min(), get_max() };
+    }
+
     const int &operator[](uint64_t index) const
     {
         if (index >= nrows)
@@ -404,10 +606,42 @@ public:
         if (gpu_only &&
             (!on_device || device_index < 0 || device_index >= device_queues.size() || !on_device_vec[device_index]))
             return 0;
+        if (gpu_only && is_packed_on(device_index))
+            return packed_word_count(nrows, packed_bits) * sizeof(uint32_t);
         return nrows * (is_aggregate_result ? sizeof(uint64_t) : sizeof(int));
     }
 
-    sycl::event move_to_device(int device_index)
+    // loaded segments keep their host data and can be moved to any device
+    bool can_move_to_device() const { return !is_materialized && !is_aggregate_result; }
+
+    // The next moves of the segment are plain ints. Packed copies already on a device are
+    // dropped, the placement or the scheduler moves the segment there again.
+    void set_read_plain()
+    {
+        read_plain = true;
+        for (int d = 0; d < packed_device_ptrs.size(); d++)
+        {
+            if (!is_packed_on(d))
+                continue;
+            device_copies[d].wait();
+            sycl::free(packed_device_ptrs[d], device_queues[d]);
+            packed_device_ptrs[d] = nullptr;
+            on_device_vec[d] = false;
+        }
+        on_device = std::find(on_device_vec.begin(), on_device_vec.end(), true) != on_device_vec.end();
+    }
+
+    // bytes taken on a device by move_to_device
+    uint64_t get_moved_data_size() const
+    {
+        int bits = moved_packed_bits();
+        if (bits > 0)
+            return packed_word_count(nrows, bits) * sizeof(uint32_t);
+        return get_data_size(false, -1);
+    }
+
+    // the copy runs on the copy queue of the device, the kernels reading the segment there depend on the returned event
+    sycl::event move_to_device(int device_index, transfer_engine &transfers)
     {
         if (is_materialized || is_aggregate_result)
         {
@@ -422,231 +656,103 @@ public:
         if (on_device && on_device_vec[device_index])
             return sycl::event();
 
+        if (moved_packed_bits() > 0)
+        {
+            packed_bits = moved_packed_bits();
+            return move_packed_to_device(device_index, transfers);
+        }
+
         if (device_ptrs[device_index] == nullptr)
             device_ptrs[device_index] = sycl::malloc_device<int>(nrows, device_queues[device_index]);
 
         on_device = true;
         on_device_vec[device_index] = true;
-        return device_queues[device_index].memcpy(device_ptrs[device_index], data_host, nrows * sizeof(int));
+        device_copies[device_index] = transfers.to_device(device_ptrs[device_index], data_host, nrows * sizeof(int), device_index, is_host_pinned(device_index));
+        return device_copies[device_index];
     }
 
-    sycl::event copy_on_host()
+    // the host data can be copied to the device without staging: SYCL host allocations are pinned,
+    // a mapped range is if the runtime could register it
+    bool is_host_pinned(int device_index)
     {
-        sycl::event e;
-
-        if (on_device && dirty_cache && is_materialized)
-        {
-            for (int i = 0; i < device_queues.size(); i++)
-            {
-                if (on_device_vec[i])
-                {
-                    if (is_aggregate_result)
-                        e = device_queues[i].memcpy(
-                            reinterpret_cast<uint64_t *>(data_host),
-                            reinterpret_cast<uint64_t *>(device_ptrs[i]),
-                            nrows * sizeof(uint64_t)
-                        );
-                    else
-                        e = device_queues[i].memcpy(data_host, device_ptrs[i], nrows * sizeof(int));
-                    break;
-                }
-            }
-            dirty_cache = false;
-        }
-        else
-            e = sycl::event();
-
-        return e;
+        return mapping == nullptr || mapping->prepare_for_device(data_host, nrows * sizeof(int), device_queues[device_index]);
     }
 
-    bool needs_copy_on(bool device, int device_index) const
+    // Host data copied to a device buffer when the segment is streamed instead of moved: the packed
+    // words if it would be moved packed (pinned), else the plain ints. The segment is left on the host.
+    packed_column get_stream_source(int device_index)
     {
-        return (device != on_device || (device && !on_device_vec[device_index]))
-            && is_materialized && dirty_cache;
-    }
-
-    KernelBundle search_operator(
-        const ExprType &expr,
-        std::string parent_op,
-        memory_manager &cpu_allocator,
-        std::vector<memory_manager> &device_allocators,
-        bool *cpu_flags,
-        std::vector<bool *> &device_flags) const
-    {
-        int device_index = -1;
-        if (on_device)
+        if (!can_move_to_device())
         {
-            device_index = get_device_index();
-            if (device_index == -1)
-            {
-                std::cerr << "Segment search_operator: no device found for on_device segment" << std::endl;
-                throw std::runtime_error("Segment search_operator: no device found for on_device segment");
-            }
+            std::cerr << "Segment get_stream_source: cannot stream materialized or aggregate result segment to device" << std::endl;
+            throw std::runtime_error("Segment get_stream_source: cannot stream materialized or aggregate result segment to device");
         }
-        memory_manager &allocator = on_device ? device_allocators[device_index] : cpu_allocator;
-        int *data = on_device ? device_ptrs[device_index] : data_host;
-        bool *flags = on_device ? device_flags[device_index] : cpu_flags;
-
-        bool *local_flags = allocator.alloc<bool>(nrows, true);
-
-        KernelBundle operations(on_device, device_index);
-
-        if (expr.operands[1].literal.rangeSet.size() == 1) // range
+        if (device_index < 0 || device_index >= device_queues.size())
         {
-            int lower = std::stoi(expr.operands[1].literal.rangeSet[0][1]),
-                upper = std::stoi(expr.operands[1].literal.rangeSet[0][2]);
-
-            operations.add_kernel(
-                KernelData(
-                    KernelType::SelectionKernelLiteral,
-                    new SelectionKernelLiteral(
-                        local_flags,
-                        data,
-                        ">=",
-                        lower,
-                        "NONE",
-                        nrows
-                    )
-                )
-            );
-            operations.add_kernel(
-                KernelData(
-                    KernelType::SelectionKernelLiteral,
-                    new SelectionKernelLiteral(
-                        local_flags,
-                        data,
-                        "<=",
-                        upper,
-                        "AND",
-                        nrows
-                    )
-                )
-            );
-
-            // TODO: min and max here
-            // table_data.columns[col_index].min_value = lower;
-            // table_data.columns[col_index].max_value = upper;
+            std::cerr << "Segment get_stream_source: invalid device index " << device_index << std::endl;
+            throw std::runtime_error("Segment get_stream_source: invalid device index");
         }
-        else // or between two values
-        {
-            int first = std::stoi(expr.operands[1].literal.rangeSet[0][1]),
-                second = std::stoi(expr.operands[1].literal.rangeSet[1][1]);
 
-            operations.add_kernel(
-                KernelData(
-                    KernelType::SelectionKernelLiteral,
-                    new SelectionKernelLiteral(
-                        local_flags,
-                        data,
-                        "==",
-                        first,
-                        "NONE",
-                        nrows
-                    )
-                )
-            );
-            operations.add_kernel(
-                KernelData(
-                    KernelType::SelectionKernelLiteral,
-                    new SelectionKernelLiteral(
-                        local_flags,
-                        data,
-                        "==",
-                        second,
-                        "OR",
-                        nrows
-                    )
-                )
-            );
+        packed_bits = device_packed_bits();
+        if (packed_bits > 0)
+        {
+            pack_on_host();
+            return packed_column(packed_host, min, packed_bits);
         }
+        return packed_column(data_host);
+    }
 
-        logical_op logic = get_logical_op(parent_op);
-
-        operations.add_kernel(
-            KernelData(
-                KernelType::LogicalKernel,
-                new LogicalKernel(
-                    logic,
-                    flags,
-                    local_flags,
-                    nrows
-                )
-            )
-        );
+    // for the values read one at a time, see copy_on_host(transfer_engine &) to read back whole columns
+    sycl::event copy_on_host()
+    {
+        int source = copy_on_host_source();
+        if (source < 0)
+            return sycl::event();
 
-        return operations;
+        dirty_cache = false;
+        return device_queues[source].memcpy(data_host, device_ptrs[source], get_data_size(false, -1));
     }
 
-    SelectionKernelLiteral *filter_operator(
-        std::string op,
-        std::string parent_op,
-        int literal_value,
-        bool *flags,
-        int device_index) const
+    sycl::event copy_on_host(transfer_engine &transfers)
     {
-        return new SelectionKernelLiteral(
-            flags,
-            on_device ? device_ptrs[device_index] : data_host,
-            op,
-            literal_value,
-            parent_op,
-            nrows
-        );
+        int source = copy_on_host_source();
+        if (source < 0)
+            return sycl::event();
+
+        dirty_cache = false;
+        return transfers.to_host(data_host, device_ptrs[source], get_data_size(false, -1), source);
     }
 
-    SelectionKernelColumns *filter_operator(
-        std::string op,
-        std::string parent_op,
-        const Segment &other_segment,
-        bool *flags,
-        int device_index) const
+    bool needs_copy_on(bool device, int device_index) const
     {
-        return new SelectionKernelColumns(
-            flags,
-            on_device ? device_ptrs[device_index] : data_host,
-            op,
-            other_segment.get_data(on_device, device_index),
-            parent_op,
-            nrows
-        );
+        return (device != on_device || (device && !on_device_vec[device_index]))
+            && is_materialized && dirty_cache;
     }
 
-    PerformOperationKernelColumns *perform_operator(
-        const Segment &first_operand,
-        const Segment &second_operand,
-        bool perform_on_device,
-        int device_index,
-        const bool *flags,
-        const std::string &op)
+    // Zone maps are only used for loaded segments: materialized min/max are estimates.
+    zone_map_match zone_map_filter(comp_op comparison, int literal_value) const
     {
-        if (perform_on_device && !on_device)
-        {
-            std::cerr << "Perform operation: Mismatched segment locations between columns" << std::endl;
-            throw std::runtime_error("Perform operation: Mismatched segment locations between columns");
-        }
-
-        min = std::min(first_operand.min, second_operand.min);
-        max = std::max(first_operand.max, second_operand.max);
+        if (is_materialized || is_aggregate_result)
+            return PARTIAL_MATCH;
+        return evaluate_zone_map(comparison, get_min(), get_max(), literal_value);
+    }
 
-        dirty_cache = true;
+    // filter whose predicate has the same value on every row of the segment
+    KernelData constant_filter_operator(bool predicate, logical_op logic, flag_word *flags) const
+    {
+        if (constant_filter_is_noop(logic, predicate))
+            return KernelData(KernelType::EmptyKernel, new EmptyKernel(nrows));
 
-        return new PerformOperationKernelColumns(
-            perform_on_device ? device_ptrs[device_index] : data_host,
-            first_operand.get_data(perform_on_device, device_index),
-            second_operand.get_data(perform_on_device, device_index),
-            flags,
-            op,
-            nrows
-        );
+        return KernelData(KernelType::FillFlagsKernel, new FillFlagsKernel(flags, predicate, nrows));
     }
 
-    PerformOperationKernelLiteralSecond *perform_operator(
-        const Segment &first_operand,
-        int second_operand,
+    // operands holds the segment of every column slot of the program
+    ExpressionKernel *expression_operator(
+        const expression_program &program,
+        const std::vector<const Segment *> &operands,
         bool perform_on_device,
         int device_index,
-        const bool *flags,
-        const std::string &op)
+        const flag_word *flags)
     {
         if (perform_on_device && !on_device)
         {
@@ -654,186 +760,89 @@ public:
             throw std::runtime_error("Perform operation: Mismatched segment locations between columns");
         }
 
-        min = first_operand.min;
-        max = first_operand.max;
-
-        dirty_cache = true;
-
-        return new PerformOperationKernelLiteralSecond(
-            perform_on_device ? device_ptrs[device_index] : data_host,
-            first_operand.get_data(perform_on_device, device_index),
-            second_operand,
-            flags,
-            op,
-            nrows
-        );
-    }
+        if (program.result_type != get_type())
+        {
+            std::cerr << "Perform operation: result segment width does not match the expression" << std::endl;
+            throw std::runtime_error("Perform operation: result segment width does not match the expression");
+        }
 
-    PerformOperationKernelLiteralFirst *perform_operator(
-        int first_operand,
-        const Segment &second_operand,
-        bool perform_on_device,
-        int device_index,
-        const bool *flags,
-        const std::string &op)
-    {
-        if (perform_on_device && !on_device)
+        const void *columns[MAX_EXPRESSION_COLUMNS];
+        std::vector<std::pair<int64_t, int64_t>> ranges;
+        for (int c = 0; c < operands.size(); c++)
         {
-            std::cerr << "Perform operation: Mismatched segment locations between columns" << std::endl;
-            throw std::runtime_error("Perform operation: Mismatched segment locations between columns");
+            columns[c] = operands[c]->get_typed_data(perform_on_device, device_index).data;
+            ranges.push_back(operands[c]->get_value_range());
         }
 
-        min = second_operand.min;
-        max = second_operand.max;
+        if (is_aggregate_result)
+            min = max = 0;
+        else
+        {
+            expression_bounds bounds = expression_range(program, ranges);
+            min = bounds.min_value;
+            max = bounds.max_value;
+        }
 
         dirty_cache = true;
 
-        return new PerformOperationKernelLiteralFirst(
+        return new ExpressionKernel(
+            program,
+            columns,
             perform_on_device ? device_ptrs[device_index] : data_host,
-            first_operand,
-            second_operand.get_data(perform_on_device, device_index),
             flags,
-            op,
             nrows
         );
     }
 
-    AggregateOperationKernel *aggregate_operator(
-        const bool *flags,
-        bool aggregate_on_device,
-        int device_index,
-        uint64_t *agg_res) const
-    {
-        return new AggregateOperationKernel(
-            aggregate_on_device ? device_ptrs[device_index] : data_host,
-            flags,
-            nrows,
-            agg_res
-        );
-    }
-
     BuildKeysHTKernel *build_keys_hash_table(
-        bool *ht,
-        const bool *flags,
-        int ht_len,
-        int ht_min_value,
+        const JoinHashTable &ht,
+        const flag_word *flags,
         int device_index
     ) const
     {
         return new BuildKeysHTKernel(
             ht,
-            on_device ? device_ptrs[device_index] : data_host,
+            on_device ? device_data(device_index) : data_host,
             flags,
-            ht_len,
-            ht_min_value,
-            nrows
-        );
-    }
-
-    FilterJoinKernel *semi_join_operator(
-        bool *probe_flags,
-        int build_min_value,
-        int build_max_value,
-        const bool *build_ht,
-        int device_index) const
-    {
-        return new FilterJoinKernel(
-            on_device ? device_ptrs[device_index] : data_host,
-            probe_flags,
-            build_ht,
-            build_min_value,
-            build_max_value,
             nrows
         );
     }
 
     BuildKeyValsHTKernel *build_key_vals_hash_ht(
-        int *ht,
-        const bool *flags,
-        int ht_len,
-        int ht_min_value,
+        const JoinHashTable &ht,
+        const flag_word *flags,
         bool build_on_device,
         int device_index,
-        const Segment &value_segment) const
+        const std::vector<const Segment *> &payload_segments) const
     {
-        if (build_on_device &&
-            (!on_device || !on_device_vec[device_index]
-                || !value_segment.on_device || !value_segment.on_device_vec[device_index]))
+        const int *payloads[MAX_JOIN_PAYLOADS];
+
+        if (build_on_device && (!on_device || !on_device_vec[device_index]))
         {
             std::cerr << "Build key-vals hash table: Mismatched segment locations between columns" << std::endl;
             throw std::runtime_error("Build key-vals hash table: Mismatched segment locations between columns");
         }
 
-        return new BuildKeyValsHTKernel(
-            ht,
-            build_on_device ? device_ptrs[device_index] : data_host,
-            build_on_device ? value_segment.device_ptrs[device_index] : value_segment.data_host,
-            flags,
-            ht_len,
-            ht_min_value,
-            nrows
-        );
-    }
-
-    FullJoinKernel *full_join_operator(
-        Segment &result_segment,
-        bool *probe_flags,
-        const int *ht,
-        int ht_min_value,
-        int ht_max_value,
-        bool ht_on_device,
-        int device_index
-    ) const
-    {
-        if (ht_on_device &&
-            (!on_device || !on_device_vec[device_index]
-                || !result_segment.on_device || !result_segment.on_device_vec[device_index]))
+        for (int p = 0; p < payload_segments.size(); p++)
         {
-            std::cerr << "Full join: Mismatched segment locations between columns" << std::endl;
-            throw std::runtime_error("Full join: Mismatched segment locations between columns");
+            const Segment &payload_segment = *payload_segments[p];
+            if (build_on_device && (!payload_segment.on_device || !payload_segment.on_device_vec[device_index]))
+            {
+                std::cerr << "Build key-vals hash table: Mismatched segment locations between columns" << std::endl;
+                throw std::runtime_error("Build key-vals hash table: Mismatched segment locations between columns");
+            }
+            payloads[p] = build_on_device ? payload_segment.device_data(device_index) : payload_segment.data_host;
         }
 
-        return new FullJoinKernel(
-            ht_on_device ? device_ptrs[device_index] : data_host,
-            ht_on_device ? result_segment.device_ptrs[device_index] : result_segment.data_host,
-            probe_flags,
+        return new BuildKeyValsHTKernel(
             ht,
-            ht_min_value,
-            ht_max_value,
-            nrows
-        );
-    }
-
-    GroupByAggregateKernel *group_by_aggregate_operator(
-        const int **contents,
-        const int *max,
-        const int *min,
-        const bool *flags,
-        uint64_t *agg_res,
-        int group_size,
-        int **results,
-        unsigned *result_flags,
-        bool aggregate_on_device,
-        int device_index,
-        uint64_t prod_ranges
-    ) const
-    {
-        return new GroupByAggregateKernel(
-            contents,
-            aggregate_on_device ? device_ptrs[device_index] : data_host,
-            max,
-            min,
+            build_on_device ? device_data(device_index) : data_host,
+            payloads,
             flags,
-            group_size,
-            nrows,
-            results,
-            agg_res,
-            result_flags,
-            prod_ranges
+            nrows
         );
     }
 
-
     // assumption: sync point. needs to be improved
     sycl::event compress_sync(
         int *row_ids_device,
@@ -841,23 +850,43 @@ public:
         sycl::event &e_row_ids_host,
         uint64_t nrows_selected,
         memory_manager &device_allocator,
-        int device_index)
+        int device_index,
+        transfer_engine &transfers)
     {
-        if (is_aggregate_result)
-        {
-            std::cerr << "Compress operator: cannot compress aggregate result segment" << std::endl;
-            throw std::runtime_error("Compress operator: cannot compress aggregate result segment");
-        }
         if (!on_device || !on_device_vec[device_index])
         {
             std::cerr << "Compress operator: segment not on device" << std::endl;
             throw std::runtime_error("Compress operator: segment not on device");
         }
 
-        int *data_device_compressed = device_allocator.alloc<int>(nrows_selected, true);
-        int *data_host_compressed = device_allocator.alloc<int>(nrows_selected, false);
-        int *device_ptr = device_ptrs[device_index];
-        int *host_ptr = data_host;
+        sycl::event e = is_aggregate_result ?
+            compress_sync_values(
+                reinterpret_cast<uint64_t *>(device_ptrs[device_index]), reinterpret_cast<uint64_t *>(data_host),
+                row_ids_device, row_ids_host, e_row_ids_host, nrows_selected, device_allocator, device_index, transfers) :
+            compress_sync_values(
+                const_cast<int *>(device_data(device_index)), data_host,
+                row_ids_device, row_ids_host, e_row_ids_host, nrows_selected, device_allocator, device_index, transfers);
+
+        dirty_cache = false;
+
+        return e;
+    }
+
+private:
+    template <typename T>
+    sycl::event compress_sync_values(
+        T *device_ptr,
+        T *host_ptr,
+        int *row_ids_device,
+        int *row_ids_host,
+        sycl::event &e_row_ids_host,
+        uint64_t nrows_selected,
+        memory_manager &device_allocator,
+        int device_index,
+        transfer_engine &transfers)
+    {
+        T *data_device_compressed = device_allocator.alloc<T>(nrows_selected, true);
+        T *data_host_compressed = device_allocator.alloc<T>(nrows_selected, false);
 
         auto e1 = device_queues[device_index].submit(
             [&](sycl::handler &cgh)
@@ -874,14 +903,15 @@ public:
             }
         );
 
-        auto e2 = device_queues[device_index].memcpy(
+        auto e2 = transfers.to_host(
             data_host_compressed,
             data_device_compressed,
-            nrows_selected * sizeof(int),
-            e1
+            nrows_selected * sizeof(T),
+            device_index,
+            { e1 }
         );
 
-        auto e3 = cpu_queue.submit(
+        return cpu_queue.submit(
             [&](sycl::handler &cgh)
             {
                 cgh.depends_on(e2);
@@ -897,10 +927,6 @@ public:
                 );
             }
         );
-
-        dirty_cache = false;
-
-        return e3;
     }
 };
 
@@ -910,6 +936,9 @@ class Column
 private:
     std::vector<Segment> segments;
     bool is_aggregate_result;
+    int scale = 0; // decimal scale of the values
+    const column_dictionary *dictionary = nullptr; // strings of the codes of a dictionary-encoded column
+    Column *input_rows = nullptr; // input rows of each value, a value of no rows is NULL; nullptr if never NULL
 public:
     Column() : is_aggregate_result(false)
     {
@@ -931,14 +960,56 @@ public:
             segments.emplace_back(init_data + full_segments * SEGMENT_SIZE, cpu_queue, device_queues, remainder);
     }
 
+    Column(
+        std::shared_ptr<mapped_file> mapping,
+        uint64_t nrows,
+        sycl::queue &cpu_queue,
+        std::vector<sycl::queue> &device_queues,
+        const column_file_view *file = nullptr)
+        : is_aggregate_result(false)
+    {
+        uint64_t full_segments = nrows / SEGMENT_SIZE;
+        uint64_t remainder = nrows % SEGMENT_SIZE;
+        uint64_t first_row = file != nullptr ? file->get_first_row_offset() : 0;
+
+        // the directory stats can only be reused if the file was written with our segment size
+        bool use_stats = file != nullptr && file->get_segment_size() == SEGMENT_SIZE;
+        if (file != nullptr && !use_stats)
+            std::cerr << "Warning: column file segment size " << file->get_segment_size()
+            << " differs from SEGMENT_SIZE, statistics will be computed on first use" << std::endl;
+
+        segments.reserve(full_segments + (remainder > 0));
+
+        for (uint64_t i = 0; i < full_segments; i++)
+            segments.emplace_back(
+                mapping,
+                first_row + i * SEGMENT_SIZE,
+                cpu_queue,
+                device_queues,
+                SEGMENT_SIZE,
+                use_stats ? &file->get_segment_stats(i) : nullptr
+            );
+
+        if (remainder > 0)
+            segments.emplace_back(
+                mapping,
+                first_row + full_segments * SEGMENT_SIZE,
+                cpu_queue,
+                device_queues,
+                remainder,
+                use_stats ? &file->get_segment_stats(full_segments) : nullptr
+            );
+    }
+
     Column(
         uint64_t nrows,
         sycl::queue &cpu_queue,
         std::vector<sycl::queue> &device_queues,
         memory_manager &cpu_allocator,
         memory_manager &device_allocator,
-        bool use_alloc_host = false)
-        : is_aggregate_result(false)
+        bool use_alloc_host = false,
+        ColumnType type = ColumnType::Int32)
+        : is_aggregate_result(type == ColumnType::Int64)
     {
         uint64_t full_segments = nrows / SEGMENT_SIZE,
             remainder = nrows % SEGMENT_SIZE;
@@ -946,10 +1017,10 @@ public:
         segments.reserve(full_segments + (remainder > 0));
 
         for (uint64_t i = 0; i < full_segments; i++)
-            segments.emplace_back(cpu_queue, device_queues, cpu_allocator, device_allocator, use_alloc_host);
+            segments.emplace_back(cpu_queue, device_queues, cpu_allocator, device_allocator, use_alloc_host, SEGMENT_SIZE, type);
 
         if (remainder > 0)
-            segments.emplace_back(cpu_queue, device_queues, cpu_allocator, device_allocator, use_alloc_host, remainder);
+            segments.emplace_back(cpu_queue, device_queues, cpu_allocator, device_allocator, use_alloc_host, remainder, type);
     }
 
     Column(
@@ -1034,7 +1105,39 @@ public:
 
     const std::vector<Segment> &get_segments() const { return segments; }
     std::vector<Segment> &get_segments() { return segments; }
+
+    uint64_t get_nrows() const
+    {
+        uint64_t nrows = 0;
+        for (const Segment &seg : segments)
+            nrows += seg.get_nrows();
+        return nrows;
+    }
     bool get_is_aggregate_result() const { return is_aggregate_result; }
+    ColumnType get_type() const { return is_aggregate_result ? ColumnType::Int64 : ColumnType::Int32; }
+    int get_scale() const { return scale; }
+    void set_scale(int value) { scale = value; }
+    const column_dictionary *get_dictionary() const { return dictionary; }
+    void set_dictionary(const column_dictionary *value) { dictionary = value; }
+
+    Column *get_input_rows() const { return input_rows; }
+    void set_input_rows(Column *value) { input_rows = value; }
+    bool is_null(uint64_t index) const { return input_rows != nullptr && input_rows->get_aggregate_value(index) == 0; }
+
+    // scale and dictionary of a column holding values of source
+    void set_value_format(const Column &source)
+    {
+        scale = source.scale;
+        dictionary = source.dictionary;
+    }
+
+    std::pair<int64_t, int64_t> get_value_range() const
+    {
+        if (is_aggregate_result)
+            return column_type_range(ColumnType::Int64);
+        auto [min_value, max_value] = get_min_max();
+        return { min_value, max_value };
+    }
 
     bool is_all_on_same_device() const
     {
@@ -1143,21 +1246,30 @@ public:
         return operations;
     }
 
-    void move_all_to_device(int device_index)
+    void move_all_to_device(int device_index, transfer_engine &transfers)
     {
         for (auto &seg : segments)
-            seg.move_to_device(device_index);
+            seg.move_to_device(device_index, transfers);
     }
 
-    void move_to_device(int device_index, const std::vector<bool> &segments_choices = {})
+    void move_to_device(int device_index, transfer_engine &transfers, const std::vector<bool> &segments_choices = {})
     {
         for (int i = 0; i < segments.size(); i++)
         {
             if (segments_choices.size() <= i || segments_choices[i])
-                segments[i].move_to_device(device_index);
+                segments[i].move_to_device(device_index, transfers);
         }
     }
 
+    // issues the copies of all the segments to read back, to wait for before reading the values
+    std::vector<sycl::event> copy_on_host(transfer_engine &transfers)
+    {
+        std::vector<sycl::event> events;
+        for (auto &seg : segments)
+            events.push_back(seg.copy_on_host(transfers));
+        return events;
+    }
+
     uint64_t get_data_size(bool gpu_only, int device_index) const
     {
         uint64_t total_size = 0;
@@ -1166,6 +1278,20 @@ public:
         return total_size;
     }
 
+    uint64_t get_moved_data_size() const
+    {
+        uint64_t total_size = 0;
+        for (const auto &seg : segments)
+            total_size += seg.get_moved_data_size();
+        return total_size;
+    }
+
+    void set_read_plain()
+    {
+        for (auto &seg : segments)
+            seg.set_read_plain();
+    }
+
     bool needs_copy_on(bool device, int device_index) const
     {
         for (const auto &seg : segments)
@@ -1174,18 +1300,13 @@ public:
         return false;
     }
 
-    std::tuple<bool *, int, int, std::vector<KernelBundle>> build_keys_hash_table(bool *flags, memory_manager &allocator, bool on_device, int device_index) const
+    std::tuple<JoinHashTable, std::vector<KernelBundle>> build_keys_hash_table(flag_word *flags, memory_manager &allocator, bool on_device, int device_index) const
     {
         std::vector<KernelBundle> ops;
         ops.reserve(segments.size());
 
         auto min_max = get_min_max();
-        int min_value = min_max.first;
-        int max_value = min_max.second;
-
-        int ht_len = max_value - min_value + 1;
-
-        bool *ht = allocator.alloc_zero<bool>(ht_len);
+        JoinHashTable ht = make_join_hash_table(min_max.first, min_max.second, get_nrows(), 0, allocator);
 
         for (int i = 0; i < segments.size(); i++)
         {
@@ -1201,9 +1322,7 @@ public:
                     KernelType::BuildKeysHTKernel,
                     seg.build_keys_hash_table(
                         ht,
-                        flags + i * SEGMENT_SIZE,
-                        ht_len,
-                        min_value,
+                        flags + i * SEGMENT_FLAG_WORDS,
                         device_index
                     )
                 )
@@ -1211,56 +1330,12 @@ public:
             ops.push_back(bundle);
         }
 
-        return { ht, min_value, max_value, ops };
+        return { ht, ops };
     }
 
-    std::vector<KernelBundle> semi_join(
-        bool *probe_flags_cpu,
-        std::vector<bool *> &probe_flags_devices,
-        int build_min_value,
-        int build_max_value,
-        const bool *ht_cpu,
-        const std::vector<bool *> &ht_devices,
-        std::vector<bool> &flags_modified_host,
-        std::vector<std::vector<bool>> &flags_modified_devices
-    ) const
-    {
-        std::vector<KernelBundle> ops;
-        ops.reserve(segments.size());
-
-        for (int i = 0; i < segments.size(); i++)
-        {
-            const Segment &seg = segments[i];
-            int device_index = seg.get_device_index();
-            bool on_device = seg.is_on_device() && ht_devices[device_index] != nullptr;
-            KernelBundle bundle(on_device, device_index);
-
-            bundle.add_kernel(
-                KernelData(
-                    KernelType::FilterJoinKernel,
-                    seg.semi_join_operator(
-                        (on_device ? probe_flags_devices[device_index] : probe_flags_cpu) + i * SEGMENT_SIZE,
-                        build_min_value,
-                        build_max_value,
-                        on_device ? ht_devices[device_index] : ht_cpu,
-                        device_index
-                    )
-                )
-            );
-            ops.push_back(bundle);
-
-            if (on_device)
-                flags_modified_devices[device_index][i] = true;
-            else
-                flags_modified_host[i] = true;
-        }
-
-        return ops;
-    }
-
-    std::tuple<int *, int, int, std::vector<KernelBundle>> build_key_vals_hash_table(
-        const Column *vals_column,
-        bool *flags,
+    std::tuple<JoinHashTable, std::vector<KernelBundle>> build_key_vals_hash_table(
+        const std::vector<const Column *> &payload_columns,
+        flag_word *flags,
         memory_manager &allocator,
         bool on_device,
         int device_index) const
@@ -1269,125 +1344,31 @@ public:
         ops.reserve(segments.size());
 
         auto min_max = get_min_max();
-        int min_value = min_max.first;
-        int max_value = min_max.second;
-
-        int ht_len = max_value - min_value + 1;
-
-        int *ht = allocator.alloc_zero<int>(ht_len * 2);
+        JoinHashTable ht = make_join_hash_table(min_max.first, min_max.second, get_nrows(), payload_columns.size(), allocator);
 
         for (int i = 0; i < segments.size(); i++)
         {
+            std::vector<const Segment *> payload_segments;
+            for (const Column *payload_column : payload_columns)
+                payload_segments.push_back(&payload_column->segments[i]);
+
             KernelBundle bundle(on_device, device_index);
             bundle.add_kernel(
                 KernelData(
                     KernelType::BuildKeyValsHTKernel,
                     segments[i].build_key_vals_hash_ht(
                         ht,
-                        flags + i * SEGMENT_SIZE,
-                        ht_len,
-                        min_value,
+                        flags + i * SEGMENT_FLAG_WORDS,
                         on_device,
                         device_index,
-                        vals_column->segments[i]
+                        payload_segments
                     )
                 )
             );
             ops.push_back(bundle);
         }
 
-        return { ht, min_value, max_value, ops };
-    }
-
-    std::vector<KernelBundle> full_join_operation(
-        bool *probe_flags_host,
-        std::vector<bool *> &probe_flags_devices,
-        int build_min_value,
-        int build_max_value,
-        int group_by_column_min,
-        int group_by_column_max,
-        const int *build_ht_host,
-        const std::vector<int *> &build_hts_devices,
-        Column &new_column,
-        sycl::queue &cpu_queue,
-        std::vector<sycl::queue> &device_queues,
-        memory_manager &cpu_allocator,
-        std::vector<memory_manager> &device_allocators,
-        std::vector<bool> &flags_modified_host,
-        std::vector<std::vector<bool>> &flags_modified_devices) const
-    {
-        std::vector<KernelBundle> ops;
-        ops.reserve(segments.size());
-
-        for (int i = 0; i < segments.size(); i++)
-        {
-            const Segment &seg = segments[i];
-            Segment &new_seg = new_column.segments[i];
-            bool on_device = seg.is_on_device(), built = false;
-            const std::vector<bool> &on_device_vec = seg.get_on_device_vec();
-
-            if (on_device)
-            {
-                for (int d = 0; d < on_device_vec.size(); d++)
-                {
-                    if (on_device_vec[d] && build_hts_devices[d] != nullptr)
-                    {
-                        KernelBundle bundle(on_device, d);
-
-                        new_seg.build_on_device(device_allocators[d], d);
-
-                        bundle.add_kernel(
-                            KernelData(
-                                KernelType::FullJoinKernel,
-                                seg.full_join_operator(
-                                    new_seg,
-                                    probe_flags_devices[d] + i * SEGMENT_SIZE,
-                                    build_hts_devices[d],
-                                    build_min_value,
-                                    build_max_value,
-                                    on_device,
-                                    d
-                                )
-                            )
-                        );
-                        new_seg.set_min(group_by_column_min);
-                        new_seg.set_max(group_by_column_max);
-                        flags_modified_devices[d][i] = true;
-                        ops.push_back(bundle);
-                        built = true;
-                        break;
-                    }
-                }
-            }
-
-            if (!built)
-            {
-                KernelBundle bundle(false, -1);
-
-                // new_seg.build_on_device(device_allocators[d], d);
-
-                bundle.add_kernel(
-                    KernelData(
-                        KernelType::FullJoinKernel,
-                        seg.full_join_operator(
-                            new_seg,
-                            probe_flags_host + i * SEGMENT_SIZE,
-                            build_ht_host,
-                            build_min_value,
-                            build_max_value,
-                            false,
-                            -1
-                        )
-                    )
-                );
-                new_seg.set_min(group_by_column_min);
-                new_seg.set_max(group_by_column_max);
-                flags_modified_host[i] = true;
-                ops.push_back(bundle);
-            }
-        }
-
-        return ops;
+        return { ht, ops };
     }
 };
 
@@ -1402,17 +1383,69 @@ public:
     Table(const std::string table_name, sycl::queue &cpu_queue, std::vector<sycl::queue> &device_queues)
         : table_name(table_name)
     {
-        int col_number = table_column_numbers[table_name], *content;
+        int col_number = table_column_numbers[table_name], *content = nullptr;
         columns.reserve(col_number);
 
         const std::set<int> &columns_needed = table_column_indices[table_name];
 
+        // mapped segments are read in place by cpu_queue kernels,
+        // so the CPU device must be able to access system allocations
+        #if USE_MMAP_LOADING
+        bool use_mmap = cpu_queue.get_device().has(sycl::aspect::usm_system_allocations);
+        if (!use_mmap)
+            std::cerr << "Warning: CPU device does not support system allocations, copying " << table_name << " instead of mapping it" << std::endl;
+        #else
+        bool use_mmap = false;
+        #endif
+
         for (int i = 0; i < col_number; i++)
         {
             std::string col_name = table_name + std::to_string(i);
             std::transform(col_name.begin(), col_name.end(), col_name.begin(), ::toupper);
 
             std::string filename = DATA_DIR + col_name;
+
+            if (use_mmap)
+            {
+                // prefer the self-describing container written by convert_columns
+                std::string container_filename = filename + COLUMN_FILE_EXTENSION;
+                bool has_container = access(container_filename.c_str(), R_OK) == 0;
+
+                auto mapping = std::make_shared<mapped_file>(has_container ? container_filename : filename);
+                std::optional<column_file_view> file;
+                uint64_t num_entries;
+
+                if (has_container)
+                {
+                    file.emplace(mapping->get_data<char>(), mapping->get_size(), container_filename);
+                    num_entries = file->get_nrows();
+                    file->verify_checksums(container_filename);
+                }
+                else
+                    num_entries = mapping->get_size() / sizeof(int);
+
+                if (i == 0)
+                    nrows = num_entries;
+
+                if (num_entries != nrows)
+                {
+                    std::cerr << "Warning: Column length mismatch in " << filename << ": expected " << nrows << ", got " << num_entries << std::endl;
+                    columns.emplace_back();
+                }
+                else if (columns_needed.find(i) == columns_needed.end())
+                {
+                    std::cout << "Skipping loading column " << col_name << std::endl;
+                    columns.emplace_back();
+                }
+                else
+                {
+                    columns.emplace_back(mapping, num_entries, cpu_queue, device_queues, file ? &*file : nullptr);
+                    columns.back().set_dictionary(load_column_dictionary(filename));
+                }
+
+                continue;
+            }
+
             std::ifstream colData(filename.c_str(), std::ios::in | std::ios::binary);
 
             colData.seekg(0, std::ios::end);
@@ -1442,11 +1475,14 @@ public:
                 colData.seekg(0, std::ios::beg);
                 colData.read((char *)content, num_entries * sizeof(int));
                 columns.emplace_back(content, num_entries, cpu_queue, device_queues);
+                columns.back().set_dictionary(load_column_dictionary(filename));
             }
 
             colData.close();
         }
-        sycl::free(content, cpu_queue);
+
+        if (content != nullptr)
+            sycl::free(content, cpu_queue);
     }
 
     uint64_t get_nrows() const { return nrows; }
@@ -1461,18 +1497,23 @@ public:
         return total_size;
     }
 
-    void move_all_to_device(int device_index)
+    void move_all_to_device(int device_index, transfer_engine &transfers)
     {
         for (auto &col : columns)
-            col.move_all_to_device(device_index);
+            col.move_all_to_device(device_index, transfers);
     }
 
-    void move_column_to_device(int col_index, int device_index, const std::vector<bool> &segments = {})
+    void move_column_to_device(int col_index, int device_index, transfer_engine &transfers, const std::vector<bool> &segments = {})
     {
         if (segments.empty())
-            columns[col_index].move_all_to_device(device_index);
+            columns[col_index].move_all_to_device(device_index, transfers);
         else
-            columns[col_index].move_to_device(device_index, segments);
+            columns[col_index].move_to_device(device_index, transfers, segments);
+    }
+
+    void set_column_read_plain(int col_index)
+    {
+        columns[col_index].set_read_plain();
     }
 
     uint64_t num_segments() const
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <sycl/sycl.hpp>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "../operations/preprocessing.hpp"
+#include "../common.hpp"
+
+#include "models.hpp"
+#include "stream.hpp"
+
+// Placement of the loaded columns on the devices, planned at startup from the
+// memory of the devices, the size of the columns once moved (get_moved_data_size)
+// and the columns read by a workload. Columns the workload reads with kernels that
+// cannot decode packed segments are moved as plain ints (apply_plain_reads), so that
+// no decoded copy is made on the devices outside of the budgets.
+//
+// Columns used together stay on one device: the DDOR operators only run on a
+// device when all their input segments are there. The build side table of a join
+// (its filters, key and payloads) goes with the probe key column, and the columns
+// of a table read by one filter go together; the other columns are placed on their
+// own, so that the fact table columns spread over the devices. Groups are placed by
+// decreasing accesses per byte, each on the device with the most free memory that
+// holds it, what fits nowhere stays on the host: without devices nothing is moved.
+
+typedef std::tuple<int, int> placed_column; // table index, column number
+
+struct placement_workload
+{
+    std::map<placed_column, uint64_t> accesses;          // number of queries reading the column
+    std::vector<std::vector<placed_column>> co_accessed; // columns to keep on one device
+    std::set<placed_column> plain_reads;                  // columns read by kernels that cannot decode packed segments
+};
+
+int placement_table_index(const Table tables[], int ntables, const std::string &name)
+{
+    for (int t = 0; t < ntables; t++)
+        if (tables[t].get_name() == name)
+            return t;
+    return -1;
+}
+
+// adds the columns a query reads plain, without counting its accesses
+void add_plain_reads(placement_workload &workload, const ExecutionInfo &info, const Table tables[], int ntables)
+{
+    for (const auto &[table_name, column] : info.plain_columns)
+    {
+        int table = placement_table_index(tables, ntables, table_name);
+        if (table >= 0)
+            workload.plain_reads.insert(placed_column(table, column));
+    }
+}
+
+// adds the columns read by a query, from the execution info of its plan
+void add_plan_to_workload(placement_workload &workload, const ExecutionInfo &info, const Table tables[], int ntables)
+{
+    auto placed = [&](const std::tuple<std::string, int> &column)
+    {
+        return placed_column(placement_table_index(tables, ntables, std::get<0>(column)), std::get<1>(column));
+    };
+
+    add_plain_reads(workload, info, tables, ntables);
+
+    for (const auto &[table_name, columns] : info.loaded_columns)
+    {
+        int table = placement_table_index(tables, ntables, table_name);
+        if (table < 0)
+            continue;
+        for (int column : columns)
+            workload.accesses[placed_column(table, column)]++;
+    }
+
+    for (const auto &[left_key, right_key] : info.join_keys)
+    {
+        std::vector<placed_column> group = { placed(left_key) };
+        auto build_columns = info.loaded_columns.find(std::get<0>(right_key));
+        if (build_columns != info.loaded_columns.end())
+            for (int column : build_columns->second)
+                group.push_back(placed(std::make_tuple(std::get<0>(right_key), column)));
+        workload.co_accessed.push_back(group);
+    }
+
+    for (const auto &columns : info.filter_columns)
+    {
+        // a filter spanning several tables runs after their joins, only its columns of one table go together
+        std::map<int, std::vector<placed_column>> per_table;
+        for (const auto &column : columns)
+            per_table[std::get<0>(placed(column))].push_back(placed(column));
+        for (const auto &[table, group] : per_table)
+            if (group.size() > 1)
+                workload.co_accessed.push_back(group);
+    }
+}
+
+// SQL text of the .sql files of directory, in name order, none if it is empty or missing
+std::vector<std::string> read_workload_queries(const std::string &directory)
+{
+    std::vector<std::string> queries;
+    if (directory.empty() || !std::filesystem::is_directory(directory))
+        return queries;
+
+    std::vector<std::filesystem::path> files;
+    for (const auto &entry : std::filesystem::directory_iterator(directory))
+        if (entry.is_regular_file() && entry.path().extension() == ".sql")
+            files.push_back(entry.path());
+    std::sort(files.begin(), files.end());
+
+    for (const auto &path : files)
+    {
+        std::ifstream file(path);
+        if (!file.is_open())
+        {
+            std::cerr << "Placement: could not open workload query " << path << std::endl;
+            continue;
+        }
+        queries.emplace_back(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    return queries;
+}
+
+// device memory left for the columns: the device allocators take half of it, the stream ring its slots
+uint64_t placement_device_budget(const sycl::queue &queue)
+{
+    uint64_t mem_size = queue.get_device().get_info<sycl::info::device::global_mem_size>();
+    uint64_t reserved = (mem_size >> 1) + mem_size / PLACEMENT_DEVICE_HEADROOM;
+    #if USE_SEGMENT_STREAMING
+    reserved += segment_streams::ring_size();
+    #endif
+    return mem_size > reserved ? mem_size - reserved : 0;
+}
+
+// device index of every column to move, the columns not in the result stay on the host
+std::map<placed_column, int> plan_placement(
+    const Table tables[],
+    int ntables,
+    const placement_workload &workload,
+    const std::vector<uint64_t> &device_budgets)
+{
+    // union-find over the accessed columns, merging the co-accessed ones
+    std::map<placed_column, placed_column> parent;
+    auto find = [&](placed_column column)
+    {
+        while (parent[column] != column)
+            column = parent[column] = parent[parent[column]];
+        return column;
+    };
+
+    auto is_loaded = [&](const placed_column &column)
+    {
+        auto [table, number] = column;
+        return table >= 0 && table < ntables && number >= 0 && number < tables[table].get_columns().size()
+            && !tables[table].get_columns()[number].get_segments().empty();
+    };
+
+    for (const auto &[column, count] : workload.accesses)
+        if (is_loaded(column))
+            parent[column] = column;
+
+    for (const auto &group : workload.co_accessed)
+    {
+        std::vector<placed_column> members;
+        for (const placed_column &column : group)
+            if (parent.count(column))
+                members.push_back(column);
+        for (int m = 1; m < members.size(); m++)
+            parent[find(members[m])] = find(members[0]);
+    }
+
+    struct placement_group
+    {
+        std::vector<placed_column> columns;
+        uint64_t size = 0, accesses = 0;
+    };
+    std::map<placed_column, placement_group> groups;
+    for (const auto &[column, count] : workload.accesses)
+    {
+        if (!parent.count(column))
+            continue;
+        placement_group &group = groups[find(column)];
+        group.columns.push_back(column);
+        group.size += tables[std::get<0>(column)].get_columns()[std::get<1>(column)].get_moved_data_size();
+        group.accesses += count;
+    }
+
+    std::vector<const placement_group *> order;
+    for (const auto &[root, group] : groups)
+        order.push_back(&group);
+    std::stable_sort(order.begin(), order.end(),
+        [](const placement_group *a, const placement_group *b)
+        {
+            // accesses per byte, compared without dividing
+            return (unsigned __int128)a->accesses * std::max<uint64_t>(b->size, 1)
+                > (unsigned __int128)b->accesses * std::max<uint64_t>(a->size, 1);
+        }
+    );
+
+    std::vector<uint64_t> free_memory(device_budgets);
+    std::map<placed_column, int> placement;
+    for (const placement_group *group : order)
+    {
+        int device = -1;
+        for (int d = 0; d < free_memory.size(); d++)
+            if (free_memory[d] >= group->size && (device < 0 || free_memory[d] > free_memory[device]))
+                device = d;
+        if (device < 0)
+            continue;
+
+        free_memory[device] -= group->size;
+        for (const placed_column &column : group->columns)
+            placement[column] = device;
+    }
+
+    return placement;
+}
+
+// before plan_placement: the sizes it plans with are those of the moves
+void apply_plain_reads(Table tables[], const placement_workload &workload)
+{
+    for (const auto &[table, number] : workload.plain_reads)
+        if (number >= 0 && number < tables[table].get_columns().size())
+            tables[table].set_column_read_plain(number);
+}
+
+// the moves run on the copy queues, wait for transfers before running queries
+void apply_placement(Table tables[], const std::map<placed_column, int> &placement, transfer_engine &transfers)
+{
+    for (const auto &[column, device] : placement)
+    {
+        auto [table, number] = column;
+        #if not PERFORMANCE_MEASUREMENT_ACTIVE
+        std::cout << "Placement: " << tables[table].get_name() << " column " << number << " on GPU" << device << std::endl;
+        #endif
+        tables[table].move_column_to_device(number, device, transfers);
+    }
+}
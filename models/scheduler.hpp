@@ -0,0 +1,177 @@
+#pragma once
+
+#include <sycl/sycl.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "../common.hpp"
+
+// Choice of the location running each segment of the DDOR operators, -1 being the host
+// and d device d.
+//
+// Segments are scheduled as morsels: an operator offers the locations holding the inputs
+// of a segment, and the devices its loaded inputs can be moved to on demand, and the
+// scheduler picks the one expected to finish first, given the work already queued there
+// in the current batch, its measured throughput and the transfer of the missing inputs.
+// The home location of the segment is offered first and keeps ties, so a balanced
+// placement is left as is and only the segments stalling a slow or overloaded location
+// move. The moved inputs stay on the device, within the memory the placement left free;
+// past it they are streamed (see models/stream.hpp), their copies overlapping the kernels.
+// Throughputs are measured by finish_batch when the kernels of a batch complete.
+
+struct segment_candidate
+{
+    int location;
+    uint64_t bytes_to_move; // inputs missing on the location, 0 where they all are
+};
+
+struct segment_assignment
+{
+    int location;
+    bool streamed; // the missing inputs are streamed instead of moved
+};
+
+class segment_scheduler
+{
+private:
+    std::vector<double> rows_per_ms;    // measured throughput of every location (index location + 1)
+    std::vector<double> queued_ms;      // estimated time of the work queued in the current batch
+    std::vector<uint64_t> queued_rows;  // rows queued in the current batch
+    std::vector<uint64_t> move_budgets; // device memory still free for moved inputs
+    std::mutex mutex;                   // throughputs are updated from host tasks
+
+    double estimated_ms(int location, uint64_t rows, uint64_t bytes_to_move, bool streamed) const
+    {
+        double kernel_ms = rows / rows_per_ms[location + 1],
+            transfer_ms = (double)bytes_to_move / SCHEDULER_TRANSFER_BYTES_PER_MS;
+        return streamed ? std::max(kernel_ms, transfer_ms) : kernel_ms + transfer_ms;
+    }
+public:
+    // nothing is moved on demand until set_move_budgets
+    segment_scheduler(int num_devices)
+        : rows_per_ms(num_devices + 1, SCHEDULER_DEVICE_ROWS_PER_MS),
+        queued_ms(num_devices + 1, 0),
+        queued_rows(num_devices + 1, 0),
+        move_budgets(num_devices, 0)
+    {
+        rows_per_ms[0] = SCHEDULER_HOST_ROWS_PER_MS;
+    }
+
+    // device memory left to the inputs moved on demand, one per device
+    void set_move_budgets(const std::vector<uint64_t> &budgets)
+    {
+        if (budgets.size() != move_budgets.size())
+        {
+            std::cerr << "Segment scheduler: " << budgets.size() << " move budgets for " << move_budgets.size() << " devices" << std::endl;
+            throw std::invalid_argument("Segment scheduler: wrong number of move budgets");
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        move_budgets = budgets;
+    }
+
+    // candidates: the home location first
+    segment_assignment assign(uint64_t rows, const std::vector<segment_candidate> &candidates)
+    {
+        if (candidates.empty())
+        {
+            std::cerr << "Segment scheduler: no location can run the segment" << std::endl;
+            throw std::runtime_error("Segment scheduler: no location can run the segment");
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        const segment_candidate *best = &candidates[0];
+        bool best_streamed = false;
+        #if USE_SEGMENT_SCHEDULER
+        double best_finish = std::numeric_limits<double>::infinity();
+        for (const segment_candidate &candidate : candidates)
+        {
+            bool streamed = false;
+            if (candidate.bytes_to_move > 0 &&
+                (candidate.location < 0 || candidate.bytes_to_move > move_budgets[candidate.location]))
+            {
+                #if USE_SEGMENT_STREAMING
+                if (candidate.location < 0)
+                    continue;
+                streamed = true;
+                #else
+                continue;
+                #endif
+            }
+
+            double finish = queued_ms[candidate.location + 1]
+                + estimated_ms(candidate.location, rows, candidate.bytes_to_move, streamed);
+            if (finish < best_finish)
+            {
+                best = &candidate;
+                best_streamed = streamed;
+                best_finish = finish;
+            }
+        }
+        #endif
+
+        if (best->bytes_to_move > 0 && !best_streamed)
+            move_budgets[best->location] -= best->bytes_to_move;
+        queued_ms[best->location + 1] += estimated_ms(best->location, rows, best->bytes_to_move, best_streamed);
+        queued_rows[best->location + 1] += rows;
+        return { best->location, best_streamed };
+    }
+
+    // Ends the batch started at start: the completion of the kernels of every location that ran
+    // scheduled rows, after its events, updates its throughput
+    void finish_batch(
+        std::chrono::steady_clock::time_point start,
+        sycl::queue &cpu_queue,
+        std::vector<sycl::queue> &device_queues,
+        const std::vector<sycl::event> &events_cpu,
+        const std::vector<std::vector<sycl::event>> &events_devices)
+    {
+        std::vector<std::pair<int, uint64_t>> batch;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int location = -1; location < (int)device_queues.size(); location++)
+            {
+                if (queued_rows[location + 1] > 0)
+                    batch.push_back({ location, queued_rows[location + 1] });
+                queued_rows[location + 1] = 0;
+                queued_ms[location + 1] = 0;
+            }
+        }
+
+        for (auto [location, rows] : batch)
+        {
+            sycl::queue &queue = location < 0 ? cpu_queue : device_queues[location];
+            const std::vector<sycl::event> &events = location < 0 ? events_cpu : events_devices[location];
+            queue.submit(
+                [&](sycl::handler &cgh)
+                {
+                    cgh.depends_on(events);
+                    cgh.host_task(
+                        [this, start, location, rows]()
+                        {
+                            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                            observe(location, rows, elapsed.count());
+                        }
+                    );
+                }
+            );
+        }
+    }
+
+    // smoothed, a single slow batch does not move every later segment
+    void observe(int location, uint64_t rows, double ms)
+    {
+        if (ms <= 0)
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        double measured = rows / ms;
+        rows_per_ms[location + 1] = 0.5 * rows_per_ms[location + 1] + 0.5 * measured;
+    }
+};
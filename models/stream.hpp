@@ -0,0 +1,88 @@
+#pragma once
+
+#include <sycl/sycl.hpp>
+
+#include <vector>
+
+#include "../common.hpp"
+#include "../kernels/selection.hpp"
+#include "../kernels/join.hpp"
+
+#include "models.hpp"
+#include "execution.hpp"
+#include "transfer.hpp"
+
+// Out-of-core execution of the segments that do not fit on a device.
+//
+// Instead of being moved, a loaded segment the scheduler runs on a device without room for it
+// is streamed: the kernel bundle copies its host data (packed words when it would be moved
+// packed) into a slot of a bounded ring of device buffers right before its kernels, on the
+// copy queue of the device (see transfer_engine), and the slot is reused once they are done.
+// The copy of a segment only waits for the previous user of its slot, so it overlaps the
+// kernels of the segments before it. Nothing stays on the device: the flags and payloads
+// written there are merged on the host like for any segment run on a device (see
+// TransientTable::compress_and_sync).
+
+// a single bundle takes a slot per streamed input
+static_assert(STREAM_RING_SLOTS >= MAX_PREDICATE_COLUMNS && STREAM_RING_SLOTS >= MAX_STAR_JOIN_TABLES,
+    "STREAM_RING_SLOTS is smaller than the inputs of a kernel");
+
+class segment_streams
+{
+private:
+    std::vector<sycl::queue> &device_queues;
+    transfer_engine &transfers;
+    std::vector<std::vector<stream_slot>> slots; // ring of every device, buffers allocated on first use
+    std::vector<uint64_t> next_slot;
+public:
+    segment_streams(std::vector<sycl::queue> &device_queues, transfer_engine &transfers)
+        : device_queues(device_queues),
+        transfers(transfers),
+        slots(device_queues.size(), std::vector<stream_slot>(STREAM_RING_SLOTS)),
+        next_slot(device_queues.size(), 0)
+    {}
+
+    segment_streams(const segment_streams &) = delete;
+    segment_streams &operator=(const segment_streams &) = delete;
+
+    ~segment_streams()
+    {
+        for (int d = 0; d < slots.size(); d++)
+            for (stream_slot &slot : slots[d])
+                if (slot.buffer != nullptr)
+                    sycl::free(slot.buffer, device_queues[d]);
+    }
+
+    // device memory taken by the ring of a device once every slot is used
+    static constexpr uint64_t ring_size()
+    {
+        return STREAM_RING_SLOTS * SEGMENT_SIZE * sizeof(int);
+    }
+
+    // Streams segment into the next slot of the ring of the device of bundle, the returned column
+    // reads the copy and is only valid in the kernels of bundle.
+    packed_column stream(Segment &segment, KernelBundle &bundle)
+    {
+        int device_index = bundle.get_device_index();
+        if (!bundle.is_on_device() || device_index < 0 || device_index >= device_queues.size())
+        {
+            std::cerr << "Segment stream: invalid device index " << device_index << std::endl;
+            throw std::runtime_error("Segment stream: invalid device index");
+        }
+
+        packed_column source = segment.get_stream_source(device_index);
+
+        stream_slot &slot = slots[device_index][next_slot[device_index]++ % STREAM_RING_SLOTS];
+        if (slot.buffer == nullptr)
+            slot.buffer = sycl::malloc_device<int>(SEGMENT_SIZE, device_queues[device_index]);
+
+        if (source.values != nullptr)
+        {
+            bundle.add_transfer({ &slot, source.values, segment.get_nrows() * sizeof(int), segment.is_host_pinned(device_index), &transfers });
+            return packed_column(static_cast<const int *>(slot.buffer));
+        }
+
+        bundle.add_transfer({ &slot, source.words, packed_word_count(segment.get_nrows(), source.bits) * sizeof(uint32_t), true, &transfers });
+        return packed_column(static_cast<const uint32_t *>(slot.buffer), source.base, source.bits);
+    }
+};
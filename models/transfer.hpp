@@ -0,0 +1,121 @@
+#pragma once
+
+#include <sycl/sycl.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include "../common.hpp"
+
+// Host-device copies of the DDOR engine, issued on an in-order copy queue per device so
+// that they run beside the kernels of the compute queues instead of between them.
+//
+// Pinned host data (SYCL host allocations, mapped ranges registered for copies) is copied
+// directly. Pageable data goes through a pool of pinned staging buffers, STAGING_BUFFER_SIZE
+// bytes at a time: the host fills a buffer while the device reads the previous one, and a
+// buffer is only refilled once the copy reading it is done. The copies return events, the
+// kernels reading the data depend on them instead of the callers waiting.
+
+struct staging_buffer
+{
+    char *data = nullptr;
+    std::vector<sycl::event> release; // device copy reading the buffer
+};
+
+class transfer_engine
+{
+private:
+    sycl::queue &cpu_queue;
+    std::vector<sycl::queue> copy_queues;
+    std::vector<staging_buffer> staging; // allocated on first use
+    uint64_t next_staging = 0;
+
+    void check_device(int device_index) const
+    {
+        if (device_index < 0 || device_index >= copy_queues.size())
+        {
+            std::cerr << "Transfer: invalid device index " << device_index << std::endl;
+            throw std::runtime_error("Transfer: invalid device index");
+        }
+    }
+
+    // the copies of a transfer are in order on the copy queue, the last one completes it
+    sycl::event staged_to_device(char *dst, const char *src, uint64_t bytes, int device_index, const std::vector<sycl::event> &dependencies)
+    {
+        sycl::event copied;
+        for (uint64_t offset = 0; offset < bytes; offset += STAGING_BUFFER_SIZE)
+        {
+            uint64_t chunk = std::min<uint64_t>(STAGING_BUFFER_SIZE, bytes - offset);
+            staging_buffer &buffer = staging[next_staging++ % staging.size()];
+            if (buffer.data == nullptr)
+                buffer.data = sycl::malloc_host<char>(STAGING_BUFFER_SIZE, cpu_queue);
+
+            std::vector<sycl::event> copy_dependencies(dependencies);
+            copy_dependencies.push_back(cpu_queue.memcpy(buffer.data, src + offset, chunk, buffer.release));
+
+            copied = copy_queues[device_index].memcpy(dst + offset, buffer.data, chunk, copy_dependencies);
+            buffer.release = { copied };
+        }
+        return copied;
+    }
+public:
+    transfer_engine(sycl::queue &cpu_queue, std::vector<sycl::queue> &device_queues)
+        : cpu_queue(cpu_queue), staging(STAGING_BUFFERS)
+    {
+        copy_queues.reserve(device_queues.size());
+        for (sycl::queue &queue : device_queues)
+            copy_queues.emplace_back(queue.get_context(), queue.get_device(), sycl::property::queue::in_order {});
+    }
+
+    transfer_engine(const transfer_engine &) = delete;
+    transfer_engine &operator=(const transfer_engine &) = delete;
+
+    ~transfer_engine()
+    {
+        for (sycl::queue &queue : copy_queues)
+            queue.wait();
+        cpu_queue.wait();
+        for (staging_buffer &buffer : staging)
+            if (buffer.data != nullptr)
+                sycl::free(buffer.data, cpu_queue);
+    }
+
+    // src is pinned when the device can read it directly, otherwise it is staged
+    sycl::event to_device(
+        void *dst,
+        const void *src,
+        uint64_t bytes,
+        int device_index,
+        bool pinned,
+        const std::vector<sycl::event> &dependencies = {})
+    {
+        check_device(device_index);
+        if (bytes == 0)
+            return sycl::event();
+        if (pinned)
+            return copy_queues[device_index].memcpy(dst, src, bytes, dependencies);
+        return staged_to_device(static_cast<char *>(dst), static_cast<const char *>(src), bytes, device_index, dependencies);
+    }
+
+    // dst is pinned host memory, the results read back always are
+    sycl::event to_host(
+        void *dst,
+        const void *src,
+        uint64_t bytes,
+        int device_index,
+        const std::vector<sycl::event> &dependencies = {})
+    {
+        check_device(device_index);
+        if (bytes == 0)
+            return sycl::event();
+        return copy_queues[device_index].memcpy(dst, src, bytes, dependencies);
+    }
+
+    void wait()
+    {
+        for (sycl::queue &queue : copy_queues)
+            queue.wait_and_throw();
+    }
+};
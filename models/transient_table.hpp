@@ -10,16 +10,35 @@
 
 #include "models.hpp"
 #include "execution.hpp"
+#include "scheduler.hpp"
+#include "stream.hpp"
+#include "transfer.hpp"
+#include "graph.hpp"
 #include "../operations/memory_manager.hpp"
 #include "../gen-cpp/calciteserver_types.h"
 
 #include "../kernels/common.hpp"
+#include "../kernels/sort.hpp"
+#include "../operations/predicate.hpp"
+#include "../operations/expression.hpp"
+
+// Probe side of a join, queued by apply_join until the next operation (see flush_join_probes)
+struct PendingJoinProbe
+{
+    Column *probe_column;
+    JoinHashTable ht_host;
+    std::vector<JoinHashTable> ht_devices;
+    std::vector<Column *> payload_columns; // materialized payload outputs, empty for semi joins
+    std::vector<int> segment_locations;    // device probing every segment, -1 for the host
+    std::vector<bool> segment_streamed;    // probe key segment streamed to its device
+    std::vector<sycl::event> segment_moves; // copy of the probe key segment moved to its device
+};
 
 class TransientTable
 {
 private:
-    bool *flags_host;
-    std::vector<bool *> flags_devices;
+    flag_word *flags_host;
+    std::vector<flag_word *> flags_devices;
     std::vector<bool> flags_modified_host;
     std::vector<std::vector<bool>> flags_modified_devices;
     sycl::queue &cpu_queue;
@@ -31,11 +50,14 @@ private:
     std::vector<Column *> current_columns;
     std::vector<Column> materialized_columns;
     uint64_t nrows;
-    Column *group_by_column;
-    uint64_t group_by_column_index;
     std::vector<std::vector<KernelBundle>> pending_kernels;
+    std::vector<PendingJoinProbe> pending_probes;
     std::vector<sycl::event> pending_kernels_dependencies_cpu;
     std::vector<std::vector<sycl::event>> pending_kernels_dependencies_devices;
+    segment_scheduler &scheduler;
+    segment_streams &streams;
+    transfer_engine &transfers;
+    kernel_graphs &graphs;
 public:
     TransientTable(Table *base_table,
         sycl::queue &cpu_queue,
@@ -45,7 +67,11 @@ public:
         std::vector<sycl::ext::codeplay::experimental::fusion_wrapper> &fw_devices,
         #endif
         memory_manager &cpu_allocator,
-        std::vector<memory_manager> &device_allocators
+        std::vector<memory_manager> &device_allocators,
+        segment_scheduler &scheduler,
+        segment_streams &streams,
+        transfer_engine &transfers,
+        kernel_graphs &graphs
     )
         :
         flags_modified_devices(device_queues.size()),
@@ -56,23 +82,25 @@ public:
         fw_devices(fw_devices),
         #endif
         nrows(base_table->get_nrows()),
-        group_by_column(nullptr),
-        group_by_column_index(0),
-        pending_kernels_dependencies_devices(device_queues.size())
+        pending_kernels_dependencies_devices(device_queues.size()),
+        scheduler(scheduler),
+        streams(streams),
+        transfers(transfers),
+        graphs(graphs)
     {
         // std::cout << "Creating transient table with " << nrows << " rows." << std::endl;
 
-        flags_host = cpu_allocator.alloc<bool>(nrows, true);
-        auto e1 = cpu_queue.fill<bool>(flags_host, true, nrows);
+        flags_host = cpu_allocator.alloc<flag_word>(flag_words(nrows), true);
+        auto e1 = fill_flags(flags_host, true, nrows, cpu_queue);
 
         std::vector<sycl::event> gpu_events;
         gpu_events.reserve(device_queues.size());
         flags_devices.reserve(device_queues.size());
         for (int d = 0; d < device_queues.size(); d++)
         {
-            flags_devices.push_back(device_allocators[d].alloc<bool>(nrows, true));
+            flags_devices.push_back(device_allocators[d].alloc<flag_word>(flag_words(nrows), true));
             gpu_events.push_back(
-                device_queues[d].fill<bool>(flags_devices[d], true, nrows)
+                fill_flags(flags_devices[d], true, nrows, device_queues[d])
             );
         }
 
@@ -97,25 +125,41 @@ public:
 
     std::vector<Column *> get_columns() const { return current_columns; }
     uint64_t get_nrows() const { return nrows; }
-    const Column *get_group_by_column() const { return group_by_column; }
-
-    void set_group_by_column(uint64_t col)
-    {
-        group_by_column = current_columns[col];
-        group_by_column_index = col;
-    }
 
     friend std::ostream &operator<<(std::ostream &out, const TransientTable &table)
     {
+        // the results still on a device are read back together, instead of a blocking copy per segment from operator[]
+        std::vector<sycl::event> copies;
+        for (Column *col : table.current_columns)
+        {
+            if (col == nullptr)
+                continue;
+            std::vector<sycl::event> column_copies = col->copy_on_host(table.transfers);
+            copies.insert(copies.end(), column_copies.begin(), column_copies.end());
+            if (col->get_input_rows() != nullptr)
+            {
+                column_copies = col->get_input_rows()->copy_on_host(table.transfers);
+                copies.insert(copies.end(), column_copies.begin(), column_copies.end());
+            }
+        }
+        sycl::event::wait(copies);
+
         for (uint64_t i = 0; i < table.nrows; i++)
         {
-            if (table.flags_host[i])
+            if (get_flag(table.flags_host, i))
             {
                 for (uint64_t j = 0; j < table.current_columns.size(); j++)
                 {
                     const Column *col = table.current_columns[j];
                     if (col != nullptr && col->get_segments().size() > 0)
-                        out << (col->get_is_aggregate_result() ? col->get_aggregate_value(i) : col->operator[](i)) << ((j < table.current_columns.size() - 1) ? " " : "");
+                    {
+                        int64_t value = col->get_is_aggregate_result() ? static_cast<int64_t>(col->get_aggregate_value(i)) : col->operator[](i);
+                        if (col->is_null(i))
+                            out << "NULL";
+                        else
+                            out << (col->get_dictionary() != nullptr ? col->get_dictionary()->decode(value) : format_scaled(value, col->get_scale()));
+                        out << ((j < table.current_columns.size() - 1) ? " " : "");
+                    }
                 }
                 out << "\n";
             }
@@ -124,12 +168,103 @@ public:
         return out;
     }
 
+    // The probes of consecutive joins run as one StarJoinKernel per segment: the flags are read and
+    // written once and a row stops at its first missing key, instead of one probe pass per join.
+    // Called before any other operation reads the flags or the payload columns.
+    void flush_join_probes()
+    {
+        if (pending_probes.empty())
+            return;
+
+        uint64_t segment_num = flags_modified_host.size();
+        std::vector<std::vector<KernelBundle>> phases;
+
+        for (uint64_t i = 0; i < segment_num; i++)
+        {
+            // one kernel per location probing this segment, normally all the probes share it
+            std::vector<int> locations;
+            for (const PendingJoinProbe &probe : pending_probes)
+                if (std::find(locations.begin(), locations.end(), probe.segment_locations[i]) == locations.end())
+                    locations.push_back(probe.segment_locations[i]);
+
+            for (int l = 0; l < locations.size(); l++)
+            {
+                int device_index = locations[l];
+                bool on_device = device_index >= 0;
+                KernelBundle bundle(on_device, device_index);
+                StarJoinKernel *kernel = new StarJoinKernel(
+                    (on_device ? flags_devices[device_index] : flags_host) + i * SEGMENT_FLAG_WORDS,
+                    segment_rows(i)
+                );
+
+                for (const PendingJoinProbe &probe : pending_probes)
+                {
+                    if (probe.segment_locations[i] != device_index)
+                        continue;
+                    bundle.add_dependency(probe.segment_moves[i]);
+
+                    int *payloads[MAX_JOIN_PAYLOADS];
+                    for (int p = 0; p < probe.payload_columns.size(); p++)
+                        payloads[p] = probe.payload_columns[p]->get_segments()[i].get_data(on_device, device_index);
+
+                    Segment &probe_segment = probe.probe_column->get_segments()[i];
+                    kernel->add_table(
+                        probe.segment_streamed[i] ? streams.stream(probe_segment, bundle) : probe_segment.get_packed_data(on_device, device_index),
+                        on_device ? probe.ht_devices[device_index] : probe.ht_host,
+                        payloads
+                    );
+                }
+
+                if (l == phases.size())
+                {
+                    phases.emplace_back();
+                    phases.back().reserve(segment_num);
+                    for (uint64_t j = 0; j < i; j++)
+                        phases.back().push_back(empty_bundle(j));
+                }
+
+                bundle.add_kernel(KernelData(KernelType::StarJoinKernel, kernel));
+                phases[l].push_back(bundle);
+
+                if (on_device)
+                    flags_modified_devices[device_index][i] = true;
+                else
+                    flags_modified_host[i] = true;
+            }
+
+            for (int l = locations.size(); l < phases.size(); l++)
+                phases[l].push_back(empty_bundle(i));
+        }
+
+        #if not PERFORMANCE_MEASUREMENT_ACTIVE
+        std::cout << "Star join of " << pending_probes.size() << " hash tables in "
+            << phases.size() << " pass" << (phases.size() > 1 ? "es" : "") << std::endl;
+        #endif
+
+        pending_kernels.insert(pending_kernels.end(), phases.begin(), phases.end());
+        pending_probes.clear();
+    }
+
+    uint64_t segment_rows(uint64_t segment_number) const
+    {
+        return std::min<uint64_t>(SEGMENT_SIZE, nrows - segment_number * SEGMENT_SIZE);
+    }
+
+    KernelBundle empty_bundle(uint64_t segment_number) const
+    {
+        KernelBundle bundle(false, -1);
+        bundle.add_kernel(KernelData(KernelType::EmptyKernel, new EmptyKernel(segment_rows(segment_number))));
+        return bundle;
+    }
+
     std::pair<std::vector<sycl::event>, std::vector<std::vector<sycl::event>>> execute_pending_kernels(
         #if USE_FUSION
         bool fuse = true
         #endif
     )
     {
+        flush_join_probes();
+
         // std::cout << "start execute" << std::endl;
         uint64_t segment_num = nrows / SEGMENT_SIZE + (nrows % SEGMENT_SIZE > 0);
         std::vector<sycl::event> events_cpu;
@@ -165,7 +300,14 @@ public:
             events_devices[d].reserve(segment_num);
         events_cpu.reserve(segment_num);
 
-        for (uint64_t segment_index = 0; segment_index < segment_num; segment_index++)
+        auto batch_start = std::chrono::steady_clock::now();
+
+        bool submitted_graphs = false;
+        #if USE_COMMAND_GRAPHS
+        submitted_graphs = submit_pending_graphs(graphs.next_batch(), events_cpu, events_devices, executed_cpu, executed_devices);
+        #endif
+
+        for (uint64_t segment_index = 0; segment_index < segment_num && !submitted_graphs; segment_index++)
         {
             std::vector<sycl::event> deps_cpu, tmp;
             std::vector<std::vector<sycl::event>> deps_devices(device_queues.size());
@@ -314,11 +456,98 @@ public:
         pending_kernels.clear();
         pending_kernels_dependencies_cpu.clear();
 
+        scheduler.finish_batch(batch_start, cpu_queue, device_queues, events_cpu, events_devices);
+
         // std::cout << "end execute" << std::endl;
 
         return { events_cpu, events_devices };
     }
 
+    #if USE_COMMAND_GRAPHS
+    // Submits the pending kernels of every location as a command graph (see kernel_graphs),
+    // false when the batch cannot be recorded: copies of streamed segments run between its
+    // kernels, or a location running kernels does not support graphs.
+    // The kernels of a segment are chained like in execute_pending_kernels, the graph of a
+    // location runs after all the pending dependencies of the location instead of per segment.
+    bool submit_pending_graphs(
+        const std::string &batch,
+        std::vector<sycl::event> &events_cpu,
+        std::vector<std::vector<sycl::event>> &events_devices,
+        bool &executed_cpu,
+        std::vector<bool> &executed_devices)
+    {
+        uint64_t segment_num = flags_modified_host.size();
+        std::vector<std::string> signatures(device_queues.size() + 1), arguments(device_queues.size() + 1);
+        std::vector<std::vector<sycl::event>> dependencies(device_queues.size() + 1);
+
+        for (uint64_t i = 0; i < segment_num; i++)
+        {
+            for (const auto &phases : pending_kernels)
+            {
+                const KernelBundle &bundle = phases[i];
+                int location = bundle.is_on_device() ? bundle.get_device_index() : -1;
+                if (!bundle.has_kernels())
+                    continue;
+                if (bundle.has_transfers() || !graphs.supports(location))
+                    return false;
+
+                signatures[location + 1] += std::to_string(i) + '|';
+                bundle.describe(signatures[location + 1], arguments[location + 1]);
+                dependencies[location + 1].insert(
+                    dependencies[location + 1].end(),
+                    bundle.get_dependencies().begin(),
+                    bundle.get_dependencies().end()
+                );
+            }
+        }
+
+        for (int location = -1; location < (int)device_queues.size(); location++)
+        {
+            if (signatures[location + 1].empty())
+                continue;
+
+            sycl::queue &queue = location < 0 ? cpu_queue : device_queues[location];
+            const std::vector<sycl::event> &pending = location < 0 ? pending_kernels_dependencies_cpu : pending_kernels_dependencies_devices[location];
+            dependencies[location + 1].insert(dependencies[location + 1].end(), pending.begin(), pending.end());
+
+            sycl::event graph_event = graphs.submit(
+                batch,
+                location,
+                queue,
+                signatures[location + 1],
+                arguments[location + 1],
+                [&]()
+                {
+                    for (uint64_t i = 0; i < segment_num; i++)
+                    {
+                        std::vector<sycl::event> segment_events;
+                        for (const auto &phases : pending_kernels)
+                        {
+                            const KernelBundle &bundle = phases[i];
+                            if (bundle.has_kernels() && (bundle.is_on_device() ? bundle.get_device_index() : -1) == location)
+                                segment_events = bundle.execute_kernels(queue, segment_events);
+                        }
+                    }
+                },
+                dependencies[location + 1]
+            );
+
+            if (location < 0)
+            {
+                events_cpu = { graph_event };
+                executed_cpu = true;
+            }
+            else
+            {
+                events_devices[location] = { graph_event };
+                executed_devices[location] = true;
+            }
+        }
+
+        return true;
+    }
+    #endif
+
     void assert_flags_to_cpu()
     {
         for (auto &flags_modified_gpu : flags_modified_devices)
@@ -349,7 +578,7 @@ public:
     // This function is a sync point due to oneDPL algorithms and needs dependencies to be waited manually before calling it
     std::tuple<int *, uint64_t> build_row_ids(int segment_n, int segment_size, memory_manager &gpu_allocator, int device_index)
     {
-        bool *flags = flags_devices[device_index] + segment_n * SEGMENT_SIZE;
+        const flag_word *flags = flags_devices[device_index] + segment_n * SEGMENT_FLAG_WORDS;
         int *row_ids_gpu = gpu_allocator.alloc<int>(segment_size, true);
 
         auto policy = oneapi::dpl::execution::make_device_policy(device_queues[device_index]);
@@ -363,7 +592,7 @@ public:
             row_ids_gpu,
             [=](int i)
             {
-                return flags[i];
+                return get_flag(flags, i);
             }
         );
 
@@ -387,25 +616,14 @@ public:
 
         device_queues[device_index].wait();
 
+        // the copies back run on the copy queue of the device, the segments are not waited one by one
+        std::vector<sycl::event> sync_events;
         for (int i = 0; i < num_segments; i++)
         {
             int *row_ids_gpu = nullptr, *row_ids_host = nullptr;
             uint64_t segment_size = (i == num_segments - 1) ? (nrows - i * SEGMENT_SIZE) : SEGMENT_SIZE;
             sycl::event e_row_ids_host;
 
-            if (flags_modified_devices[device_index][i])
-            {
-                auto row_id_res = build_row_ids(i, segment_size, device_allocator, device_index);
-                row_ids_gpu = std::get<0>(row_id_res);
-                n_rows_new[i] = std::get<1>(row_id_res);
-                row_ids_host = device_allocator.alloc<int>(n_rows_new[i], false);
-                e_row_ids_host = device_queues[device_index].memcpy(
-                    row_ids_host,
-                    row_ids_gpu,
-                    n_rows_new[i] * sizeof(int)
-                );
-            }
-
             for (const Column *col : columns_to_sync)
             {
                 Segment &seg = const_cast<Segment &>(col->get_segments()[i]);
@@ -417,77 +635,63 @@ public:
                         row_ids_gpu = std::get<0>(row_id_res);
                         n_rows_new[i] = std::get<1>(row_id_res);
                         row_ids_host = device_allocator.alloc<int>(n_rows_new[i], false);
-                        e_row_ids_host = device_queues[device_index].memcpy(
+                        e_row_ids_host = transfers.to_host(
                             row_ids_host,
                             row_ids_gpu,
-                            n_rows_new[i] * sizeof(int)
+                            n_rows_new[i] * sizeof(int),
+                            device_index
                         );
                     }
 
-                    seg.compress_sync(
-                        row_ids_gpu,
-                        row_ids_host,
-                        e_row_ids_host,
-                        n_rows_new[i],
-                        device_allocator,
-                        device_index
-                    ).wait(); // TODO: need to find why sometimes segfault if not wait here
+                    sync_events.push_back(
+                        seg.compress_sync(
+                            row_ids_gpu,
+                            row_ids_host,
+                            e_row_ids_host,
+                            n_rows_new[i],
+                            device_allocator,
+                            device_index,
+                            transfers
+                        )
+                    );
                 }
             }
 
             if (flags_modified_devices[device_index][i])
             {
-                bool *flags = flags_host + i * SEGMENT_SIZE;
-                cpu_queue.submit(
+                // The device only unselects rows, so the host flags are ANDed with the device ones.
+                // With bitmap flags this is a copy of segment_size / 64 words, no row ids needed.
+                uint64_t n_words = flag_words(segment_size);
+                flag_word *device_flags_host = device_allocator.alloc<flag_word>(n_words, false);
+                auto e_flags_host = transfers.to_host(
+                    device_flags_host,
+                    flags_devices[device_index] + i * SEGMENT_FLAG_WORDS,
+                    n_words * sizeof(flag_word),
+                    device_index
+                );
+
+                LogicalKernel kernel(AND, flags_host + i * SEGMENT_FLAG_WORDS, device_flags_host, segment_size);
+                sync_events.push_back(cpu_queue.submit(
                     [&](sycl::handler &cgh)
                     {
-                        cgh.depends_on(e_row_ids_host);
+                        cgh.depends_on(e_flags_host);
                         cgh.parallel_for(
-                            n_rows_new[i] - 1,
-                            [=](sycl::id<1> idx)
-                            {
-                                auto i = idx[0];
-                                int row_id = row_ids_host[i],
-                                    next_row_id = row_ids_host[i + 1];
-
-                                for (int r = row_id + 1; r < next_row_id; r++)
-                                    flags[r] = false;
-                            }
+                            kernel.get_col_len(),
+                            kernel
                         );
                     }
-                );
-
-                e_row_ids_host.wait();
-
-                int first_row_id = row_ids_host[0];
-                if (first_row_id > 0)
-                {
-                    cpu_queue.memset(
-                        flags,
-                        0,
-                        first_row_id * sizeof(bool)
-                    );
-                }
-
-                int last_row_id = row_ids_host[n_rows_new[i] - 1];
-                if (last_row_id < segment_size - 1)
-                {
-                    cpu_queue.memset(
-                        flags + last_row_id + 1,
-                        0,
-                        (segment_size - 1 - last_row_id) * sizeof(bool)
-                    );
-                }
+                ));
 
                 flags_modified_devices[device_index][i] = false;
             }
         }
 
+        sycl::event::wait_and_throw(sync_events);
         device_queues[device_index].wait_and_throw();
         cpu_queue.wait_and_throw();
     }
 
-    std::tuple<bool *, int, int> build_keys_hash_table(int column, memory_manager &cpu_allocator, memory_manager &device_allocator, bool on_device, int device_index)
+    JoinHashTable build_keys_hash_table(int column, memory_manager &cpu_allocator, memory_manager &device_allocator, bool on_device, int device_index)
     {
         // Assumption: flags do not need to be synced before building hash table
 
@@ -498,193 +702,218 @@ public:
             device_index
         );
 
-        std::vector<KernelBundle> ht_kernels = std::get<3>(ht_res);
+        std::vector<KernelBundle> ht_kernels = std::get<1>(ht_res);
         pending_kernels.push_back(ht_kernels);
 
-        return std::make_tuple(
-            std::get<0>(ht_res),
-            std::get<1>(ht_res),
-            std::get<2>(ht_res)
-        );
+        return std::get<0>(ht_res);
     }
 
-    std::tuple<int *, int, int> build_key_vals_hash_table(int column, bool on_device, int device_index, memory_manager &cpu_allocator, memory_manager &device_allocator)
+    JoinHashTable build_key_vals_hash_table(
+        int column,
+        const std::vector<int> &payload_columns,
+        bool on_device,
+        int device_index,
+        memory_manager &cpu_allocator,
+        memory_manager &device_allocator)
     {
         // Assumption: flags do not need to be synced before building hash table
 
+        std::vector<const Column *> payloads;
+        for (int payload_column : payload_columns)
+            payloads.push_back(current_columns[payload_column]);
+
         auto ht_res = current_columns[column]->build_key_vals_hash_table(
-            group_by_column,
+            payloads,
             (on_device ? flags_devices[device_index] : flags_host),
             (on_device ? device_allocator : cpu_allocator),
             on_device,
             device_index
         );
 
-        std::vector<KernelBundle> ht_kernels = std::get<3>(ht_res);
+        std::vector<KernelBundle> ht_kernels = std::get<1>(ht_res);
         pending_kernels.push_back(ht_kernels);
 
-        return std::make_tuple(
-            std::get<0>(ht_res),
-            std::get<1>(ht_res),
-            std::get<2>(ht_res)
+        return std::get<0>(ht_res);
+    }
+
+    // location of a segment of an operator reading columns: the device holding all its inputs, else the host (-1)
+    int home_location(const std::vector<const Column *> &columns, uint64_t segment_number) const
+    {
+        int device_index = columns[0]->get_segments()[segment_number].get_device_index();
+        for (const Column *col : columns)
+            if (device_index >= 0 && !col->get_segments()[segment_number].is_on_device(device_index))
+                return -1;
+        return device_index;
+    }
+
+    // Location of a segment chosen by the scheduler among its home location, the host when the host
+    // data of the inputs is valid, the devices holding all the inputs and the devices the missing
+    // inputs can be moved or streamed to. The copies of the moved inputs are added to moves, for the
+    // bundle of the segment to depend on, the streamed ones are issued by the bundle (see segment_streams).
+    segment_assignment schedule_segment(const std::vector<const Column *> &columns, uint64_t segment_number, std::vector<sycl::event> &moves)
+    {
+        int home = home_location(columns, segment_number);
+        std::vector<segment_candidate> candidates = { { home, 0 } };
+
+        bool host_valid = true;
+        for (const Column *col : columns)
+            host_valid = host_valid && !col->get_segments()[segment_number].needs_copy_on(false, -1);
+        if (home >= 0 && host_valid)
+            candidates.push_back({ -1, 0 });
+
+        for (int d = 0; d < device_queues.size(); d++)
+        {
+            if (d == home)
+                continue;
+
+            bool can_run = true;
+            uint64_t bytes_to_move = 0;
+            for (const Column *col : columns)
+            {
+                const Segment &seg = col->get_segments()[segment_number];
+                if (seg.is_on_device(d))
+                    continue;
+                can_run = can_run && seg.can_move_to_device();
+                bytes_to_move += seg.get_moved_data_size();
+            }
+            if (can_run)
+                candidates.push_back({ d, bytes_to_move });
+        }
+
+        segment_assignment assignment = scheduler.assign(segment_rows(segment_number), candidates);
+        if (assignment.location >= 0 && !assignment.streamed)
+            for (const Column *col : columns)
+            {
+                Segment &seg = const_cast<Segment &>(col->get_segments()[segment_number]);
+                if (!seg.is_on_device(assignment.location))
+                    moves.push_back(seg.move_to_device(assignment.location, transfers));
+            }
+        return assignment;
+    }
+
+    // Filter bundle for a segment where the zone map already decided the predicate.
+    // The flags are filled with the predicate, or left untouched when that changes nothing.
+    KernelBundle constant_filter_bundle(const Segment &segment, size_t segment_number, bool predicate, logical_op logic)
+    {
+        bool on_device = segment.is_on_device();
+        int device_index = segment.get_device_index();
+        KernelBundle bundle(on_device, device_index);
+
+        bundle.add_kernel(
+            segment.constant_filter_operator(
+                predicate,
+                logic,
+                (on_device ? flags_devices[device_index] : flags_host) + segment_number * SEGMENT_FLAG_WORDS
+            )
         );
+
+        if (!constant_filter_is_noop(logic, predicate))
+        {
+            if (on_device)
+                flags_modified_devices[device_index][segment_number] = true;
+            else
+                flags_modified_host[segment_number] = true;
+        }
+
+        return bundle;
     }
 
+    // The whole condition is compiled into one kernel per segment: every input column is read once and
+    // the flags are written once. Segments where the zone maps decide the condition run no kernel.
     void apply_filter(
         const ExprType &expr,
         std::string parent_op,
         memory_manager &cpu_allocator,
         std::vector<memory_manager> &device_allocators)
     {
-        // Recursive parsing of EXPR types. LITERAL and COLUMN are handled in parent EXPR type.
-        if (expr.exprType != ExprOption::EXPR)
-        {
-            std::cerr << "Filter condition: Unsupported parsing ExprType " << expr.exprType << std::endl;
-            return;
-        }
+        flush_join_probes();
 
-        std::vector<KernelBundle> ops;
-
-        if (expr.op == "SEARCH")
-        {
-            const std::vector<Segment> &segments = current_columns[expr.operands[0].input]->get_segments();
-
-            ops.reserve(segments.size());
+        std::vector<int> column_inputs;
+        // an unsupported or too large condition throws, the query fails instead of running unfiltered
+        predicate_program program = compile_predicate(
+            expr, column_inputs,
+            [&](int input) { return current_columns[input]->get_dictionary(); }
+        );
 
-            for (size_t segment_number = 0; segment_number < segments.size(); segment_number++)
-            {
-                const Segment &segment = segments[segment_number];
-                std::vector<bool *> segments_flags_devices;
-                segments_flags_devices.reserve(device_queues.size());
-                std::transform(
-                    flags_devices.begin(),
-                    flags_devices.end(),
-                    std::back_inserter(segments_flags_devices),
-                    [segment_number](bool *flags_device)
-                    {
-                        return flags_device + segment_number * SEGMENT_SIZE;
-                    }
-                );
-                KernelBundle bundle = segment.search_operator(
-                    expr,
-                    parent_op,
-                    cpu_allocator,
-                    device_allocators,
-                    flags_host + segment_number * SEGMENT_SIZE,
-                    segments_flags_devices
-                );
+        // a filter only narrows the current selection
+        logical_op logic = get_logical_op(parent_op);
+        if (logic == NONE)
+            logic = AND;
 
-                if (bundle.is_on_device())
-                {
-                    int device_index = bundle.get_device_index();
-                    flags_modified_devices[device_index][segment_number] = true;
-                }
-                else
-                    flags_modified_host[segment_number] = true;
+        std::vector<const Column *> columns;
+        columns.reserve(column_inputs.size());
+        for (int input : column_inputs)
+            columns.push_back(current_columns[input]);
 
-                ops.push_back(bundle);
-            }
+        const std::vector<Segment> &segments = columns[0]->get_segments();
+        std::vector<KernelBundle> ops;
+        ops.reserve(segments.size());
+        uint64_t skipped_segments = 0;
 
-            pending_kernels.push_back(ops);
-        }
-        else if (is_filter_logical(expr.op))
-        {
-            // Logical operation between other expressions. Pass parent op to the first then use the current op.
-            // TODO: check if passing parent logic is correct in general
-            bool parent_op_used = false;
-            for (const ExprType &operand : expr.operands)
-            {
-                apply_filter(
-                    operand,
-                    parent_op_used ? expr.op : parent_op,
-                    cpu_allocator,
-                    device_allocators
-                );
-                parent_op_used = true;
-            }
-        }
-        else
+        for (size_t segment_number = 0; segment_number < segments.size(); segment_number++)
         {
-            if (expr.operands.size() != 2)
-            {
-                std::cerr << "Filter condition: Unsupported number of operands for EXPR" << std::endl;
-                return;
-            }
+            const Segment &segment = segments[segment_number];
 
-            Column *cols[2];
-            bool literal = false;
-            int literal_value;
-
-            for (int i = 0; i < 2; i++)
-            {
-                switch (expr.operands[i].exprType)
+            zone_map_match match = evaluate_zone_map(
+                program,
+                [&](const predicate_node &node)
                 {
-                case ExprOption::COLUMN:
-                    cols[i] = current_columns[expr.operands[i].input];
-                    break;
-                case ExprOption::LITERAL:
-                    literal = true;
-                    literal_value = expr.operands[i].literal.value;
-                    break;
-                default:
-                    std::cerr << "Filter condition: Unsupported parsing ExprType "
-                        << expr.operands[i].exprType
-                        << " for comparison operand"
-                        << std::endl;
-                    return;
+                    if (node.type != PREDICATE_COMPARE_LITERAL)
+                        return PARTIAL_MATCH;
+                    return columns[node.column1]->get_segments()[segment_number].zone_map_filter(node.comparison, node.value);
                 }
+            );
+            if (match != PARTIAL_MATCH)
+            {
+                ops.push_back(constant_filter_bundle(segment, segment_number, match == FULL_MATCH, logic));
+                skipped_segments++;
+                continue;
             }
 
-            const std::vector<Segment> &segments = cols[0]->get_segments();
-            ops.reserve(segments.size());
-
-            for (size_t segment_number = 0; segment_number < segments.size(); segment_number++)
+            // flags combined with another logic than AND cannot be split between locations
+            std::vector<sycl::event> moves;
+            segment_assignment assignment = logic == AND ?
+                schedule_segment(columns, segment_number, moves) : segment_assignment{ home_location(columns, segment_number), false };
+            int device_index = assignment.location;
+            bool on_device = device_index >= 0;
+            KernelBundle bundle(on_device, device_index);
+            for (const sycl::event &move : moves)
+                bundle.add_dependency(move);
+
+            packed_column segment_columns[MAX_PREDICATE_COLUMNS];
+            for (int c = 0; c < columns.size(); c++)
             {
-                const Segment &segment = segments[segment_number];
-                bool on_device =
-                    segment.is_on_device() &&
-                    (literal ||
-                        (cols[1]->get_segments()[segment_number].is_on_device()
-                            && cols[1]->get_segments()[segment_number].get_device_index() == segment.get_device_index()
-                            ));
-                int device_index = segment.get_device_index();
-                KernelBundle bundle(on_device, device_index);
+                Segment &column_segment = const_cast<Segment &>(columns[c]->get_segments()[segment_number]);
+                segment_columns[c] = assignment.streamed && !column_segment.is_on_device(device_index) ?
+                    streams.stream(column_segment, bundle) : column_segment.get_packed_data(on_device, device_index);
+            }
 
-                bundle.add_kernel(
-                    KernelData(
-                        literal ? KernelType::SelectionKernelLiteral : KernelType::SelectionKernelColumns,
-                        literal ?
-                        static_cast<KernelDefinition *>(
-                            segment.filter_operator(
-                                expr.op,
-                                parent_op,
-                                literal_value,
-                                (on_device ? flags_devices[device_index] : flags_host) + segment_number * SEGMENT_SIZE,
-                                device_index
-                            )
-                            ) :
-                        static_cast<KernelDefinition *>(
-                            segment.filter_operator(
-                                expr.op,
-                                parent_op,
-                                cols[1]->get_segments()[segment_number],
-                                (on_device ? flags_devices[device_index] : flags_host) + segment_number * SEGMENT_SIZE,
-                                device_index
-                            )
-                            )
+            bundle.add_kernel(
+                KernelData(
+                    KernelType::PredicateTreeKernel,
+                    new PredicateTreeKernel(
+                        program,
+                        segment_columns,
+                        logic,
+                        (on_device ? flags_devices[device_index] : flags_host) + segment_number * SEGMENT_FLAG_WORDS,
+                        segment.get_nrows()
                     )
-                );
-
-                if (on_device)
-                    flags_modified_devices[device_index][segment_number] = true;
-                else
-                    flags_modified_host[segment_number] = true;
+                )
+            );
 
-                ops.push_back(bundle);
-            }
+            if (on_device)
+                flags_modified_devices[device_index][segment_number] = true;
+            else
+                flags_modified_host[segment_number] = true;
 
-            pending_kernels.push_back(ops);
+            ops.push_back(bundle);
         }
+
+        pending_kernels.push_back(ops);
+
+        #if not PERFORMANCE_MEASUREMENT_ACTIVE
+        std::cout << "Filter: " << skipped_segments << "/" << segments.size() << " segments decided by zone maps" << std::endl;
+        #endif
     }
 
     void apply_project(
@@ -692,6 +921,8 @@ public:
         memory_manager &cpu_allocator,
         std::vector<memory_manager> &device_allocators)
     {
+        flush_join_probes();
+
         std::vector<Column *> new_columns;
         new_columns.reserve(exprs.size() + 50);
 
@@ -703,8 +934,6 @@ public:
             case ExprOption::COLUMN:
             {
                 new_columns.push_back(current_columns[expr.input]);
-                if (expr.input == group_by_column_index)
-                    group_by_column_index = i;
                 break;
             }
             case ExprOption::LITERAL:
@@ -718,6 +947,8 @@ public:
                     device_allocators[0]
                 );
 
+                new_col.set_scale(decimal_scale(expr.type));
+
                 // TODO better way
 
                 std::vector<KernelBundle> fill_bundles_cpu = new_col.fill_with_literal(literal_value, false, -1, cpu_allocator);
@@ -731,11 +962,16 @@ public:
             }
             case ExprOption::EXPR:
             {
-                if (expr.operands.size() != 2)
-                {
-                    std::cerr << "Project operation: Unsupported number of operands for EXPR" << std::endl;
-                    return;
-                }
+                std::vector<int> column_inputs;
+                expression_program program = compile_expression(
+                    expr, column_inputs,
+                    [&](int input)
+                    {
+                        const Column *column = current_columns[input];
+                        auto [min_value, max_value] = column->get_value_range();
+                        return expression_column{ column->get_type(), column->get_scale(), min_value, max_value };
+                    }
+                );
 
                 // TODO: pass the correct allocator in order to do host malloc, to speed up transfers.
                 Column &new_col = materialized_columns.emplace_back(
@@ -743,126 +979,48 @@ public:
                     cpu_queue,
                     device_queues,
                     cpu_allocator,
-                    device_allocators[0]
+                    device_allocators[0],
+                    false,
+                    program.result_type
                 );
+                new_col.set_scale(program.scale);
 
                 std::vector<KernelBundle> ops;
 
                 std::vector<Segment> &segments_result = new_col.get_segments();
                 ops.reserve(segments_result.size());
 
-                if (expr.operands[0].exprType == ExprOption::COLUMN &&
-                    expr.operands[1].exprType == ExprOption::COLUMN)
-                {
-                    const std::vector<Segment> &segments_a = current_columns[expr.operands[0].input]->get_segments();
-                    const std::vector<Segment> &segments_b = current_columns[expr.operands[1].input]->get_segments();
-
-                    if (segments_a.size() != segments_b.size())
-                    {
-                        std::cerr << "Project operation: Mismatched segment sizes between columns" << std::endl;
-                        return;
-                    }
-
-                    for (size_t segment_number = 0; segment_number < segments_a.size(); segment_number++)
-                    {
-                        const Segment &segment_a = segments_a[segment_number];
-                        const Segment &segment_b = segments_b[segment_number];
-                        Segment &segment_result = segments_result[segment_number];
-                        bool on_device = segment_a.is_on_device() && segment_b.is_on_device()
-                            && segment_a.get_device_index() == segment_b.get_device_index();
-                        int device_index = segment_a.get_device_index();
-                        KernelBundle bundle(on_device, device_index);
-
-                        if (on_device)
-                            segment_result.build_on_device(device_allocators[device_index], device_index);
-
-                        bundle.add_kernel(
-                            KernelData(
-                                KernelType::PerformOperationKernelColumns,
-                                segment_result.perform_operator(
-                                    segment_a,
-                                    segment_b,
-                                    on_device,
-                                    device_index,
-                                    (on_device ? flags_devices[device_index] : flags_host) + segment_number * SEGMENT_SIZE,
-                                    expr.op
-                                )
-                            )
-                        );
-                        ops.push_back(bundle);
-                    }
-                }
-                else if (expr.operands[0].exprType == ExprOption::LITERAL &&
-                    expr.operands[1].exprType == ExprOption::COLUMN)
-                {
-                    const std::vector<Segment> &segments = current_columns[expr.operands[1].input]->get_segments();
-
-                    for (size_t segment_number = 0; segment_number < segments.size(); segment_number++)
-                    {
-                        const Segment &segment = segments[segment_number];
-                        Segment &segment_result = segments_result[segment_number];
-                        bool on_device = segment.is_on_device();
-                        int device_index = segment.get_device_index();
-                        KernelBundle bundle(on_device, device_index);
-
-                        if (on_device)
-                            segment_result.build_on_device(device_allocators[device_index], device_index);
-
-                        bundle.add_kernel(
-                            KernelData(
-                                KernelType::PerformOperationKernelLiteralFirst,
-                                segment_result.perform_operator(
-                                    (int)expr.operands[0].literal.value,
-                                    segment,
-                                    on_device,
-                                    device_index,
-                                    (on_device ? flags_devices[device_index] : flags_host) + segment_number * SEGMENT_SIZE,
-                                    expr.op
-                                )
-                            )
-                        );
-                        ops.push_back(bundle);
-                    }
-                }
-                else if (expr.operands[0].exprType == ExprOption::COLUMN &&
-                    expr.operands[1].exprType == ExprOption::LITERAL)
+                for (size_t segment_number = 0; segment_number < segments_result.size(); segment_number++)
                 {
-                    const std::vector<Segment> &segments = current_columns[expr.operands[0].input]->get_segments();
-
-                    for (size_t segment_number = 0; segment_number < segments.size(); segment_number++)
-                    {
-                        const Segment &segment = segments[segment_number];
-                        Segment &segment_result = segments_result[segment_number];
-                        bool on_device = segment.is_on_device();
-                        int device_index = segment.get_device_index();
-                        KernelBundle bundle(on_device, device_index);
-
-                        if (on_device)
-                            segment_result.build_on_device(device_allocators[device_index], device_index);
-
-                        bundle.add_kernel(
-                            KernelData(
-                                KernelType::PerformOperationKernelLiteralSecond,
-                                segment_result.perform_operator(
-                                    segment,
-                                    (int)expr.operands[1].literal.value,
-                                    on_device,
-                                    device_index,
-                                    (on_device ? flags_devices[device_index] : flags_host) + segment_number * SEGMENT_SIZE,
-                                    expr.op
-                                )
+                    std::vector<const Segment *> operands;
+                    for (int input : column_inputs)
+                        operands.push_back(&current_columns[input]->get_segments()[segment_number]);
+
+                    // on the device only if all the operand segments are there
+                    bool on_device = !operands.empty() && operands[0]->is_on_device();
+                    int device_index = operands.empty() ? -1 : operands[0]->get_device_index();
+                    for (const Segment *operand : operands)
+                        on_device = on_device && operand->is_on_device() && operand->get_device_index() == device_index;
+
+                    Segment &segment_result = segments_result[segment_number];
+                    KernelBundle bundle(on_device, device_index);
+
+                    if (on_device)
+                        segment_result.build_on_device(device_allocators[device_index], device_index);
+
+                    bundle.add_kernel(
+                        KernelData(
+                            KernelType::ExpressionKernel,
+                            segment_result.expression_operator(
+                                program,
+                                operands,
+                                on_device,
+                                device_index,
+                                (on_device ? flags_devices[device_index] : flags_host) + segment_number * SEGMENT_FLAG_WORDS
                             )
-                        );
-                        ops.push_back(bundle);
-                    }
-                }
-                else
-                {
-                    std::cerr << "Project operation: Unsupported parsing ExprType "
-                        << expr.operands[0].exprType << " and "
-                        << expr.operands[1].exprType
-                        << " for EXPR" << std::endl;
-                    return;
+                        )
+                    );
+                    ops.push_back(bundle);
                 }
 
                 pending_kernels.push_back(ops);
@@ -875,133 +1033,200 @@ public:
         current_columns = new_columns;
     }
 
+    // MIN and MAX keep the codes of a dictionary-encoded input, SUM and AVG its decimal scale
+    static void set_aggregate_format(Column &result, AggregateFunction function, const Column *input)
+    {
+        if (input == nullptr || function == AggregateFunction::Count)
+            return;
+        if (function == AggregateFunction::Min || function == AggregateFunction::Max)
+            result.set_value_format(*input);
+        else
+            result.set_scale(input->get_scale());
+    }
+
+    // The flags of a location only hold the rows it unselected, they are merged by ANDing them on the host.
+    // An operator reading the flags on a device whose flags were also modified elsewhere (e.g. segments the
+    // scheduler filtered on another location) runs on the host after the merge.
+    bool flags_modified_away_from(bool on_device, int device_index) const
+    {
+        auto modified = [](const std::vector<bool> &flags_modified)
+        {
+            return std::find(flags_modified.begin(), flags_modified.end(), true) != flags_modified.end();
+        };
+
+        if (on_device && modified(flags_modified_host))
+            return true;
+        for (int d = 0; d < device_queues.size(); d++)
+            if ((!on_device || d != device_index) && modified(flags_modified_devices[d]))
+                return true;
+        return false;
+    }
+
+    // aggregation runs on a device only if all its input columns are entirely on that device
+    std::pair<bool, int> aggregate_location(const std::vector<const Column *> &columns) const
+    {
+        int device_index = -1;
+        for (const Column *col : columns)
+        {
+            if (col == nullptr)
+                continue;
+            if (!col->is_all_on_same_device())
+                return { false, -1 };
+
+            int col_device_index = col->get_segments()[0].get_device_index();
+            if (device_index != -1 && col_device_index != device_index)
+                return { false, -1 };
+            device_index = col_device_index;
+        }
+        return { device_index != -1, device_index };
+    }
+
+    // All the aggregates of the node are computed in one pass over the segments,
+    // sharing the flags and the group hash. COUNT has no input column.
     void apply_aggregate(
-        const AggType &agg,
+        const std::vector<AggType> &aggs,
         const std::vector<long> &group,
         memory_manager &cpu_allocator,
         std::vector<memory_manager> &device_allocators)
     {
-        std::vector<KernelBundle> agg_bundles;
+        flush_join_probes();
 
-        if (group.size() == 0)
+        int num_aggs = aggs.size();
+        std::vector<AggregateFunction> functions;
+        std::vector<const Column *> agg_columns;
+        for (const AggType &agg : aggs)
         {
-            const std::vector<Segment> &input_segments = current_columns[agg.operands[0]]->get_segments();
+            functions.push_back(get_aggregate_function(agg.agg));
+            if (functions.back() == AggregateFunction::Count)
+                agg_columns.push_back(nullptr);
+            else if (agg.operands.empty())
+            {
+                std::cerr << "Aggregate operation: " << agg.agg << " without operands" << std::endl;
+                throw std::invalid_argument("Aggregate operation: aggregate without operands");
+            }
+            else
+                agg_columns.push_back(current_columns[agg.operands[0]]);
+        }
 
-            bool on_device = current_columns[agg.operands[0]]->is_all_on_same_device(),
-                need_sync = false;
-            int device_index = input_segments[0].get_device_index();
+        aggregate_slots slots = plan_aggregate_slots(functions, group.size() > 0);
+        int num_slots = slots.functions.size();
+        if (num_slots > MAX_AGGREGATES)
+        {
+            std::cerr << "Aggregate operation: more than " << MAX_AGGREGATES << " aggregate slots" << std::endl;
+            throw std::invalid_argument("Aggregate operation: too many aggregates");
+        }
 
-            #if not PERFORMANCE_MEASUREMENT_ACTIVE
-            std::cout << "Applying aggregate on "
-                << (on_device ? "GPU" : "CPU")
-                << " with " << input_segments.size() << " segments." << std::endl;
-            #endif
+        uint64_t input_segments = flags_modified_host.size();
+        std::vector<KernelBundle> agg_bundles;
 
-            if (on_device)
-            {
-                for (bool modified : flags_modified_host)
-                {
-                    if (modified)
-                    {
-                        // need_sync = true;
-                        // break;
-                        std::cerr << "Error: aggregation flags on CPU to GPU modified not implemented yet" << std::endl;
-                        throw std::runtime_error("Flags on CPU to GPU modified not implemented yet.");
-                    }
-                }
-                for (int d = 0; d < device_queues.size(); d++)
-                {
-                    if (need_sync)
-                        break;
-                    if (d == device_index)
-                        continue;
-                    for (bool modified : flags_modified_devices[d])
-                    {
-                        if (modified)
-                        {
-                            // need_sync = true;
-                            // break;
-                            std::cerr << "Error: aggregation flags on other GPU modified not implemented yet" << std::endl;
-                            throw std::runtime_error("Flags on other GPU modified not implemented yet.");
-                        }
-                    }
-                }
-            }
-            else
+        if (group.size() == 0)
+        {
+            auto [on_device, device_index] = aggregate_location(agg_columns);
+            bool need_sync = flags_modified_away_from(on_device, device_index);
+            if (need_sync)
             {
-                for (const auto &flags_modified_gpu : flags_modified_devices)
-                {
-                    for (bool modified : flags_modified_gpu)
-                    {
-                        if (modified)
-                        {
-                            need_sync = true;
-                            break;
-                        }
-                    }
-                    if (need_sync)
-                        break;
-                }
+                on_device = false;
+                device_index = -1;
             }
 
-            if (need_sync)
+            #if not PERFORMANCE_MEASUREMENT_ACTIVE
+            std::cout << "Applying aggregate on "
+                << (on_device ? "GPU" : "CPU")
+                << " with " << input_segments << " segments." << std::endl;
+            #endif
+
+            std::vector<Column *> columns_to_sync;
+            for (const Column *col : agg_columns)
+                if (col != nullptr && col->needs_copy_on(on_device, device_index))
+                    columns_to_sync.push_back(const_cast<Column *>(col));
+
+            if (need_sync || !columns_to_sync.empty())
             {
                 for (int d = 0; d < device_queues.size(); d++)
                     compress_and_sync(
                         cpu_allocator,
                         device_allocators[d],
-                        d
+                        d,
+                        columns_to_sync
                     );
             }
             uint64_t *final_result = (on_device ?
-                device_allocators[device_index].alloc_zero<uint64_t>(1) :
-                cpu_allocator.alloc_zero<uint64_t>(1)
+                device_allocators[device_index].alloc_zero<uint64_t>(num_slots) :
+                cpu_allocator.alloc_zero<uint64_t>(num_slots)
                 );
+            sycl::queue &result_queue = on_device ? device_queues[device_index] : cpu_queue;
+            // the identity fill is a few bytes, waiting keeps the per-segment dependencies intact
+            sycl::event::wait(init_aggregate_slots(final_result, slots.functions, 1, result_queue, {}));
 
-            agg_bundles.reserve(input_segments.size());
+            agg_bundles.reserve(input_segments);
 
-            for (int i = 0; i < input_segments.size(); i++)
+            for (int i = 0; i < input_segments; i++)
             {
-                const Segment &input_segment = input_segments[i];
+                typed_column data[MAX_AGGREGATES] = {};
+                for (int a = 0; a < num_aggs; a++)
+                    if (agg_columns[a] != nullptr)
+                        data[a] = agg_columns[a]->get_segments()[i].get_typed_data(on_device, device_index);
+
+                const flag_word *segment_flags = (on_device ? flags_devices[device_index] : flags_host) + i * SEGMENT_FLAG_WORDS;
+
                 KernelBundle bundle(on_device, device_index);
-                bundle.add_kernel(
-                    KernelData(
-                        KernelType::AggregateOperationKernel,
-                        input_segment.aggregate_operator(
-                            (on_device ? flags_devices[device_index] : flags_host) + i * SEGMENT_SIZE,
-                            on_device,
-                            device_index,
-                            final_result
+                if (!on_device)
+                {
+                    int partitions = cpu_aggregate_partitions(1, num_slots, flag_words(segment_rows(i)), 1, cpu_queue);
+                    bundle.add_kernel(
+                        KernelData(
+                            KernelType::CpuAggregateKernel,
+                            new CpuAggregateKernel(
+                                data, slots.functions.data(), num_slots, segment_flags, segment_rows(i), final_result,
+                                cpu_allocator.alloc<uint64_t>(partitions * num_slots, true),
+                                cpu_allocator.alloc<unsigned>(partitions, true),
+                                partitions
+                            )
                         )
-                    )
-                );
+                    );
+                }
+                else
+                    bundle.add_kernel(
+                        KernelData(
+                            KernelType::LocalAggregateKernel,
+                            new LocalAggregateKernel(
+                                data, slots.functions.data(), num_slots, segment_flags, segment_rows(i), final_result
+                            )
+                        )
+                    );
                 agg_bundles.push_back(bundle);
             }
 
             pending_kernels.push_back(agg_bundles);
 
             auto dependencies = execute_pending_kernels();
+            if (!slots.averages.empty())
+            {
+                std::vector<sycl::event> &result_dependencies = on_device ? dependencies.second[device_index] : dependencies.first;
+                result_dependencies = { finalize_averages(final_result, slots.averages, 1, result_queue, result_dependencies) };
+            }
             pending_kernels_dependencies_cpu = dependencies.first;
             for (int d = 0; d < device_queues.size(); d++)
             {
                 pending_kernels_dependencies_devices[d] = dependencies.second[d];
-                bool *new_flags = device_allocators[d].alloc<bool>(1, true);
+                flag_word *new_flags = device_allocators[d].alloc<flag_word>(flag_words(1), true);
                 pending_kernels_dependencies_devices[d].push_back(
-                    device_queues[d].fill<bool>(new_flags, true, 1)
+                    fill_flags(new_flags, true, 1, device_queues[d])
                 );
                 flags_devices[d] = new_flags;
                 flags_modified_devices[d] = { false };
             }
 
-            bool *new_cpu_flags = cpu_allocator.alloc<bool>(1, true);
-            new_cpu_flags[0] = true;
+            flag_word *new_cpu_flags = cpu_allocator.alloc<flag_word>(flag_words(1), true);
+            new_cpu_flags[0] = 1;
             flags_host = new_cpu_flags;
             flags_modified_host = { false };
 
             nrows = 1;
 
-            Column &result_column = materialized_columns.emplace_back(
-                final_result,
+            // the count of the input rows is not a result column, it only marks MIN, MAX and AVG of no rows as NULL
+            Column *input_rows = slots.rows_slot < 0 ? nullptr : &materialized_columns.emplace_back(
+                final_result + slots.rows_slot,
                 on_device,
                 device_index,
                 cpu_queue,
@@ -1012,18 +1237,36 @@ public:
             );
 
             current_columns.clear();
-            current_columns.push_back(&result_column);
+            for (int a = 0; a < num_aggs; a++)
+            {
+                Column &result_column = materialized_columns.emplace_back(
+                    final_result + a,
+                    on_device,
+                    device_index,
+                    cpu_queue,
+                    device_queues,
+                    cpu_allocator,
+                    device_allocators,
+                    nrows
+                );
+                set_aggregate_format(result_column, functions[a], agg_columns[a]);
+                if (aggregate_is_nullable(functions[a]))
+                    result_column.set_input_rows(input_rows);
+                current_columns.push_back(&result_column);
+            }
         }
         else
         {
-            const Column *agg_column = current_columns[agg.operands[0]];
-            bool on_device = agg_column->is_all_on_same_device(),
-                need_sync = false;
-            int device_index = agg_column->get_segments()[0].get_device_index();
-            for (int i = 0; i < group.size() && on_device; i++)
+            std::vector<const Column *> input_columns(agg_columns);
+            for (long col : group)
+                input_columns.push_back(current_columns[col]);
+
+            auto [on_device, device_index] = aggregate_location(input_columns);
+            bool need_sync = flags_modified_away_from(on_device, device_index);
+            if (need_sync)
             {
-                on_device = current_columns[group[i]]->is_all_on_same_device() &&
-                    current_columns[group[i]]->get_segments()[0].get_device_index() == device_index;
+                on_device = false;
+                device_index = -1;
             }
 
             #if not PERFORMANCE_MEASUREMENT_ACTIVE
@@ -1031,65 +1274,16 @@ public:
                 << (on_device ? "GPU" : "CPU") << std::endl;
             #endif
 
-            if (on_device)
-            {
-                for (bool modified : flags_modified_host)
-                {
-                    if (modified)
-                    {
-                        // need_sync = true;
-                        // break;
-                        std::cerr << "Error: aggregation flags on CPU to GPU modified not implemented yet" << std::endl;
-                        throw std::runtime_error("Flags on CPU to GPU modified not implemented yet.");
-                    }
-                }
-                for (int d = 0; d < device_queues.size(); d++)
-                {
-                    if (need_sync)
-                        break;
-                    if (d == device_index)
-                        continue;
-                    for (bool modified : flags_modified_devices[d])
-                    {
-                        if (modified)
-                        {
-                            // need_sync = true;
-                            // break;
-                            std::cerr << "Error: aggregation flags on other GPU modified not implemented yet" << std::endl;
-                            throw std::runtime_error("Flags on other GPU modified not implemented yet.");
-                        }
-                    }
-                }
-            }
-            else
-            {
-                for (const auto &flags_modified_gpu : flags_modified_devices)
-                {
-                    for (bool modified : flags_modified_gpu)
-                    {
-                        if (modified)
-                        {
-                            need_sync = true;
-                            break;
-                        }
-                    }
-                    if (need_sync)
-                        break;
-                }
-            }
-
-            need_sync = need_sync || agg_column->needs_copy_on(on_device, device_index);
-            for (int i = 0; i < group.size() && !need_sync; i++)
-                need_sync = current_columns[group[i]]->needs_copy_on(on_device, device_index);
-
+            for (const Column *col : input_columns)
+                need_sync = need_sync || (col != nullptr && col->needs_copy_on(on_device, device_index));
 
             if (need_sync)
             {
                 std::vector<Column *> columns_to_sync;
-                columns_to_sync.reserve(group.size() + 1);
-                columns_to_sync.push_back(const_cast<Column *>(agg_column));
-                for (int i = 0; i < group.size(); i++)
-                    columns_to_sync.push_back(current_columns[group[i]]);
+                columns_to_sync.reserve(input_columns.size());
+                for (const Column *col : input_columns)
+                    if (col != nullptr)
+                        columns_to_sync.push_back(const_cast<Column *>(col));
                 for (int d = 0; d < device_queues.size(); d++)
                     compress_and_sync(
                         cpu_allocator,
@@ -1101,7 +1295,6 @@ public:
 
             memory_manager &allocator = on_device ? device_allocators[device_index] : cpu_allocator;
 
-            uint64_t prod_ranges = 1;
             int *min = allocator.alloc<int>(group.size(), !on_device),
                 *max = allocator.alloc<int>(group.size(), !on_device);
 
@@ -1110,21 +1303,44 @@ public:
                 auto min_max = current_columns[group[i]]->get_min_max();
                 min[i] = min_max.first;
                 max[i] = min_max.second;
-                prod_ranges *= max[i] - min[i] + 1;
             }
 
-            uint64_t *aggregate_result = allocator.alloc_zero<uint64_t>(prod_ranges);
-            unsigned *temp_flags = allocator.alloc_zero<unsigned>(prod_ranges);
+            sycl::queue &result_queue = on_device ? device_queues[device_index] : cpu_queue;
+
+            // the selected rows bound the groups when the key space is too large for dense slots
+            uint64_t key_space = group_key_space(min, max, group.size()), max_groups = key_space;
+            if (key_space > DENSE_GROUP_BY_MAX_SLOTS)
+            {
+                auto dependencies = execute_pending_kernels();
+                pending_kernels_dependencies_cpu = dependencies.first;
+                for (int d = 0; d < device_queues.size(); d++)
+                    pending_kernels_dependencies_devices[d] = dependencies.second[d];
+
+                max_groups = std::min(key_space, count_true_flags(
+                    on_device ? flags_devices[device_index] : flags_host,
+                    nrows,
+                    result_queue,
+                    on_device ? dependencies.second[device_index] : dependencies.first
+                ));
+            }
+            GroupByTable table = make_group_by_table(key_space, max_groups, allocator);
+
+            uint64_t *aggregate_result = allocator.alloc_zero<uint64_t>(num_slots * table.capacity);
+            sycl::event::wait(init_aggregate_slots(aggregate_result, slots.functions, table.capacity, result_queue, {}));
+            unsigned *temp_flags = allocator.alloc_zero<unsigned>(table.capacity);
             int **results = allocator.alloc<int *>(group.size(), !on_device);
 
             for (int i = 0; i < group.size(); i++)
-                results[i] = allocator.alloc<int>(prod_ranges, true);
+                results[i] = allocator.alloc<int>(table.capacity, true);
 
-            const std::vector<Segment> &agg_segments = agg_column->get_segments();
+            // the CPU segments aggregate into per-thread partial tables, the device ones privatize per work-group when the slots fit
+            int cpu_partitions = !on_device && table.layout == HashTableLayout::Dense ?
+                cpu_aggregate_partitions(table.capacity, num_slots, SEGMENT_FLAG_WORDS, input_segments, cpu_queue) : 0;
+            bool local_aggregation = use_local_aggregation(table, num_slots, result_queue);
 
-            agg_bundles.reserve(agg_segments.size());
+            agg_bundles.reserve(input_segments);
 
-            for (int i = 0; i < agg_segments.size(); i++)
+            for (int i = 0; i < input_segments; i++)
             {
                 const int **contents = allocator.alloc<const int *>(group.size(), !on_device);
                 for (int j = 0; j < group.size(); j++)
@@ -1132,27 +1348,48 @@ public:
                     const Segment &segment = current_columns[group[j]]->get_segments()[i];
                     contents[j] = segment.get_data(on_device, device_index);
                 }
-                const Segment &agg_segment = agg_segments[i];
+
+                typed_column data[MAX_AGGREGATES] = {};
+                for (int a = 0; a < num_aggs; a++)
+                    if (agg_columns[a] != nullptr)
+                        data[a] = agg_columns[a]->get_segments()[i].get_typed_data(on_device, device_index);
+
+                const flag_word *segment_flags = (on_device ? flags_devices[device_index] : flags_host) + i * SEGMENT_FLAG_WORDS;
 
                 KernelBundle bundle(on_device, device_index);
-                bundle.add_kernel(
-                    KernelData(
-                        KernelType::GroupByAggregateKernel,
-                        agg_segment.group_by_aggregate_operator(
-                            contents,
-                            max,
-                            min,
-                            (on_device ? flags_devices[device_index] : flags_host) + i * SEGMENT_SIZE,
-                            aggregate_result,
-                            group.size(),
-                            results,
-                            temp_flags,
-                            on_device,
-                            device_index,
-                            prod_ranges
+                if (cpu_partitions > 0)
+                    bundle.add_kernel(
+                        KernelData(
+                            KernelType::CpuAggregateKernel,
+                            new CpuAggregateKernel(
+                                contents, data, slots.functions.data(), num_slots, max, min, segment_flags,
+                                group.size(), segment_rows(i), results, aggregate_result, temp_flags, table,
+                                cpu_allocator.alloc<uint64_t>(cpu_partitions * num_slots * table.capacity, true),
+                                cpu_allocator.alloc<unsigned>(cpu_partitions * table.capacity, true),
+                                cpu_partitions
+                            )
                         )
-                    )
-                );
+                    );
+                else if (local_aggregation)
+                    bundle.add_kernel(
+                        KernelData(
+                            KernelType::LocalAggregateKernel,
+                            new LocalAggregateKernel(
+                                contents, data, slots.functions.data(), num_slots, max, min, segment_flags,
+                                group.size(), segment_rows(i), results, aggregate_result, temp_flags, table
+                            )
+                        )
+                    );
+                else
+                    bundle.add_kernel(
+                        KernelData(
+                            KernelType::GroupByAggregateKernel,
+                            new GroupByAggregateKernel(
+                                contents, data, slots.functions.data(), num_slots, max, min, segment_flags,
+                                group.size(), segment_rows(i), results, aggregate_result, temp_flags, table
+                            )
+                        )
+                    );
                 agg_bundles.push_back(bundle);
             }
 
@@ -1161,56 +1398,40 @@ public:
             // std::cout << "Executing aggregate kernels" << std::endl;
             auto dependencies = execute_pending_kernels();
 
-            bool *new_cpu_flags = on_device ? device_allocators[device_index].alloc<bool>(prod_ranges, false) :
-                cpu_allocator.alloc<bool>(prod_ranges, true);
-            flags_host = new_cpu_flags;
+            auto [group_columns, group_aggregates, num_groups, compact_event] = compact_group_by(
+                results, group.size(), aggregate_result, num_slots, temp_flags, table.capacity, allocator, result_queue,
+                on_device ? dependencies.second[device_index] : dependencies.first
+            );
+
+            std::vector<sycl::event> result_dependencies = { compact_event };
+            if (!slots.averages.empty())
+                result_dependencies = { finalize_averages(group_aggregates, slots.averages, num_groups, result_queue, result_dependencies) };
 
-            nrows = prod_ranges;
+            nrows = num_groups;
 
             uint64_t segment_num = nrows / SEGMENT_SIZE + (nrows % SEGMENT_SIZE > 0);
 
+            // every compacted slot is a group
+            flag_word *new_cpu_flags = on_device ? device_allocators[device_index].alloc<flag_word>(flag_words(nrows), false) :
+                cpu_allocator.alloc<flag_word>(flag_words(nrows), true);
+            flags_host = new_cpu_flags;
+
             if (on_device)
             {
-                bool *new_gpu_flags = device_allocators[device_index].alloc<bool>(prod_ranges, true);
-                auto e1 = device_queues[device_index].submit(
-                    [&](sycl::handler &cgh)
-                    {
-                        if (!dependencies.second[0].empty())
-                            cgh.depends_on(dependencies.second[0]);
-                        cgh.parallel_for(
-                            prod_ranges,
-                            [=](sycl::id<1> idx)
-                            {
-                                new_gpu_flags[idx[0]] = temp_flags[idx[0]] != 0;
-                            }
-                        );
-                    }
-                );
+                flag_word *new_gpu_flags = device_allocators[device_index].alloc<flag_word>(flag_words(nrows), true);
+                auto e1 = fill_flags(new_gpu_flags, true, nrows, device_queues[device_index], result_dependencies);
 
                 flags_devices[device_index] = new_gpu_flags;
                 pending_kernels_dependencies_devices[device_index].push_back(
                     device_queues[device_index].memcpy(
                         new_cpu_flags,
                         new_gpu_flags,
-                        sizeof(bool) * prod_ranges,
+                        sizeof(flag_word) * flag_words(nrows),
                         e1
                     )
                 );
                 for (int d = 0; d < device_queues.size(); d++)
                 {
-                    // if (d != device_index)
-                    // {
-                    //     bool *new_flags = device_allocators[d].alloc<bool>(prod_ranges, true);
-                    //     pending_kernels_dependencies_devices[d].push_back(
-                    //         device_queues[d].memcpy(
-                    //             new_flags,
-                    //             new_gpu_flags,
-                    //             sizeof(bool) * prod_ranges,
-                    //             e1
-                    //         )
-                    //     );
-                    //     flags_devices[d] = new_flags;
-                    // }
                     flags_modified_devices[d].resize(segment_num, false);
                     std::fill(
                         flags_modified_devices[d].begin(),
@@ -1222,53 +1443,49 @@ public:
             else
             {
                 pending_kernels_dependencies_cpu.push_back(
-                    cpu_queue.submit(
-                        [&](sycl::handler &cgh)
-                        {
-                            if (!dependencies.first.empty())
-                                cgh.depends_on(dependencies.first);
-                            cgh.parallel_for(
-                                prod_ranges,
-                                [=](sycl::id<1> idx)
-                                {
-                                    new_cpu_flags[idx[0]] = temp_flags[idx[0]] != 0;
-                                }
-                            );
-                        }
-                    )
+                    fill_flags(new_cpu_flags, true, nrows, cpu_queue, result_dependencies)
                 );
 
                 // gpu update skipped since after aggregation on cpu, nothing is run on gpu
             }
 
+            std::vector<const Column *> group_sources;
+            for (long col : group)
+                group_sources.push_back(current_columns[col]);
+
             current_columns.clear();
 
             for (int i = 0; i < group.size(); i++)
             {
                 Column &new_col = materialized_columns.emplace_back(
-                    results[i],
+                    group_columns[i],
                     on_device,
                     device_index,
                     cpu_queue,
                     device_queues,
                     cpu_allocator,
                     device_allocators,
-                    prod_ranges
+                    nrows
                 );
+                new_col.set_value_format(*group_sources[i]);
                 current_columns.push_back(&new_col);
             }
 
-            Column &agg_col = materialized_columns.emplace_back(
-                aggregate_result,
-                on_device,
-                device_index,
-                cpu_queue,
-                device_queues,
-                cpu_allocator,
-                device_allocators,
-                prod_ranges
-            );
-            current_columns.push_back(&agg_col);
+            for (int a = 0; a < num_aggs; a++)
+            {
+                Column &agg_col = materialized_columns.emplace_back(
+                    group_aggregates + a * nrows,
+                    on_device,
+                    device_index,
+                    cpu_queue,
+                    device_queues,
+                    cpu_allocator,
+                    device_allocators,
+                    nrows
+                );
+                set_aggregate_format(agg_col, functions[a], agg_columns[a]);
+                current_columns.push_back(&agg_col);
+            }
 
             flags_modified_host.resize(segment_num, false);
             std::fill(
@@ -1279,9 +1496,226 @@ public:
         }
     }
 
+    // The columns are gathered into contiguous arrays on the device holding all of them, or on the
+    // host, sorted there and materialized again in the sorted order. This is a sync point.
+    void apply_sort(
+        const std::vector<CollationType> &collation,
+        uint64_t offset,
+        uint64_t fetch,
+        memory_manager &cpu_allocator,
+        std::vector<memory_manager> &device_allocators)
+    {
+        flush_join_probes();
+
+        if ((collation.empty() && offset == 0 && fetch == UINT64_MAX) || nrows == 0)
+            return;
+
+        std::vector<const Column *> columns(current_columns.begin(), current_columns.end());
+        auto [on_device, device_index] = aggregate_location(columns);
+
+        bool need_sync = flags_modified_away_from(on_device, device_index);
+        if (need_sync)
+        {
+            on_device = false;
+            device_index = -1;
+        }
+
+        for (const Column *col : columns)
+            need_sync = need_sync || (col != nullptr && col->needs_copy_on(on_device, device_index));
+
+        if (need_sync)
+        {
+            for (int d = 0; d < device_queues.size(); d++)
+                compress_and_sync(cpu_allocator, device_allocators[d], d, current_columns);
+        }
+
+        #if not PERFORMANCE_MEASUREMENT_ACTIVE
+        std::cout << "Applying sort on " << (on_device ? "GPU" : "CPU") << std::endl;
+        #endif
+
+        memory_manager &allocator = on_device ? device_allocators[device_index] : cpu_allocator;
+        sycl::queue &sort_queue = on_device ? device_queues[device_index] : cpu_queue;
+        flag_word *flags = on_device ? flags_devices[device_index] : flags_host;
+
+        auto dependencies = execute_pending_kernels();
+        sycl::event::wait(on_device ? dependencies.second[device_index] : dependencies.first);
+
+        // contiguous copies of the columns, the sort reads and gathers whole columns
+        std::vector<void *> contents(current_columns.size(), nullptr);
+        std::vector<sycl::event> copy_events;
+        for (int c = 0; c < current_columns.size(); c++)
+        {
+            const Column *col = current_columns[c];
+            if (col == nullptr || col->get_segments().empty())
+                continue;
+
+            bool is_aggregate_result = col->get_is_aggregate_result();
+            uint64_t value_size = is_aggregate_result ? sizeof(uint64_t) : sizeof(int);
+            char *content = reinterpret_cast<char *>(is_aggregate_result ?
+                static_cast<void *>(allocator.alloc<uint64_t>(nrows, on_device)) :
+                static_cast<void *>(allocator.alloc<int>(nrows, on_device)));
+
+            // segments moved packed are decoded into the copy
+            const std::vector<Segment> &segments = col->get_segments();
+            for (int i = 0; i < segments.size(); i++)
+            {
+                char *segment_content = content + i * SEGMENT_SIZE * value_size;
+                if (is_aggregate_result)
+                {
+                    copy_events.push_back(sort_queue.memcpy(
+                        segment_content, segments[i].get_aggregate_data(on_device, device_index), segment_rows(i) * value_size));
+                    continue;
+                }
+
+                packed_column segment_data = segments[i].get_packed_data(on_device, device_index);
+                copy_events.push_back(segment_data.values != nullptr ?
+                    sort_queue.memcpy(segment_content, segment_data.values, segment_rows(i) * value_size) :
+                    unpack_ints(reinterpret_cast<int *>(segment_content), segment_data, segment_rows(i), sort_queue));
+            }
+            contents[c] = content;
+        }
+        sycl::event::wait(copy_events);
+
+        std::vector<sort_column> sort_columns;
+        for (const CollationType &col : collation)
+        {
+            if (contents.at(col.field) == nullptr)
+            {
+                std::cerr << "Sort operation: sort column " << col.field << " has no data" << std::endl;
+                throw std::invalid_argument("Sort operation: sort column without data");
+            }
+            sort_columns.push_back({ contents[col.field], current_columns[col.field]->get_is_aggregate_result(), col.direction == DirectionOption::ASCENDING });
+        }
+
+        // with a FETCH only the first rows are ordered and kept, the result stays small on its device
+        auto [first_row, result_rows] = sort_result_range(nrows, offset, fetch);
+        int *row_ids = sort_row_ids(sort_columns, flags, nrows, allocator, sort_queue, first_row + result_rows) + first_row;
+
+        std::vector<sycl::event> gather_events;
+        std::vector<Column *> new_columns(current_columns.size(), nullptr);
+        for (int c = 0; c < current_columns.size(); c++)
+        {
+            if (contents[c] == nullptr)
+                continue;
+
+            if (current_columns[c]->get_is_aggregate_result())
+            {
+                uint64_t *sorted = allocator.alloc<uint64_t>(result_rows, on_device);
+                gather_events.push_back(gather_rows(sorted, static_cast<const uint64_t *>(contents[c]), row_ids, result_rows, sort_queue));
+                new_columns[c] = &materialized_columns.emplace_back(
+                    sorted, on_device, device_index, cpu_queue, device_queues, cpu_allocator, device_allocators, result_rows);
+            }
+            else
+            {
+                int *sorted = allocator.alloc<int>(result_rows, on_device);
+                gather_events.push_back(gather_rows(sorted, static_cast<const int *>(contents[c]), row_ids, result_rows, sort_queue));
+                new_columns[c] = &materialized_columns.emplace_back(
+                    sorted, on_device, device_index, cpu_queue, device_queues, cpu_allocator, device_allocators, result_rows);
+            }
+            new_columns[c]->set_value_format(*current_columns[c]);
+            // only the single row of an aggregate without group by can be NULL, its position is kept
+            new_columns[c]->set_input_rows(current_columns[c]->get_input_rows());
+        }
+
+        flag_word *sorted_flags = allocator.alloc<flag_word>(flag_words(result_rows), true);
+        gather_events.push_back(gather_flags(sorted_flags, flags, row_ids, result_rows, sort_queue));
+        sycl::event::wait(gather_events);
+
+        if (on_device)
+        {
+            flags_devices[device_index] = sorted_flags;
+            flags_host = device_allocators[device_index].alloc<flag_word>(flag_words(result_rows), false);
+            sort_queue.memcpy(flags_host, sorted_flags, sizeof(flag_word) * flag_words(result_rows)).wait();
+        }
+        else
+            flags_host = sorted_flags; // gpu update skipped since after sorting on cpu, nothing is run on gpu
+
+        nrows = result_rows;
+
+        uint64_t segment_num = nrows / SEGMENT_SIZE + (nrows % SEGMENT_SIZE > 0);
+        for (auto &flags_modified_gpu : flags_modified_devices)
+            flags_modified_gpu.assign(segment_num, false);
+        flags_modified_host.assign(segment_num, false);
+
+        current_columns = new_columns;
+    }
+
+    // Queues the probe of a join, each segment is probed on the first device holding it and a hash table,
+    // or on the host. A probe reading the payload of a queued one waits for it to be flushed.
+    const PendingJoinProbe &queue_join_probe(
+        Column *probe_column,
+        const JoinHashTable &ht_host,
+        const std::vector<JoinHashTable> &ht_devices,
+        const std::vector<Column *> &payload_columns)
+    {
+        for (const PendingJoinProbe &probe : pending_probes)
+            if (std::find(probe.payload_columns.begin(), probe.payload_columns.end(), probe_column) != probe.payload_columns.end())
+            {
+                flush_join_probes();
+                break;
+            }
+
+        if (pending_probes.size() == MAX_STAR_JOIN_TABLES)
+            flush_join_probes();
+
+        PendingJoinProbe &probe = pending_probes.emplace_back();
+        probe.probe_column = probe_column;
+        probe.ht_host = ht_host;
+        probe.ht_devices = ht_devices;
+        probe.payload_columns = payload_columns;
+
+        for (uint64_t i = 0; i < probe_column->get_segments().size(); i++)
+        {
+            Segment &seg = probe_column->get_segments()[i];
+            int home = -1;
+            const std::vector<bool> &on_device_vec = seg.get_on_device_vec();
+            for (int d = 0; d < on_device_vec.size() && seg.is_on_device(); d++)
+            {
+                if (on_device_vec[d] && ht_devices[d].slots != nullptr)
+                {
+                    home = d;
+                    break;
+                }
+            }
+
+            if (home == -1 && ht_host.slots == nullptr)
+            {
+                std::cerr << "Join operation: no hash table on the host for a probe segment off device" << std::endl;
+                throw std::runtime_error("Join operation: no hash table on the host for a probe segment off device");
+            }
+
+            // the scheduler may move the probe to another location with a hash table
+            std::vector<segment_candidate> candidates = { { home, 0 } };
+            if (home >= 0 && ht_host.slots != nullptr && !seg.needs_copy_on(false, -1))
+                candidates.push_back({ -1, 0 });
+            for (int d = 0; d < ht_devices.size(); d++)
+            {
+                if (d == home || ht_devices[d].slots == nullptr)
+                    continue;
+                if (seg.is_on_device(d))
+                    candidates.push_back({ d, 0 });
+                else if (seg.can_move_to_device())
+                    candidates.push_back({ d, seg.get_moved_data_size() });
+            }
+
+            segment_assignment assignment = scheduler.assign(segment_rows(i), candidates);
+            probe.segment_moves.push_back(
+                assignment.location >= 0 && !assignment.streamed && !seg.is_on_device(assignment.location) ?
+                seg.move_to_device(assignment.location, transfers) : sycl::event()
+            );
+            probe.segment_locations.push_back(assignment.location);
+            probe.segment_streamed.push_back(assignment.streamed);
+        }
+
+        return probe;
+    }
+
+    // payload_columns are the columns of right_table used after the join, a full join
+    // materializes them as new columns of this table and leaves the probe key untouched
     void apply_join(
         TransientTable &right_table,
         const RelNode &rel,
+        const std::vector<int> &payload_columns,
         memory_manager &cpu_allocator,
         std::vector<memory_manager> &device_allocators)
     {
@@ -1297,47 +1731,57 @@ public:
             throw std::invalid_argument("Invalid column indices in join condition.");
         }
 
+        // the hash tables are built after the pending probes of the right table
+        right_table.flush_join_probes();
+
         if (rel.joinType == "semi")
         {
             #if not PERFORMANCE_MEASUREMENT_ACTIVE
             std::cout << "Applying semi-join" << std::endl;
             #endif
 
-            bool *ht_cpu = nullptr;
-            std::vector<bool *> ht_devices(device_queues.size(), nullptr);
-            int build_min_value, build_max_value;
+            JoinHashTable ht_cpu;
+            std::vector<JoinHashTable> ht_devices(device_queues.size());
 
             for (const Segment &seg : current_columns[left_column]->get_segments())
             {
                 int device_index = seg.get_device_index();
-                if (seg.is_on_device() && ht_devices[device_index] == nullptr)
+                if (seg.is_on_device() && ht_devices[device_index].slots == nullptr)
                 {
-                    auto ht_data = right_table.build_keys_hash_table(
+                    ht_devices[device_index] = right_table.build_keys_hash_table(
                         right_column,
                         cpu_allocator,
                         device_allocators[device_index],
                         true,
                         device_index
                     );
-                    ht_devices[device_index] = std::get<0>(ht_data);
-                    build_min_value = std::get<1>(ht_data);
-                    build_max_value = std::get<2>(ht_data);
                 }
-                else if (!seg.is_on_device() && ht_cpu == nullptr)
+                else if (!seg.is_on_device() && ht_cpu.slots == nullptr)
                 {
-                    auto ht_data = right_table.build_keys_hash_table(
+                    ht_cpu = right_table.build_keys_hash_table(
                         right_column,
                         cpu_allocator,
                         device_allocators[0],
                         false,
                         -1
                     );
-                    ht_cpu = std::get<0>(ht_data);
-                    build_min_value = std::get<1>(ht_data);
-                    build_max_value = std::get<2>(ht_data);
                 }
             }
 
+            #if USE_SEGMENT_STREAMING
+            // the probe segments can be streamed to any device holding the build side
+            auto build_devices = right_table.current_columns[right_column]->get_full_col_on_device();
+            for (int d = 0; d < device_queues.size(); d++)
+                if (build_devices[d] && ht_devices[d].slots == nullptr)
+                    ht_devices[d] = right_table.build_keys_hash_table(
+                        right_column,
+                        cpu_allocator,
+                        device_allocators[d],
+                        true,
+                        d
+                    );
+            #endif
+
             auto ht_dependencies = right_table.execute_pending_kernels();
 
             pending_kernels_dependencies_cpu.insert(
@@ -1354,18 +1798,7 @@ public:
                 );
             }
 
-            pending_kernels.push_back(
-                current_columns[left_column]->semi_join(
-                    flags_host,
-                    flags_devices,
-                    build_min_value,
-                    build_max_value,
-                    ht_cpu,
-                    ht_devices,
-                    flags_modified_host,
-                    flags_modified_devices
-                )
-            );
+            queue_join_probe(current_columns[left_column], ht_cpu, ht_devices, {});
 
             for (int i = 0; i < right_table.current_columns.size(); i++)
                 current_columns.push_back(nullptr);
@@ -1376,21 +1809,34 @@ public:
             std::cout << "Applying full join" << std::endl;
             #endif
 
-            auto probe_col_locations = current_columns[left_column]->get_positions();
+            Column *probe_column = current_columns[left_column];
+            auto probe_col_locations = probe_column->get_positions();
 
             bool can_probe_on_device = false, can_build_on_device = false;
             for (bool on_device : probe_col_locations.second)
                 can_probe_on_device = can_probe_on_device || on_device;
 
-            auto col_devices = right_table.current_columns[right_column]->get_full_col_on_device(),
-                group_by_col_devices = right_table.group_by_column->get_full_col_on_device();
+            std::vector<const Column *> payloads;
+            auto col_devices = right_table.current_columns[right_column]->get_full_col_on_device();
 
-            for (int d = 0; d < device_queues.size(); d++)
+            for (int payload_column : payload_columns)
             {
-                col_devices[d] = col_devices[d] && group_by_col_devices[d];
-                can_build_on_device = can_build_on_device || col_devices[d];
+                const Column *payload = right_table.current_columns[payload_column];
+                if (payload == nullptr)
+                {
+                    std::cerr << "Join operation: payload column " << payload_column << " is not available in the right table" << std::endl;
+                    throw std::invalid_argument("Join operation: payload column not available in the right table");
+                }
+                payloads.push_back(payload);
+
+                auto payload_devices = payload->get_full_col_on_device();
+                for (int d = 0; d < device_queues.size(); d++)
+                    col_devices[d] = col_devices[d] && payload_devices[d];
             }
 
+            for (int d = 0; d < device_queues.size(); d++)
+                can_build_on_device = can_build_on_device || col_devices[d];
+
             #if not PERFORMANCE_MEASUREMENT_ACTIVE
             std::cout << "Join hash table will be built on "
                 << (can_build_on_device && can_probe_on_device ? "GPU" : "CPU")
@@ -1398,40 +1844,46 @@ public:
                 << std::endl;
             #endif
 
-            Column &new_column = materialized_columns.emplace_back(
-                nrows,
-                cpu_queue,
-                device_queues,
-                cpu_allocator,
-                device_allocators[0],
-                true
-            );
-
-            auto min_max_gb = right_table.group_by_column->get_min_max();
-            uint64_t group_by_col_index = current_columns.size() + right_table.group_by_column_index;
-
+            uint64_t right_columns_start = current_columns.size();
             for (int i = 0; i < right_table.current_columns.size(); i++)
                 current_columns.push_back(nullptr);
 
-            current_columns[group_by_col_index] = &materialized_columns[materialized_columns.size() - 1];
+            std::vector<Column *> new_columns;
+            for (int payload_column : payload_columns)
+            {
+                Column &new_column = materialized_columns.emplace_back(
+                    nrows,
+                    cpu_queue,
+                    device_queues,
+                    cpu_allocator,
+                    device_allocators[0],
+                    true
+                );
+                new_column.set_value_format(*right_table.current_columns[payload_column]);
+                new_columns.push_back(&new_column);
+                current_columns[right_columns_start + payload_column] = &new_column;
+            }
 
-            int build_min_value, build_max_value, *ht_host = nullptr;
-            std::vector<int *> ht_devices(device_queues.size(), nullptr);
+            JoinHashTable ht_host;
+            std::vector<JoinHashTable> ht_devices(device_queues.size());
 
             for (int d = 0; d < device_queues.size(); d++)
             {
-                if (probe_col_locations.second[d] && col_devices[d])
+                #if USE_SEGMENT_STREAMING
+                bool probe_on_device = true; // the probe segments can be streamed to any device holding the build side
+                #else
+                bool probe_on_device = probe_col_locations.second[d];
+                #endif
+                if (probe_on_device && col_devices[d])
                 {
-                    auto ht_data = right_table.build_key_vals_hash_table(
+                    ht_devices[d] = right_table.build_key_vals_hash_table(
                         right_column,
+                        payload_columns,
                         true,
                         d,
                         cpu_allocator,
                         device_allocators[d]
                     );
-                    ht_devices[d] = std::get<0>(ht_data);
-                    build_min_value = std::get<1>(ht_data);
-                    build_max_value = std::get<2>(ht_data);
                 }
             }
 
@@ -1439,16 +1891,14 @@ public:
             // Assumed all probe segments on a device have the full build columns on device too
             if (probe_col_locations.first)
             {
-                auto ht_data = right_table.build_key_vals_hash_table(
+                ht_host = right_table.build_key_vals_hash_table(
                     right_column,
+                    payload_columns,
                     false,
                     -1,
                     cpu_allocator,
                     device_allocators[0]
                 );
-                ht_host = std::get<0>(ht_data);
-                build_min_value = std::get<1>(ht_data);
-                build_max_value = std::get<2>(ht_data);
             }
 
             auto ht_dependencies = right_table.execute_pending_kernels();
@@ -1467,25 +1917,23 @@ public:
                 );
             }
 
-            auto join_ops = current_columns[left_column]->full_join_operation(
-                flags_host,
-                flags_devices,
-                build_min_value,
-                build_max_value,
-                min_max_gb.first,
-                min_max_gb.second,
-                ht_host,
-                ht_devices,
-                new_column,
-                cpu_queue,
-                device_queues,
-                cpu_allocator,
-                device_allocators,
-                flags_modified_host,
-                flags_modified_devices
-            );
+            for (int p = 0; p < new_columns.size(); p++)
+            {
+                auto min_max = payloads[p]->get_min_max();
+                for (Segment &new_seg : new_columns[p]->get_segments())
+                {
+                    new_seg.set_min(min_max.first);
+                    new_seg.set_max(min_max.second);
+                }
+            }
+
+            const PendingJoinProbe &probe = queue_join_probe(probe_column, ht_host, ht_devices, new_columns);
 
-            pending_kernels.push_back(join_ops);
+            // payloads are written where their segment is probed
+            for (uint64_t i = 0; i < probe.segment_locations.size(); i++)
+                if (probe.segment_locations[i] >= 0)
+                    for (Column *new_column : new_columns)
+                        new_column->get_segments()[i].build_on_device(device_allocators[probe.segment_locations[i]], probe.segment_locations[i]);
         }
     }
 };
\ No newline at end of file
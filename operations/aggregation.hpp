@@ -13,7 +13,7 @@
 
 std::vector<sycl::event> parse_aggregate(
     TableData<int> &table_data,
-    const AggType &agg,
+    const std::vector<AggType> &aggs,
     const std::vector<long> &group,
     std::vector<void *> &resources,
     memory_manager &gpu_allocator,
@@ -27,12 +27,66 @@ std::vector<sycl::event> parse_aggregate(
     std::vector<sycl::event> events;
     events.reserve(group.size() + 2);
 
+    // all the aggregates are computed in one pass, COUNT has no input column
+    int num_aggs = aggs.size();
+    std::vector<AggregateFunction> functions;
+    std::vector<typed_column> agg_columns;
+    std::vector<int> scales; // decimal scale of every aggregate result
+    std::vector<const column_dictionary *> dictionaries; // MIN and MAX of a string column are codes
+    for (const AggType &agg : aggs)
+    {
+        AggregateFunction function;
+        try
+        {
+            function = get_aggregate_function(agg.agg);
+        }
+        catch (const std::invalid_argument &e)
+        {
+            std::cerr << "Aggregate operation: " << e.what() << std::endl;
+            return {};
+        }
+        functions.push_back(function);
+
+        if (function == AggregateFunction::Count)
+        {
+            agg_columns.push_back({});
+            scales.push_back(0);
+            dictionaries.push_back(nullptr);
+        }
+        else if (agg.operands.empty())
+        {
+            std::cerr << "Aggregate operation: " << agg.agg << " without operands" << std::endl;
+            return {};
+        }
+        else
+        {
+            const ColumnData<int> &column = table_data.columns[table_data.column_indices.at(agg.operands[0])];
+            agg_columns.push_back({ column.content, column.type });
+            scales.push_back(column.scale);
+            dictionaries.push_back(function == AggregateFunction::Min || function == AggregateFunction::Max ? column.dictionary : nullptr);
+        }
+    }
+
+    aggregate_slots slots = plan_aggregate_slots(functions, group.size() > 0);
+    int num_slots = slots.functions.size();
+    if (num_slots > MAX_AGGREGATES)
+    {
+        std::cerr << "Aggregate operation: more than " << MAX_AGGREGATES << " aggregate slots" << std::endl;
+        return {};
+    }
+    agg_columns.resize(num_slots);
+
     if (group.size() == 0)
     {
-        uint64_t *result = gpu_allocator.alloc_zero<uint64_t>(1);
-        events.push_back(aggregate_operation(
-            table_data.columns[table_data.column_indices.at(agg.operands[0])].content,
-            table_data.flags, table_data.col_len, result, queue, dependencies));
+        uint64_t *result = gpu_allocator.alloc_zero<uint64_t>(num_slots);
+        std::vector<sycl::event> agg_dependencies = init_aggregate_slots(result, slots.functions, 1, queue, dependencies);
+        agg_dependencies.insert(agg_dependencies.end(), dependencies.begin(), dependencies.end());
+        sycl::event agg_event = aggregate_operation(
+            agg_columns.data(), slots.functions.data(), num_slots,
+            table_data.flags, table_data.col_len, result, gpu_allocator, queue, agg_dependencies);
+        if (!slots.averages.empty())
+            agg_event = finalize_averages(result, slots.averages, 1, queue, { agg_event });
+        events.push_back(agg_event);
 
         #if PRINT_AGGREGATE_DEBUG_INFO
         auto end = std::chrono::high_resolution_clock::now();
@@ -52,16 +106,23 @@ std::vector<sycl::event> parse_aggregate(
         start = std::chrono::high_resolution_clock::now();
         #endif
 
-        table_data.columns = sycl::malloc_shared<ColumnData<int>>(1, queue);
-        table_data.columns[0].content = (int *)result;
-        table_data.columns[0].has_ownership = true;
-        table_data.columns[0].is_aggregate_result = true;
-        table_data.columns[0].min_value = 0; // TODO: set real min value
-        table_data.columns[0].max_value = 0; // TODO: set real max value
-        table_data.col_number = 1;
-        table_data.columns_size = 1;
+        table_data.columns = sycl::malloc_shared<ColumnData<int>>(num_aggs, queue);
+        for (int a = 0; a < num_aggs; a++)
+        {
+            table_data.columns[a].content = (int *)(result + a);
+            table_data.columns[a].has_ownership = true;
+            table_data.columns[a].is_aggregate_result = true;
+            table_data.columns[a].type = ColumnType::Int64;
+            table_data.columns[a].scale = scales[a];
+            table_data.columns[a].dictionary = dictionaries[a];
+            table_data.columns[a].input_rows = aggregate_is_nullable(functions[a]) ? result + slots.rows_slot : nullptr;
+            table_data.columns[a].min_value = 0; // TODO: set real min value
+            table_data.columns[a].max_value = 0; // TODO: set real max value
+            table_data.column_indices[a] = a;
+        }
+        table_data.col_number = num_aggs;
+        table_data.columns_size = num_aggs;
         table_data.col_len = 1;
-        table_data.column_indices[0] = 0;
 
         #if PRINT_AGGREGATE_DEBUG_INFO
         end = std::chrono::high_resolution_clock::now();
@@ -70,8 +131,8 @@ std::vector<sycl::event> parse_aggregate(
         start = std::chrono::high_resolution_clock::now();
         #endif
 
-        table_data.flags = gpu_allocator.alloc<bool>(1, true);
-        events.push_back(queue.fill(table_data.flags, true, 1));
+        table_data.flags = gpu_allocator.alloc<flag_word>(flag_words(1), true);
+        events.push_back(fill_flags(table_data.flags, true, 1, queue));
 
         #if PRINT_AGGREGATE_DEBUG_INFO
         end = std::chrono::high_resolution_clock::now();
@@ -83,7 +144,15 @@ std::vector<sycl::event> parse_aggregate(
     {
         ColumnData<int> *group_columns = sycl::malloc_shared<ColumnData<int>>(group.size(), queue);
         for (int i = 0; i < group.size(); i++)
+        {
             group_columns[i] = table_data.columns[table_data.column_indices.at(group[i])];
+            if (group_columns[i].type != ColumnType::Int32)
+            {
+                std::cerr << "Aggregate operation: group by on a 64-bit column is not supported" << std::endl;
+                sycl::free(group_columns, queue);
+                return {};
+            }
+        }
 
         #if PRINT_AGGREGATE_DEBUG_INFO
         auto end = std::chrono::high_resolution_clock::now();
@@ -94,8 +163,8 @@ std::vector<sycl::event> parse_aggregate(
 
         auto agg_res = group_by_aggregate(
             group_columns,
-            table_data.columns[table_data.column_indices.at(agg.operands[0])].content,
-            table_data.flags, group.size(), table_data.col_len, agg.agg,
+            agg_columns.data(), slots.functions.data(), num_slots,
+            table_data.flags, group.size(), table_data.col_len,
             gpu_allocator, queue, dependencies);
 
         resources.push_back(group_columns);
@@ -119,22 +188,28 @@ std::vector<sycl::event> parse_aggregate(
         #endif
 
         sycl::event agg_event = std::get<4>(agg_res);
+        if (!slots.averages.empty())
+            events.push_back(finalize_averages(std::get<3>(agg_res), slots.averages, std::get<1>(agg_res), queue, { agg_event }));
+        else
+            events.push_back(agg_event);
 
         int **results = std::get<0>(agg_res);
 
-        table_data.columns = sycl::malloc_shared<ColumnData<int>>(group.size() + 1, queue);
+        table_data.columns = sycl::malloc_shared<ColumnData<int>>(group.size() + num_aggs, queue);
         for (int i = 0; i < group.size(); i++)
         {
             table_data.columns[i].content = results[i];
             table_data.columns[i].has_ownership = true;
             table_data.columns[i].is_aggregate_result = false;
-            table_data.columns[i].min_value = 0; // TODO: set real min value
-            table_data.columns[i].max_value = 0; //  TODO: set real max value
+            table_data.columns[i].type = ColumnType::Int32;
+            table_data.columns[i].scale = group_columns[i].scale;
+            table_data.columns[i].dictionary = group_columns[i].dictionary;
+            table_data.columns[i].input_rows = nullptr;
+            table_data.columns[i].min_value = group_columns[i].min_value;
+            table_data.columns[i].max_value = group_columns[i].max_value;
             table_data.column_indices[i] = i;
         }
 
-        resources.push_back(results);
-
         #if PRINT_AGGREGATE_DEBUG_INFO
         end = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double, std::milli> alloc_time = end - start;
@@ -142,15 +217,24 @@ std::vector<sycl::event> parse_aggregate(
         start = std::chrono::high_resolution_clock::now();
         #endif
 
-        table_data.columns[group.size()].content = (int *)std::get<3>(agg_res);
-        table_data.columns[group.size()].has_ownership = true;
-        table_data.columns[group.size()].is_aggregate_result = true;
-        table_data.columns[group.size()].min_value = 0; // TODO: set real min value
-        table_data.columns[group.size()].max_value = 0; // TODO: set real max value
-        table_data.column_indices[group.size()] = group.size();
+        // the results of every aggregate follow each other
+        for (int a = 0; a < num_aggs; a++)
+        {
+            int col = group.size() + a;
+            table_data.columns[col].content = (int *)(std::get<3>(agg_res) + a * std::get<1>(agg_res));
+            table_data.columns[col].has_ownership = true;
+            table_data.columns[col].is_aggregate_result = true;
+            table_data.columns[col].type = ColumnType::Int64;
+            table_data.columns[col].scale = scales[a];
+            table_data.columns[col].dictionary = dictionaries[a];
+            table_data.columns[col].input_rows = nullptr; // every group has rows
+            table_data.columns[col].min_value = 0; // TODO: set real min value
+            table_data.columns[col].max_value = 0; // TODO: set real max value
+            table_data.column_indices[col] = col;
+        }
 
-        table_data.col_number = group.size() + 1;
-        table_data.columns_size = group.size() + 1;
+        table_data.col_number = group.size() + num_aggs;
+        table_data.columns_size = group.size() + num_aggs;
         table_data.col_len = std::get<1>(agg_res);
         table_data.flags = std::get<2>(agg_res);;
 
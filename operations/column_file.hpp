@@ -0,0 +1,216 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../common.hpp"
+
+// Self-describing column container.
+//
+// Layout:
+//   column_file_header
+//   column_segment_stats[num_segments]  (segment directory)
+//   padding up to data_offset (multiple of COLUMN_FILE_ALIGNMENT)
+//   nrows values of value_size bytes, segment after segment
+//
+// Segment i starts at data_offset + i * segment_size * value_size, so with a
+// page-multiple segment size every segment is a page-aligned range of the file.
+// The directory holds the per-segment statistics, so they are available for
+// planning before any data page is read.
+
+#define COLUMN_FILE_VERSION 1
+#define COLUMN_FILE_ALIGNMENT 4096
+#define COLUMN_FILE_EXTENSION ".col"
+
+#define COLUMN_FILE_HAS_CHECKSUMS 1
+
+static const char column_file_magic[8] = { 'S', 'Y', 'C', 'L', 'D', 'B', 'C', 'F' };
+
+struct column_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t value_size;   // bytes per value
+    uint64_t nrows;
+    uint64_t segment_size; // rows per segment (last one may be shorter)
+    uint64_t num_segments;
+    uint64_t data_offset;  // byte offset of the first value
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct column_segment_stats
+{
+    uint64_t nrows;
+    int min_value;
+    int max_value;
+    uint64_t null_count;
+    uint64_t checksum; // 0 when the file has no checksums
+};
+
+// FNV-1a over the segment values
+uint64_t column_checksum(const int *data, uint64_t count)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        hash ^= static_cast<uint32_t>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void write_column_file(
+    const std::string &filename,
+    const int *data,
+    uint64_t nrows,
+    uint64_t segment_size,
+    bool with_checksums = true)
+{
+    if (segment_size == 0)
+    {
+        std::cerr << "Column file: segment size must be positive" << std::endl;
+        throw std::invalid_argument("Column file: segment size must be positive");
+    }
+
+    column_file_header header;
+    std::memcpy(header.magic, column_file_magic, sizeof(header.magic));
+    header.version = COLUMN_FILE_VERSION;
+    header.value_size = sizeof(int);
+    header.nrows = nrows;
+    header.segment_size = segment_size;
+    header.num_segments = (nrows + segment_size - 1) / segment_size;
+    header.flags = with_checksums ? COLUMN_FILE_HAS_CHECKSUMS : 0;
+    header.reserved = 0;
+
+    uint64_t directory_end = sizeof(column_file_header) + header.num_segments * sizeof(column_segment_stats);
+    header.data_offset = (directory_end + COLUMN_FILE_ALIGNMENT - 1) / COLUMN_FILE_ALIGNMENT * COLUMN_FILE_ALIGNMENT;
+
+    std::vector<column_segment_stats> directory(header.num_segments);
+    for (uint64_t s = 0; s < header.num_segments; s++)
+    {
+        const int *segment = data + s * segment_size;
+        uint64_t count = std::min(segment_size, nrows - s * segment_size);
+
+        column_segment_stats &stats = directory[s];
+        stats.nrows = count;
+        stats.min_value = segment[0];
+        stats.max_value = segment[0];
+        for (uint64_t i = 1; i < count; i++)
+        {
+            stats.min_value = std::min(stats.min_value, segment[i]);
+            stats.max_value = std::max(stats.max_value, segment[i]);
+        }
+        stats.null_count = 0; // raw columns have no nulls
+        stats.checksum = with_checksums ? column_checksum(segment, count) : 0;
+    }
+
+    std::ofstream out(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out.is_open())
+    {
+        std::cerr << "Column file: could not open " << filename << " for writing" << std::endl;
+        throw std::runtime_error("Column file: could not open " + filename + " for writing");
+    }
+
+    std::vector<char> padding(header.data_offset - directory_end, 0);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(directory.data()), directory.size() * sizeof(column_segment_stats));
+    out.write(padding.data(), padding.size());
+    out.write(reinterpret_cast<const char *>(data), nrows * sizeof(int));
+
+    if (!out.good())
+    {
+        std::cerr << "Column file: write failed for " << filename << std::endl;
+        throw std::runtime_error("Column file: write failed for " + filename);
+    }
+}
+
+// Non-owning view over the bytes of a column file (usually a mapped_file).
+// Only the header and the directory are read on construction.
+class column_file_view
+{
+private:
+    const column_file_header *header;
+    const column_segment_stats *directory;
+    const char *base;
+public:
+    column_file_view(const void *file_data, uint64_t file_size, const std::string &filename);
+
+    uint64_t get_nrows() const { return header->nrows; }
+    uint64_t get_segment_size() const { return header->segment_size; }
+    uint64_t num_segments() const { return header->num_segments; }
+    bool has_checksums() const { return header->flags & COLUMN_FILE_HAS_CHECKSUMS; }
+
+    // offset of the first value, in values from the beginning of the file
+    uint64_t get_first_row_offset() const { return header->data_offset / header->value_size; }
+
+    const column_segment_stats &get_segment_stats(uint64_t segment) const { return directory[segment]; }
+    const int *get_segment_data(uint64_t segment) const
+    {
+        return reinterpret_cast<const int *>(base + header->data_offset) + segment * header->segment_size;
+    }
+
+    bool verify_segment(uint64_t segment) const;
+    void verify_checksums(const std::string &filename) const;
+};
+
+column_file_view::column_file_view(const void *file_data, uint64_t file_size, const std::string &filename)
+    : header(reinterpret_cast<const column_file_header *>(file_data)),
+    base(reinterpret_cast<const char *>(file_data))
+{
+    if (file_size < sizeof(column_file_header) || std::memcmp(header->magic, column_file_magic, sizeof(column_file_magic)) != 0)
+    {
+        std::cerr << "Column file: " << filename << " is not a column file" << std::endl;
+        throw std::runtime_error("Column file: " + filename + " is not a column file");
+    }
+    if (header->version != COLUMN_FILE_VERSION)
+    {
+        std::cerr << "Column file: " << filename << " has unsupported version " << header->version << std::endl;
+        throw std::runtime_error("Column file: " + filename + " has unsupported version");
+    }
+    if (header->value_size != sizeof(int) || header->data_offset % sizeof(int) != 0)
+    {
+        std::cerr << "Column file: " << filename << " has unsupported value size " << header->value_size << std::endl;
+        throw std::runtime_error("Column file: " + filename + " has unsupported value size");
+    }
+    if (header->segment_size == 0
+        || header->num_segments != (header->nrows + header->segment_size - 1) / header->segment_size
+        || sizeof(column_file_header) + header->num_segments * sizeof(column_segment_stats) > header->data_offset
+        || header->data_offset + header->nrows * header->value_size > file_size)
+    {
+        std::cerr << "Column file: " << filename << " is truncated or corrupted" << std::endl;
+        throw std::runtime_error("Column file: " + filename + " is truncated or corrupted");
+    }
+
+    directory = reinterpret_cast<const column_segment_stats *>(base + sizeof(column_file_header));
+}
+
+bool column_file_view::verify_segment(uint64_t segment) const
+{
+    if (!has_checksums())
+        return true;
+
+    const column_segment_stats &stats = directory[segment];
+    return column_checksum(get_segment_data(segment), stats.nrows) == stats.checksum;
+}
+
+// every segment when VERIFY_COLUMN_CHECKSUMS is set, called by the loaders of both engines
+void column_file_view::verify_checksums([[maybe_unused]] const std::string &filename) const
+{
+    #if VERIFY_COLUMN_CHECKSUMS
+    for (uint64_t s = 0; s < num_segments(); s++)
+    {
+        if (!verify_segment(s))
+        {
+            std::cerr << "Checksum mismatch in " << filename << " segment " << s << std::endl;
+            throw std::runtime_error("Checksum mismatch in " + filename);
+        }
+    }
+    #endif
+}
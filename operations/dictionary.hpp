@@ -0,0 +1,150 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Dictionary encoding of string columns.
+//
+// The column file of a string column holds int codes, its sidecar
+// <column file>.dict holds the dictionary: the distinct strings in sorted
+// order, one per line, the code of a string being its line number. Codes
+// compare like the strings they stand for, so equality, range predicates,
+// sorts and group bys run on the codes; strings are only needed to translate
+// the literals of a plan and to write the result.
+
+#define DICTIONARY_FILE_EXTENSION ".dict"
+
+class column_dictionary
+{
+private:
+    std::vector<std::string> values; // sorted, distinct
+public:
+    column_dictionary(std::vector<std::string> sorted_values)
+        : values(std::move(sorted_values))
+    {
+        if (!std::is_sorted(values.begin(), values.end()) ||
+            std::adjacent_find(values.begin(), values.end()) != values.end())
+        {
+            std::cerr << "Column dictionary: values are not sorted and distinct" << std::endl;
+            throw std::invalid_argument("Column dictionary: values are not sorted and distinct");
+        }
+    }
+
+    uint64_t size() const { return values.size(); }
+
+    const std::string &decode(int code) const
+    {
+        if (code < 0 || (uint64_t)code >= values.size())
+        {
+            std::cerr << "Column dictionary: code " << code << " out of range (" << values.size() << " values)" << std::endl;
+            throw std::out_of_range("Column dictionary: code out of range");
+        }
+        return values[code];
+    }
+
+    // code of value, -1 when it is not in the dictionary (no row can match)
+    int encode(const std::string &value) const
+    {
+        auto it = std::lower_bound(values.begin(), values.end(), value);
+        return it != values.end() && *it == value ? it - values.begin() : -1;
+    }
+
+    // first code whose string is >= value
+    int lower_bound_code(const std::string &value) const
+    {
+        return std::lower_bound(values.begin(), values.end(), value) - values.begin();
+    }
+
+    // first code whose string is > value
+    int upper_bound_code(const std::string &value) const
+    {
+        return std::upper_bound(values.begin(), values.end(), value) - values.begin();
+    }
+};
+
+// Calcite type of a character literal, e.g. CHAR(9) or VARCHAR
+bool is_character_type(const std::string &type)
+{
+    return type.rfind("CHAR", 0) == 0 || type.rfind("VARCHAR", 0) == 0;
+}
+
+// Builds the dictionary of strings and writes the code of every string into codes
+column_dictionary dictionary_encode(const std::vector<std::string> &strings, std::vector<int> &codes)
+{
+    std::vector<std::string> values(strings);
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+
+    column_dictionary dictionary(std::move(values));
+    codes.resize(strings.size());
+    for (uint64_t i = 0; i < strings.size(); i++)
+        codes[i] = dictionary.encode(strings[i]);
+    return dictionary;
+}
+
+void write_dictionary_file(const std::string &filename, const column_dictionary &dictionary)
+{
+    std::ofstream out(filename.c_str(), std::ios::out | std::ios::trunc);
+    if (!out.is_open())
+    {
+        std::cerr << "Column dictionary: could not open " << filename << " for writing" << std::endl;
+        throw std::runtime_error("Column dictionary: could not open " + filename + " for writing");
+    }
+
+    for (uint64_t code = 0; code < dictionary.size(); code++)
+    {
+        const std::string &value = dictionary.decode(code);
+        if (value.find('\n') != std::string::npos)
+        {
+            std::cerr << "Column dictionary: value with a line break in " << filename << std::endl;
+            throw std::invalid_argument("Column dictionary: value with a line break");
+        }
+        out << value << '\n';
+    }
+
+    if (!out.good())
+    {
+        std::cerr << "Column dictionary: write failed for " << filename << std::endl;
+        throw std::runtime_error("Column dictionary: write failed for " + filename);
+    }
+}
+
+column_dictionary read_dictionary_file(const std::string &filename)
+{
+    std::ifstream in(filename.c_str());
+    if (!in.is_open())
+    {
+        std::cerr << "Column dictionary: could not open " << filename << std::endl;
+        throw std::runtime_error("Column dictionary: could not open " + filename);
+    }
+
+    std::vector<std::string> values;
+    for (std::string line; std::getline(in, line);)
+        values.push_back(line);
+    return column_dictionary(std::move(values));
+}
+
+// dictionaries of the loaded string columns, kept for the whole run like the mapped column files
+std::map<std::string, std::unique_ptr<column_dictionary>> column_dictionaries;
+
+// dictionary of the column stored in column_filename, nullptr for a numeric column (no sidecar)
+const column_dictionary *load_column_dictionary(const std::string &column_filename)
+{
+    auto it = column_dictionaries.find(column_filename);
+    if (it != column_dictionaries.end())
+        return it->second.get();
+
+    std::string dictionary_filename = column_filename + DICTIONARY_FILE_EXTENSION;
+    if (access(dictionary_filename.c_str(), R_OK) != 0)
+        return nullptr;
+
+    auto dictionary = std::make_unique<column_dictionary>(read_dictionary_file(dictionary_filename));
+    return column_dictionaries.emplace(column_filename, std::move(dictionary)).first->second.get();
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../gen-cpp/calciteserver_types.h"
+
+#include "../kernels/projection.hpp"
+
+// Compilation of a PROJECT expression into an expression_program
+// (kernels/projection.hpp), shared by the two engines.
+
+// type, decimal scale and value range of an input column, as known by the engine
+struct expression_column
+{
+    ColumnType type;
+    int scale;
+    int64_t min_value, max_value;
+};
+
+#define MAX_DECIMAL_SCALE 18
+
+// scale of a Calcite DECIMAL(p, s) type, 0 for the integer types
+int decimal_scale(const std::string &type)
+{
+    if (type.rfind("DECIMAL", 0) != 0)
+        return 0;
+
+    std::string::size_type comma = type.find(',');
+    return comma == std::string::npos ? 0 : std::stoi(type.substr(comma + 1));
+}
+
+inline int64_t power_of_ten(int exponent)
+{
+    int64_t value = 1;
+    for (int e = 0; e < exponent; e++)
+        value *= 10;
+    return value;
+}
+
+template <typename ColumnInfo>
+class expression_compiler
+{
+private:
+    expression_program &program;
+    std::vector<int> &column_inputs;
+    std::vector<std::pair<int64_t, int64_t>> &column_ranges;
+    const ColumnInfo &column_info;
+    std::vector<expression_node> nodes;
+
+    int column_slot(int input, int &scale)
+    {
+        for (int c = 0; c < column_inputs.size(); c++)
+            if (column_inputs[c] == input)
+            {
+                scale = column_info(input).scale;
+                return c;
+            }
+
+        if (column_inputs.size() == MAX_EXPRESSION_COLUMNS)
+        {
+            std::cerr << "Project expression: more than " << MAX_EXPRESSION_COLUMNS << " columns" << std::endl;
+            throw std::runtime_error("Project expression: too many columns");
+        }
+
+        expression_column column = column_info(input);
+        program.column_types[column_inputs.size()] = column.type;
+        column_ranges.push_back({ column.min_value, column.max_value });
+        column_inputs.push_back(input);
+        program.num_columns = column_inputs.size();
+        scale = column.scale;
+        return column_inputs.size() - 1;
+    }
+
+    // multiplies the operand ending before position by 10^exponent
+    void rescale(std::vector<expression_node>::size_type position, int exponent)
+    {
+        if (exponent > MAX_DECIMAL_SCALE)
+        {
+            std::cerr << "Project expression: decimal scale above " << MAX_DECIMAL_SCALE << std::endl;
+            throw std::runtime_error("Project expression: decimal scale too large");
+        }
+        nodes.insert(nodes.begin() + position, {
+            { EXPRESSION_LITERAL, BinaryOp::Add, -1, power_of_ten(exponent) },
+            { EXPRESSION_OPERATION, BinaryOp::Multiply, -1, 0 }
+        });
+    }
+
+    // returns the decimal scale of the expression, the operands of + and - are aligned
+    // to the larger scale and the dividend of / is scaled up so that the quotient keeps its own
+    int compile_node(const ExprType &expr)
+    {
+        switch (expr.exprType)
+        {
+        case ExprOption::COLUMN:
+        {
+            int scale;
+            nodes.push_back({ EXPRESSION_COLUMN, BinaryOp::Add, column_slot(expr.input, scale), 0 });
+            return scale;
+        }
+        case ExprOption::LITERAL:
+            nodes.push_back({ EXPRESSION_LITERAL, BinaryOp::Add, -1, expr.literal.value });
+            return decimal_scale(expr.type);
+        case ExprOption::EXPR:
+        {
+            if (expr.operands.size() != 2)
+            {
+                std::cerr << "Project expression: Unsupported number of operands " << expr.operands.size()
+                    << " for " << expr.op << std::endl;
+                throw std::runtime_error("Project expression: Unsupported number of operands for EXPR");
+            }
+
+            BinaryOp op;
+            try
+            {
+                op = get_op_from_string(expr.op);
+            }
+            catch (const std::invalid_argument &)
+            {
+                std::cerr << "Project expression: Unsupported operation " << expr.op << std::endl;
+                throw;
+            }
+
+            int left_scale = compile_node(expr.operands[0]);
+            auto left_end = nodes.size();
+            int right_scale = compile_node(expr.operands[1]);
+
+            int scale;
+            switch (op)
+            {
+            case BinaryOp::Multiply:
+                scale = left_scale + right_scale;
+                break;
+            case BinaryOp::Divide:
+                scale = left_scale;
+                if (right_scale > 0)
+                    rescale(left_end, right_scale);
+                break;
+            default:
+                scale = std::max(left_scale, right_scale);
+                if (left_scale < scale)
+                    rescale(left_end, scale - left_scale);
+                else if (right_scale < scale)
+                    rescale(nodes.size(), scale - right_scale);
+                break;
+            }
+            if (scale > MAX_DECIMAL_SCALE)
+            {
+                std::cerr << "Project expression: decimal scale above " << MAX_DECIMAL_SCALE << std::endl;
+                throw std::runtime_error("Project expression: decimal scale too large");
+            }
+
+            nodes.push_back({ EXPRESSION_OPERATION, op, -1, 0 });
+            return scale;
+        }
+        default:
+            std::cerr << "Project expression: Unsupported parsing ExprType " << expr.exprType << std::endl;
+            throw std::runtime_error("Project expression: Unsupported parsing ExprType");
+        }
+    }
+
+public:
+    expression_compiler(
+        expression_program &program,
+        std::vector<int> &column_inputs,
+        std::vector<std::pair<int64_t, int64_t>> &column_ranges,
+        const ColumnInfo &column_info)
+        : program(program), column_inputs(column_inputs), column_ranges(column_ranges), column_info(column_info)
+    {}
+
+    void compile(const ExprType &expr)
+    {
+        program.scale = compile_node(expr);
+        if (nodes.size() > MAX_EXPRESSION_NODES)
+        {
+            std::cerr << "Project expression: more than " << MAX_EXPRESSION_NODES << " expression nodes" << std::endl;
+            throw std::runtime_error("Project expression: too many expression nodes");
+        }
+        std::copy(nodes.begin(), nodes.end(), program.nodes);
+        program.num_nodes = nodes.size();
+    }
+};
+
+// column_inputs receives the Calcite input index of every column slot of the program,
+// column_info(input) gives the expression_column of an input. The widths of the program
+// are planned here, once per query, from the ranges of the whole columns.
+template <typename ColumnInfo>
+expression_program compile_expression(const ExprType &expr, std::vector<int> &column_inputs, const ColumnInfo &column_info)
+{
+    expression_program program;
+    std::vector<std::pair<int64_t, int64_t>> column_ranges;
+    column_inputs.clear();
+    expression_compiler<ColumnInfo>(program, column_inputs, column_ranges, column_info).compile(expr);
+    program.shape = get_expression_shape(program);
+    expression_types(program, column_ranges);
+    return program;
+}
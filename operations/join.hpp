@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <map>
+#include <vector>
 
 #include <sycl/sycl.hpp>
 
@@ -17,6 +18,8 @@ std::vector<sycl::event> parse_join(
     TableData<int> &left_table,
     TableData<int> &right_table,
     const std::map<std::string, int> &table_last_used,
+    const std::vector<int> &payload_columns, // right table columns used after the join
+    std::vector<void *> &resources,
     memory_manager &gpu_allocator,
     sycl::queue &queue,
     const std::vector<sycl::event> &dependencies)
@@ -38,30 +41,20 @@ std::vector<sycl::event> parse_join(
     // filter joins if the right table is last accessed at this operation
     if (right_table.table_name != "" && table_last_used.at(right_table.table_name) == rel.id)
     {
-        int max_value, min_value;
-
-        if (right_table.ht != nullptr)
-        {
-            max_value = right_table.ht_max;
-            min_value = right_table.ht_min;
-        }
-        else
-        {
-            max_value = right_table.columns[right_table.column_indices.at(right_column)].max_value;
+        int max_value = right_table.columns[right_table.column_indices.at(right_column)].max_value,
             min_value = right_table.columns[right_table.column_indices.at(right_column)].min_value;
-        }
 
         event = filter_join(
             right_table.columns[right_table.column_indices.at(right_column)].content,
             right_table.flags, right_table.col_len,
             max_value, min_value,
             left_table.columns[left_table.column_indices.at(left_column)].content,
-            left_table.flags, left_table.col_len, (bool *)right_table.ht,
+            left_table.flags, left_table.col_len, right_table.ht,
             gpu_allocator, queue, dependencies);
     }
     else if (left_table.table_name == "lineorder")
     {
-        event = full_join(left_table, right_table, left_column, right_column, gpu_allocator, queue, dependencies);
+        event = full_join(left_table, right_table, left_column, right_column, payload_columns, resources, gpu_allocator, queue, dependencies);
     }
     else
     {
@@ -2,14 +2,22 @@
 
 #include <set>
 #include <fstream>
+#include <memory>
 
 #include <sycl/sycl.hpp>
 
 #include "../kernels/types.hpp"
 #include "memory_manager.hpp"
+#include "../kernels/common.hpp"
+#include "mapped_file.hpp"
+#include "column_file.hpp"
+#include "dictionary.hpp"
 
 #include "../common.hpp"
 
+// mappings backing host-resident tables, kept for the whole run like the malloc_host buffers they replace
+std::vector<std::unique_ptr<mapped_file>> table_mappings;
+
 TableData<int> loadTable(
     std::string table_name,
     int col_number,
@@ -23,7 +31,7 @@ TableData<int> loadTable(
     res.col_number = col_number;
     res.columns_size = columns.size();
     res.table_name = table_name;
-    res.ht = nullptr;
+    res.ht = JoinHashTable();
 
     res.columns = sycl::malloc_shared<ColumnData<int>>(res.columns_size, queue);
 
@@ -38,67 +46,125 @@ TableData<int> loadTable(
         std::string filename = DATA_DIR + col_name;
         // std::cout << "Loading column: " << filename << std::endl;
 
-        std::ifstream colData(filename.c_str(), std::ios::in | std::ios::binary);
+        #if USE_MMAP_LOADING
+        // host-resident columns are read in place by kernels on queue
+        bool use_mmap = load_on_device || queue.get_device().has(sycl::aspect::usm_system_allocations);
+        #else
+        bool use_mmap = false;
+        #endif
 
-        colData.seekg(0, std::ios::end);
-        std::streampos fileSize = colData.tellg();
-        int num_entries = static_cast<int>(fileSize / sizeof(int));
+        int num_entries;
+        bool has_stats = false;
 
-        colData.seekg(0, std::ios::beg);
+        if (use_mmap)
+        {
+            // prefer the self-describing container written by convert_columns,
+            // its directory already holds the column min/max
+            std::string container_filename = filename + COLUMN_FILE_EXTENSION;
+            bool has_container = access(container_filename.c_str(), R_OK) == 0;
 
-        int *content = sycl::malloc_host<int>(num_entries, queue);
-        colData.read((char *)content, num_entries * sizeof(int));
-        colData.close();
+            auto mapping = std::make_unique<mapped_file>(has_container ? container_filename : filename);
+            const int *file_content = mapping->get_data<int>();
 
-        if (load_on_device)
-        {
-            res.columns[i].content = allocator.alloc<int>(num_entries, true);
-            queue.memcpy(content, res.columns[i].content, num_entries * sizeof(int)).wait();
-            sycl::free(content, queue);
+            if (has_container)
+            {
+                column_file_view file(mapping->get_data<char>(), mapping->get_size(), container_filename);
+                file.verify_checksums(container_filename);
+                num_entries = static_cast<int>(file.get_nrows());
+                file_content = file.get_segment_data(0);
+
+                res.columns[i].min_value = file.get_segment_stats(0).min_value;
+                res.columns[i].max_value = file.get_segment_stats(0).max_value;
+                for (uint64_t s = 1; s < file.num_segments(); s++)
+                {
+                    res.columns[i].min_value = std::min(res.columns[i].min_value, file.get_segment_stats(s).min_value);
+                    res.columns[i].max_value = std::max(res.columns[i].max_value, file.get_segment_stats(s).max_value);
+                }
+                has_stats = true;
+            }
+            else
+                num_entries = static_cast<int>(mapping->get_size() / sizeof(int));
+
+            if (load_on_device)
+            {
+                res.columns[i].content = allocator.alloc<int>(num_entries, true);
+                queue.memcpy(res.columns[i].content, file_content, num_entries * sizeof(int)).wait();
+            }
+            else
+            {
+                res.columns[i].content = const_cast<int *>(file_content);
+                table_mappings.push_back(std::move(mapping));
+            }
         }
         else
         {
-            res.columns[i].content = content;
-        }
+            std::ifstream colData(filename.c_str(), std::ios::in | std::ios::binary);
 
+            colData.seekg(0, std::ios::end);
+            std::streampos fileSize = colData.tellg();
+            num_entries = static_cast<int>(fileSize / sizeof(int));
 
+            colData.seekg(0, std::ios::beg);
 
-        res.col_len = num_entries;
-        res.columns[i].has_ownership = true;
-        res.columns[i].is_aggregate_result = false;
-
-        int *min_val = sycl::malloc_shared<int>(1, queue);
-        int *max_val = sycl::malloc_shared<int>(1, queue);
-        content = res.columns[i].content;
-
-        auto e2 = queue.copy(content, min_val, 1);
-        auto e3 = queue.copy(content, max_val, 1);
+            int *content = sycl::malloc_host<int>(num_entries, queue);
+            colData.read((char *)content, num_entries * sizeof(int));
+            colData.close();
 
-        queue.submit(
-            [&](sycl::handler &cgh)
+            if (load_on_device)
             {
-                cgh.depends_on(e2);
-                cgh.depends_on(e3);
-
-                cgh.parallel_for(
-                    sycl::range<1>(res.col_len - 1),
-                    sycl::reduction(max_val, sycl::maximum<int>()),
-                    sycl::reduction(min_val, sycl::minimum<int>()),
-                    [=](sycl::id<1> idx, auto &maxr, auto &minr)
-                    {
-                        auto j = idx[0] + 1;
-                        int val = content[j];
-                        maxr.combine(val);
-                        minr.combine(val);
-                    }
-                );
+                res.columns[i].content = allocator.alloc<int>(num_entries, true);
+                queue.memcpy(res.columns[i].content, content, num_entries * sizeof(int)).wait();
+                sycl::free(content, queue);
             }
-        ).wait();
+            else
+            {
+                res.columns[i].content = content;
+            }
+        }
 
-        res.columns[i].min_value = *min_val;
-        res.columns[i].max_value = *max_val;
-        sycl::free(min_val, queue);
-        sycl::free(max_val, queue);
+        res.col_len = num_entries;
+        res.columns[i].has_ownership = true;
+        res.columns[i].is_aggregate_result = false;
+        res.columns[i].type = ColumnType::Int32;
+        res.columns[i].scale = 0;
+        res.columns[i].dictionary = load_column_dictionary(filename);
+        res.columns[i].input_rows = nullptr;
+
+        if (!has_stats)
+        {
+            int *min_val = sycl::malloc_shared<int>(1, queue);
+            int *max_val = sycl::malloc_shared<int>(1, queue);
+            int *content = res.columns[i].content;
+
+            auto e2 = queue.copy(content, min_val, 1);
+            auto e3 = queue.copy(content, max_val, 1);
+
+            queue.submit(
+                [&](sycl::handler &cgh)
+                {
+                    cgh.depends_on(e2);
+                    cgh.depends_on(e3);
+
+                    cgh.parallel_for(
+                        sycl::range<1>(res.col_len - 1),
+                        sycl::reduction(max_val, sycl::maximum<int>()),
+                        sycl::reduction(min_val, sycl::minimum<int>()),
+                        [=](sycl::id<1> idx, auto &maxr, auto &minr)
+                        {
+                            auto j = idx[0] + 1;
+                            int val = content[j];
+                            maxr.combine(val);
+                            minr.combine(val);
+                        }
+                    );
+                }
+            ).wait();
+
+            res.columns[i].min_value = *min_val;
+            res.columns[i].max_value = *max_val;
+            sycl::free(min_val, queue);
+            sycl::free(max_val, queue);
+        }
 
         i++;
     }
@@ -108,8 +174,8 @@ TableData<int> loadTable(
         << res.col_number << " columns ("
         << res.columns_size << " in memory)" << std::endl;
 
-    res.flags = allocator.alloc<bool>(res.col_len, true);
-    queue.fill(res.flags, true, res.col_len).wait();
+    res.flags = allocator.alloc<flag_word>(flag_words(res.col_len), true);
+    fill_flags(res.flags, true, res.col_len, queue).wait();
     return res;
 }
 
@@ -139,7 +205,7 @@ TableData<int> copy_table(
     res.col_number = table_data.col_number;
     res.columns_size = columns.size();
     res.table_name = table_data.table_name;
-    res.ht = nullptr;
+    res.ht = JoinHashTable();
     res.col_len = table_data.col_len;
 
     res.columns = sycl::malloc_shared<ColumnData<int>>(res.columns_size, queue);
@@ -155,6 +221,10 @@ TableData<int> copy_table(
         res.columns[i].content = content;
         res.columns[i].has_ownership = true;
         res.columns[i].is_aggregate_result = false;
+        res.columns[i].type = ColumnType::Int32;
+        res.columns[i].scale = table_data.columns[orig_col_idx].scale;
+        res.columns[i].dictionary = table_data.columns[orig_col_idx].dictionary;
+        res.columns[i].input_rows = nullptr;
 
         res.columns[i].min_value = table_data.columns[orig_col_idx].min_value;
         res.columns[i].max_value = table_data.columns[orig_col_idx].max_value;
@@ -162,7 +232,7 @@ TableData<int> copy_table(
         i++;
     }
 
-    res.flags = gpu_allocator.alloc<bool>(res.col_len, true);
-    queue.copy(table_data.flags, res.flags, res.col_len);
+    res.flags = gpu_allocator.alloc<flag_word>(flag_words(res.col_len), true);
+    queue.copy(table_data.flags, res.flags, flag_words(res.col_len));
     return res;
 }
\ No newline at end of file
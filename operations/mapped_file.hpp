@@ -0,0 +1,102 @@
+#pragma once
+
+#include <sycl/sycl.hpp>
+
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a column file.
+// Pages are only faulted in when a kernel (or a copy) first touches them,
+// so mapping a file costs the same regardless of its size.
+class mapped_file
+{
+private:
+    void *mapping;
+    uint64_t size;
+    std::vector<std::pair<const void *, sycl::context>> prepared_ranges;
+public:
+    mapped_file(const std::string &filename);
+    ~mapped_file();
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    uint64_t get_size() const { return size; }
+
+    template <typename T>
+    const T *get_data(uint64_t offset = 0) const { return reinterpret_cast<const T *>(mapping) + offset; }
+
+    bool prepare_for_device(const void *ptr, uint64_t bytes, sycl::queue &queue);
+};
+
+mapped_file::mapped_file(const std::string &filename)
+    : mapping(nullptr), size(0)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cerr << "Could not open column file: " << filename << std::endl;
+        throw std::runtime_error("Could not open column file: " + filename);
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
+    {
+        close(fd);
+        std::cerr << "Could not stat column file: " << filename << std::endl;
+        throw std::runtime_error("Could not stat column file: " + filename);
+    }
+    size = file_stat.st_size;
+
+    if (size > 0)
+    {
+        // MAP_PRIVATE + PROT_READ: loaded columns are never written,
+        // results always go to materialized segments.
+        mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            mapping = nullptr;
+            close(fd);
+            std::cerr << "Could not map column file: " << filename << std::endl;
+            throw std::runtime_error("Could not map column file: " + filename);
+        }
+    }
+
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+}
+
+mapped_file::~mapped_file()
+{
+    #ifdef SYCL_EXT_ONEAPI_COPY_OPTIMIZE
+    for (auto &range : prepared_ranges)
+        sycl::ext::oneapi::experimental::release_from_device_copy(range.first, range.second);
+    #endif
+
+    if (mapping != nullptr)
+        munmap(mapping, size);
+}
+
+// Register a range of the mapping with the runtime before it is copied to a device,
+// so that host->device copies can use DMA instead of an internal staging buffer.
+// Returns false when the runtime cannot, the copies then have to be staged.
+bool mapped_file::prepare_for_device(const void *ptr, uint64_t bytes, sycl::queue &queue)
+{
+    #ifdef SYCL_EXT_ONEAPI_COPY_OPTIMIZE
+    sycl::context context = queue.get_context();
+    for (auto &range : prepared_ranges)
+        if (range.first == ptr && range.second == context)
+            return true;
+
+    sycl::ext::oneapi::experimental::prepare_for_device_copy(ptr, bytes, context);
+    prepared_ranges.emplace_back(ptr, context);
+    return true;
+    #else
+    return false;
+    #endif
+}
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../gen-cpp/CalciteServer.h"
+#include "../gen-cpp/calciteserver_types.h"
+
+#include "preprocessing.hpp"
+#include "plan_json.hpp"
+#include "dictionary.hpp"
+
+// In-process cache of the plans of the queries run, so that a repeated query, or another
+// instance of a query template, does not go through the Calcite server again.
+//
+// Queries are keyed by their normalized SQL (see normalize_sql), literals replaced by
+// placeholders. The first plan of a key becomes its template when the literals of the plan
+// (comparison values, SEARCH bounds, LIMIT and OFFSET) map one-to-one to the literals of
+// the SQL text, every SQL literal being found in the plan as written and only once among
+// the SQL literals. Other literals of the key are then substituted into a copy of the
+// template. Plans whose literals Calcite rewrote (folded expressions, dates, decimals) only
+// serve the exact same literals. The execution info (with the order of the operations) and
+// the plan shape do not depend on the literals, they are computed once per cached plan.
+
+struct cached_plan
+{
+    PlanResult result;
+    ExecutionInfo exec_info;
+    std::string shape; // see plan_shape
+};
+
+struct normalized_sql
+{
+    std::string text;                  // '?' for a number, '?' quoted for a string
+    std::vector<std::string> literals; // in text order, numbers as written and strings unquoted
+};
+
+// Drops comments, whitespace between symbols and a final ';', lowercases unquoted words
+// and replaces literals by placeholders: queries differing only by these have the same text.
+normalized_sql normalize_sql(const std::string &sql)
+{
+    normalized_sql normalized;
+    std::string &text = normalized.text;
+    uint64_t i = 0, n = sql.size();
+
+    auto is_word = [](char c) { return std::isalnum((unsigned char)c) || c == '_' || c == '?'; };
+    // words stay apart, symbols need no space
+    auto append = [&](const std::string &token)
+    {
+        if (!text.empty() && is_word(text.back()) && is_word(token.front()))
+            text += ' ';
+        text += token;
+    };
+
+    while (i < n)
+    {
+        char c = sql[i];
+        if (std::isspace((unsigned char)c))
+            i++;
+        else if (c == '-' && i + 1 < n && sql[i + 1] == '-')
+        {
+            while (i < n && sql[i] != '\n')
+                i++;
+        }
+        else if (c == '/' && i + 1 < n && sql[i + 1] == '*')
+        {
+            uint64_t end = sql.find("*/", i + 2);
+            i = end == std::string::npos ? n : end + 2;
+        }
+        else if (c == '\'')
+        {
+            std::string value;
+            for (i++; i < n; i++)
+            {
+                if (sql[i] != '\'')
+                    value += sql[i];
+                else if (i + 1 < n && sql[i + 1] == '\'') // escaped quote
+                    value += sql[i++];
+                else
+                    break;
+            }
+            i++;
+            normalized.literals.push_back(value);
+            append("'?'");
+        }
+        else if (c == '"') // quoted identifier, case sensitive
+        {
+            uint64_t end = sql.find('"', i + 1);
+            end = end == std::string::npos ? n : end + 1;
+            append(sql.substr(i, end - i));
+            i = end;
+        }
+        else if (std::isdigit((unsigned char)c) || (c == '.' && i + 1 < n && std::isdigit((unsigned char)sql[i + 1])))
+        {
+            uint64_t start = i;
+            while (i < n && (std::isdigit((unsigned char)sql[i]) || sql[i] == '.'))
+                i++;
+            normalized.literals.push_back(sql.substr(start, i - start));
+            append("?");
+        }
+        else if (std::isalpha((unsigned char)c) || c == '_')
+        {
+            std::string word;
+            for (; i < n && (std::isalnum((unsigned char)sql[i]) || sql[i] == '_'); i++)
+                word += std::tolower((unsigned char)sql[i]);
+            append(word);
+        }
+        else
+        {
+            append(std::string(1, c));
+            i++;
+        }
+    }
+
+    while (!text.empty() && text.back() == ';')
+        text.pop_back();
+
+    return normalized;
+}
+
+// literal of a plan, value for numbers, LIMIT and OFFSET, text for strings and SEARCH bounds
+struct plan_literal
+{
+    int64_t *value = nullptr;
+    std::string *text = nullptr;
+
+    static bool is_integer(const std::string &literal, int64_t &integer)
+    {
+        auto [end, error] = std::from_chars(literal.data(), literal.data() + literal.size(), integer);
+        return error == std::errc() && end == literal.data() + literal.size();
+    }
+
+    std::string sql_text() const
+    {
+        return text != nullptr ? *text : std::to_string(*value);
+    }
+
+    // false when the SQL literal does not fit, e.g. a decimal in place of an int
+    bool set(const std::string &literal) const
+    {
+        int64_t integer;
+        if (text == nullptr)
+            return is_integer(literal, *value);
+        if (is_integer(*text, integer) && !is_integer(literal, integer))
+            return false;
+        *text = literal;
+        return true;
+    }
+};
+
+void collect_expression_literals(ExprType &expr, std::vector<plan_literal> &literals)
+{
+    if (expr.exprType == ExprOption::LITERAL)
+    {
+        if (expr.literal.literalOption == LiteralOption::RANGE)
+        {
+            for (std::vector<std::string> &range : expr.literal.rangeSet)
+                for (uint64_t b = 1; b < range.size(); b++) // range[0] is the kind of the range
+                    literals.push_back({ nullptr, &range[b] });
+        }
+        else if (is_character_type(expr.type)) // string in the name, see resolve_plan_json
+            literals.push_back({ nullptr, &expr.name });
+        else
+            literals.push_back({ &expr.literal.value, nullptr });
+    }
+    else if (expr.exprType == ExprOption::EXPR)
+        for (ExprType &operand : expr.operands)
+            collect_expression_literals(operand, literals);
+}
+
+// every literal of plan, always in the same order for plans of the same shape
+std::vector<plan_literal> collect_plan_literals(PlanResult &plan)
+{
+    std::vector<plan_literal> literals;
+    for (RelNode &rel : plan.rels)
+    {
+        if (rel.relOp == RelNodeType::FILTER || rel.relOp == RelNodeType::JOIN)
+            collect_expression_literals(rel.condition, literals);
+        for (ExprType &expr : rel.exprs) // with the FETCH and OFFSET of a SORT, see resolve_plan_json
+            collect_expression_literals(expr, literals);
+    }
+    return literals;
+}
+
+class plan_cache
+{
+private:
+    struct plan_template
+    {
+        cached_plan plan;
+        std::vector<std::string> literals; // of the SQL text the plan was parsed from
+        std::vector<int> bindings;         // SQL literal of every plan literal
+    };
+
+    CalciteServerClient &client;
+    std::unordered_map<std::string, plan_template> templates; // normalized SQL -> template
+    std::unordered_map<std::string, cached_plan> plans;       // normalized SQL and literals -> plan
+    cached_plan instance;                                     // last template instance
+
+    // the SQL literal of every plan literal, false when they are not one-to-one
+    static bool bind_literals(PlanResult &plan, const std::vector<std::string> &sql_literals, std::vector<int> &bindings)
+    {
+        std::vector<bool> bound(sql_literals.size(), false);
+        for (const plan_literal &literal : collect_plan_literals(plan))
+        {
+            std::string text = literal.sql_text();
+            auto first = std::find(sql_literals.begin(), sql_literals.end(), text);
+            if (first == sql_literals.end() || std::find(first + 1, sql_literals.end(), text) != sql_literals.end())
+                return false;
+
+            bindings.push_back(first - sql_literals.begin());
+            bound[bindings.back()] = true;
+        }
+        return std::all_of(bound.begin(), bound.end(), [](bool b) { return b; });
+    }
+
+    // false when a literal does not fit its plan literal
+    static bool substitute_literals(PlanResult &plan, const std::vector<int> &bindings, const std::vector<std::string> &sql_literals)
+    {
+        std::vector<plan_literal> literals = collect_plan_literals(plan);
+        for (uint64_t l = 0; l < literals.size(); l++)
+            if (!literals[l].set(sql_literals[bindings[l]]))
+                return false;
+        return true;
+    }
+public:
+    plan_cache(CalciteServerClient &client)
+        : client(client)
+    {}
+
+    plan_cache(const plan_cache &) = delete;
+    plan_cache &operator=(const plan_cache &) = delete;
+
+    // The plan of sql, parsed by the Calcite server on a miss.
+    // A template instance is only valid until the next call.
+    const cached_plan &get(const std::string &sql)
+    {
+        normalized_sql normalized = normalize_sql(sql);
+
+        auto found_template = templates.find(normalized.text);
+        if (found_template != templates.end())
+        {
+            const plan_template &matched = found_template->second;
+            if (normalized.literals == matched.literals)
+                return matched.plan;
+
+            instance = matched.plan;
+            if (substitute_literals(instance.result, matched.bindings, normalized.literals))
+                return instance;
+        }
+
+        std::string key = normalized.text;
+        for (const std::string &literal : normalized.literals)
+            key += '\0' + literal;
+
+        auto found_plan = plans.find(key);
+        if (found_plan != plans.end())
+            return found_plan->second;
+
+        cached_plan plan;
+        client.parse(plan.result, sql);
+        resolve_plan_json(plan.result);
+        plan.exec_info = parse_execution_info(plan.result);
+        plan.shape = plan_shape(plan.result);
+
+        std::vector<int> bindings;
+        if (found_template == templates.end() && bind_literals(plan.result, normalized.literals, bindings))
+        {
+            return templates.emplace(
+                normalized.text,
+                plan_template { std::move(plan), normalized.literals, std::move(bindings) }
+            ).first->second.plan;
+        }
+
+        return plans.emplace(key, std::move(plan)).first->second;
+    }
+};
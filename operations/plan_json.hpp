@@ -0,0 +1,441 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../gen-cpp/calciteserver_types.h"
+
+#include "dictionary.hpp"
+
+// Parts of a plan only found in the JSON plan Calcite writes for it (PlanResult.oldJson),
+// copied into the fields of the Thrift plan by resolve_plan_json right after parsing.
+//
+// - The FETCH (LIMIT) and OFFSET of a SORT node become literal exprs of the node,
+//   named "fetch" and "offset", like the RexNode bounds of a Calcite Sort.
+// - A character literal (CHAR or VARCHAR) has no string in the Thrift plan, its string
+//   becomes the name of the literal. The character literals of a condition or of the
+//   exprs of a rel are those of its JSON, in the same depth-first order.
+//
+// The JSON rels are those of the Thrift plan, matched by id. A plan with character
+// literals and no JSON (or not the same literals) is rejected: the filters would compare
+// the columns to the wrong strings.
+
+struct json_value
+{
+    enum json_kind
+    {
+        JSON_NULL,
+        JSON_BOOLEAN,
+        JSON_NUMBER,
+        JSON_STRING,
+        JSON_ARRAY,
+        JSON_OBJECT
+    };
+
+    json_kind kind = JSON_NULL;
+    std::string text;                                        // strings unescaped, numbers and booleans as written
+    std::vector<json_value> items;                           // array
+    std::vector<std::pair<std::string, json_value>> members; // object, in order
+
+    // member of an object, nullptr when it has none of this name
+    const json_value *member(const std::string &name) const
+    {
+        for (const auto &[member_name, value] : members)
+            if (member_name == name)
+                return &value;
+        return nullptr;
+    }
+};
+
+class json_reader
+{
+private:
+    const std::string &json;
+    uint64_t position = 0;
+
+    [[noreturn]] void fail(const std::string &message) const
+    {
+        std::cerr << "Plan JSON: " << message << " at offset " << position << std::endl;
+        throw std::runtime_error("Plan JSON: " + message);
+    }
+
+    void skip_whitespace()
+    {
+        while (position < json.size() && (json[position] == ' ' || json[position] == '\t' || json[position] == '\n' || json[position] == '\r'))
+            position++;
+    }
+
+    void expect(char c)
+    {
+        skip_whitespace();
+        if (position >= json.size() || json[position] != c)
+            fail(std::string("expected '") + c + "'");
+        position++;
+    }
+
+    unsigned read_hex4()
+    {
+        if (position + 4 > json.size())
+            fail("truncated \\u escape");
+        unsigned code = 0;
+        for (int d = 0; d < 4; d++)
+        {
+            char c = json[position++];
+            code <<= 4;
+            if (c >= '0' && c <= '9')
+                code |= c - '0';
+            else if (c >= 'a' && c <= 'f')
+                code |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                code |= c - 'A' + 10;
+            else
+                fail("invalid \\u escape");
+        }
+        return code;
+    }
+
+    static void append_utf8(std::string &out, unsigned code)
+    {
+        if (code < 0x80)
+            out += (char)code;
+        else if (code < 0x800)
+        {
+            out += (char)(0xC0 | (code >> 6));
+            out += (char)(0x80 | (code & 0x3F));
+        }
+        else if (code < 0x10000)
+        {
+            out += (char)(0xE0 | (code >> 12));
+            out += (char)(0x80 | ((code >> 6) & 0x3F));
+            out += (char)(0x80 | (code & 0x3F));
+        }
+        else
+        {
+            out += (char)(0xF0 | (code >> 18));
+            out += (char)(0x80 | ((code >> 12) & 0x3F));
+            out += (char)(0x80 | ((code >> 6) & 0x3F));
+            out += (char)(0x80 | (code & 0x3F));
+        }
+    }
+
+    std::string read_string()
+    {
+        expect('"');
+        std::string out;
+        while (true)
+        {
+            if (position >= json.size())
+                fail("unterminated string");
+            char c = json[position++];
+            if (c == '"')
+                return out;
+            if (c != '\\')
+            {
+                out += c;
+                continue;
+            }
+
+            if (position >= json.size())
+                fail("unterminated string");
+            char escaped = json[position++];
+            switch (escaped)
+            {
+            case '"':
+            case '\\':
+            case '/':
+                out += escaped;
+                break;
+            case 'b':
+                out += '\b';
+                break;
+            case 'f':
+                out += '\f';
+                break;
+            case 'n':
+                out += '\n';
+                break;
+            case 'r':
+                out += '\r';
+                break;
+            case 't':
+                out += '\t';
+                break;
+            case 'u':
+            {
+                unsigned code = read_hex4();
+                if (code >= 0xD800 && code < 0xDC00 && position + 1 < json.size() && json[position] == '\\' && json[position + 1] == 'u')
+                {
+                    position += 2;
+                    unsigned low = read_hex4();
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                }
+                append_utf8(out, code);
+                break;
+            }
+            default:
+                fail("invalid escape");
+            }
+        }
+    }
+
+    json_value read_value()
+    {
+        skip_whitespace();
+        if (position >= json.size())
+            fail("unexpected end");
+
+        json_value value;
+        char c = json[position];
+        if (c == '{')
+        {
+            value.kind = json_value::JSON_OBJECT;
+            position++;
+            skip_whitespace();
+            if (position < json.size() && json[position] == '}')
+            {
+                position++;
+                return value;
+            }
+            while (true)
+            {
+                std::string name = read_string();
+                expect(':');
+                value.members.emplace_back(std::move(name), read_value());
+                skip_whitespace();
+                if (position < json.size() && json[position] == ',')
+                    position++;
+                else
+                {
+                    expect('}');
+                    return value;
+                }
+            }
+        }
+        if (c == '[')
+        {
+            value.kind = json_value::JSON_ARRAY;
+            position++;
+            skip_whitespace();
+            if (position < json.size() && json[position] == ']')
+            {
+                position++;
+                return value;
+            }
+            while (true)
+            {
+                value.items.push_back(read_value());
+                skip_whitespace();
+                if (position < json.size() && json[position] == ',')
+                    position++;
+                else
+                {
+                    expect(']');
+                    return value;
+                }
+            }
+        }
+        if (c == '"')
+        {
+            value.kind = json_value::JSON_STRING;
+            value.text = read_string();
+            return value;
+        }
+
+        // number, true, false or null
+        uint64_t start = position;
+        while (position < json.size() && json[position] != ',' && json[position] != '}' && json[position] != ']'
+            && json[position] != ' ' && json[position] != '\t' && json[position] != '\n' && json[position] != '\r')
+            position++;
+        value.text = json.substr(start, position - start);
+        if (value.text == "null")
+            value.kind = json_value::JSON_NULL;
+        else if (value.text == "true" || value.text == "false")
+            value.kind = json_value::JSON_BOOLEAN;
+        else if (!value.text.empty() && (value.text[0] == '-' || (value.text[0] >= '0' && value.text[0] <= '9')))
+            value.kind = json_value::JSON_NUMBER;
+        else
+            fail("unexpected token " + value.text);
+        return value;
+    }
+public:
+    json_reader(const std::string &json)
+        : json(json)
+    {}
+
+    json_value read()
+    {
+        json_value value = read_value();
+        skip_whitespace();
+        if (position != json.size())
+            fail("trailing characters");
+        return value;
+    }
+};
+
+json_value parse_json(const std::string &json)
+{
+    return json_reader(json).read();
+}
+
+// JSON of the rel with the given id, nullptr when the plan has none
+const json_value *plan_json_rel(const json_value &plan, int64_t id)
+{
+    const json_value *rels = plan.member("rels");
+    if (rels == nullptr || rels->kind != json_value::JSON_ARRAY)
+        return nullptr;
+
+    std::string id_text = std::to_string(id);
+    for (const json_value &rel : rels->items)
+    {
+        const json_value *rel_id = rel.member("id");
+        if (rel_id != nullptr && rel_id->text == id_text)
+            return &rel;
+    }
+    return nullptr;
+}
+
+// literal expr named name holding the integer RexLiteral bound of a JSON Sort
+ExprType sort_bound_literal(const std::string &name, const json_value &bound)
+{
+    const json_value *literal = bound.member("literal");
+    if (literal == nullptr || literal->kind != json_value::JSON_NUMBER)
+    {
+        std::cerr << "Plan JSON: the " << name << " of a SORT is not an integer literal" << std::endl;
+        throw std::runtime_error("Plan JSON: unsupported SORT " + name);
+    }
+
+    ExprType expr;
+    expr.__set_exprType(ExprOption::LITERAL);
+    expr.__set_name(name);
+    LiteralType value;
+    value.__set_literalOption(LiteralOption::LITERAL);
+    value.__set_value(std::stoll(literal->text));
+    expr.__set_literal(value);
+    const json_value *type = bound.member("type");
+    if (type != nullptr && type->member("type") != nullptr)
+        expr.__set_type(type->member("type")->text);
+    return expr;
+}
+
+// literal expr named name of a SORT node (see resolve_plan_json), nullptr when it has none
+const ExprType *sort_bound(const RelNode &rel, const std::string &name)
+{
+    for (const ExprType &expr : rel.exprs)
+        if (expr.exprType == ExprOption::LITERAL && expr.name == name)
+            return &expr;
+    return nullptr;
+}
+
+uint64_t sort_offset(const RelNode &rel)
+{
+    const ExprType *offset = sort_bound(rel, "offset");
+    return offset != nullptr ? offset->literal.value : 0;
+}
+
+uint64_t sort_fetch(const RelNode &rel)
+{
+    const ExprType *fetch = sort_bound(rel, "fetch");
+    return fetch != nullptr ? fetch->literal.value : UINT64_MAX;
+}
+
+// character literals of expr in depth-first order, SEARCH ranges carry their strings
+void collect_character_literals(ExprType &expr, std::vector<ExprType *> &literals)
+{
+    if (expr.exprType == ExprOption::LITERAL)
+    {
+        if (expr.literal.literalOption != LiteralOption::RANGE && is_character_type(expr.type))
+            literals.push_back(&expr);
+    }
+    else if (expr.exprType == ExprOption::EXPR)
+        for (ExprType &operand : expr.operands)
+            collect_character_literals(operand, literals);
+}
+
+// strings of the character RexLiterals of a JSON RexNode (or array of them), in depth-first order
+void collect_json_strings(const json_value &rex, std::vector<const std::string *> &strings)
+{
+    if (rex.kind == json_value::JSON_ARRAY)
+    {
+        for (const json_value &item : rex.items)
+            collect_json_strings(item, strings);
+        return;
+    }
+
+    const json_value *literal = rex.member("literal");
+    if (literal != nullptr)
+    {
+        const json_value *type = rex.member("type");
+        const json_value *type_name = type != nullptr ? type->member("type") : nullptr;
+        if (literal->kind == json_value::JSON_STRING && type_name != nullptr && is_character_type(type_name->text))
+            strings.push_back(&literal->text);
+        return;
+    }
+
+    const json_value *operands = rex.member("operands");
+    if (operands != nullptr)
+        collect_json_strings(*operands, strings);
+}
+
+void resolve_plan_json(PlanResult &plan)
+{
+    json_value json;
+    if (!plan.oldJson.empty())
+        json = parse_json(plan.oldJson);
+
+    for (RelNode &rel : plan.rels)
+    {
+        std::vector<ExprType *> literals;
+        if (rel.relOp == RelNodeType::FILTER || rel.relOp == RelNodeType::JOIN)
+            collect_character_literals(rel.condition, literals);
+        else if (rel.relOp == RelNodeType::PROJECT)
+            for (ExprType &expr : rel.exprs)
+                collect_character_literals(expr, literals);
+
+        if (literals.empty() && rel.relOp != RelNodeType::SORT)
+            continue;
+
+        if (plan.oldJson.empty())
+        {
+            if (literals.empty())
+                continue; // no FETCH or OFFSET known, the sort keeps every row
+            std::cerr << "Plan JSON: rel " << rel.id << " has character literals but the plan has no JSON for their strings" << std::endl;
+            throw std::runtime_error("Plan JSON: character literals without their strings");
+        }
+
+        const json_value *json_rel = plan_json_rel(json, rel.id);
+        if (json_rel == nullptr)
+        {
+            std::cerr << "Plan JSON: no rel with id " << rel.id << std::endl;
+            throw std::runtime_error("Plan JSON: missing rel");
+        }
+
+        if (rel.relOp == RelNodeType::SORT)
+        {
+            for (const char *name : { "offset", "fetch" })
+            {
+                const json_value *bound = json_rel->member(name);
+                if (bound != nullptr && bound->kind != json_value::JSON_NULL)
+                    rel.exprs.push_back(sort_bound_literal(name, *bound));
+            }
+            continue;
+        }
+
+        std::vector<const std::string *> strings;
+        for (const char *member : { "condition", "exprs" })
+            if (json_rel->member(member) != nullptr)
+                collect_json_strings(*json_rel->member(member), strings);
+
+        if (strings.size() != literals.size())
+        {
+            std::cerr << "Plan JSON: rel " << rel.id << " has " << literals.size() << " character literals but its JSON has "
+                << strings.size() << std::endl;
+            throw std::runtime_error("Plan JSON: character literals do not match");
+        }
+        for (uint64_t l = 0; l < literals.size(); l++)
+            literals[l]->__set_name(*strings[l]);
+    }
+}
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../gen-cpp/calciteserver_types.h"
+
+#include "../kernels/selection.hpp"
+
+#include "dictionary.hpp"
+
+// Compilation of the condition of a FILTER node into a predicate_program
+// (kernels/selection.hpp), shared by the two engines.
+
+comp_op mirror_comp_op(comp_op op)
+{
+    switch (op)
+    {
+    case LT:
+        return GT;
+    case LE:
+        return GE;
+    case GT:
+        return LT;
+    case GE:
+        return LE;
+    default:
+        return op;
+    }
+}
+
+// Bounds of a SEARCH range, ints or, on a dictionary-encoded column, strings translated into codes.
+int search_lower_bound(const std::string &bound, const column_dictionary *dictionary)
+{
+    return dictionary == nullptr ? std::stoi(bound) : dictionary->lower_bound_code(bound);
+}
+
+int search_upper_bound(const std::string &bound, const column_dictionary *dictionary)
+{
+    return dictionary == nullptr ? std::stoi(bound) : dictionary->upper_bound_code(bound) - 1;
+}
+
+int search_point(const std::string &point, const column_dictionary *dictionary)
+{
+    return dictionary == nullptr ? std::stoi(point) : dictionary->encode(point);
+}
+
+template <typename DictionaryOf>
+class predicate_compiler
+{
+private:
+    predicate_program &program;
+    std::vector<int> &column_inputs;
+    const DictionaryOf &dictionary_of;
+
+    void push_node(predicate_node_type type, comp_op comparison, int column1, int column2, int value)
+    {
+        if (program.num_nodes == MAX_PREDICATE_NODES)
+        {
+            std::cerr << "Filter condition: more than " << MAX_PREDICATE_NODES << " predicate nodes" << std::endl;
+            throw std::runtime_error("Filter condition: too many predicate nodes");
+        }
+        program.nodes[program.num_nodes++] = { type, comparison, column1, column2, value };
+    }
+
+    int column_slot(int input)
+    {
+        for (int c = 0; c < column_inputs.size(); c++)
+            if (column_inputs[c] == input)
+                return c;
+
+        if (column_inputs.size() == MAX_PREDICATE_COLUMNS)
+        {
+            std::cerr << "Filter condition: more than " << MAX_PREDICATE_COLUMNS << " columns" << std::endl;
+            throw std::runtime_error("Filter condition: too many columns");
+        }
+        column_inputs.push_back(input);
+        program.num_columns = column_inputs.size();
+        return column_inputs.size() - 1;
+    }
+
+    // dictionary used to translate a literal compared to the given input, nullptr for numbers
+    const column_dictionary *literal_dictionary(const ExprType &literal, int input)
+    {
+        if (!is_character_type(literal.type))
+            return nullptr;
+
+        const column_dictionary *dictionary = dictionary_of(input);
+        if (dictionary == nullptr)
+        {
+            std::cerr << "Filter condition: string literal compared to column " << input
+                << " which is not dictionary-encoded" << std::endl;
+            throw std::runtime_error("Filter condition: string literal on a column without dictionary");
+        }
+        return dictionary;
+    }
+
+    // Value a column is compared to: the literal itself or, for a string, its code. As the codes are
+    // in string order, a range comparison becomes a comparison to the first code past the string.
+    int comparison_value(const ExprType &literal, int input, comp_op &comparison)
+    {
+        const column_dictionary *dictionary = literal_dictionary(literal, input);
+        if (dictionary == nullptr)
+            return literal.literal.value;
+
+        const std::string &value = literal.name; // see resolve_plan_json
+        switch (comparison)
+        {
+        case LT:
+            return dictionary->lower_bound_code(value);
+        case LE:
+            comparison = LT;
+            return dictionary->upper_bound_code(value);
+        case GT:
+            comparison = GE;
+            return dictionary->upper_bound_code(value);
+        case GE:
+            return dictionary->lower_bound_code(value);
+        default:
+            return dictionary->encode(value); // -1 when absent, no row is equal to it
+        }
+    }
+
+    void compile_search(const ExprType &expr)
+    {
+        int slot = column_slot(expr.operands[0].input);
+        const auto &range_set = expr.operands[1].literal.rangeSet;
+        const column_dictionary *dictionary = literal_dictionary(expr.operands[1], expr.operands[0].input);
+
+        if (range_set.size() == 1) // range
+        {
+            push_node(PREDICATE_COMPARE_LITERAL, GE, slot, -1, search_lower_bound(range_set[0][1], dictionary));
+            push_node(PREDICATE_COMPARE_LITERAL, LE, slot, -1, search_upper_bound(range_set[0][2], dictionary));
+            push_node(PREDICATE_AND, EQ, -1, -1, 0);
+        }
+        else // or between values
+        {
+            for (int i = 0; i < range_set.size(); i++)
+            {
+                push_node(PREDICATE_COMPARE_LITERAL, EQ, slot, -1, search_point(range_set[i][1], dictionary));
+                if (i > 0)
+                    push_node(PREDICATE_OR, EQ, -1, -1, 0);
+            }
+        }
+    }
+
+    void compile_comparison(const ExprType &expr)
+    {
+        if (expr.operands.size() != 2)
+        {
+            std::cerr << "Filter condition: Unsupported number of operands for EXPR" << std::endl;
+            throw std::runtime_error("Filter condition: Unsupported number of operands for EXPR");
+        }
+
+        const ExprType &first = expr.operands[0], &second = expr.operands[1];
+        comp_op comparison = get_comp_op(expr.op);
+
+        if (first.exprType == ExprOption::COLUMN && second.exprType == ExprOption::COLUMN)
+            push_node(PREDICATE_COMPARE_COLUMNS, comparison, column_slot(first.input), column_slot(second.input), 0);
+        else if (first.exprType == ExprOption::COLUMN && second.exprType == ExprOption::LITERAL)
+        {
+            int value = comparison_value(second, first.input, comparison);
+            push_node(PREDICATE_COMPARE_LITERAL, comparison, column_slot(first.input), -1, value);
+        }
+        else if (first.exprType == ExprOption::LITERAL && second.exprType == ExprOption::COLUMN)
+        {
+            comparison = mirror_comp_op(comparison);
+            int value = comparison_value(first, second.input, comparison);
+            push_node(PREDICATE_COMPARE_LITERAL, comparison, column_slot(second.input), -1, value);
+        }
+        else
+        {
+            std::cerr << "Filter condition: Unsupported comparison operands "
+                << first.exprType << " and " << second.exprType << std::endl;
+            throw std::runtime_error("Filter condition: Unsupported comparison operands");
+        }
+    }
+
+public:
+    predicate_compiler(predicate_program &program, std::vector<int> &column_inputs, const DictionaryOf &dictionary_of)
+        : program(program), column_inputs(column_inputs), dictionary_of(dictionary_of)
+    {}
+
+    void compile(const ExprType &expr)
+    {
+        if (expr.exprType != ExprOption::EXPR)
+        {
+            std::cerr << "Filter condition: Unsupported parsing ExprType " << expr.exprType << std::endl;
+            throw std::runtime_error("Filter condition: Unsupported parsing ExprType");
+        }
+
+        if (expr.op == "SEARCH")
+            compile_search(expr);
+        else if (is_filter_logical(expr.op))
+        {
+            predicate_node_type type;
+            switch (get_logical_op(expr.op))
+            {
+            case AND:
+                type = PREDICATE_AND;
+                break;
+            case OR:
+                type = PREDICATE_OR;
+                break;
+            default:
+                std::cerr << "Filter condition: Unsupported logical operation " << expr.op << std::endl;
+                throw std::runtime_error("Filter condition: Unsupported logical operation " + expr.op);
+            }
+
+            for (int i = 0; i < expr.operands.size(); i++)
+            {
+                compile(expr.operands[i]);
+                if (i > 0)
+                    push_node(type, EQ, -1, -1, 0);
+            }
+        }
+        else
+            compile_comparison(expr);
+    }
+};
+
+// column_inputs receives the Calcite input index of every column slot of the program,
+// dictionary_of(input) gives the column_dictionary of a string input, nullptr otherwise
+template <typename DictionaryOf>
+predicate_program compile_predicate(const ExprType &expr, std::vector<int> &column_inputs, const DictionaryOf &dictionary_of)
+{
+    predicate_program program;
+    column_inputs.clear();
+    predicate_compiler<DictionaryOf>(program, column_inputs, dictionary_of).compile(expr);
+    return program;
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <iostream>
 #include <map>
 #include <set>
@@ -12,14 +13,20 @@
 
 #include "../kernels/types.hpp"
 
+#include "plan_json.hpp"
+
 
 struct ExecutionInfo
 {
     std::map<std::string, std::set<int>> loaded_columns;
-    std::map<std::string, int> table_last_used, group_by_columns;
+    std::map<std::string, int> table_last_used;
     std::map<int, std::tuple<int, int>> prepare_join_id;
+    std::map<int, std::set<int>> join_payloads; // join id -> columns of the right input used after the join
     std::map<std::string, std::tuple<int, int>> prepare_join;
     std::vector<int> dag_order;
+    std::vector<std::tuple<std::tuple<std::string, int>, std::tuple<std::string, int>>> join_keys; // (left, right) key column of every equi-join
+    std::vector<std::set<std::tuple<std::string, int>>> filter_columns; // table columns read by every filter
+    std::set<std::tuple<std::string, int>> plain_columns; // table columns read by kernels that cannot decode packed segments
 };
 
 void parse_expression_columns(const ExprType &expr, std::set<int> &columns)
@@ -133,6 +140,36 @@ ExecutionInfo parse_execution_info(const PlanResult &result)
     std::vector<std::vector<std::tuple<std::string, int>>> ops_info;
     ops_info.reserve(result.rels.size());
 
+    // origin of the columns of the right input of every join: (table, column) -> (join id, column in the right input)
+    std::map<std::tuple<std::string, int>, std::tuple<int, int>> join_right_columns;
+
+    // mark the column as used and its table as last used at op_id.
+    // A column of the right input of a join used after that join is carried by its hash table as a payload.
+    auto use_column = [&](const std::tuple<std::string, int> &column, int op_id)
+    {
+        const std::string &table_name = std::get<0>(column);
+        if (table_name.empty()) // not from a table column
+            return;
+
+        info.loaded_columns[table_name].insert(std::get<1>(column));
+        info.table_last_used[table_name] = op_id;
+
+        auto join_column = join_right_columns.find(column);
+        if (join_column != join_right_columns.end() && std::get<0>(join_column->second) < op_id)
+        {
+            info.join_payloads[std::get<0>(join_column->second)].insert(std::get<1>(join_column->second));
+            info.plain_columns.insert(column); // read when the hash table is built
+        }
+    };
+
+    // filters and join probes decode packed segments, the other kernels read plain ints
+    auto use_column_plain = [&](const std::tuple<std::string, int> &column, int op_id)
+    {
+        use_column(column, op_id);
+        if (!std::get<0>(column).empty())
+            info.plain_columns.insert(column);
+    };
+
     for (const RelNode &rel : result.rels)
     {
         switch (rel.relOp)
@@ -164,12 +201,14 @@ ExecutionInfo parse_execution_info(const PlanResult &result)
 
             // mark columns in the filter as used
             // mark the table as last used at current id
+            std::set<std::tuple<std::string, int>> filter_columns;
             for (int col : columns)
             {
-                std::string table_name = std::get<0>(op_info[col]);
-                info.loaded_columns[table_name].insert(std::get<1>(op_info[col]));
-                info.table_last_used[table_name] = rel.id;
+                use_column(op_info[col], rel.id);
+                if (!std::get<0>(op_info[col]).empty())
+                    filter_columns.insert(op_info[col]);
             }
+            info.filter_columns.push_back(filter_columns);
             ops_info.push_back(op_info);
             break;
         }
@@ -184,11 +223,13 @@ ExecutionInfo parse_execution_info(const PlanResult &result)
 
                 // mark columns in the project as used (if any)
                 // mark the table as last used at current id
+                // a column projected as is is not read
                 for (int col : columns)
                 {
-                    std::string table_name = std::get<0>(last_op_info[col]);
-                    info.loaded_columns[table_name].insert(std::get<1>(last_op_info[col]));
-                    info.table_last_used[table_name] = rel.id;
+                    if (expr.exprType == ExprOption::EXPR)
+                        use_column_plain(last_op_info[col], rel.id);
+                    else
+                        use_column(last_op_info[col], rel.id);
                 }
 
                 // if the expression contains at least one column, use the first one as a reference
@@ -210,30 +251,22 @@ ExecutionInfo parse_execution_info(const PlanResult &result)
             // save the info about the columns since they form the new table
             for (int agg_col : rel.group)
             {
-                std::string table_name = std::get<0>(last_op_info[agg_col]);
-                int col_index = std::get<1>(last_op_info[agg_col]);
-                info.loaded_columns[table_name].insert(col_index);
-                info.table_last_used[table_name] = rel.id;
-                op_info.push_back(std::make_tuple(table_name, col_index));
-                info.group_by_columns[table_name] = col_index;
+                use_column_plain(last_op_info[agg_col], rel.id);
+                op_info.push_back(last_op_info[agg_col]);
             }
 
             for (const AggType &agg : rel.aggs)
             {
                 // save columns and table for every aggregate operation
                 for (int agg_col : agg.operands)
-                {
-                    std::string table_name = std::get<0>(last_op_info[agg_col]);
-                    info.loaded_columns[table_name].insert(std::get<1>(last_op_info[agg_col]));
-                    info.table_last_used[table_name] = rel.id;
-                }
+                    use_column_plain(last_op_info[agg_col], rel.id);
 
-                // use the first column of the aggregate as a reference
+                // use the first column of the aggregate as a reference, COUNT(*) has none
                 // TODO: improve this by considering all columns
-                int agg_col = agg.operands[0];
-                op_info.push_back(std::make_tuple(
-                    std::get<0>(last_op_info[agg_col]),
-                    std::get<1>(last_op_info[agg_col])));
+                if (agg.operands.empty())
+                    op_info.push_back(std::make_tuple(std::string(), -1));
+                else
+                    op_info.push_back(last_op_info[agg.operands[0]]);
             }
             ops_info.push_back(op_info);
             break;
@@ -276,10 +309,27 @@ ExecutionInfo parse_execution_info(const PlanResult &result)
                     }
                 }
 
-                info.loaded_columns[table_name].insert(col_index);
-                info.table_last_used[table_name] = rel.id;
+                use_column(std::make_tuple(table_name, col_index), rel.id);
+            }
+
+            if (rel.condition.operands.size() == 2 &&
+                rel.condition.operands[0].exprType == ExprOption::COLUMN &&
+                rel.condition.operands[1].exprType == ExprOption::COLUMN)
+            {
+                int left_key = std::min(rel.condition.operands[0].input, rel.condition.operands[1].input),
+                    right_key = std::max(rel.condition.operands[0].input, rel.condition.operands[1].input);
+                if (left_key >= 0 && left_key < left_info.size() &&
+                    right_key >= left_info.size() && right_key < left_info.size() + right_info.size() &&
+                    !std::get<0>(left_info[left_key]).empty() && !std::get<0>(right_info[right_key - left_info.size()]).empty())
+                {
+                    info.join_keys.push_back(std::make_tuple(left_info[left_key], right_info[right_key - left_info.size()]));
+                    info.plain_columns.insert(right_info[right_key - left_info.size()]); // the build key, the probe decodes
+                }
             }
 
+            for (int i = 0; i < right_info.size(); i++)
+                join_right_columns[right_info[i]] = std::make_tuple(rel.id, i);
+
             // insert left and right info into the operation info
             op_info.insert(op_info.begin(), left_info.begin(), left_info.end());
             op_info.insert(op_info.end(), right_info.begin(), right_info.end());
@@ -298,12 +348,7 @@ ExecutionInfo parse_execution_info(const PlanResult &result)
             for (int64_t col : columns)
             {
                 if (col < op_info.size()) // some projects will add literals columns that are not in any original table
-                {
-                    std::string table_name = std::get<0>(op_info[col]);
-                    int col_index = std::get<1>(op_info[col]);
-                    info.loaded_columns[table_name].insert(col_index);
-                    info.table_last_used[table_name] = rel.id;
-                }
+                    use_column_plain(op_info[col], rel.id);
             }
 
             ops_info.push_back(op_info);
@@ -318,4 +363,76 @@ ExecutionInfo parse_execution_info(const PlanResult &result)
     info.dag_order = dag_topological_sort(result);
 
     return info;
-}
\ No newline at end of file
+}
+
+// columns of the right input of a join carried by its hash table, in increasing order
+std::vector<int> join_payload_columns(const ExecutionInfo &info, int join_id)
+{
+    auto payloads = info.join_payloads.find(join_id);
+    if (payloads == info.join_payloads.end())
+        return {};
+    return std::vector<int>(payloads->second.begin(), payloads->second.end());
+}
+
+void append_expression_shape(const ExprType &expr, std::string &shape)
+{
+    switch (expr.exprType)
+    {
+    case ExprOption::LITERAL:
+        shape += '?'; // a parameter of the plan
+        if (expr.literal.literalOption == LiteralOption::RANGE)
+            shape += std::to_string(expr.literal.rangeSet.size());
+        break;
+    case ExprOption::COLUMN:
+        shape += '$' + std::to_string(expr.input);
+        break;
+    case ExprOption::EXPR:
+        shape += expr.op + '(';
+        for (const ExprType &operand : expr.operands)
+        {
+            append_expression_shape(operand, shape);
+            shape += ',';
+        }
+        shape += ')';
+        break;
+    }
+    shape += ':' + expr.type;
+}
+
+// the plan without its literals, the same for every execution of a query (or of a query
+// template) whatever its constants
+std::string plan_shape(const PlanResult &result)
+{
+    std::string shape;
+    for (const RelNode &rel : result.rels)
+    {
+        shape += std::to_string(rel.relOp) + '[';
+        for (const std::string &table : rel.tables)
+            shape += table + '.';
+        for (int64_t input : rel.inputs)
+            shape += '<' + std::to_string(input);
+        if (rel.relOp == RelNodeType::FILTER || rel.relOp == RelNodeType::JOIN)
+            append_expression_shape(rel.condition, shape);
+        shape += rel.joinType;
+        for (const ExprType &expr : rel.exprs)
+        {
+            append_expression_shape(expr, shape);
+            shape += ';';
+        }
+        for (int64_t group : rel.group)
+            shape += 'g' + std::to_string(group);
+        for (const AggType &agg : rel.aggs)
+        {
+            shape += agg.agg + (agg.distinct ? "!" : "");
+            for (int64_t operand : agg.operands)
+                shape += '$' + std::to_string(operand);
+            shape += ';';
+        }
+        for (const CollationType &collation : rel.collation)
+            shape += 'c' + std::to_string(collation.field) + std::to_string(collation.direction);
+        shape += sort_bound(rel, "offset") != nullptr ? "o" : "";
+        shape += sort_bound(rel, "fetch") != nullptr ? "f" : ""; // the bounds themselves are parameters
+        shape += ']';
+    }
+    return shape;
+}
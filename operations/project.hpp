@@ -5,12 +5,21 @@
 #include <sycl/sycl.hpp>
 
 #include "../kernels/types.hpp"
-#include "../kernels/aggregation.hpp"
+#include "../kernels/projection.hpp"
 
+#include "expression.hpp"
 #include "memory_manager.hpp"
 
 #include "../gen-cpp/calciteserver_types.h"
 
+// value range of a column for the expression planning, the min/max of 64-bit columns are not tracked
+std::pair<int64_t, int64_t> column_value_range(const ColumnData<int> &column)
+{
+    if (column.type == ColumnType::Int32)
+        return { column.min_value, column.max_value };
+    return column_type_range(column.type);
+}
+
 std::vector<sycl::event> parse_project(
     const std::vector<ExprType> &exprs,
     TableData<int> &table_data,
@@ -32,8 +41,6 @@ std::vector<sycl::event> parse_project(
             new_columns[i] = table_data.columns[table_data.column_indices.at(exprs[i].input)];
 
             table_data.columns[table_data.column_indices.at(exprs[i].input)].has_ownership = false;
-            if (exprs[i].input == table_data.group_by_column)
-                table_data.group_by_column = i; // update group by column index
             break;
         case ExprOption::LITERAL:
             // create a new column with the literal value
@@ -45,65 +52,56 @@ std::vector<sycl::event> parse_project(
             new_columns[i].max_value = exprs[i].literal.value;
             new_columns[i].has_ownership = true;
             new_columns[i].is_aggregate_result = false;
+            new_columns[i].type = ColumnType::Int32;
+            new_columns[i].scale = decimal_scale(exprs[i].type);
+            new_columns[i].dictionary = nullptr;
+            new_columns[i].input_rows = nullptr;
             break;
         case ExprOption::EXPR:
-            // Assumed only 2 operands which are either COLUMN or LITERAL
-            if (exprs[i].operands.size() != 2)
+        {
+            std::vector<int> column_inputs;
+            expression_program program = compile_expression(
+                exprs[i], column_inputs,
+                [&](int input)
+                {
+                    const ColumnData<int> &column = table_data.columns[table_data.column_indices.at(input)];
+                    auto [min_value, max_value] = column_value_range(column);
+                    return expression_column{ column.type, column.scale, min_value, max_value };
+                }
+            );
+
+            const void *columns[MAX_EXPRESSION_COLUMNS];
+            std::vector<std::pair<int64_t, int64_t>> ranges;
+            for (int c = 0; c < column_inputs.size(); c++)
             {
-                std::cerr << "Project operation: Unsupported number of operands for EXPR" << std::endl;
-                return {};
+                const ColumnData<int> &column = table_data.columns[table_data.column_indices.at(column_inputs[c])];
+                columns[c] = column.content;
+                ranges.push_back(column_value_range(column));
             }
-            new_columns[i].content = gpu_allocator.alloc<int>(table_data.col_len, true);
+
+            if (program.result_type == ColumnType::Int64)
+                new_columns[i].content = (int *)gpu_allocator.alloc<int64_t>(table_data.col_len, true);
+            else
+                new_columns[i].content = gpu_allocator.alloc<int>(table_data.col_len, true);
             new_columns[i].has_ownership = true;
             new_columns[i].is_aggregate_result = false;
-
-            // call the perform_operation overloaded function based on the operands types
-            // and set min and max values of the column
-            if (exprs[i].operands[0].exprType == ExprOption::COLUMN &&
-                exprs[i].operands[1].exprType == ExprOption::COLUMN)
+            new_columns[i].type = program.result_type;
+            new_columns[i].scale = program.scale;
+            new_columns[i].dictionary = nullptr;
+            new_columns[i].input_rows = nullptr;
+            if (program.result_type == ColumnType::Int32)
             {
-                events = { perform_operation(new_columns[i].content,
-                    table_data.columns[table_data.column_indices.at(exprs[i].operands[0].input)].content,
-                    table_data.columns[table_data.column_indices.at(exprs[i].operands[1].input)].content,
-                    table_data.flags, table_data.col_len, exprs[i].op, queue, std::move(events)
-                ) };
-                new_columns[i].min_value =
-                    std::min(table_data.columns[table_data.column_indices.at(exprs[i].operands[0].input)].min_value,
-                        table_data.columns[table_data.column_indices.at(exprs[i].operands[1].input)].min_value);
-                new_columns[i].max_value =
-                    std::max(table_data.columns[table_data.column_indices.at(exprs[i].operands[0].input)].max_value,
-                        table_data.columns[table_data.column_indices.at(exprs[i].operands[1].input)].max_value);
-            }
-            else if (exprs[i].operands[0].exprType == ExprOption::LITERAL &&
-                exprs[i].operands[1].exprType == ExprOption::COLUMN)
-            {
-                events = { perform_operation(new_columns[i].content,
-                    (int)exprs[i].operands[0].literal.value,
-                    table_data.columns[table_data.column_indices.at(exprs[i].operands[1].input)].content,
-                    table_data.flags, table_data.col_len, exprs[i].op, queue, std::move(events)) };
-                new_columns[i].min_value = table_data.columns[table_data.column_indices.at(exprs[i].operands[1].input)].min_value;
-                new_columns[i].max_value = table_data.columns[table_data.column_indices.at(exprs[i].operands[1].input)].max_value;
-            }
-            else if (exprs[i].operands[0].exprType == ExprOption::COLUMN &&
-                exprs[i].operands[1].exprType == ExprOption::LITERAL)
-            {
-                events = { perform_operation(new_columns[i].content,
-                    table_data.columns[table_data.column_indices.at(exprs[i].operands[0].input)].content,
-                    (int)exprs[i].operands[1].literal.value,
-                    table_data.flags, table_data.col_len, exprs[i].op, queue, std::move(events)) };
-                new_columns[i].min_value = table_data.columns[table_data.column_indices.at(exprs[i].operands[0].input)].min_value;
-                new_columns[i].max_value = table_data.columns[table_data.column_indices.at(exprs[i].operands[0].input)].max_value;
+                expression_bounds bounds = expression_range(program, ranges);
+                new_columns[i].min_value = bounds.min_value;
+                new_columns[i].max_value = bounds.max_value;
             }
             else
-            {
-                std::cerr << "Project operation: Unsupported parsing ExprType "
-                    << exprs[i].operands[0].exprType << " and "
-                    << exprs[i].operands[1].exprType
-                    << " for EXPR" << std::endl;
-                return {};
-            }
+                new_columns[i].min_value = new_columns[i].max_value = 0;
+
+            events = { projection(new_columns[i].content, program, columns, table_data.flags, table_data.col_len, queue, std::move(events)) };
             break;
         }
+        }
     }
 
     // Free old columns and replace with new ones
@@ -4,12 +4,15 @@
 
 #include "../kernels/types.hpp"
 #include "../kernels/sort.hpp"
+#include "memory_manager.hpp"
+#include "plan_json.hpp"
 
 #include "../gen-cpp/calciteserver_types.h"
 
-void parse_sort(const RelNode &rel, TableData<int> &table_data, sycl::queue &queue)
+void parse_sort(const RelNode &rel, TableData<int> &table_data, memory_manager &gpu_allocator, sycl::queue &queue)
 {
-    if (rel.collation.size() == 0)
+    uint64_t offset = sort_offset(rel), fetch = sort_fetch(rel);
+    if (rel.collation.size() == 0 && offset == 0 && fetch == UINT64_MAX)
         return;
 
     int *sort_columns = sycl::malloc_host<int>(rel.collation.size(), queue);
@@ -21,7 +24,12 @@ void parse_sort(const RelNode &rel, TableData<int> &table_data, sycl::queue &que
         sort_orders[i] = rel.collation[i].direction == DirectionOption::ASCENDING;
     }
 
-    sort_table(table_data, sort_columns, sort_orders, rel.collation.size(), queue);
+    // with a FETCH only the first offset + fetch rows are ordered, through a top-K
+    sort_table(
+        table_data, sort_columns, sort_orders, rel.collation.size(), gpu_allocator, queue,
+        offset,
+        fetch
+    );
 
     sycl::free(sort_columns, queue);
     sycl::free(sort_orders, queue);